@@ -0,0 +1,183 @@
+// bench_pose_convert.cpp
+// Microbenchmark for converting ODE poses (pos + 3x4 R) into per-instance data.
+//
+// Compares, in nanoseconds per instance:
+//   matrix : the old path (buildModelMatrix-style glm::mat4 + float color, 80 bytes)
+//   scalar : rotationToQuat + snorm16 packing, one instance at a time
+//   kernel : ds_internal::convertRotationsToQuat (SSE2 / AVX2 dispatch)
+// for both float and double input. No window or GL context is needed.
+//
+// Usage: bench_pose_convert [count] [repeat]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "drawstuff_core.hpp"
+
+using ds_internal::InstanceCompact;
+
+namespace
+{
+    // 旧インスタンス形式（mat4 + vec4）
+    struct InstanceMatrix
+    {
+        glm::mat4 model;
+        glm::vec4 color;
+    };
+
+    // DrawstuffApp::buildModelMatrix と同じ組み立て方
+    template <typename T>
+    glm::mat4 buildModelMatrix(const T pos[3], const T R[12], const glm::vec3 sides)
+    {
+        glm::mat4 rot(1.0f);
+        rot[0][0] = (float)R[0];
+        rot[1][0] = (float)R[1];
+        rot[2][0] = (float)R[2];
+        rot[0][1] = (float)R[4];
+        rot[1][1] = (float)R[5];
+        rot[2][1] = (float)R[6];
+        rot[0][2] = (float)R[8];
+        rot[1][2] = (float)R[9];
+        rot[2][2] = (float)R[10];
+
+        glm::mat4 model = glm::translate(glm::mat4(1.0f),
+                                         glm::vec3((float)pos[0], (float)pos[1], (float)pos[2]));
+        model *= rot;
+        return glm::scale(model, sides);
+    }
+
+    // ODE の dBody と同じように pos[4] と R[12] を持つレコード
+    template <typename T>
+    struct Body
+    {
+        T pos[4];
+        T R[12];
+    };
+
+    template <typename T>
+    std::vector<Body<T>> makeBodies(const std::size_t n)
+    {
+        std::mt19937 rng(12345);
+        std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+        std::vector<Body<T>> bodies(n);
+        for (Body<T> &b : bodies)
+        {
+            glm::vec3 axis(u(rng), u(rng), u(rng));
+            if (glm::dot(axis, axis) < 1e-6f)
+                axis = glm::vec3(0, 0, 1);
+            const glm::mat4 m = glm::rotate(glm::mat4(1.0f), 3.14159265f * u(rng), glm::normalize(axis));
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 3; ++c)
+                    b.R[r * 4 + c] = (T)m[c][r];
+                b.R[r * 4 + 3] = 0;
+                b.pos[r] = (T)(10.0f * u(rng));
+            }
+            b.pos[3] = 0;
+        }
+        return bodies;
+    }
+
+    template <typename F>
+    double nsPerInstance(const std::size_t n, const int repeat, F &&fn)
+    {
+        fn(); // warm-up
+        const auto t0 = std::chrono::steady_clock::now();
+        for (int k = 0; k < repeat; ++k)
+            fn();
+        const auto t1 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(t1 - t0).count() / (double(n) * repeat);
+    }
+
+    template <typename T>
+    void run(const char *label, const std::size_t n, const int repeat)
+    {
+        const std::vector<Body<T>> bodies = makeBodies<T>(n);
+        std::vector<InstanceMatrix> outMat(n);
+        std::vector<InstanceCompact> outCompact(n);
+        std::vector<std::int16_t> quat(n * 4);
+        const glm::vec4 color(1.0f, 0.5f, 0.25f, 1.0f);
+        const std::uint8_t rgba[4] = {255, 128, 64, 255};
+        const glm::vec3 sides(0.1f);
+
+        const double tMatrix = nsPerInstance(n, repeat, [&]
+                                             {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                outMat[i].model = buildModelMatrix(bodies[i].pos, bodies[i].R, sides);
+                outMat[i].color = color;
+            } });
+
+        const double tScalar = nsPerInstance(n, repeat, [&]
+                                             {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                InstanceCompact &d = outCompact[i];
+                for (int k = 0; k < 3; ++k)
+                {
+                    d.pos[k] = (float)bodies[i].pos[k];
+                    d.scale[k] = sides[k];
+                }
+                ds_internal::packRotationQuat(bodies[i].R, d.rot);
+                std::memcpy(d.color, rgba, 4);
+            } });
+
+        // カーネルはバッチ API と同じく 256 個ずつ変換してから詰める
+        const double tKernel = nsPerInstance(n, repeat, [&]
+                                             {
+            constexpr std::size_t kChunk = 256;
+            std::int16_t q[kChunk][4];
+            for (std::size_t base = 0; base < n; base += kChunk)
+            {
+                const std::size_t m = std::min(kChunk, n - base);
+                ds_internal::convertRotationsToQuat(bodies[base].R, sizeof(Body<T>), m, q);
+                for (std::size_t j = 0; j < m; ++j)
+                {
+                    InstanceCompact &d = outCompact[base + j];
+                    const Body<T> &b = bodies[base + j];
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        d.pos[k] = (float)b.pos[k];
+                        d.scale[k] = sides[k];
+                    }
+                    std::memcpy(d.rot, q[j], sizeof(d.rot));
+                    std::memcpy(d.color, rgba, 4);
+                }
+            } });
+
+        // 正しさの確認：カーネルとスカラー版の差（snorm16 の LSB 単位）
+        ds_internal::convertRotationsToQuat(bodies[0].R, sizeof(Body<T>), n,
+                                            reinterpret_cast<std::int16_t(*)[4]>(quat.data()));
+        int maxDiff = 0;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            std::int16_t ref[4];
+            ds_internal::packRotationQuat(bodies[i].R, ref);
+            for (int k = 0; k < 4; ++k)
+                maxDiff = std::max(maxDiff, std::abs(int(ref[k]) - int(quat[i * 4 + k])));
+        }
+
+        std::printf("%-6s matrix %7.2f ns  scalar %7.2f ns  kernel(%s) %7.2f ns  (x%.1f vs matrix, max diff %d LSB)\n",
+                    label, tMatrix, tScalar, ds_internal::poseKernelName(), tKernel,
+                    tMatrix / tKernel, maxDiff);
+    }
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    const std::size_t n = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    const int repeat = (argc > 2) ? std::atoi(argv[2]) : 50;
+    if (n == 0 || repeat <= 0)
+    {
+        std::fprintf(stderr, "usage: %s [count] [repeat]\n", argv[0]);
+        return 1;
+    }
+
+    std::printf("pose conversion, %zu instances x %d\n", n, repeat);
+    run<float>("float", n, repeat);
+    run<double>("double", n, repeat);
+    return 0;
+}
@@ -38,6 +38,45 @@ enum ObjectType
 
 static std::vector<Object> g_objects;
 
+// Batch (structure-of-arrays) inputs for dsDraw*Batch.
+// Positions and radii are read straight out of g_objects using a stride;
+// the remaining per-object values are precomputed here.
+static std::vector<float> g_colors;      // RGBA per object
+static std::vector<float> g_capsule_len; // capsule length per object
+static std::vector<float> g_box_sides;   // 3 sides per object
+
+// For MIXTURE mode in batch: objects gathered per type
+struct TypeBatch
+{
+    std::vector<float> pos, r, l, capsule_len, sides, color;
+};
+static TypeBatch g_mix[4];
+
+static bool g_use_batch = false;
+
+// Retained mode: every object is a dsCreateInstance() handle and only a
+// small moving subset is updated each frame.
+static bool g_use_retained = false;
+static std::vector<dsInstanceHandle> g_instances;
+static int g_instances_type = -1; // object_type the handles were created for
+static constexpr int RETAINED_MOVING = 1000;
+
+static int g_cullMode = DS_CULL_CPU;
+static bool g_occlusion = false;
+static bool g_lod = true;
+static bool g_impostors = false;
+static bool g_depthSort = false;
+static bool g_multiDraw = true;
+
+// Translucency: every fourth object gets alpha 0.4 (sorted or weighted OIT)
+static bool g_translucent = false;
+static bool g_weighted = false;
+
+static float objectAlpha(const Object &s)
+{
+    return (g_translucent && (&s - &g_objects[0]) % 4 == 0) ? 0.4f : 1.0f;
+}
+
 // Grid sizes
 static constexpr int NX = 100;
 static constexpr int NY = 100;
@@ -121,6 +160,46 @@ static void buildObjects()
     }
 }
 
+static float capsuleLength(const Object &s)
+{
+    // Capsule must fit in pitch; length is calculated from pitch and radius.
+    return std::max(0.0f, PITCH - 2.0f * s.r - 0.5f * MARGIN);
+}
+
+// Precompute the arrays passed to the batch API
+static void buildBatchArrays(const std::vector<uint8_t> &types)
+{
+    const size_t n = g_objects.size();
+    g_colors.resize(n * 4);
+    g_capsule_len.resize(n);
+    g_box_sides.resize(n * 3);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const Object &s = g_objects[i];
+        g_colors[i * 4 + 0] = s.color[0];
+        g_colors[i * 4 + 1] = s.color[1];
+        g_colors[i * 4 + 2] = s.color[2];
+        g_colors[i * 4 + 3] = objectAlpha(s);
+        g_capsule_len[i] = capsuleLength(s);
+        g_box_sides[i * 3 + 0] = s.r * 2.0f;
+        g_box_sides[i * 3 + 1] = s.r * 2.0f;
+        g_box_sides[i * 3 + 2] = s.l;
+    }
+
+    for (TypeBatch &b : g_mix)
+        b = TypeBatch();
+    for (size_t i = 0; i < n && i < types.size(); ++i)
+    {
+        TypeBatch &b = g_mix[types[i]];
+        b.pos.insert(b.pos.end(), g_objects[i].pos, g_objects[i].pos + 3);
+        b.r.push_back(g_objects[i].r);
+        b.l.push_back(g_objects[i].l);
+        b.capsule_len.push_back(g_capsule_len[i]);
+        b.sides.insert(b.sides.end(), &g_box_sides[i * 3], &g_box_sides[i * 3] + 3);
+        b.color.insert(b.color.end(), &g_colors[i * 4], &g_colors[i * 4] + 4);
+    }
+}
+
 ObjectType object_type = SPHERE;
 int object_quality = 3; // default quality for spheres and cylinders
 static const char* kHelpText =
@@ -128,7 +207,17 @@ static const char* kHelpText =
     "  Space : cycle SPHERE->CYLINDER->CAPSULE->BOX->MIXTURE\n"
     "  S/Y/C/B/M : select SPHERE/CYLINDER/CAPSULE/BOX/MIXTURE\n"
     "  +/- or 1/2/3 : sphere and capsule quality\n"
-    "  R : rebuild objects\n";
+    "  R : rebuild objects\n"
+    "  A : toggle scalar dsDraw* calls / dsDraw*Batch calls\n"
+    "  T : toggle retained instances (dsCreateInstance, 1000 moving)\n"
+    "  F : cycle view-frustum culling (off / CPU / GPU)\n"
+    "  O : toggle occlusion culling (GPU culling only)\n"
+    "  L : toggle level of detail for spheres, cylinders and capsules (CPU culling only)\n"
+    "  I : toggle ray-cast impostors for spheres, cylinders and capsules\n"
+    "  X : toggle translucency for every fourth object\n"
+    "  W : toggle sorted / weighted blended transparency\n"
+    "  D : toggle front-to-back ordering of opaque objects (CPU culling only)\n"
+    "  N : toggle the multi-draw-indirect backend (OpenGL 4.3+)\n";
 std::vector<uint8_t> g_object_type;
 static thread_local std::mt19937 rng(std::random_device{}());
 
@@ -145,6 +234,7 @@ static void start()
         g_object_type[i] = static_cast<uint8_t>(i % 4);
     }
     std::shuffle(g_object_type.begin(), g_object_type.end(), rng);
+    buildBatchArrays(g_object_type);
 
     // Camera: back and above
     float xyz[3] = {0.0f, -18.0f, 8.0f};
@@ -158,7 +248,155 @@ static void start()
     dsSetCapsuleQuality(object_quality);
 }
 
+static void drawBatched()
+{
+    const int n = static_cast<int>(g_objects.size());
+    const int stride = static_cast<int>(sizeof(Object));
+    const float *pos = g_objects[0].pos;
+    const float *r = &g_objects[0].r;
+    const float *l = &g_objects[0].l;
+
+    // Identity rotation for every object: pass NULL for R
+    switch (object_type)
+    {
+    case SPHERE:
+        dsDrawSpheresBatch(n, pos, stride, nullptr, 0, r, stride, g_colors.data(), 0);
+        break;
+    case CYLINDER:
+        dsDrawCylindersBatch(n, pos, stride, nullptr, 0, l, stride, r, stride, g_colors.data(), 0);
+        break;
+    case CAPSULE:
+        dsDrawCapsulesBatch(n, pos, stride, nullptr, 0, g_capsule_len.data(), 0, r, stride,
+                            g_colors.data(), 0);
+        break;
+    case BOX:
+        dsDrawBoxesBatch(n, pos, stride, nullptr, 0, g_box_sides.data(), 0, g_colors.data(), 0);
+        break;
+    default:
+    {
+        const TypeBatch &sp = g_mix[0], &cy = g_mix[1], &ca = g_mix[2], &bx = g_mix[3];
+        dsDrawSpheresBatch(static_cast<int>(sp.r.size()), sp.pos.data(), 0, nullptr, 0,
+                           sp.r.data(), 0, sp.color.data(), 0);
+        dsDrawCylindersBatch(static_cast<int>(cy.r.size()), cy.pos.data(), 0, nullptr, 0,
+                             cy.l.data(), 0, cy.r.data(), 0, cy.color.data(), 0);
+        dsDrawCapsulesBatch(static_cast<int>(ca.r.size()), ca.pos.data(), 0, nullptr, 0,
+                            ca.capsule_len.data(), 0, ca.r.data(), 0, ca.color.data(), 0);
+        dsDrawBoxesBatch(static_cast<int>(bx.r.size()), bx.pos.data(), 0, nullptr, 0,
+                         bx.sides.data(), 0, bx.color.data(), 0);
+        break;
+    }
+    }
+}
+
+static void drawScalar();
+
+static void destroyRetained()
+{
+    for (const dsInstanceHandle &h : g_instances)
+        dsDestroyInstance(h);
+    g_instances.clear();
+    g_instances_type = -1;
+}
+
+// (Re)create one retained instance per object for the current object type
+static void createRetained()
+{
+    static const float R[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+    destroyRetained();
+    g_instances.reserve(g_objects.size());
+    for (size_t i = 0; i < g_objects.size(); ++i)
+    {
+        const Object &s = g_objects[i];
+        const int type = (object_type == MIXTURE) ? g_object_type[i] : object_type;
+        float size[3] = {s.r, 0.0f, 0.0f};
+        int shape = DS_INSTANCE_SPHERE;
+        if (type == CYLINDER)
+        {
+            shape = DS_INSTANCE_CYLINDER;
+            size[0] = s.l;
+            size[1] = s.r;
+        }
+        else if (type == CAPSULE)
+        {
+            shape = DS_INSTANCE_CAPSULE;
+            size[0] = capsuleLength(s);
+            size[1] = s.r;
+        }
+        else if (type == BOX)
+        {
+            shape = DS_INSTANCE_BOX;
+            size[0] = size[1] = s.r * 2.0f;
+            size[2] = s.l;
+        }
+        dsSetColorAlpha(s.color[0], s.color[1], s.color[2], objectAlpha(s));
+        g_instances.push_back(dsCreateInstance(shape, s.pos, R, size));
+    }
+    g_instances_type = object_type;
+}
+
+// Only the first RETAINED_MOVING objects move (bob up and down);
+// the rest stay on the GPU untouched.
+static void drawRetained()
+{
+    static const float R[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+    static int frame = 0;
+    if (g_instances_type != object_type)
+        createRetained();
+
+    ++frame;
+    const size_t n = std::min<size_t>(RETAINED_MOVING, g_instances.size());
+    for (size_t i = 0; i < n; ++i)
+    {
+        const Object &s = g_objects[i];
+        const float pos[3] = {s.pos[0], s.pos[1],
+                              s.pos[2] + 0.05f * std::sin(0.05f * frame + 0.1f * static_cast<float>(i))};
+        dsUpdateInstancePose(g_instances[i], pos, R);
+    }
+}
+
+// Report the CPU time spent recording draw calls (averaged over 120 frames)
 static void simLoop(int /*pause*/)
+{
+    static double acc_us = 0.0;
+    static int frames = 0;
+
+    const auto t0 = std::chrono::steady_clock::now();
+    if (g_use_retained)
+        drawRetained();
+    else if (g_use_batch)
+        drawBatched();
+    else
+        drawScalar();
+    const auto t1 = std::chrono::steady_clock::now();
+
+    acc_us += std::chrono::duration<double, std::micro>(t1 - t0).count();
+    if (++frames == 120)
+    {
+        const double us = acc_us / frames;
+        std::cerr << (g_use_retained ? "[retain] " : (g_use_batch ? "[batch ] " : "[scalar] "))
+                  << std::fixed << std::setprecision(1) << us << " us/frame, "
+                  << std::setprecision(2) << (us * 1000.0 / g_objects.size()) << " ns/object";
+        dsCullStats cs;
+        dsGetCullStats(&cs);
+        std::cerr << "  | visible " << cs.visible << " / " << cs.instances
+                  << " (culled " << cs.culled << ", occluded " << cs.occluded << "), shadows "
+                  << cs.shadow_visible << " (culled " << cs.shadow_culled << ", occluded "
+                  << cs.shadow_occluded << ")";
+        dsOpaquePassStats os;
+        dsGetOpaquePassStats(&os);
+        std::cerr << "  | opaque pass " << std::setprecision(2) << os.gpu_ms << " ms GPU, overdraw "
+                  << os.overdraw << (g_depthSort ? " (front to back)" : "");
+        dsMultiDrawStats ms;
+        dsGetMultiDrawStats(&ms);
+        if (ms.active)
+            std::cerr << "  | multi-draw " << ms.commands << " commands in " << ms.draws << " calls";
+        std::cerr << std::endl;
+        acc_us = 0.0;
+        frames = 0;
+    }
+}
+
+static void drawScalar()
 {
     // Identity rotation for objects
     float R[12] = {
@@ -170,7 +408,7 @@ static void simLoop(int /*pause*/)
     // (If your library batches/instances spheres, it should be fast.)
     for (const auto &s : g_objects)
     {
-        dsSetColor(s.color[0], s.color[1], s.color[2]);
+        dsSetColorAlpha(s.color[0], s.color[1], s.color[2], objectAlpha(s));
         if (object_type == CYLINDER)
         {
             dsDrawCylinder(s.pos, R, s.l, s.r);
@@ -335,8 +573,80 @@ static void command(int cmd)
     {
         buildObjects();
         std::shuffle(g_object_type.begin(), g_object_type.end(), rng);
+        buildBatchArrays(g_object_type);
+        if (g_use_retained)
+            createRetained();
         std::cerr << "Rebuilt objects." << std::endl;
     }
+    else if (cmd == 'a' || cmd == 'A')
+    {
+        g_use_batch = !g_use_batch;
+        std::cerr << "Using " << (g_use_batch ? "dsDraw*Batch" : "scalar dsDraw*") << " calls." << std::endl;
+    }
+    else if (cmd == 'f' || cmd == 'F')
+    {
+        static const char *const names[] = {"off", "CPU", "GPU"};
+        g_cullMode = (g_cullMode + 1) % 3;
+        dsSetCulling(g_cullMode);
+        std::cerr << "Frustum culling: " << names[g_cullMode] << "." << std::endl;
+    }
+    else if (cmd == 'o' || cmd == 'O')
+    {
+        g_occlusion = !g_occlusion;
+        dsSetOcclusionCulling(g_occlusion ? 1 : 0);
+        std::cerr << "Occlusion culling " << (g_occlusion ? "on" : "off")
+                  << (g_cullMode == DS_CULL_GPU ? "." : " (needs GPU culling, press F).") << std::endl;
+    }
+    else if (cmd == 'l' || cmd == 'L')
+    {
+        g_lod = !g_lod;
+        dsSetLevelOfDetail(g_lod ? 1 : 0);
+        std::cerr << "Level of detail " << (g_lod ? "on." : "off.") << std::endl;
+    }
+    else if (cmd == 'i' || cmd == 'I')
+    {
+        g_impostors = !g_impostors;
+        dsSetImpostor(DS_INSTANCE_SPHERE, g_impostors ? 1 : 0);
+        dsSetImpostor(DS_INSTANCE_CYLINDER, g_impostors ? 1 : 0);
+        dsSetImpostor(DS_INSTANCE_CAPSULE, g_impostors ? 1 : 0);
+        std::cerr << "Impostors " << (g_impostors ? "on." : "off.") << std::endl;
+    }
+    else if (cmd == 't' || cmd == 'T')
+    {
+        g_use_retained = !g_use_retained;
+        if (!g_use_retained)
+            destroyRetained();
+        std::cerr << (g_use_retained ? "Using retained instances." : "Retained instances off.") << std::endl;
+    }
+    else if (cmd == 'x' || cmd == 'X')
+    {
+        g_translucent = !g_translucent;
+        buildBatchArrays(g_object_type);
+        if (g_use_retained)
+            createRetained();
+        std::cerr << "Translucent objects " << (g_translucent ? "on." : "off.") << std::endl;
+    }
+    else if (cmd == 'd' || cmd == 'D')
+    {
+        g_depthSort = !g_depthSort;
+        dsSetDepthSort(g_depthSort ? 1 : 0);
+        std::cerr << "Front-to-back ordering " << (g_depthSort ? "on." : "off.") << std::endl;
+    }
+    else if (cmd == 'n' || cmd == 'N')
+    {
+        g_multiDraw = !g_multiDraw;
+        dsSetMultiDrawIndirect(g_multiDraw ? 1 : 0);
+        dsMultiDrawStats ms;
+        dsGetMultiDrawStats(&ms);
+        std::cerr << "Multi-draw-indirect " << (g_multiDraw ? "on" : "off")
+                  << (g_multiDraw && !ms.active ? " (not supported, using the OpenGL 3.3 path)." : ".") << std::endl;
+    }
+    else if (cmd == 'w' || cmd == 'W')
+    {
+        g_weighted = !g_weighted;
+        dsSetTransparency(g_weighted ? DS_TRANSPARENCY_WEIGHTED : DS_TRANSPARENCY_SORTED);
+        std::cerr << "Transparency: " << (g_weighted ? "weighted blended OIT." : "sorted.") << std::endl;
+    }
 }
 
 static void postStep(int pause)
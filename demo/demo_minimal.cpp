@@ -15,7 +15,8 @@ static fps_hud::FpsHud g_fps_hud;
 int object_quality = 3; // default quality
 static const char* kHelpText =
     "Keys:\n"
-    "  +/- or 1/2/3 : sphere and capsule quality\n";
+    "  +/- or 1/2/3 : sphere and capsule quality\n"
+    "  G : print GL state calls issued / elided in the last frame\n";
 
 static void start()
 {
@@ -121,6 +122,12 @@ static void command(int cmd)
         dsSetSphereQuality(object_quality);
         dsSetCapsuleQuality(object_quality);
     }
+    else if (cmd == 'g' || cmd == 'G')
+    {
+        dsGLStateStats gs;
+        dsGetGLStateStats(&gs);
+        std::cerr << "GL state calls: issued " << gs.issued << ", elided " << gs.elided << std::endl;
+    }
 }
 
 static void postStep(int pause)
@@ -261,9 +261,11 @@ static const char* kHelpText =
     "Keys:\n"
     "  W : wireframe\n"
     "  S : solid\n"
-    "  +/- : grid extent\n"
+    "  +/- : grid extent (up to 45 x 45 copies)\n"
     "  Space : toggle draw mode\n"
-    "    triangles / registered mesh\n";
+    "    triangles / registered mesh\n"
+    "  G : print GL state calls issued / elided in the last frame\n"
+    "  M : print mesh memory and opaque pass GPU time\n";
 
 static void simStart() {
     std::cout << kHelpText << std::endl;
@@ -289,7 +291,7 @@ static void simStart() {
 static void simCommand(int cmd) {
   if (cmd == 'w' || cmd == 'W') g_solid = 0;
   if (cmd == 's' || cmd == 'S') g_solid = 1;
-  if (cmd == '+') gridExtent = std::min(gridExtent + 1, 5);
+  if (cmd == '+') gridExtent = std::min(gridExtent + 1, 22);
   if (cmd == '-') gridExtent = std::max(gridExtent - 1, 0);
   if (cmd == ' ') {
     // toggle draw mode
@@ -303,6 +305,20 @@ static void simCommand(int cmd) {
         std::cout << "Draw mode: triangles\n";
     }
   }
+  if (cmd == 'g' || cmd == 'G') {
+    dsGLStateStats gs;
+    dsGetGLStateStats(&gs);
+    std::cout << "GL state calls: issued " << gs.issued << ", elided " << gs.elided << "\n";
+  }
+  if (cmd == 'm' || cmd == 'M') {
+    dsGeometryStats geo;
+    dsGetGeometryStats(&geo);
+    dsOpaquePassStats op;
+    dsGetOpaquePassStats(&op);
+    std::printf("Mesh memory: %d vertices, %d indices, %.1f MiB used / %.1f MiB reserved, "
+                "normal error <= %.3f deg; opaque pass %.2f ms\n",
+                geo.vertices, geo.indices, geo.used_mb, geo.reserved_mb, geo.max_normal_error, op.gpu_ms);
+  }
 }
 
 static void simStep(int /*pause*/)
@@ -369,6 +385,12 @@ int main(int argc, char** argv) {
     // Register mesh
     g_trimesh = dsRegisterIndexedMesh(
         g_vertices, g_indices);
+    dsRegisteredMeshStats ms;
+    dsGetRegisteredMeshStats(g_trimesh, &ms);
+    std::printf("Registered mesh: %d vertices, %d triangles, %d-bit indices\n"
+                "  ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+                ms.vertices, ms.triangles, ms.index_bytes * 8,
+                ms.acmr_before, ms.acmr_after, ms.atvr_before, ms.atvr_after);
 
     dsFunctions fn;
     fn.version = DS_VERSION;
@@ -287,6 +287,384 @@ extern "C"
                               const unsigned int _pointcount,
                               const unsigned int *_polygons);
 
+    /**
+     * @brief Draw many spheres in one call (structure-of-arrays form).
+     * @ingroup drawstuff
+     * Each array is addressed as base + i * stride, where the stride is given
+     * in bytes; a stride of 0 means the elements are tightly packed.  This
+     * allows both separate arrays and fields of an array of structs to be
+     * passed directly.
+     * @param count number of spheres
+     * @param pos   positions, 3 values per sphere
+     * @param R     3x4 rotation matrices (ODE layout), 12 values per sphere;
+     *              NULL means identity for all spheres
+     * @param radius radii, 1 value per sphere
+     * @param color RGBA colors, 4 floats per sphere; NULL means the current color
+     */
+    DS_API void dsDrawSpheresBatch(const int count,
+                                   const float *pos, const int pos_stride,
+                                   const float *R, const int R_stride,
+                                   const float *radius, const int radius_stride,
+                                   const float *color, const int color_stride);
+
+    /**
+     * @brief Draw many boxes in one call (structure-of-arrays form).
+     * @ingroup drawstuff
+     * See dsDrawSpheresBatch() for the meaning of the arrays and strides.
+     * @param sides box side lengths, 3 values per box
+     */
+    DS_API void dsDrawBoxesBatch(const int count,
+                                 const float *pos, const int pos_stride,
+                                 const float *R, const int R_stride,
+                                 const float *sides, const int sides_stride,
+                                 const float *color, const int color_stride);
+
+    /**
+     * @brief Draw many cylinders in one call (structure-of-arrays form).
+     * @ingroup drawstuff
+     * See dsDrawSpheresBatch() for the meaning of the arrays and strides.
+     * @param length cylinder lengths, 1 value per cylinder
+     * @param radius cylinder radii, 1 value per cylinder
+     */
+    DS_API void dsDrawCylindersBatch(const int count,
+                                     const float *pos, const int pos_stride,
+                                     const float *R, const int R_stride,
+                                     const float *length, const int length_stride,
+                                     const float *radius, const int radius_stride,
+                                     const float *color, const int color_stride);
+
+    /**
+     * @brief Draw many capsules in one call (structure-of-arrays form).
+     * @ingroup drawstuff
+     * See dsDrawSpheresBatch() for the meaning of the arrays and strides.
+     * @param length capsule lengths (cylindrical part), 1 value per capsule
+     * @param radius capsule radii, 1 value per capsule
+     */
+    DS_API void dsDrawCapsulesBatch(const int count,
+                                    const float *pos, const int pos_stride,
+                                    const float *R, const int R_stride,
+                                    const float *length, const int length_stride,
+                                    const float *radius, const int radius_stride,
+                                    const float *color, const int color_stride);
+
+    /* double precision versions of the batch functions (colors stay float) */
+    DS_API void dsDrawSpheresBatchD(const int count,
+                                    const double *pos, const int pos_stride,
+                                    const double *R, const int R_stride,
+                                    const double *radius, const int radius_stride,
+                                    const float *color, const int color_stride);
+    DS_API void dsDrawBoxesBatchD(const int count,
+                                  const double *pos, const int pos_stride,
+                                  const double *R, const int R_stride,
+                                  const double *sides, const int sides_stride,
+                                  const float *color, const int color_stride);
+    DS_API void dsDrawCylindersBatchD(const int count,
+                                      const double *pos, const int pos_stride,
+                                      const double *R, const int R_stride,
+                                      const double *length, const int length_stride,
+                                      const double *radius, const int radius_stride,
+                                      const float *color, const int color_stride);
+    DS_API void dsDrawCapsulesBatchD(const int count,
+                                     const double *pos, const int pos_stride,
+                                     const double *R, const int R_stride,
+                                     const double *length, const int length_stride,
+                                     const double *radius, const int radius_stride,
+                                     const float *color, const int color_stride);
+
+    /**
+     * @brief Start recording draw calls from the calling thread.
+     * @ingroup drawstuff
+     * Must be called from within the step() callback.  Between this call and
+     * dsEndParallelDraw(), dsSetColor(), dsSetColorAlpha(), dsDrawBox(),
+     * dsDrawSphere(), dsDrawCylinder() and dsDrawCapsule() (and their double
+     * and batch variants) may be called concurrently from several threads.  They record
+     * into a per-slot buffer without touching OpenGL.
+     *
+     * After step() returns, slots are merged in ascending slot order after
+     * the instances drawn by the main thread, so the result does not depend
+     * on thread scheduling.  Each slot must be used by at most one thread at
+     * a time, and every thread must call dsEndParallelDraw() before step()
+     * returns.  The color of a slot starts as opaque white.
+     *
+     * Other drawing functions (triangles, lines, convex and registered
+     * meshes) are not allowed while recording in parallel.
+     * @param slot slot number in [0, 256), e.g. the worker index
+     */
+    DS_API void dsBeginParallelDraw(const int slot);
+
+    /**
+     * @brief Stop recording draw calls from the calling thread.
+     * @ingroup drawstuff
+     */
+    DS_API void dsEndParallelDraw(void);
+
+    /* modes for dsSetCulling() */
+    enum
+    {
+        DS_CULL_OFF = 0,
+        DS_CULL_CPU = 1,
+        DS_CULL_GPU = 2
+    };
+
+    /**
+     * @brief Select how primitive instances are culled against the view frustum.
+     * @ingroup drawstuff
+     * With DS_CULL_CPU (the default), spheres, boxes, cylinders and capsules
+     * drawn during step() are tested against the view frustum on worker
+     * threads before they are sent to the GPU, and their ground shadows are
+     * tested separately.  Retained instances (dsCreateInstance()) are not
+     * culled in this mode.
+     * With DS_CULL_GPU, the same tests run on the GPU in a transform feedback
+     * pass, for both step() instances and retained instances, and the
+     * survivors are drawn without reading them back.  Its statistics lag
+     * one frame behind.  Takes effect from the next frame.
+     * @param mode DS_CULL_OFF, DS_CULL_CPU or DS_CULL_GPU
+     *        (any other non-zero value means DS_CULL_CPU)
+     */
+    DS_API void dsSetCulling(const int mode);
+
+    /**
+     * @brief Also cull instances that look smaller than the given size on screen.
+     * @ingroup drawstuff
+     * Only used with DS_CULL_GPU.  The size is the radius of the bounding
+     * sphere in pixels.
+     * @param pixels minimum radius in pixels, 0 (the default) to disable
+     */
+    DS_API void dsSetCullScreenSize(const float pixels);
+
+    /**
+     * @brief Enable or disable occlusion culling of primitive instances.
+     * @ingroup drawstuff
+     * Only used with DS_CULL_GPU.  At the end of each frame a max-depth
+     * pyramid (hierarchical Z) is built from the depth buffer, and the next
+     * frame drops instances and shadows that lie behind it.  Because the
+     * previous frame's depth is used, an object that has just come out from
+     * behind another one may appear one frame late.  Off by default.
+     * @param enable 1 to enable, 0 to disable
+     */
+    DS_API void dsSetOcclusionCulling(const int enable);
+
+    /**
+     * @brief Enable or disable automatic level of detail for spheres, cylinders
+     *        and capsules.
+     * @ingroup drawstuff
+     * Used with DS_CULL_CPU.  Each visible sphere, cylinder and capsule
+     * instance is drawn with a coarser mesh when it looks small on screen: the
+     * quality set by dsSetSphereQuality() / dsSetCylinderQuality() /
+     * dsSetCapsuleQuality() is used above the
+     * fine threshold, one level lower between the thresholds, and two levels
+     * lower (but at least 1) below the coarse threshold.  Shadows use twice
+     * the thresholds.  A small hysteresis keeps instances from switching back
+     * and forth.  On by default.
+     * @param enable 1 to enable, 0 to disable
+     */
+    DS_API void dsSetLevelOfDetail(const int enable);
+
+    /**
+     * @brief Set the level-of-detail thresholds.
+     * @ingroup drawstuff
+     * @param fine bounding-sphere radius in pixels above which the full
+     *        quality is used (default 32)
+     * @param coarse radius in pixels below which the lowest level is used
+     *        (default 8)
+     */
+    DS_API void dsSetLevelOfDetailThresholds(const float fine, const float coarse);
+
+    /**
+     * @brief Draw a primitive type as ray-cast impostors instead of meshes.
+     * @ingroup drawstuff
+     * Each instance becomes one camera-facing quad, and the fragment shader
+     * intersects the exact shape, writing its depth and normal.  Silhouettes
+     * are exact at any size and the vertex cost no longer depends on
+     * dsSetSphereQuality() and friends, which pays off for scenes with very
+     * many spheres.  Shadows are drawn the same way on the ground plane.
+     * Works with every culling mode; level of detail is not applied to
+     * impostors.  Boxes are always drawn as meshes.  Off by default.
+     * @param shape DS_INSTANCE_SPHERE, DS_INSTANCE_CYLINDER or DS_INSTANCE_CAPSULE
+     *        (applies to dsDraw*() and retained instances alike)
+     * @param enable 1 to draw impostors, 0 to draw meshes
+     */
+    DS_API void dsSetImpostor(const int shape, const int enable);
+
+    /* modes for dsSetConvexCache() */
+    enum
+    {
+        DS_CONVEX_CACHE_OFF = 0,
+        DS_CONVEX_CACHE_CONTENT = 1,
+        DS_CONVEX_CACHE_POINTER = 2
+    };
+
+    /**
+     * @brief Select how dsDrawConvex() recognizes shapes it has drawn before.
+     * @ingroup drawstuff
+     * A convex shape is triangulated once and kept on the GPU.  All bodies
+     * drawn with the same shape in a frame are drawn, together with their
+     * shadows, as instances of that mesh.  Shapes that have not been drawn
+     * for a while are dropped from the cache.
+     * With DS_CONVEX_CACHE_CONTENT (the default), shapes are matched by a
+     * hash of the plane, point and polygon arrays, so it is safe when the
+     * arrays are changed in place.  With DS_CONVEX_CACHE_POINTER, they are
+     * matched by the addresses of the arrays, which skips hashing; use it
+     * only when the arrays are never modified while they are in use.
+     * DS_CONVEX_CACHE_OFF triangulates and draws every call separately.
+     * @param mode DS_CONVEX_CACHE_OFF, DS_CONVEX_CACHE_CONTENT or
+     *        DS_CONVEX_CACHE_POINTER
+     */
+    DS_API void dsSetConvexCache(const int mode);
+
+    /* modes for dsSetTransparency() */
+    enum
+    {
+        DS_TRANSPARENCY_SORTED = 0,
+        DS_TRANSPARENCY_WEIGHTED = 1
+    };
+
+    /**
+     * @brief Select how translucent spheres, boxes, cylinders and capsules are drawn.
+     * @ingroup drawstuff
+     * Instances whose alpha is below 1 (from dsSetColorAlpha(), the batch
+     * color arrays or dsSetInstanceColor()) are kept apart from the opaque
+     * ones and drawn after everything opaque, without writing depth.
+     * With DS_TRANSPARENCY_SORTED (the default), they are sorted back to
+     * front every frame and alpha blended in that order; consecutive
+     * instances of the same shape share one draw call, so many interleaved
+     * shapes mean many draw calls.  DS_TRANSPARENCY_WEIGHTED skips sorting
+     * and uses weighted blended order-independent transparency: one draw
+     * call per shape and a full-screen resolve, at the cost of approximate
+     * colors where several layers overlap.
+     * Translucent convex shapes and registered meshes are not affected.
+     * @param mode DS_TRANSPARENCY_SORTED or DS_TRANSPARENCY_WEIGHTED
+     */
+    DS_API void dsSetTransparency(const int mode);
+
+    /* Per-frame culling statistics, see dsGetCullStats() */
+    typedef struct dsCullStats
+    {
+        int instances;       /* primitive instances tested; with DS_CULL_GPU this
+                                includes retained instances */
+        int visible;         /* instances sent to the main pass */
+        int culled;          /* outside the frustum (or too small): instances - visible - occluded */
+        int occluded;        /* inside the frustum but hidden (dsSetOcclusionCulling()) */
+        int shadow_visible;  /* instances sent to the shadow pass */
+        int shadow_culled;   /* likewise for shadows (when shadows are on) */
+        int shadow_occluded; /* likewise for shadows */
+    } dsCullStats;
+
+    /**
+     * @brief Get the culling statistics of the most recently rendered frame.
+     * @ingroup drawstuff
+     * @param stats filled with the counts
+     */
+    DS_API void dsGetCullStats(dsCullStats *stats);
+
+    /**
+     * @brief Draw opaque primitive instances roughly front to back.
+     * @ingroup drawstuff
+     * With CPU culling (the default), the instances of each shape and
+     * level of detail are uploaded in order of view depth. The key is the
+     * depth quantized to 16 bits, and the sort is a parallel radix sort.
+     * Nearer surfaces then fill the depth buffer first, and hidden
+     * fragments behind them are rejected before shading (early-Z). This
+     * helps when fragment shading is the bottleneck: software renderers,
+     * high resolutions, or textures on. If the previous frame's order is
+     * still almost sorted, the sort is skipped. Retained instances are not
+     * reordered. Off by default; use dsGetOpaquePassStats() to see whether
+     * it pays off.
+     * @param enable 1 to sort, 0 to keep submission order
+     */
+    DS_API void dsSetDepthSort(const int enable);
+
+    /* Measurements of the opaque primitive pass, see dsGetOpaquePassStats() */
+    typedef struct dsOpaquePassStats
+    {
+        double gpu_ms;   /* GPU time of the pass (GL_TIME_ELAPSED), a few frames old */
+        double overdraw; /* samples that passed the depth test in that pass, per pixel */
+        int sorted;      /* instances ordered by dsSetDepthSort() in the last frame */
+        int reused;      /* of those, instances whose previous order was kept without sorting */
+    } dsOpaquePassStats;
+
+    /**
+     * @brief Get timing and overdraw of the opaque primitive pass.
+     * @ingroup drawstuff
+     * The pass covers spheres, boxes, cylinders, capsules, cached convex
+     * shapes, registered meshes and impostors, but not the sky, ground,
+     * shadows or translucent instances. The GPU results are read without
+     * stalling, so they lag a few frames behind.
+     * @param stats filled with the measurements
+     */
+    DS_API void dsGetOpaquePassStats(dsOpaquePassStats *stats);
+
+    /**
+     * @brief Enable or disable the multi-draw-indirect backend.
+     * @ingroup drawstuff
+     * When the context offers OpenGL 4.3 (or GL_ARB_multi_draw_indirect
+     * with base instances), the instanced draws of the opaque and shadow
+     * passes (spheres, boxes, cylinders, capsules at every level of detail,
+     * cached convex shapes and solid registered meshes) are written into one
+     * indirect command buffer. Each pass then issues one
+     * glMultiDrawElementsIndirect() per instance buffer. Without that support
+     * the OpenGL 3.3 path is always used. On by default; 0 forces the 3.3 path
+     * for comparison.
+     * @param enable 1 to use multi-draw when available, 0 to disable
+     */
+    DS_API void dsSetMultiDrawIndirect(const int enable);
+
+    /* Multi-draw statistics of the last frame, see dsGetMultiDrawStats() */
+    typedef struct dsMultiDrawStats
+    {
+        int active;   /* 1 if supported by the context and enabled */
+        int commands; /* indirect draw commands in the last frame */
+        int draws;    /* glMultiDrawElementsIndirect() calls that drew them */
+    } dsMultiDrawStats;
+
+    /**
+     * @brief Get multi-draw-indirect statistics of the last frame.
+     * @ingroup drawstuff
+     * @param stats filled with the counts
+     */
+    DS_API void dsGetMultiDrawStats(dsMultiDrawStats *stats);
+
+    /* GPU memory of static mesh geometry, see dsGetGeometryStats() */
+    typedef struct dsGeometryStats
+    {
+        int vertices;            /* vertices in use */
+        int indices;             /* indices in use */
+        double used_mb;          /* vertex and index bytes in use, in MiB */
+        double reserved_mb;      /* bytes allocated for the buffers, in MiB */
+        double max_normal_error; /* worst normal direction error from packing, in degrees */
+    } dsGeometryStats;
+
+    /**
+     * @brief Get the GPU memory used by static mesh geometry.
+     * @ingroup drawstuff
+     * Primitive meshes, cached convex shapes and registered meshes share
+     * one vertex buffer and one index buffer. Each vertex takes 16 bytes:
+     * a float position and a normal packed into 10 bits per component
+     * (GL_INT_2_10_10_10_REV). The normal error is measured at upload.
+     * Streaming triangles and lines are not included.
+     * @param stats filled with the counts
+     */
+    DS_API void dsGetGeometryStats(dsGeometryStats *stats);
+
+    /* Per-frame GL state statistics, see dsGetGLStateStats() */
+    typedef struct dsGLStateStats
+    {
+        int issued; /* state changes and uniform uploads actually sent to GL */
+        int elided; /* calls skipped because the value was already current */
+    } dsGLStateStats;
+
+    /**
+     * @brief Get the GL state statistics of the most recently rendered frame.
+     * @ingroup drawstuff
+     *
+     * drawstuff keeps a shadow copy of the GL state it uses (program, vertex
+     * array, capabilities, depth/blend/polygon settings, bound textures and
+     * uniform values) and skips calls that would not change anything.
+     * Draw calls and buffer uploads are not counted.
+     * @param stats filled with the counts
+     */
+    DS_API void dsGetGLStateStats(dsGLStateStats *stats);
+
     /**
      * @brief Set sphere tesselation quality.
      * @ingroup drawstuff
@@ -337,6 +715,85 @@ extern "C"
     void dsDrawRegisteredMesh(
         dsMeshHandle handle,
         const float pos[3], const float R[12], const bool solid = true);
+
+    // Unregister a mesh and give its GPU storage back.  The handle becomes
+    // invalid, and its id may be reused by a later dsRegisterIndexedMesh().
+    void dsUnregisterMesh(dsMeshHandle handle);
+
+    // Registration reorders the triangles for the post-transform vertex
+    // cache (Tipsify), puts outward-facing clusters first to reduce
+    // overdraw, and renumbers vertices in order of first use.  Meshes with
+    // at most 65536 vertices get 16-bit indices.  ACMR is cache misses per
+    // triangle and ATVR cache misses per vertex, both for a 16-entry FIFO
+    // cache, before and after the reordering.
+    struct dsRegisteredMeshStats
+    {
+        int vertices;
+        int triangles;
+        int index_bytes; // 2 or 4
+        double acmr_before, acmr_after;
+        double atvr_before, atvr_after;
+    };
+
+    void dsGetRegisteredMeshStats(dsMeshHandle handle, dsRegisteredMeshStats *stats);
+
+    // ========== Retained instances (drawstuff-modern extension) ==============
+    // Bodies that rarely move (sleeping, static) can be created once and kept
+    // on the GPU instead of being drawn every frame.  Only instances whose
+    // pose or color changed are uploaded again.  Retained instances are drawn
+    // every frame together with the immediate dsDraw*() calls.
+    // ========================================================================
+
+    /* shapes for dsCreateInstance() */
+    enum
+    {
+        DS_INSTANCE_SPHERE = 0,
+        DS_INSTANCE_BOX,
+        DS_INSTANCE_CYLINDER,
+        DS_INSTANCE_CAPSULE
+    };
+
+    struct dsInstanceHandle
+    {
+        unsigned int id = 0; // 0 = invalid
+        bool isValid() const { return id != 0; }
+    };
+
+    /**
+     * @brief Create a retained instance that is drawn every frame until destroyed.
+     * @ingroup drawstuff
+     * The instance uses the current color (see dsSetColor()).
+     * @param shape DS_INSTANCE_SPHERE, DS_INSTANCE_BOX, DS_INSTANCE_CYLINDER or DS_INSTANCE_CAPSULE
+     * @param pos position, 3 values
+     * @param R rotation matrix, 12 values (ODE layout)
+     * @param size sphere: {radius}, box: {lx, ly, lz},
+     *             cylinder and capsule: {length, radius}
+     * @return handle of the new instance
+     */
+    DS_API dsInstanceHandle dsCreateInstance(const int shape, const float pos[3], const float R[12],
+                                             const float size[3]);
+    DS_API dsInstanceHandle dsCreateInstanceD(const int shape, const double pos[3], const double R[12],
+                                              const double size[3]);
+
+    /**
+     * @brief Move a retained instance.
+     * @ingroup drawstuff
+     */
+    DS_API void dsUpdateInstancePose(const dsInstanceHandle h, const float pos[3], const float R[12]);
+    DS_API void dsUpdateInstancePoseD(const dsInstanceHandle h, const double pos[3], const double R[12]);
+
+    /**
+     * @brief Change the color of a retained instance.
+     * @ingroup drawstuff
+     */
+    DS_API void dsSetInstanceColor(const dsInstanceHandle h,
+                                   const float red, const float green, const float blue, const float alpha);
+
+    /**
+     * @brief Destroy a retained instance.  The handle becomes invalid.
+     * @ingroup drawstuff
+     */
+    DS_API void dsDestroyInstance(const dsInstanceHandle h);
     
 /* closing bracket for extern "C" */
 #ifdef __cplusplus
@@ -12,11 +12,22 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <cmath>
+#include <cstring>
 #include <X11/Xlib.h>  // XEvent
 #include <glad/glad.h>
 #include <glm/glm.hpp>
@@ -119,32 +130,1100 @@ namespace ds_internal
         glm::vec3 normal;
     };
 
+    // GeometryArena へ渡す頂点。cap はカプセルの蓋（胴 0，上の蓋 +1，下の蓋 -1）で，他の形は 0
+    struct VertexPNC
+    {
+        glm::vec3 pos;
+        glm::vec3 normal;
+        float cap;
+    };
+
+    // GeometryArena の中での頂点の形（16 バイト。VertexPNC は 28 バイト）。
+    // 法線と cap は GL_INT_2_10_10_10_REV の 1 語にする：x,y,z は法線 × 511 の 10bit 整数，w は cap の 2bit 整数。
+    // 正規化せずに読むので（GL のバージョンで snorm の変換規則が違うため）シェーダでは xyz を 1/511 倍する
+    struct VertexPacked
+    {
+        glm::vec3 pos;
+        std::uint32_t normalCap;
+    };
+
+    // 即時描画の線をフレームの終わりにまとめて描くための頂点。
+    // モデル行列は CPU で掛けておき，テクスチャ用にモデル座標も持つ（basic.vs と同じ見た目）
+    struct VertexStream
+    {
+        glm::vec3 pos;         // ワールド座標
+        glm::vec3 normal;      // ワールド座標
+        glm::vec3 localPos;    // テクスチャ用（モデル座標）
+        glm::vec3 localNormal;
+        std::uint8_t color[4]; // RGBA8
+    };
+
+    // 即時描画の三角形用の頂点（法線なし，VertexStream の約半分）。
+    // 三角形の中で法線は一定なので，FS で位置の微分から求める（stream シェーダの FLAT_NORMAL）
+    struct VertexFlat
+    {
+        glm::vec3 pos;         // ワールド座標
+        glm::vec3 localPos;    // テクスチャ用（モデル座標）
+        std::uint8_t color[4]; // RGBA8
+    };
+
+    // VertexFlat の置き場の種類。バッファにはこの順（各々 不透明 → 半透明）に詰め，線はその後ろ
+    enum StreamBatch
+    {
+        STREAM_SOLID = 0, // 塗り潰しの三角形（影あり）
+        STREAM_WIRE,      // ワイヤーフレームの三角形（影なし）
+        STREAM_BATCH_COUNT
+    };
+
     struct Mesh
     {
         GLuint vao = 0;
         GLuint vbo = 0;
-        GLuint ebo = 0; // インデックスを使うなら
+        GLuint ebo = 0; // インデックスを使うなら（GeometryArena のメッシュは 0）
         GLsizei indexCount = 0;
         GLenum primitive = GL_TRIANGLES;
+        // GeometryArena 内の場所（geometry は 1 始まりの番号，0 なら自前のバッファ）
+        std::uint32_t geometry = 0;
+        GLint baseVertex = 0;
+        GLuint firstIndex = 0; // indexType の要素単位
+        // GeometryArena は頂点が 65536 個までのメッシュを GL_UNSIGNED_SHORT で持つ
+        GLenum indexType = GL_UNSIGNED_INT;
+
+        // glDrawElements* の indices 引数（インデックスバッファ内のバイト位置）
+        const void *indexOffset() const
+        {
+            const std::size_t size = (indexType == GL_UNSIGNED_SHORT) ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+            return reinterpret_cast<const void *>(std::uintptr_t(firstIndex) * size);
+        }
     };
 
-    // TriMesh 用高速描画 API 用
+    // TriMesh 用高速描画 API 用（0 は無効）
     using MeshHandle = std::size_t;
 
-    struct InstanceBasic
+    // インスタンス 1 個分のデータ（36 バイト）。
+    // モデル行列の最下行は常に (0,0,0,1)，色も画面上は 8bit なので，
+    // 位置＋四元数（snorm16）＋スケール＋RGBA8 に詰めて VS 側で行列を組み立て直す。
+    struct InstanceCompact
+    {
+        float pos[3];
+        std::int16_t rot[4];   // 四元数 (x, y, z, w)，snorm16
+        float scale[3];
+        std::uint8_t color[4]; // RGBA8
+    };
+    static_assert(sizeof(InstanceCompact) == 36, "InstanceCompact must be tightly packed");
+
+    inline std::int16_t packSnorm16(const float v)
+    {
+        const float c = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+        return static_cast<std::int16_t>(std::lround(c * 32767.0f));
+    }
+
+    inline std::uint8_t packUnorm8(const float v)
+    {
+        const float c = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+        return static_cast<std::uint8_t>(c * 255.0f + 0.5f);
+    }
+
+    // ODE の 3x4 回転行列 → 四元数 (x, y, z, w)
+    template <typename T>
+    inline void rotationToQuat(const T R[12], float q[4])
+    {
+        const float m00 = (float)R[0], m01 = (float)R[1], m02 = (float)R[2];
+        const float m10 = (float)R[4], m11 = (float)R[5], m12 = (float)R[6];
+        const float m20 = (float)R[8], m21 = (float)R[9], m22 = (float)R[10];
+
+        // 対角成分の最大のものを軸に選ぶ（数値的に安定な方法）
+        const float tr = m00 + m11 + m22;
+        if (tr > 0.0f)
+        {
+            const float s = std::sqrt(tr + 1.0f) * 2.0f; // s = 4w
+            q[3] = 0.25f * s;
+            q[0] = (m21 - m12) / s;
+            q[1] = (m02 - m20) / s;
+            q[2] = (m10 - m01) / s;
+        }
+        else if (m00 > m11 && m00 > m22)
+        {
+            const float s = std::sqrt(1.0f + m00 - m11 - m22) * 2.0f; // s = 4x
+            q[3] = (m21 - m12) / s;
+            q[0] = 0.25f * s;
+            q[1] = (m01 + m10) / s;
+            q[2] = (m02 + m20) / s;
+        }
+        else if (m11 > m22)
+        {
+            const float s = std::sqrt(1.0f + m11 - m00 - m22) * 2.0f; // s = 4y
+            q[3] = (m02 - m20) / s;
+            q[0] = (m01 + m10) / s;
+            q[1] = 0.25f * s;
+            q[2] = (m12 + m21) / s;
+        }
+        else
+        {
+            const float s = std::sqrt(1.0f + m22 - m00 - m11) * 2.0f; // s = 4z
+            q[3] = (m10 - m01) / s;
+            q[0] = (m02 + m20) / s;
+            q[1] = (m12 + m21) / s;
+            q[2] = 0.25f * s;
+        }
+    }
+
+    // 1 個分：回転行列 → snorm16 四元数
+    template <typename T>
+    inline void packRotationQuat(const T R[12], std::int16_t rot[4])
+    {
+        float q[4];
+        rotationToQuat(R, q);
+        for (int k = 0; k < 4; ++k)
+            rot[k] = packSnorm16(q[k]);
+    }
+
+    // まとめて変換する SIMD 版（pose_kernels.cpp）。
+    // R は stride バイトおきに並んだ ODE 形式の 3x4 行列，out[i] に (x,y,z,w) を書く。
+    // x86-64 では SSE2，実行時に AVX2 が使えればそちらを使う。
+    void convertRotationsToQuat(const float *R, std::size_t stride, std::size_t n, std::int16_t (*out)[4]);
+    void convertRotationsToQuat(const double *R, std::size_t stride, std::size_t n, std::int16_t (*out)[4]);
+    const char *poseKernelName(); // "avx2" / "sse2" / "scalar"
+
+    // インスタンス描画の振り分け先（形状ごとのバケット）
+    enum InstanceBucket
+    {
+        BUCKET_SPHERE = 0,
+        BUCKET_BOX,
+        BUCKET_CYLINDER,
+        // カプセルは 1 インスタンス = スケール (r, r, 平行部の半分)。蓋は VS でずらす
+        BUCKET_CAPSULE,
+        BUCKET_COUNT
+    };
+
+    // 1 回の glDrawElementsInstanced に渡す連続したインスタンス範囲
+    struct InstanceRange
+    {
+        GLuint buffer = 0;
+        GLintptr offset = 0; // バイト単位
+        GLsizei count = 0;
+        int lod = 0; // 詳細度：設定された quality から下げる段数（カリング時に選ぶ）
+    };
+
+    // 全形状共通のインスタンス用リングバッファ。
+    // バッファは 1 本だけ確保し，kFrameCount フレーム分のスロットに分けて
+    // glFenceSync で GPU の読み終わりを待ってから再利用する。
+    // GL 4.4 (ARB_buffer_storage) があれば永続マップ，
+    // なければ毎フレーム glMapBufferRange(UNSYNCHRONIZED) で書き込む。
+    // drawSphere 等は allocate() で得たマップ済みメモリへ直接書き込む。
+    class InstanceArena
+    {
+    public:
+        static constexpr int kFrameCount = 3;
+
+        void init();
+        void destroy();
+
+        // renderFrame の先頭（step の前）で呼ぶ：スロットを進めて書き込み先を用意
+        void beginFrame();
+        // step の後，描画の前に呼ぶ：アンマップと溢れ分のアップロード
+        void endFrame();
+        // そのフレームの描画コマンドをすべて発行した後に呼ぶ
+        void fenceFrame();
+
+        // bucket に n 個分の連続領域を確保して返す（書き込み専用メモリなので読まないこと）
+        InstanceCompact *allocate(const int bucket, const std::size_t n = 1)
+        {
+            Segment &seg = segments_[bucket];
+            if (seg.count + n <= seg.capacity)
+            {
+                InstanceCompact *p = seg.base + seg.count;
+                seg.count += n;
+                return p;
+            }
+            return allocateSlow(bucket, n);
+        }
+
+        std::size_t count(const int bucket) const
+        {
+            return segments_[bucket].count + segments_[bucket].overflow.size();
+        }
+        const std::vector<InstanceRange> &ranges(const int bucket) const
+        {
+            return segments_[bucket].ranges;
+        }
+        // 影パス用の描画範囲（遅延モード以外は本描画と同じ）
+        const std::vector<InstanceRange> &shadowRanges(const int bucket) const
+        {
+            return deferred_ ? segments_[bucket].shadowRanges : segments_[bucket].ranges;
+        }
+        bool isPersistent() const { return persistent_; }
+
+        // ---- 遅延モード（カリング用）----
+        // step 中は CPU 側の staging に記録しておき，endFrame の後で
+        // mapOutput → addRange → unmapOutput の順に，選別した分だけを詰めて送る。
+        // 切り替えは次の beginFrame から有効
+        void setDeferred(const bool deferred) { wantDeferred_ = deferred; }
+        bool isDeferred() const { return deferred_; }
+        // 記録された bucket の内容（count(bucket) 個，CPU メモリなので読んでよい）
+        const InstanceCompact *staged(const int bucket) const { return segments_[bucket].base; }
+        // このフレームのスロットに total 個分の書き込み先を用意する
+        InstanceCompact *mapOutput(const std::size_t total);
+        // mapOutput の先頭から first 個目以降 count 個を bucket の描画範囲にする
+        void addRange(const int bucket, const std::size_t first, const std::size_t count, const bool shadow,
+                      const int lod = 0);
+        void unmapOutput();
+
+    private:
+        struct Segment
+        {
+            InstanceCompact *base = nullptr; // マップ済みメモリ上の先頭
+            std::size_t offset = 0;        // スロット先頭からのバイトオフセット
+            std::size_t capacity = 0;
+            std::size_t count = 0;
+            std::size_t lastCount = 0; // 前フレームの総数（次の容量見積もり用）
+            std::vector<InstanceCompact> overflow; // 容量を超えた分（endFrame で別バッファへ）
+            std::vector<InstanceRange> ranges;
+            std::vector<InstanceCompact> staging;   // 遅延モードの記録先
+            std::vector<InstanceRange> shadowRanges; // 遅延モードの影パス用
+        };
+
+        InstanceCompact *allocateSlow(const int bucket, const std::size_t n);
+        void createBuffer(const std::size_t slotBytes);
+        void waitFence(const int slot);
+
+        Segment segments_[BUCKET_COUNT];
+        GLuint buffer_ = 0;
+        GLuint spillBuffer_ = 0; // 溢れ分用（通常の STREAM_DRAW バッファ）
+        std::size_t slotBytes_ = 0;
+        unsigned char *persistentPtr_ = nullptr;
+        unsigned char *mappedSlot_ = nullptr;
+        GLsync fences_[kFrameCount] = {};
+        int slot_ = 0;
+        bool persistent_ = false;
+        bool mapped_ = false;
+        bool deferred_ = false;
+        bool wantDeferred_ = false;
+    };
+
+    // 描画まわりの下請け用の小さなスレッドプール。
+    // parallelFor は呼び出しスレッドも一緒に働き，全チャンクが終わるまで戻らない。
+    // ワーカーは GL を触らないこと（コンテキストは描画スレッドにしかない）
+    class JobPool
+    {
+    public:
+        using JobFn = std::function<void(std::size_t begin, std::size_t end)>;
+        static constexpr int kMaxWorkers = 15;
+
+        ~JobPool() { stop(); }
+
+        // workers < 0 ならハードウェアスレッド数から決める
+        void start(int workers = -1);
+        void stop();
+        int threadCount() const { return static_cast<int>(threads_.size()) + 1; }
+
+        // [0, count) を chunk 個ずつに分けて fn(begin, end) を並列に呼ぶ
+        void parallelFor(const std::size_t count, const std::size_t chunk, const JobFn &fn);
+
+    private:
+        void workerLoop();
+        void runChunks(const JobFn &fn, const std::size_t count, const std::size_t chunk);
+
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable wakeCv_;
+        std::condition_variable doneCv_;
+        const JobFn *job_ = nullptr;
+        std::size_t count_ = 0;
+        std::size_t chunk_ = 0;
+        std::atomic<std::size_t> next_{0};
+        std::uint64_t generation_ = 0;
+        int busy_ = 0;
+        bool quit_ = false;
+    };
+
+    // 並列基数ソート（radix_sort.cpp）。keys の下位 keyBits ビット（8 の倍数）で昇順に安定に並べ，
+    // order にも同じ入れ替えをする。8bit ずつのパスをチャンクに分けてワーカーで回し，
+    // 全部が同じ桁になるパスは飛ばす。scratch は作業領域（使い回す）
+    struct RadixSortScratch
+    {
+        std::vector<std::uint32_t> keys, order, histograms;
+    };
+    void radixSort(std::vector<std::uint32_t> &keys, std::vector<std::uint32_t> &order, const int keyBits,
+                   RadixSortScratch &scratch, JobPool &jobs);
+
+    // 半透明（alpha < 1）のインスタンスの置き場（transparent_queue.cpp）。
+    // 不透明のインスタンスとは別に bucket ごとに溜め，全部の不透明パスの後で描く。
+    // sortBackToFront() は視点からの距離を 32bit キーにして radixSort() で並べる。
+    // 描くときは同じ bucket が続く区間（run）ごとに 1 draw。
+    // GPU バッファには bucket 順（影・重み付き OIT 用）と，並べ替えた場合はその順の両方を詰める
+    class TransparentQueue
+    {
+    public:
+        struct Run
+        {
+            int bucket;
+            InstanceRange range;
+        };
+
+        InstanceCompact *allocate(const int bucket, const std::size_t n = 1)
+        {
+            std::vector<InstanceCompact> &v = items_[bucket];
+            const std::size_t old = v.size();
+            v.resize(old + n);
+            return v.data() + old;
+        }
+        std::size_t size() const;
+        bool empty() const { return size() == 0; }
+        // 記録した分を捨てる（容量は次フレームのために残す）
+        void clear();
+
+        // eye から遠い順に並べる。呼ばなければ upload() は bucket 順だけを送る
+        void sortBackToFront(const float eye[3], JobPool &jobs);
+        // 描画前に呼ぶ：毎フレーム確保し直して（orphan）詰める
+        void upload();
+        // bucket 順に詰めた分のうち bucket の範囲（なければ false）
+        bool range(const int bucket, InstanceRange &r) const;
+        // 並べ替えた順の run（sortBackToFront() を呼んだフレームだけ）
+        const std::vector<Run> &sortedRuns() const { return runs_; }
+        void releaseGL();
+
+    private:
+        // 全 bucket を bucket 順につないだときの i 番目
+        const InstanceCompact &flat(const std::size_t i, int &bucket) const;
+
+        std::vector<InstanceCompact> items_[BUCKET_COUNT];
+        std::size_t first_[BUCKET_COUNT + 1] = {}; // items_ をつないだときの各 bucket の先頭
+        // 並べ替えのキーと flat な番号
+        std::vector<std::uint32_t> keys_;
+        std::vector<std::uint32_t> order_;
+        RadixSortScratch scratch_;
+        std::vector<InstanceCompact> sorted_;
+        std::vector<std::uint8_t> sortedBucket_;
+        std::vector<Run> runs_;
+        bool sortedValid_ = false;
+        GLuint buffer_ = 0;
+        std::size_t capacity_ = 0; // インスタンス数
+    };
+
+    // 視錐台カリング（instance_cull.cpp）
+    // 平面は (n, d) で n・p + d >= 0 が内側。影は地面 z=0 への平行投影
+    // (x - kx z, y - ky z, 0) として，半径を shadowScale 倍した球で判定する。
+    struct CullParams
+    {
+        float planes[6][4];
+        float shadowKx = 0.0f;
+        float shadowKy = 0.0f;
+        float shadowScale = 1.0f;
+        bool shadows = false;
+    };
+    // 投影×ビュー行列から正規化した 6 平面を取り出す
+    void extractFrustumPlanes(const glm::mat4 &viewProj, float planes[6][4]);
+    // in[0..n) の可視判定。mask[i] の bit0 = 本描画で見える，bit1 = 影が見える。
+    // 境界球の半径は bucket ごとの単位メッシュの大きさとスケールから求める
+    void cullInstanceVisibility(const InstanceCompact *in, const std::size_t n, const int bucket,
+                                const CullParams &params, std::uint8_t *mask,
+                                std::size_t &mainCount, std::size_t &shadowCount);
+    constexpr std::uint8_t kCullMain = 1;
+    constexpr std::uint8_t kCullShadow = 2;
+
+    // 画面上の大きさによる詳細度（LOD）の選択。mask の bit2-3 に本描画，bit4-5 に影の段数を入れる。
+    // 段数 k のメッシュは quality - k（最低 1）。球・円柱・カプセルの bucket が対象
+    constexpr int kLodLevels = 3;
+    constexpr int kLodMainShift = 2;
+    constexpr int kLodShadowShift = 4;
+    struct LodParams
+    {
+        float wRow[4];                      // 投影×ビュー行列の第 4 行（clip w）
+        float pixelScale = 1.0f;            // 半径 / w → ピクセル
+        float mainPixels[kLodLevels - 1];   // 段数 0, 1 でいられる最小半径（ピクセル）
+        float shadowPixels[kLodLevels - 1]; // 影用（本描画より粗く）
+        float hysteresis = 0.15f;           // 前フレームの段数を保つ幅（割合）
+    };
+    inline bool bucketHasLod(const int bucket)
+    {
+        return bucket == BUCKET_SPHERE || bucket == BUCKET_CYLINDER || bucket == BUCKET_CAPSULE;
+    }
+    // mask が立っているものに段数を付け，段数ごとの個数を数える。
+    // state は前フレームの選択（bucket 内の記録順で対応づける）で，ここで更新される
+    void selectInstanceLod(const InstanceCompact *in, const std::size_t n, const int bucket,
+                           const CullParams &params, const LodParams &lod, std::uint8_t *mask,
+                           std::uint8_t *state, std::size_t mainCount[kLodLevels],
+                           std::size_t shadowCount[kLodLevels]);
+    // bucket ごとの境界球の係数 (a, b, c)（GPU カリングのシェーダにも渡す）
+    void cullBoundCoef(const int bucket, float coef[3]);
+
+    // カリングの方式。dsSetCulling() の DS_CULL_* と同じ値
+    enum CullMode
+    {
+        CULL_OFF = 0,
+        CULL_CPU = 1, // ワーカースレッドで選別してからアップロード
+        CULL_GPU = 2  // transform feedback で GPU 上で選別（instance_cull_gpu.cpp）
+    };
+
+    // 描き終えたフレームの深度から作る最大値ピラミッド（Hi-Z，depth_pyramid.cpp）。
+    // 次のフレームの GPU カリングで，このフレームの投影×ビュー行列を使って遮蔽を判定する。
+    // level 0 が画面の 1/2 で，各 texel は下の 2x2（奇数端は 3 列・3 行）の最大深度
+    class DepthPyramid
+    {
+    public:
+        // program は DrawstuffApp::initHiZProgram() が作る
+        void init(const GLuint program);
+        void destroy();
+        bool ready() const { return program_ != 0; }
+
+        // デフォルトフレームバッファの深度から作り直す。viewProj はそのフレームのもの
+        void build(const int width, const int height, const glm::mat4 &viewProj);
+        void invalidate() { valid_ = false; }
+        bool valid() const { return valid_; }
+
+        GLuint texture() const { return pyramid_; }
+        int levels() const { return levels_; }
+        int width() const { return width_; } // 元の画面サイズ
+        int height() const { return height_; }
+        const glm::mat4 &viewProj() const { return viewProj_; }
+
+    private:
+        void resize(const int width, const int height);
+
+        GLuint program_ = 0;
+        GLint uSrc_ = -1;
+        GLint uSrcSize_ = -1;
+        GLuint vao_ = 0; // 全画面三角形（頂点は gl_VertexID から作る）
+        GLuint fbo_ = 0;
+        GLuint depth_ = 0;   // 画面の深度のコピー
+        GLuint pyramid_ = 0; // R32F + ミップマップ
+        int width_ = 0;
+        int height_ = 0;
+        int levels_ = 0;
+        bool valid_ = false;
+        glm::mat4 viewProj_{1.0f};
+    };
+
+    // 重み付きブレンドによる順序非依存の半透明（weighted blended OIT，weighted_oit.cpp）。
+    // 画面の深度をコピーした FBO に，色×重みの和（RGBA16F）と -log(1 - alpha) の和（R16F）を
+    // 加算で溜め，最後に平均色を透過率 exp(-和) で画面へ重ねる。並べ替えはいらない。
+    // 透過率を積ではなく対数の和で溜めるので，GL 3.3 の（全アタッチメント共通の）glBlendFunc で済む
+    class WeightedOit
+    {
+    public:
+        // program は DrawstuffApp::initOitProgram() が作る
+        void init(const GLuint program);
+        void destroy();
+        bool ready() const { return program_ != 0; }
+
+        // 溜め込み用 FBO を bind してクリアする（深度はデフォルトフレームバッファからコピー）。
+        // この後の描画は加算ブレンド・深度書き込みなしで行うこと
+        void begin(const int width, const int height);
+        // デフォルトフレームバッファへ戻して合成する。GL の状態は直接変える
+        void composite();
+
+    private:
+        void resize(const int width, const int height);
+
+        GLuint program_ = 0;
+        GLint uAccum_ = -1;
+        GLint uReveal_ = -1;
+        GLuint vao_ = 0; // 全画面三角形（頂点は gl_VertexID から作る）
+        GLuint fbo_ = 0;
+        GLuint depth_ = 0;
+        GLuint accum_ = 0;  // RGBA16F：(rgb * a, a) * 重み の和
+        GLuint reveal_ = 0; // R16F：-log(1 - a) の和
+        int width_ = 0;
+        int height_ = 0;
+    };
+
+    // 1 つのパスの GPU 時間（GL_TIME_ELAPSED）と，深度テストを通ったサンプル数（GL_SAMPLES_PASSED）
+    // を測る（pass_query.cpp）。結果は kFrameCount フレーム後に，出来ていれば読む（待たない）
+    class PassQuery
+    {
+    public:
+        static constexpr int kFrameCount = 3;
+
+        void init();
+        void destroy();
+        bool ready() const { return time_[0] != 0; }
+
+        // begin と end の間で他の GL_TIME_ELAPSED / GL_SAMPLES_PASSED クエリを使わないこと
+        void begin();
+        void end();
+
+        // 最後に読めたフレームの値
+        double lastMilliseconds() const { return lastMilliseconds_; }
+        std::uint64_t lastSamples() const { return lastSamples_; }
+
+    private:
+        GLuint time_[kFrameCount] = {};
+        GLuint samples_[kFrameCount] = {};
+        bool pending_[kFrameCount] = {};
+        int slot_ = 0;
+        double lastMilliseconds_ = 0.0;
+        std::uint64_t lastSamples_ = 0;
+    };
+
+    // 形状メッシュ（基本形状・dsDrawConvex のキャッシュ・登録メッシュ）の頂点とインデックスを
+    // 1 本ずつのバッファに詰めて持つ（geometry_arena.cpp）。VAO も 1 つだけで，
+    // 描画は glDrawElements*BaseVertex でメッシュの場所を選ぶ（メッシュを替えても VAO は替わらない）。
+    // インデックスは頂点が 65536 個までなら 16bit，それ以上は 32bit で持つ（Mesh::indexType）。
+    // 空きは位置順の free list（first fit，返すときに隣と併合）。足りなければバッファを作り直して広げ，
+    // 穴が増えたら compact() で詰め直す。その後は refresh() でメッシュの場所を読み直すこと
+    class GeometryArena
+    {
+    public:
+        void init();
+        void destroy();
+        GLuint vao() const { return vao_; }
+
+        // 場所を取って載せ，mesh に書く（indices はメッシュ内の頂点番号）
+        void upload(Mesh &mesh, const VertexPNC *vertices, const std::size_t vertexCount,
+                    const std::uint32_t *indices, const std::size_t indexCount);
+        void upload(Mesh &mesh, const std::vector<VertexPN> &vertices, const std::vector<std::uint32_t> &indices);
+        // mesh の場所を空きに返す（mesh は空になる）
+        void release(Mesh &mesh);
+        void refresh(Mesh &mesh) const;
+
+        // vertexCount 個の頂点のメッシュを 16bit のインデックスで持つか
+        static bool shortIndices(const std::size_t vertexCount) { return vertexCount <= (std::size_t(1) << 16); }
+
+        // 末尾以外の空き（穴）が使っている量に比べて大きい
+        bool fragmented() const;
+        void compact();
+
+        // 統計（要素数）
+        std::size_t usedVertices() const { return vertices_.used; }
+        std::size_t capacityVertices() const { return vertices_.capacity; }
+        std::size_t usedIndices() const { return liveIndices_; }
+        // インデックスバッファのバイト数
+        std::size_t usedIndexBytes() const { return indices_.used * sizeof(std::uint32_t); }
+        std::size_t capacityIndexBytes() const { return indices_.capacity * sizeof(std::uint32_t); }
+        // これまでに載せた法線を VertexPacked にしたときの最大の角度誤差（度）
+        double maxNormalError() const { return maxNormalError_; }
+
+    private:
+        struct Span
+        {
+            std::size_t offset = 0;
+            std::size_t size = 0;
+        };
+        // 要素単位の空き管理
+        struct FreeList
+        {
+            std::vector<Span> free; // offset 順，隣り合うものはない
+            std::size_t capacity = 0;
+            std::size_t used = 0;
+
+            bool allocate(const std::size_t n, std::size_t &offset);
+            void release(const std::size_t offset, const std::size_t n);
+            void grow(const std::size_t newCapacity);
+            std::size_t holes() const;
+        };
+        struct Slot
+        {
+            Span vertices;
+            Span indices; // 32bit 単位（16bit のインデックスは 2 つで 1 単位）
+            std::size_t indexCount = 0;
+            bool shortIndices = false;
+            bool live = false;
+        };
+
+        // packed_ に詰めた頂点と indices を新しい場所へ載せる
+        void uploadPacked(Mesh &mesh, const std::uint32_t *indices, const std::size_t indexCount);
+        // list から n 要素取る。足りなければ buffer を広げる
+        std::size_t allocate(FreeList &list, GLuint &buffer, const std::size_t stride, const std::size_t n);
+        void resize(GLuint &buffer, const std::size_t stride, const std::size_t oldCapacity,
+                    const std::size_t newCapacity);
+        void bindLayout();
+
+        GLuint vao_ = 0;
+        GLuint vbo_ = 0;
+        GLuint ebo_ = 0;
+        FreeList vertices_;
+        FreeList indices_;
+        std::vector<Slot> slots_; // Mesh::geometry - 1
+        std::vector<std::uint32_t> freeSlots_;
+        std::vector<VertexPacked> packed_; // upload() の詰め替え用
+        std::vector<std::uint16_t> shortIndices_;
+        std::size_t liveIndices_ = 0;
+        double maxNormalError_ = 0.0;
+    };
+
+    // glDrawElementsIndirect / glMultiDrawElementsIndirect のコマンド（GL 4.0 の定義どおり）
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // GPU 上の視錐台カリング。
+    // 保持型＋即時描画分のインスタンスを点として VS+GS に流し，残ったものだけを
+    // transform feedback で (本描画 / 影) × bucket ごとの出力バッファへ詰める。
+    // 詰めた個数は GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN クエリで得る：GL 4.4（query buffer）＋ 4.0
+    // （間接描画）があれば GPU 上で間接描画コマンドへ書き込み，なければ CPU で読む。
+    class GpuCuller
+    {
+    public:
+        // program は DrawstuffApp::initCullProgram() が作る
+        void init(const GLuint program);
+        void destroy();
+        bool ready() const { return program_ != 0; }
+
+        // 1 フレーム分の選別。inputs[b] は bucket b の入力範囲
+        // wRow は投影×ビュー行列の第 4 行（clip w），pixelScale は半径→画素への係数
+        // occluder が有効なら，その深度ピラミッドに隠れるものも捨てる
+        void run(const std::vector<InstanceRange> (&inputs)[BUCKET_COUNT], const CullParams &params,
+                 const glm::vec4 &wRow, const float pixelScale, const float minPixels,
+                 const DepthPyramid *occluder);
+        // 選別結果の範囲（個数は GPU 上にあるので count は容量）
+        bool output(const int bucket, const bool shadow, InstanceRange &r) const;
+        // 選別結果を描く。VAO とインスタンス属性は呼び出し側で設定済みのこと
+        void drawElements(const Mesh &mesh, const int bucket, const bool shadow);
+
+        // ひとつ前に run したフレームの集計（クエリ結果を待たないよう 1 フレーム遅れ）
+        std::size_t lastInstances() const { return lastInstances_; }
+        std::size_t lastVisible() const { return lastVisible_; }
+        std::size_t lastShadowVisible() const { return lastShadowVisible_; }
+        std::size_t lastOccluded() const { return lastOccluded_; }
+        std::size_t lastShadowOccluded() const { return lastShadowOccluded_; }
+        bool lastShadows() const { return lastShadows_; }
+
+    private:
+        struct Output
+        {
+            GLuint buffer = 0;
+            std::size_t capacity = 0; // インスタンス数
+            GLuint query = 0;
+            GLuint frustumQuery = 0; // 遮蔽判定なしで残る数（遮蔽の集計用）
+            bool active = false;     // 今フレームに入力があったか
+            bool counted = false;    // frustumQuery を発行したか
+        };
+        void bindInput(const InstanceRange &r);
+        void collectStats();
+
+        GLuint program_ = 0;
+        GLint uPlanes_ = -1;
+        GLint uBound_ = -1;
+        GLint uShadow_ = -1;
+        GLint uShadowPass_ = -1;
+        GLint uWRow_ = -1;
+        GLint uPixelScale_ = -1;
+        GLint uMinPixels_ = -1;
+        GLint uOcclusion_ = -1;
+        GLint uHiZ_ = -1;
+        GLint uHiZViewProj_ = -1;
+        GLint uHiZScreen_ = -1;
+        GLint uHiZMaxLevel_ = -1;
+        GLuint vao_ = 0;
+        GLuint indirect_ = 0; // 間接描画コマンド（(本描画 / 影) × bucket 個）
+
+        Output out_[2][BUCKET_COUNT];
+        std::size_t instances_ = 0; // 今フレームの入力数
+        bool shadows_ = false;
+        std::size_t lastInstances_ = 0;
+        std::size_t lastVisible_ = 0;
+        std::size_t lastShadowVisible_ = 0;
+        std::size_t lastOccluded_ = 0;
+        std::size_t lastShadowOccluded_ = 0;
+        bool lastShadows_ = false;
+    };
+
+    // GL 4.3（または ARB_multi_draw_indirect + base instance）で，1 つのパスの instanced draw を
+    // 間接描画コマンドに積んでまとめて描く（multi_draw.cpp）。メッシュは全部 GeometryArena の VAO にあり，
+    // インスタンスの範囲は baseInstance で選ぶので，インスタンスバッファ（と stride の端数）が同じ
+    // コマンドは 1 回の glMultiDrawElementsIndirect になる。
+    class MultiDrawBatch
+    {
+    public:
+        void init();
+        void destroy();
+        bool ready() const { return buffer_ != 0; }
+
+        // mesh を range のインスタンスで描くコマンドを積む
+        void add(const Mesh &mesh, const InstanceRange &range);
+        bool empty() const { return commands_.empty(); }
+        // 積んだコマンドをインスタンスバッファ・インデックスの型ごとに並べて送る（コマンド列は空になる）
+        void upload();
+        // upload() 後のまとまり。range はインスタンス属性を向ける位置（count は使わない）
+        std::size_t groupCount() const { return groups_.size(); }
+        const InstanceRange &groupRange(const std::size_t i) const { return groups_[i].range; }
+        void drawGroup(const std::size_t i) const;
+
+        // 最後のフレームの集計（コマンド数と multi-draw の回数）
+        std::size_t lastCommands() const { return lastCommands_; }
+        std::size_t lastDraws() const { return lastDraws_; }
+        void beginFrame();
+
+    private:
+        struct Pending
+        {
+            GLuint buffer;
+            GLintptr residue; // offset % sizeof(InstanceCompact)
+            GLenum indexType;
+            DrawElementsIndirectCommand cmd;
+        };
+        struct Group
+        {
+            InstanceRange range;
+            GLenum indexType = GL_UNSIGNED_INT;
+            std::size_t first = 0; // コマンド列の中の位置
+            GLsizei count = 0;
+        };
+
+        std::vector<Pending> commands_;
+        std::vector<DrawElementsIndirectCommand> packed_;
+        std::vector<Group> groups_;
+        GLuint buffer_ = 0;
+        std::size_t capacity_ = 0; // コマンド数
+        std::size_t commandsThisFrame_ = 0;
+        std::size_t drawsThisFrame_ = 0;
+        std::size_t lastCommands_ = 0;
+        std::size_t lastDraws_ = 0;
+    };
+
+    // 保持型インスタンス（dsCreateInstance）の形状。dsInstanceShape と同じ並び
+    enum RetainedShape
+    {
+        RETAINED_SPHERE = 0,
+        RETAINED_BOX,
+        RETAINED_CYLINDER,
+        RETAINED_CAPSULE,
+        RETAINED_SHAPE_COUNT
+    };
+
+    // 保持型インスタンスの置き場。
+    // 形状ごとにスロットを詰めて並べ（削除は末尾との入れ替え），
+    // CPU 側のミラーと GPU バッファをバケットごとに持つ。
+    // 変更されたスロットはビットセットに記録し，upload() でその範囲だけ送る。
+    // 動かない物体はフレームごとのコストがかからない。
+    class InstancePool
+    {
+    public:
+        // ハンドル ID：下位 24bit がエントリ番号 + 1，上位 8bit が世代（0 は無効）
+        std::uint32_t create(const int shape, const float size[3]);
+        void destroy(const std::uint32_t id);
+        bool isValid(const std::uint32_t id) const { return lookup(id) != nullptr; }
+
+        int shape(const std::uint32_t id) const { return lookup(id)->shape; }
+        const float *size(const std::uint32_t id) const { return lookup(id)->size; }
+        // インスタンスを書き換え用に返す（dirty にする）
+        InstanceCompact *edit(const std::uint32_t id);
+        // 半透明のものは GPU 側ではスケール 0（描かれない）にしておき，
+        // 毎フレーム appendTranslucent() で TransparentQueue に回す
+        void setTranslucent(const std::uint32_t id, const bool translucent);
+        bool hasTranslucent() const { return translucentCount_ > 0; }
+        void appendTranslucent(TransparentQueue &queue) const;
+
+        // 描画前に呼ぶ：dirty な範囲だけ GPU へ送る
+        void upload();
+        // bucket の保持インスタンス全体（なければ false）
+        bool range(const int bucket, InstanceRange &r) const;
+        // GL オブジェクトを捨てる（CPU 側の内容は残すので次の upload で作り直す）
+        void releaseGL();
+
+        static int shapeBucket(const int shape);
+
+    private:
+        struct Entry
+        {
+            std::uint32_t generation = 0;
+            std::uint32_t slot = 0;
+            int shape = -1; // -1 = 空き
+            float size[3] = {0, 0, 0};
+            bool translucent = false;
+        };
+        struct ShapeSlots
+        {
+            std::vector<std::uint32_t> owner;  // スロット → エントリ番号
+            std::vector<std::uint64_t> dirty;  // スロットごとの変更フラグ
+        };
+        struct BucketStore
+        {
+            std::vector<InstanceCompact> data; // CPU 側ミラー（スロット順）
+            GLuint buffer = 0;
+            std::size_t capacity = 0;          // GPU バッファの容量（インスタンス数）
+        };
+
+        const Entry *lookup(const std::uint32_t id) const;
+        void markDirty(const int shape, const std::uint32_t slot);
+        // data[first, first + n) を送る。半透明のスロットはスケールを 0 にした写しを送る
+        void uploadSlots(const int shape, const std::size_t first, const std::size_t n);
+
+        std::vector<Entry> entries_;
+        std::vector<std::uint32_t> freeEntries_;
+        ShapeSlots shapes_[RETAINED_SHAPE_COUNT];
+        BucketStore buckets_[BUCKET_COUNT];
+        std::size_t translucentCount_ = 0;
+        std::vector<InstanceCompact> scratch_; // uploadSlots() の写し
+    };
+
+    // dsDrawConvex の形のキー。dsSetConvexCache() の DS_CONVEX_CACHE_* と同じ値
+    enum ConvexCacheMode
+    {
+        CONVEX_CACHE_OFF = 0,     // 毎回三角形に分割して描く（従来どおり）
+        CONVEX_CACHE_CONTENT = 1, // 配列の中身のハッシュ
+        CONVEX_CACHE_POINTER = 2  // 配列のアドレス（中身を書き換えないと約束された場合）
+    };
+
+    // 半透明インスタンスの描き方。dsSetTransparency() の DS_TRANSPARENCY_* と同じ値
+    enum TransparencyMode
+    {
+        TRANSPARENCY_SORTED = 0,  // 遠い順に並べ替えて通常のアルファブレンド
+        TRANSPARENCY_WEIGHTED = 1 // 並べ替えずに重み付きブレンド（WeightedOit）
+    };
+
+    struct MeshPN; // mesh_utils.hpp
+
+    // dsDrawConvex で描かれた形のキャッシュ（convex_cache.cpp）。
+    // キーごとに三角形分割済みの GPU メッシュを持ち，そのフレームに描かれた
+    // 同じ形のインスタンス（scale 1）をまとめて 1 回の instanced draw で描く。
+    // しばらく描かれなかった形と，満杯のときに最後に使ったのが一番古い形は捨てる。
+    class ConvexCache
+    {
+    public:
+        // メッシュは geometry に載せる
+        explicit ConvexCache(GeometryArena &geometry) : geometry_(geometry) {}
+
+        // key の形のインスタンス列（このフレームに描く分）。未登録なら nullptr
+        std::vector<InstanceCompact> *find(const std::uint64_t key);
+        // mesh を GL に載せて登録する。このフレームで使った形で満杯なら nullptr
+        std::vector<InstanceCompact> *add(const std::uint64_t key, MeshPN &mesh);
+
+        // フレームの頭：インスタンス列を空にし，使われなくなった形を捨てる
+        void beginFrame();
+        // このフレームのインスタンスを 1 本のバッファへまとめて送る
+        void upload();
+        std::size_t size() const { return entries_.size(); }
+        const Mesh &mesh(const std::size_t i) const { return entries_[i].mesh; }
+        // i 番目の形のこのフレームのインスタンス（なければ false）
+        bool range(const std::size_t i, InstanceRange &r) const;
+        void releaseGL();
+        // GeometryArena::compact() の後にメッシュの場所を読み直す
+        void refreshGeometry();
+
+        // 配列の中身から作るキー（64bit ハッシュ。衝突は考えない）
+        template <typename T>
+        static std::uint64_t contentKey(const T *planes, const unsigned int planecount,
+                                        const T *points, const unsigned int pointcount,
+                                        const unsigned int *polygons)
+        {
+            // 多角形の配列の長さは面ごとの頂点数をたどって数える
+            std::size_t polylen = 0;
+            for (unsigned int i = 0; i < planecount; ++i)
+                polylen += 1u + polygons[polylen];
+
+            const std::uint64_t header[3] = {planecount, pointcount, sizeof(T)};
+            std::uint64_t h = hashBytes(header, sizeof(header), 0x6a09e667f3bcc909ull);
+            h = hashBytes(planes, std::size_t(planecount) * 4u * sizeof(T), h);
+            h = hashBytes(points, std::size_t(pointcount) * 3u * sizeof(T), h);
+            h = hashBytes(polygons, polylen * sizeof(unsigned int), h);
+            return finalize(h);
+        }
+        // 配列のアドレスから作るキー（中身は読まない）
+        template <typename T>
+        static std::uint64_t pointerKey(const T *planes, const unsigned int planecount,
+                                        const T *points, const unsigned int pointcount,
+                                        const unsigned int *polygons)
+        {
+            const std::uintptr_t header[6] = {
+                reinterpret_cast<std::uintptr_t>(planes), planecount,
+                reinterpret_cast<std::uintptr_t>(points), pointcount,
+                reinterpret_cast<std::uintptr_t>(polygons), sizeof(T)};
+            return finalize(hashBytes(header, sizeof(header), 0xbb67ae8584caa73bull));
+        }
+
+    private:
+        struct Entry
+        {
+            std::uint64_t key = 0;
+            Mesh mesh;
+            std::vector<InstanceCompact> instances;
+            std::uint64_t lastUsed = 0; // 最後に描かれたフレーム
+            std::size_t offset = 0;     // upload() 後のバッファ内の位置（インスタンス数）
+        };
+
+        static std::uint64_t hashBytes(const void *data, std::size_t size, std::uint64_t h);
+        static std::uint64_t finalize(std::uint64_t h);
+        void evict(const std::size_t i);
+
+        GeometryArena &geometry_;
+        std::vector<Entry> entries_;
+        std::unordered_map<std::uint64_t, std::size_t> index_; // key → entries_ の位置
+        std::uint64_t frame_ = 0;
+        GLuint buffer_ = 0;
+        std::size_t capacity_ = 0; // インスタンス数
+    };
+
+    // フレーム共通の uniform（std140 の FrameUniforms ブロックと同じ並び）。
+    // 毎フレーム 1 回だけ送り，どのシェーダも kFrameUniformBinding から読む
+    struct FrameUniforms
+    {
+        glm::mat4 proj;
+        glm::mat4 view;
+        glm::mat4 viewProj;      // proj * view
+        glm::mat4 shadowProject; // ワールド → 地面 z=0 に潰した影
+        glm::vec4 eye;           // 視点。w は未使用
+        glm::vec4 lightDir;      // 光源方向（光源→頂点）。w は未使用
+        glm::vec4 ground;        // 地面テクスチャの (scale, offset x, offset y)，w は影の濃さ
+        glm::vec4 groundColor;   // テクスチャ無し時の地面色。w は未使用
+    };
+    static_assert(sizeof(FrameUniforms) == 4 * 64 + 4 * 16, "FrameUniforms must match the std140 layout");
+    constexpr GLuint kFrameUniformBinding = 0;
+
+    // GL の状態の写し（gl_state.cpp）。描画経路はここを通して状態を変え，
+    // 覚えている値と同じなら GL を呼ばずに済ませる（呼んだ数と省いた数を数える）。
+    // uniform はプログラムごと・location ごとに最後に送った値を覚えておく。
+    // ここを通さずに状態を変えるもの（ユーザの step()，GPU カリング，Hi-Z，HUD など）の後は
+    // invalidate() する。VAO を作る関数は最後に 0 を bind して戻しておくこと。
+    class GLStateCache
+    {
+    public:
+        struct Stats
+        {
+            std::size_t issued = 0; // 実際に呼んだ GL
+            std::size_t elided = 0; // 同じ値だったので省いた呼び出し
+        };
+
+        // 状態を「不明」にする（次の設定は必ず GL を呼ぶ）。uniform の値は残す
+        void invalidate();
+        // uniform の値も含めて全部忘れる（プログラムやテクスチャを作り直したとき）
+        void reset();
+
+        void useProgram(const GLuint program);
+        void bindVertexArray(const GLuint vao);
+        void enable(const GLenum cap) { setCapability(cap, true); }
+        void disable(const GLenum cap) { setCapability(cap, false); }
+        void depthFunc(const GLenum func);
+        void depthMask(const bool write);
+        void depthRange(const float zNear, const float zFar);
+        void blendFunc(const GLenum src, const GLenum dst);
+        void polygonOffset(const float factor, const float units);
+        void polygonMode(const GLenum mode); // GL_FRONT_AND_BACK に対して
+        void lineWidth(const float width);
+        // unit 番のユニットに 2D テクスチャを bind する（glActiveTexture もここで済ませる）
+        void bindTexture2D(const int unit, const GLuint texture);
+
+        // 今のプログラムの uniform（前回送った値と同じなら送らない）
+        void uniform1i(const GLint loc, const GLint v);
+        void uniform1f(const GLint loc, const float v);
+        void uniform2f(const GLint loc, const float x, const float y);
+        void uniform3f(const GLint loc, const float x, const float y, const float z);
+        void uniform4fv(const GLint loc, const float *v);
+        void uniformMatrix4fv(const GLint loc, const float *m);
+
+        // このフレームの集計を締める（lastFrame() で読める）
+        void endFrame();
+        const Stats &lastFrame() const { return last_; }
+
+    private:
+        enum Capability
+        {
+            CAP_DEPTH_TEST,
+            CAP_BLEND,
+            CAP_CULL_FACE,
+            CAP_POLYGON_OFFSET_FILL,
+            CAP_COUNT
+        };
+        static constexpr int kTextureUnits = 8;
+        static constexpr GLuint kUnknown = ~0u; // GL の名前・enum として使われない値
+
+        // 覚えておく uniform の値（float 16 個まで。int はビット列のまま入れる）
+        struct UniformSlot
+        {
+            int size = 0; // 0 = 不明
+            float v[16];
+        };
+
+        void setCapability(const GLenum cap, const bool enable);
+        // 今のプログラムの loc の値が v[0..n) と同じなら true，違えば覚え直して false
+        bool sameUniform(const GLint loc, const void *v, const int n);
+        // 省けるなら数えて true を返す
+        bool elide(const bool same)
+        {
+            if (same)
+                ++frame_.elided;
+            else
+                ++frame_.issued;
+            return same;
+        }
+
+        GLuint program_ = kUnknown;
+        GLuint vao_ = kUnknown;
+        int capability_[CAP_COUNT] = {-1, -1, -1, -1}; // -1 = 不明
+        GLenum depthFunc_ = kUnknown;
+        int depthMask_ = -1; // -1 = 不明
+        float depthRange_[2] = {-1.0f, -1.0f};
+        GLenum blendFunc_[2] = {kUnknown, kUnknown};
+        float polygonOffset_[2] = {0.0f, 0.0f};
+        bool polygonOffsetKnown_ = false;
+        GLenum polygonMode_ = kUnknown;
+        float lineWidth_ = -1.0f;
+        int activeUnit_ = -1;
+        GLuint textures_[kTextureUnits] = {kUnknown, kUnknown, kUnknown, kUnknown,
+                                           kUnknown, kUnknown, kUnknown, kUnknown};
+        std::unordered_map<GLuint, std::vector<UniformSlot>> uniforms_; // プログラム → location ごとの値
+        std::vector<UniformSlot> *programUniforms_ = nullptr;         // 今のプログラムの分
+        Stats frame_;
+        Stats last_;
+    };
+
+    // シェーダの機能ビット。立っているビットの #define を差し込んで同じ GLSL から変種を作る
+    enum ShaderFeature : unsigned
     {
-        glm::mat4 model;
-        glm::vec4 color;
-        // 必要ならフラグなど
+        SHADER_TEXTURE = 1u << 0, // USE_TEXTURE：テクスチャを貼る（無しの変種はサンプラも読まない）
+        SHADER_WEIGHTED_OIT = 1u << 1, // WEIGHTED_OIT：FragColor の代わりに writeOit() で WeightedOit へ書く
+        SHADER_FLAT_NORMAL = 1u << 2,  // FLAT_NORMAL：法線を頂点から読まず，FS で位置の微分から求める
+        SHADER_VARIANT_COUNT = 1u << 3
     };
 
-    extern std::vector<InstanceBasic> sphereInstances_;
-    extern std::vector<InstanceBasic> boxInstances_;
-    extern std::vector<InstanceBasic> cylinderInstances_;
-    // カプセルは sphereTop / sphereBottom / cylinderSide にそれぞれ分ける
-    extern std::vector<InstanceBasic> capsuleCapTopInstances_;
-    extern std::vector<InstanceBasic> capsuleCapBottomInstances_;
-    extern std::vector<InstanceBasic> capsuleCylinderInstances_;
+    // 1 組の VS / FS から機能ビットの組み合わせごとに作るプログラム（shader_programs.cpp）。
+    // 変種は初めて使うときにコンパイル・リンクし，uniform の位置もそのとき引く。
+    // 使わない組み合わせ（テクスチャ無しで動かしたときのテクスチャ版など）は作られない
+    class ShaderPermutation
+    {
+    public:
+        // uniforms の並び順が location() の番号になる。GL は触らない
+        void setSource(const char *label, std::string vs, std::string fs,
+                       std::initializer_list<const char *> uniforms);
+        bool hasSource() const { return !vs_.empty(); }
+
+        // features の変種（無ければここで作る）
+        GLuint program(const unsigned features);
+        // program(features) を呼んだあとに使う
+        GLint location(const unsigned features, const int i) const { return variants_[features].locations[i]; }
+        // 作った変種を全部消す（ソースは残るので次に使うとき作り直す）
+        void release();
+
+    private:
+        struct Variant
+        {
+            GLuint program = 0;
+            std::vector<GLint> locations;
+        };
+        const char *label_ = "";
+        std::string vs_, fs_;
+        std::vector<const char *> uniforms_;
+        Variant variants_[SHADER_VARIANT_COUNT];
+    };
+
+    // 並列記録（dsBeginParallelDraw）のスロット数の上限
+    constexpr int kMaxParallelDrawSlots = 256;
+
+    // 並列記録用：1 スロット分の記録バッファ。
+    // ワーカースレッドからは GL を一切触らず，ここに溜めるだけにする。
+    // renderFrame で「メインスレッド分 → スロット番号順」にアリーナへ合流させるので，
+    // スレッドの実行順によらず描画順は毎フレーム同じになる。
+    struct ParallelRecorder
+    {
+        glm::vec4 color{1.0f, 1.0f, 1.0f, 1.0f};
+        std::uint8_t color_rgba8[4] = {255, 255, 255, 255};
+        std::vector<InstanceCompact> instances[BUCKET_COUNT];
+        std::vector<InstanceCompact> transparent[BUCKET_COUNT]; // alpha < 1 の分（TransparentQueue へ）
+
+        InstanceCompact *allocate(const int bucket, const std::size_t n, const bool translucent)
+        {
+            std::vector<InstanceCompact> &v = translucent ? transparent[bucket] : instances[bucket];
+            const std::size_t old = v.size();
+            v.resize(old + n);
+            return v.data() + old;
+        }
+    };
 
     // constants to convert degrees to radians and the reverse
     constexpr float RAD_TO_DEG = 180.0 / M_PI;
@@ -190,14 +1269,6 @@ namespace ds_internal
         void stopGraphics();
 
         void renderFrame(const int width, const int height, const dsFunctions *fn, const int pause);
-        void drawTriangleCore(const glm::vec3 p[3],
-                              const glm::vec3 &N,
-                              const glm::mat4 &model,
-                              const bool solid = true);
-        void drawTrianglesBatch(
-            const std::vector<VertexPN> &verts,
-            const glm::mat4 &model,
-            const bool solid = true);
         // setters/getters
         // 球などの表示品質設定
         void setSphereQuality(const int n) { sphere_quality = n; }
@@ -215,6 +1286,10 @@ namespace ds_internal
         bool getUseShadows() const { return use_shadows; }
         void setUseShadows(const bool us) { use_shadows = us; }
 
+        // 並列記録：step() 内のワーカースレッドから呼ぶ
+        void beginParallelDraw(const int slot);
+        void endParallelDraw();
+
         // 状態チェック用
         bool isInsideSimulationLoop() const { return current_state == SIM_STATE_RUNNING || current_state == SIM_STATE_DRAWING; }
 
@@ -226,6 +1301,111 @@ namespace ds_internal
         void drawRegisteredMesh(
             const MeshHandle h,
             const float pos[3], const float R[12], const bool solid = true);
+        // 登録を取り消して GeometryArena の場所を返す（ハンドルは無効になり，番号は使い回す）
+        void unregisterMesh(const MeshHandle h);
+        // 登録時に三角形・頂点を並べ替えた結果（ACMR / ATVR は並べ替える前と後）
+        struct RegisteredMeshStats
+        {
+            std::size_t vertices = 0;
+            std::size_t triangles = 0;
+            std::size_t indexBytes = 0; // インデックス 1 個のバイト数（2 か 4）
+            double acmrBefore = 0.0, acmrAfter = 0.0;
+            double atvrBefore = 0.0, atvrAfter = 0.0;
+        };
+        RegisteredMeshStats registeredMeshStats(const MeshHandle h) const;
+
+        // 保持型インスタンス API（ハンドル ID 0 は無効）
+        template <typename T>
+        std::uint32_t createInstance(const int shape, const T pos[3], const T R[12], const T size[3])
+        {
+            checkNotParallel("dsCreateInstance");
+            if (shape < 0 || shape >= RETAINED_SHAPE_COUNT)
+                fatalError("dsCreateInstance: unknown shape %d", shape);
+
+            const float sz[3] = {(float)size[0], (float)size[1], (float)size[2]};
+            const std::uint32_t id = instancePool_.create(shape, sz);
+            if (id == 0)
+                fatalError("dsCreateInstance: too many instances");
+
+            // 色は作成時の現在色
+            std::memcpy(instancePool_.edit(id)->color, current_color_rgba8_, 4);
+            instancePool_.setTranslucent(id, current_color_rgba8_[3] < 255);
+            writeRetainedPose(id, pos, R);
+            return id;
+        }
+
+        template <typename T>
+        void updateInstancePose(const std::uint32_t id, const T pos[3], const T R[12])
+        {
+            checkNotParallel("dsUpdateInstancePose");
+            requireRetained("dsUpdateInstancePose", id);
+            writeRetainedPose(id, pos, R);
+        }
+
+        void setInstanceColor(const std::uint32_t id, const float r, const float g, const float b, const float alpha);
+        void destroyInstance(const std::uint32_t id);
+
+        // 視錐台カリング（次のフレームから有効）と直前のフレームの集計
+        struct CullStats
+        {
+            std::size_t instances = 0;     // 記録されたインスタンス数
+            std::size_t visible = 0;       // 本描画に回した数
+            std::size_t shadowVisible = 0; // 影パスに回した数
+            std::size_t occluded = 0;       // 視錐台内だが Hi-Z で隠れていると判定した数
+            std::size_t shadowOccluded = 0; // 同じく影
+            bool shadows = false;          // 影パスがあったか
+        };
+        void setCulling(const int mode);
+        // GPU カリングで，画面上の半径がこれ（ピクセル）未満のものも捨てる。0 で無効
+        void setCullScreenSize(const float pixels) { cullMinPixels_ = std::max(pixels, 0.0f); }
+        // GPU カリングで，前フレームの深度に隠れるものも捨てる
+        void setOcclusionCulling(const bool enable) { occlusionCulling_ = enable; }
+        // CPU カリング時に，小さく見える球・円柱・カプセルを粗いメッシュで描く（半径ピクセルのしきい値）
+        void setLevelOfDetail(const bool enable) { lodEnabled_ = enable; }
+        void setLevelOfDetailThresholds(const float fine, const float coarse)
+        {
+            lodPixels_[0] = std::max(fine, coarse);
+            lodPixels_[1] = std::min(fine, coarse);
+        }
+        // 球・円柱・カプセル（RETAINED_* と同じ番号）を，メッシュの代わりに四角形＋レイキャストで描く
+        void setImpostor(const int shape, const bool enable);
+        const CullStats &cullStats() const { return cullStats_; }
+        // CPU カリング時に，不透明のインスタンスを bucket・LOD の範囲ごとに近い順に並べて送る（early-Z 用）
+        void setDepthSort(const bool enable) { depthSort_ = enable; }
+        // 不透明のインスタンス描画パスの計測
+        struct OpaquePassStats
+        {
+            double gpuMilliseconds = 0.0; // GPU 時間（数フレーム前のもの）
+            double overdraw = 0.0;        // 同じフレームで深度テストを通ったサンプル数 / 画素数
+            std::size_t sorted = 0;       // 直前のフレームで近い順に並べたインスタンス数
+            std::size_t reused = 0;       // そのうち前フレームの順のままで済んだ数
+        };
+        const OpaquePassStats &opaquePassStats() const { return opaquePassStats_; }
+        // GL 4.3 の multi-draw-indirect でパスの instanced draw をまとめるか（使えなければ常に 3.3 の経路）
+        void setMultiDrawIndirect(const bool enable) { multiDrawEnabled_ = enable; }
+        struct MultiDrawStats
+        {
+            bool active = false;      // 使える環境で有効になっている
+            std::size_t commands = 0; // 直前のフレームで積んだコマンド数
+            std::size_t draws = 0;    // それを描いた glMultiDrawElementsIndirect の回数
+        };
+        MultiDrawStats multiDrawStats() const;
+        // GeometryArena の使用量（基本形状・Convex のキャッシュ・登録メッシュ）
+        struct GeometryStats
+        {
+            std::size_t vertices = 0;
+            std::size_t indices = 0;
+            std::size_t usedBytes = 0;     // 頂点とインデックスの使用中のバイト数
+            std::size_t reservedBytes = 0; // バッファとして確保しているバイト数
+            double maxNormalError = 0.0;   // 法線を 10bit にした角度誤差の最大（度）
+        };
+        GeometryStats geometryStats() const;
+        // 直前のフレームで GL の状態変更を実際に呼んだ数と省いた数
+        const GLStateCache::Stats &glStateStats() const { return glState_.lastFrame(); }
+        // dsDrawConvex の形をキャッシュしてインスタンス描画する（CONVEX_CACHE_*）
+        void setConvexCache(const int mode);
+        // 半透明インスタンスの描き方（TRANSPARENCY_*）
+        void setTransparency(const int mode);
 
         // テンプレート関数群
         template <typename T>
@@ -274,15 +1454,13 @@ namespace ds_internal
                 s += " (current_state=" + std::to_string(current_state) + ")";
                 fatalError(s.c_str());
             }
-            applyMaterials(); // ライティングやカリングなど、既存の状態設定
 
-            glm::mat4 model = buildModelMatrix(pos, R, {sides[0], sides[1], sides[2]});
-
-            // 即時描画せず、「箱のインスタンス」として登録する
-            InstanceBasic inst;
-            inst.model = model;
-            inst.color = current_color;
-            boxInstances_.push_back(inst);
+            // 即時描画せず、「箱のインスタンス」としてマップ済みバッファへ直接書く
+            // （GL は呼ばないので並列記録中のワーカースレッドからも呼べる）
+            const std::uint8_t *color;
+            InstanceCompact *dst = allocateInstances(BUCKET_BOX, 1, color);
+            writeInstance(dst, color, pos, R,
+                          (float)sides[0], (float)sides[1], (float)sides[2]);
         }
 
         template <typename T>
@@ -300,15 +1478,12 @@ namespace ds_internal
                 fatalError(s.c_str());
             }
 
-            applyMaterials(); // ライティングやカリングなど、既存の状態設定
-
-            glm::mat4 model = buildModelMatrix(pos, R, {radius, radius, radius});
 
-            // 即時描画せず、「箱のインスタンス」として登録する
-            InstanceBasic inst;
-            inst.model = model;
-            inst.color = current_color;
-            sphereInstances_.push_back(inst);
+            // 即時描画せず、「球のインスタンス」としてマップ済みバッファへ直接書く
+            const float r = (float)radius;
+            const std::uint8_t *color;
+            InstanceCompact *dst = allocateInstances(BUCKET_SPHERE, 1, color);
+            writeInstance(dst, color, pos, R, r, r, r);
         }
 
         //=====================================================================
@@ -329,54 +1504,15 @@ namespace ds_internal
                 fatalError(s.c_str());
             }
 
-            applyMaterials();
 
             float l = static_cast<float>(length); // 平行部の長さ
             float r = static_cast<float>(radius); // 半径
 
-            // ODE の姿勢・位置（スケールはここでは使わない）
-            glm::mat4 W = buildModelMatrix(pos, R);
-
-            // ---- 円筒部 ----
-            // unit cylinder: 半径1, z∈[-1,1]
-            // target: 半径 r, z∈[-l/2, +l/2]
-            float halfCyl = 0.5f * l;
-            glm::mat4 S_body = glm::scale(glm::mat4(1.0f),
-                                          glm::vec3(r, r, halfCyl));
-            glm::mat4 M_body = W * S_body;
-
-            InstanceBasic instBody;
-            instBody.model = M_body;
-            instBody.color = current_color;
-            capsuleCylinderInstances_.push_back(instBody);
-
-            // ---- 上キャップ ----
-            // unit: center (0,0,1), radius 1
-            // scale → center (0,0,r)、さらに z=(l/2) にしたい
-            float tz_top = halfCyl - r; // z方向の補正
-            glm::mat4 S_cap = glm::scale(glm::mat4(1.0f),
-                                         glm::vec3(r, r, r));
-            glm::mat4 T_capTop = glm::translate(glm::mat4(1.0f),
-                                                glm::vec3(0.0f, 0.0f, tz_top));
-            glm::mat4 M_capTop = W * T_capTop * S_cap;
-
-            InstanceBasic instCap;
-            instCap.model = M_capTop;
-            instCap.color = current_color;
-            capsuleCapTopInstances_.push_back(instCap);
-
-            // ---- 下キャップ ----
-            // unit: center (0,0,-1) → scale後 center (0,0,-r)
-            // target: center (0,0,-l/2)
-            float tz_bottom = -halfCyl + r;
-            glm::mat4 T_capBottom = glm::translate(glm::mat4(1.0f),
-                                                   glm::vec3(0.0f, 0.0f, tz_bottom));
-            glm::mat4 M_capBottom = W * T_capBottom * S_cap;
-
-            InstanceBasic instCapBottom;
-            instCapBottom.model = M_capBottom;
-            instCapBottom.color = current_color;
-            capsuleCapBottomInstances_.push_back(instCapBottom);
+            // unit capsule: 半径1, 平行部 z∈[-1,1]
+            // target: 半径 r, 平行部 z∈[-l/2, +l/2]。半球の蓋は VS が z 方向にずらす
+            const std::uint8_t *color;
+            InstanceCompact *dst = allocateInstances(BUCKET_CAPSULE, 1, color);
+            writeInstance(dst, color, pos, R, r, r, 0.5f * l);
         }
 
         template <typename T>
@@ -394,15 +1530,91 @@ namespace ds_internal
                 fatalError(s.c_str());
             }
 
-            applyMaterials(); // ライティングやカリングなど、既存の状態設定
 
-            glm::mat4 model = buildModelMatrix(pos, R, {radius, radius, length});
+            // 即時描画せず、「円柱のインスタンス」としてマップ済みバッファへ直接書く
+            const float r = (float)radius;
+            const std::uint8_t *color;
+            InstanceCompact *dst = allocateInstances(BUCKET_CYLINDER, 1, color);
+            writeInstance(dst, color, pos, R, r, r, (float)length);
+        }
+
+        // =====================================================================
+        // SoA バッチ API（dsDraw*Batch）
+        // 各配列はバイト単位のストライドで指定（0 なら詰めて並んでいるとみなす）。
+        // R が nullptr なら単位行列，color (RGBA float) が nullptr なら現在色を使う。
+        // 状態チェックと領域確保は 1 回だけ行い，1 本のループでインスタンスへ書き込む。
+        // =====================================================================
+        template <typename T>
+        void drawSpheresBatch(const int count,
+                              const T *pos, const std::size_t posStride,
+                              const T *R, const std::size_t RStride,
+                              const T *radius, const std::size_t radiusStride,
+                              const float *color, const std::size_t colorStride)
+        {
+            const BatchStride<T> r(radius, radiusStride, 1);
+            recordBatch("drawSpheresBatch", BUCKET_SPHERE, count,
+                        pos, posStride, R, RStride, color, colorStride,
+                        [&r](const int i, float sc[3])
+                        {
+                            sc[0] = sc[1] = sc[2] = (float)r[i][0];
+                        });
+        }
+
+        template <typename T>
+        void drawBoxesBatch(const int count,
+                            const T *pos, const std::size_t posStride,
+                            const T *R, const std::size_t RStride,
+                            const T *sides, const std::size_t sidesStride,
+                            const float *color, const std::size_t colorStride)
+        {
+            const BatchStride<T> sd(sides, sidesStride, 3);
+            recordBatch("drawBoxesBatch", BUCKET_BOX, count,
+                        pos, posStride, R, RStride, color, colorStride,
+                        [&sd](const int i, float sc[3])
+                        {
+                            const T *v = sd[i];
+                            sc[0] = (float)v[0];
+                            sc[1] = (float)v[1];
+                            sc[2] = (float)v[2];
+                        });
+        }
+
+        template <typename T>
+        void drawCylindersBatch(const int count,
+                                const T *pos, const std::size_t posStride,
+                                const T *R, const std::size_t RStride,
+                                const T *length, const std::size_t lengthStride,
+                                const T *radius, const std::size_t radiusStride,
+                                const float *color, const std::size_t colorStride)
+        {
+            const BatchStride<T> l(length, lengthStride, 1);
+            const BatchStride<T> r(radius, radiusStride, 1);
+            recordBatch("drawCylindersBatch", BUCKET_CYLINDER, count,
+                        pos, posStride, R, RStride, color, colorStride,
+                        [&l, &r](const int i, float sc[3])
+                        {
+                            sc[0] = sc[1] = (float)r[i][0];
+                            sc[2] = (float)l[i][0];
+                        });
+        }
 
-            // 即時描画せず、「箱のインスタンス」として登録する
-            InstanceBasic inst;
-            inst.model = model;
-            inst.color = current_color;
-            cylinderInstances_.push_back(inst);
+        template <typename T>
+        void drawCapsulesBatch(const int count,
+                               const T *pos, const std::size_t posStride,
+                               const T *R, const std::size_t RStride,
+                               const T *length, const std::size_t lengthStride,
+                               const T *radius, const std::size_t radiusStride,
+                               const float *color, const std::size_t colorStride)
+        {
+            const BatchStride<T> l(length, lengthStride, 1);
+            const BatchStride<T> r(radius, radiusStride, 1);
+            recordBatch("drawCapsulesBatch", BUCKET_CAPSULE, count,
+                        pos, posStride, R, RStride, color, colorStride,
+                        [&l, &r](const int i, float sc[3])
+                        {
+                            sc[0] = sc[1] = (float)r[i][0];
+                            sc[2] = 0.5f * (float)l[i][0];
+                        });
         }
 
         template <typename T>
@@ -419,45 +1631,17 @@ namespace ds_internal
                 s += " (current_state=" + std::to_string(current_state) + ")";
                 fatalError(s.c_str());
             }
-
-            applyMaterials();
+            checkNotParallel("drawTriangles");
 
             // 1つの drawTriangles 呼び出しの中では pos,R は共通
-            glm::mat4 model = buildModelMatrix(pos, R);
+            const glm::mat4 model = buildModelMatrix(pos, R);
 
-            // ---- ここからバッチ処理 ----
-
-            std::vector<VertexPN> verts;
-            verts.reserve(static_cast<std::size_t>(n) * 3);
+            // フレームの終わりにまとめて描く置き場へ積むだけ
+            std::vector<VertexFlat> &dst = streamBatch(solid ? STREAM_SOLID : STREAM_WIRE);
 
             const T *p = v;
             for (int i = 0; i < n; ++i, p += 9)
-            {
-                glm::vec3 p0(
-                    static_cast<float>(p[0]),
-                    static_cast<float>(p[1]),
-                    static_cast<float>(p[2]));
-
-                glm::vec3 p1(
-                    static_cast<float>(p[3]),
-                    static_cast<float>(p[4]),
-                    static_cast<float>(p[5]));
-
-                glm::vec3 p2(
-                    static_cast<float>(p[6]),
-                    static_cast<float>(p[7]),
-                    static_cast<float>(p[8]));
-
-                glm::vec3 U = p1 - p0;
-                glm::vec3 V = p2 - p0;
-                glm::vec3 N = glm::normalize(glm::cross(U, V));
-
-                verts.push_back({p0, N});
-                verts.push_back({p1, N});
-                verts.push_back({p2, N});
-            }
-
-            drawTrianglesBatch(verts, model, solid);
+                appendStreamTriangle(dst, model, p, p + 3, p + 6);
         }
 
         template <typename T>
@@ -475,19 +1659,12 @@ namespace ds_internal
                 s += " (current_state=" + std::to_string(current_state) + ")";
                 fatalError(s.c_str());
             }
+            checkNotParallel("drawTriangle");
 
-            applyMaterials();
-
-            glm::mat4 model = buildModelMatrix(pos, R);
-            glm::mat4 mvp = proj_ * view_ * model;
-
-            glUseProgram(programBasic_);
-            glUniformMatrix4fv(uMVP_, 1, GL_FALSE, glm::value_ptr(mvp));
-            glUniformMatrix4fv(uModel_, 1, GL_FALSE, glm::value_ptr(model));
-            glUniform4fv(uColor_, 1, glm::value_ptr(current_color));
-
-            drawTriangleWithAutoNormal(v0, v1, v2, model, solid);
+            const glm::mat4 model = buildModelMatrix(pos, R);
+            appendStreamTriangle(streamBatch(solid ? STREAM_SOLID : STREAM_WIRE), model, v0, v1, v2);
         }
+
         template <typename T>
         void drawConvex(const T pos[3], const T R[12],
                         const T *_planes, unsigned int _planecount,
@@ -504,22 +1681,55 @@ namespace ds_internal
                 s += " (current_state=" + std::to_string(current_state) + ")";
                 fatalError(s.c_str());
             }
+            checkNotParallel("drawConvex");
 
-            // ライティング・テクスチャ等の共通設定
-            applyMaterials();
+            // 同じ形はキャッシュしたメッシュのインスタンスとして描く
+            // （本描画・影とも renderFrame で形ごとに 1 回の instanced draw）
+            if (convexCacheMode_ != CONVEX_CACHE_OFF)
+            {
+                const std::uint64_t key =
+                    (convexCacheMode_ == CONVEX_CACHE_POINTER)
+                        ? ConvexCache::pointerKey(_planes, _planecount, _points, _pointcount, _polygons)
+                        : ConvexCache::contentKey(_planes, _planecount, _points, _pointcount, _polygons);
+                std::vector<InstanceCompact> *list = convexCache_.find(key);
+                if (!list)
+                {
+                    triangulateConvex(_planes, _planecount, _points, _polygons);
+                    list = addConvexMesh(key);
+                }
+                if (list)
+                {
+                    list->emplace_back();
+                    writeInstance(&list->back(), current_color_rgba8_, pos, R, 1.0f, 1.0f, 1.0f);
+                    if (current_color_rgba8_[3] < 255)
+                        translucentInstances_ = true;
+                    return;
+                }
+                // キャッシュが満杯のときは従来の経路で描く
+            }
+            else
+            {
+                triangulateConvex(_planes, _planecount, _points, _polygons);
+            }
 
             // Convex はローカル座標で定義されているので scale=1
-            glm::mat4 model = buildModelMatrix(pos, R);
-
-            // ---- Convex → 三角形バッチへの変換 ----
+            const glm::mat4 model = buildModelMatrix(pos, R);
 
-            std::vector<VertexPN> verts;
+            // 三角形の置き場へ積む（convex は基本「塗り潰し」想定）
+            // 法線は面ごとに一定なので，位置だけ積めば FS で同じ法線になる
+            std::vector<VertexFlat> &dst = streamBatch(STREAM_SOLID);
+            for (const std::uint32_t idx : convexIndices_)
+                appendFlatVertex(dst, model, convexVerts_[idx].pos);
+        }
 
-            // 大雑把に確保（顔数×平均頂点数を3〜4と見積もっておく）
-            if (_planecount > 0)
-            {
-                verts.reserve(static_cast<std::size_t>(_planecount) * 6u);
-            }
+        // Convex → 面ごとの三角形ファン（convexVerts_ / convexIndices_ に作る）
+        // 頂点は面ごとに持つ（法線が面ごとに違うため）
+        template <typename T>
+        void triangulateConvex(const T *_planes, const unsigned int _planecount,
+                               const T *_points, const unsigned int *_polygons)
+        {
+            convexVerts_.clear();
+            convexIndices_.clear();
 
             auto getPoint = [&](unsigned int idx) -> glm::vec3
             {
@@ -554,38 +1764,22 @@ namespace ds_internal
                 N = glm::normalize(N);
 
                 // この面の頂点インデックス列は _polygons[polyindex ... polyindex+pointcount-1]
-                const unsigned int idx0 = _polygons[polyindex];
-                const glm::vec3 p0 = getPoint(idx0);
+                const std::uint32_t base = static_cast<std::uint32_t>(convexVerts_.size());
+                for (unsigned int j = 0; j < pointcount; ++j)
+                    convexVerts_.push_back(VertexPN{getPoint(_polygons[polyindex + j]), N});
 
                 // Convex なので三角形ファンで安全に分割できる：
                 // (p0, p_j, p_{j+1})  j = 1 .. pointcount-2
                 for (unsigned int j = 1; j + 1 < pointcount; ++j)
                 {
-                    const unsigned int idx1 = _polygons[polyindex + j];
-                    const unsigned int idx2 = _polygons[polyindex + j + 1];
-
-                    const glm::vec3 p1 = getPoint(idx1);
-                    const glm::vec3 p2 = getPoint(idx2);
-
-                    verts.push_back(VertexPN{p0, N});
-                    verts.push_back(VertexPN{p1, N});
-                    verts.push_back(VertexPN{p2, N});
+                    convexIndices_.push_back(base);
+                    convexIndices_.push_back(base + j);
+                    convexIndices_.push_back(base + j + 1);
                 }
 
                 // この面の頂点インデックスをすべて消費
                 polyindex += pointcount;
             }
-
-            // ---- 実際の描画（塗り＋影） ----
-
-            // convex は基本「塗り潰し」想定なので solid=true
-            const bool solid = true;
-            drawTrianglesBatch(verts, model, solid);
-
-            // drawTrianglesBatch 内で
-            //   - drawMeshBasic(meshTrianglesBatch_, model, current_color)
-            //   - if (use_shadows && solid) drawShadowMesh(...)
-            // を呼ぶ想定なので、ここで影パスを二重に呼ぶ必要はありません。
         }
 
         template <typename T>
@@ -601,27 +1795,22 @@ namespace ds_internal
                 s += " (current_state=" + std::to_string(current_state) + ")";
                 fatalError(s.c_str());
             }
+            checkNotParallel("drawLine");
 
-            // 共通の描画状態（programBasic_, uColor, ライティング etc.）
-            applyMaterials();
-
-            // ライン用メッシュに頂点を流し込む
-            drawLineCore(pos1, pos2);
-
-            // モデル行列：pos1/pos2 そのものをワールド座標として使うので単位行列
-            glm::mat4 model(1.0f);
-
-            // 線幅（対応状況は GPU 依存だが、指定するだけしておく）
-            glLineWidth(2.0f);
+            const glm::vec3 p1(static_cast<float>(pos1[0]), static_cast<float>(pos1[1]), static_cast<float>(pos1[2]));
+            const glm::vec3 p2(static_cast<float>(pos2[0]), static_cast<float>(pos2[1]), static_cast<float>(pos2[2]));
 
-            // 本体描画（他のプリミティブと同じパイプライン）
-            drawMeshBasic(meshLine_, model, current_color);
-
-            // 影（他のプリミティブと同じく programShadow_ に統一）
-            if (use_shadows)
-            {
-                drawShadowMesh(meshLine_, model);
-            }
+            // 法線：適当に線方向を入れておく（A項でそれなりに見える）
+            const glm::vec3 dir = p2 - p1;
+            const glm::vec3 N = glm::length(dir) > 0.0f
+                                    ? glm::normalize(dir)
+                                    : glm::vec3(0.0f, 1.0f, 0.0f);
+
+            // pos1/pos2 はそのままワールド座標
+            static const glm::mat4 I(1.0f);
+            std::vector<VertexStream> &dst = streamLines_[current_color[3] < 1.0f ? 1 : 0];
+            appendStreamVertex(dst, I, p1, N);
+            appendStreamVertex(dst, I, p2, N);
         }
 
     private:
@@ -645,38 +1834,46 @@ namespace ds_internal
         Mesh meshBox_;
         Mesh meshSphere_[4];
         Mesh meshCylinder_[4];
-        Mesh meshCapsuleCylinder_[4], meshCapsuleCapTop_[4], meshCapsuleCapBottom_[4]; // カプセル用メッシュ
-        Mesh meshTriangle_;
-        Mesh meshTrianglesBatch_;
-        Mesh meshLine_;
+        Mesh meshCapsule_[4]; // 胴と両端の半球を 1 つにしたカプセル（蓋の頂点は aNormal.w で印を付ける）
+        Mesh meshStream_;      // VertexFlat 用（即時描画の三角形。バッファは毎フレーム詰め直す）
+        Mesh meshStreamLines_; // VertexStream 用（即時描画の線。VBO は meshStream_ と共有）
         Mesh meshPyramid_;
+        Mesh meshImpostorQuad_; // インポスタ用の四角形（角 (±1, ±1, 0)）
+        // 上の形（ストリームとピラミッド以外）・Convex のキャッシュ・登録メッシュが載る共有バッファ
+        GeometryArena geometryArena_;
+        // 穴を詰めて，載っている全メッシュの場所を読み直す
+        void compactGeometry();
 
-        std::size_t trianglesBatchCapacity_ = 0;
+        std::size_t streamCapacity_ = 0; // バイト数
 
         // matrices
         // カメラ・投影
         glm::mat4 view_{1.0f};
         glm::mat4 proj_{1.0f};
+        // フレーム共通の uniform（FrameUniforms）を入れる UBO
+        GLuint frameUniformBuffer_ = 0;
+        void uploadFrameUniforms(const float eye[3]);
         
+        // 描画用のシェーダはテクスチャの有無などで変種を持つ（ShaderPermutation）。
+        // サンプラはどれもユニット 0（uniform の既定値）を読むので設定しない
+        // 今の描画で使う変種の機能ビット
+        unsigned textureFeatures(const bool hasTexture) const { return (use_textures && hasTexture) ? SHADER_TEXTURE : 0u; }
+        // 変種を（無ければ作って）使う
+        void useShader(ShaderPermutation &shader, const unsigned features)
+        {
+            glState_.useProgram(shader.program(features));
+        }
+
         // 基本シェーダプログラム
-        GLuint programBasic_ = 0;
-        // uniform location
-        GLint uMVP_ = -1;
-        GLint uModel_ = -1;
-        GLint uColor_ = -1;
-        GLint uUseTex_ = -1;
-        GLint uTex_ = -1;
-        GLfloat uTexScale_ = -1;
-        GLint uLightDir_ = -1;
-
-        // バッチ描画（インスタンシング）用基本シェーダプログラム
-        GLuint programBasicInstanced_ = 0;
-        GLint uProjInst_ = -1;
-        GLint uViewInst_ = -1;
-        GLint uLightDirInst_ = -1;
-        GLint uUseTexInst_ = -1;
-        GLint uTexInst_ = -1;
-        GLint uTexScaleInst_ = -1;
+        ShaderPermutation basicShader_;
+        enum BasicUniform
+        {
+            BASIC_MODEL,
+            BASIC_COLOR
+        };
+
+        // バッチ描画（インスタンシング）用基本シェーダプログラム（uniform はフレーム共通のものだけ）
+        ShaderPermutation basicInstancedShader_;
 
         // ピラミッド用 VAO/VBO
         GLuint vaoPyramid_ = 0;
@@ -685,34 +1882,136 @@ namespace ds_internal
         // 初期化ヘルパ
         void initBasicProgram();
         void initBasicInstancedProgram();
-        void setupSphereInstanceAttributes();
-        void setupBoxInstanceAttributes();
-        void setupCylinderInstanceAttributes();
-        void setupCapsuleInstanceAttributes();
+        void setupInstanceAttributes(const GLuint vao);
+        void bindInstanceRange(const InstanceRange &range);
+        // meshes[quality] が設定どおりのメッシュ。LOD の付いた範囲は meshes[quality - lod]（最低 1）で描く
+        void drawInstancedBucket(const Mesh *meshes, const int quality, const int bucket, const bool shadow = false);
+
+        // 全形状共通のインスタンスバッファ
+        InstanceArena instanceArena_;
+        // 保持型インスタンス（dsCreateInstance）。毎フレームの即時描画分と一緒に描く
+        InstancePool instancePool_;
+
+        // カリング等の下請けスレッド
+        JobPool jobPool_;
+        // 記録されたインスタンスを視錐台カリングして詰めて送る（遅延モードのアリーナ用）
+        struct CullChunk
+        {
+            int bucket;
+            std::size_t begin, end;  // bucket 内の範囲
+            std::size_t maskOffset;  // cullMask_ 内の位置
+            std::size_t mainCount[kLodLevels], shadowCount[kLodLevels]; // LOD の段数ごと
+            std::size_t mainOut[kLodLevels], shadowOut[kLodLevels];     // 出力先（mapOutput の先頭からの個数）
+        };
+        int cullMode_ = CULL_CPU;
+        CullStats cullStats_;
+        std::vector<CullChunk> cullChunks_;
+        std::vector<std::uint8_t> cullMask_;
+        // LOD：前フレームの選択（bucket 内の記録順）としきい値（影は 2 倍）
+        bool lodEnabled_ = true;
+        float lodPixels_[kLodLevels - 1] = {32.0f, 8.0f};
+        std::vector<std::uint8_t> lodState_[BUCKET_COUNT];
+        bool lodBucket(const int bucket) const { return lodEnabled_ && bucketHasLod(bucket) && !impostor_[bucket]; }
+        void cullInstances(const int height);
+        // 前から順の並べ替え：depthOrder_[b] は bucket b の記録番号を近い順に並べたもの。
+        // 個数が前フレームと同じなら前フレームの順から始め，ほぼ並んだままなら並べ替えを省く
+        bool depthSort_ = false;
+        std::vector<std::uint32_t> depthOrder_[BUCKET_COUNT];
+        std::vector<std::uint32_t> depthKeys_;
+        RadixSortScratch depthSortScratch_;
+        void sortStagedByDepth(const float wRow[4], const float zFar);
+        // 不透明のインスタンス描画パスの GPU 時間と深度テストを通ったサンプル数
+        PassQuery opaquePassQuery_;
+        OpaquePassStats opaquePassStats_;
+        // multi-draw：beginMultiDraw() から endMultiDraw() までの instanced draw は multiDraw_ に積み，
+        // end でインスタンスバッファごとに 1 回ずつ描く（インポスタ・ワイヤーフレームは積まない）
+        MultiDrawBatch multiDraw_;
+        bool multiDrawEnabled_ = true;
+        bool multiDrawActive_ = false;
+        void beginMultiDraw();
+        void endMultiDraw();
+        // mesh を r のインスタンスで描く（multi-draw 中は積むだけ）
+        void drawMeshInstances(const Mesh &mesh, const InstanceRange &r);
+        // GPU カリング（cullMode_ == CULL_GPU）。gpuCulled_ は今フレームの描画が出力側を使うか
+        GLuint programCull_ = 0;
+        GpuCuller gpuCuller_;
+        bool gpuCulled_ = false;
+        float cullMinPixels_ = 0.0f;
+        std::vector<InstanceRange> gpuCullInputs_[BUCKET_COUNT];
+        // 遮蔽カリング（GPU カリング時のみ）
+        bool occlusionCulling_ = false;
+        GLuint programHiZ_ = 0;
+        DepthPyramid depthPyramid_;
+        void initHiZProgram();
+        void initCullProgram();
+        void cullInstancesGpu(const int height);
+        // 視錐台の平面と影の投影（CPU / GPU 共通）
+        CullParams makeCullParams() const;
+        // dsDrawConvex の形のキャッシュ。convexVerts_ / convexIndices_ は分割結果の作業領域
+        int convexCacheMode_ = CONVEX_CACHE_CONTENT;
+        ConvexCache convexCache_{geometryArena_};
+        std::vector<VertexPN> convexVerts_;
+        std::vector<std::uint32_t> convexIndices_;
+        std::vector<InstanceCompact> *addConvexMesh(const std::uint64_t key);
+        // キャッシュした形ごとにこのフレームのインスタンスを描く（プログラムは呼び出し側で設定済み）
+        void drawConvexInstances();
+        // 登録メッシュ（dsDrawRegisteredMesh）のこのフレームのインスタンス。全メッシュで 1 本のバッファ
+        GLuint registeredInstanceBuffer_ = 0;
+        std::size_t registeredInstanceCapacity_ = 0; // インスタンス数
+        void uploadRegisteredMeshInstances();
+        void drawRegisteredMeshInstances(const bool shadow);
+        // インポスタ（bucket ごと）。メッシュの代わりに四角形を広げ，FS で形を光線と交差させる
+        bool impostor_[BUCKET_COUNT] = {};
+        ShaderPermutation impostorShader_;
+        ShaderPermutation shadowImpostorShader_;
+        enum ImpostorUniform // 本描画用・影用で共通
+        {
+            IMPOSTOR_SHAPE,
+            IMPOSTOR_HALF_LENGTH
+        };
+        void initImpostorPrograms();
+        void initImpostorQuadMesh();
+        void drawImpostorBuckets(const bool shadow);
+        // 球・箱・円柱・カプセルの半透明インスタンスは別の列に溜め，不透明のものを全部描いた後で描く
+        int transparencyMode_ = TRANSPARENCY_SORTED;
+        TransparentQueue transparentQueue_;
+        GLuint programOit_ = 0;
+        WeightedOit weightedOit_;
+        void initOitProgram();
+        void drawTransparentInstances(const int width, const int height);
+        void drawTransparentShadows();
+        // 列の中の bucket の 1 範囲を描く（メッシュかインポスタかでプログラムを切り替える）
+        void drawTransparentRange(const int bucket, const InstanceRange &r, const bool shadow,
+                                  const unsigned features);
+        // このフレームに半透明色の convex・登録メッシュがあるか（これらは列に入れず，描くときにブレンドする）
+        bool translucentInstances_ = false;
+
+        // 並列記録用バッファ（スロットごと）と，呼び出しスレッドが使用中のスロット
+        std::array<std::unique_ptr<ParallelRecorder>, kMaxParallelDrawSlots> parallelRecorders_;
+        static inline thread_local ParallelRecorder *tlsRecorder_ = nullptr;
+        void mergeParallelRecorders();
 
         // ground 用 VAO/VBO
         GLuint vaoGround_ = 0;
         GLuint vboGround_ = 0;
-        GLuint programGround_ = 0;
-        GLint uGroundMVP_ = -1;
-        GLint uGroundModel_ = -1;
-        GLint uGroundColor_ = -1;
-        GLint uGroundTex_ = -1;
-        GLint uGroundScale_ = -1;
-        GLint uGroundOffset_ = -1;
-        GLint uGroundUseTex_ = -1;
+        ShaderPermutation groundShader_;
+        enum GroundUniform
+        {
+            GROUND_COLOR
+        };
 
         void initGroundProgram();
         void initGroundMesh();
 
         // sky 用 VAO/VBO
-        GLuint programSky_ = 0;
-        GLint uSkyMVP_ = -1;
-        GLint uSkyColor_ = -1;
-        GLint uSkyTex_ = -1;
-        GLint uSkyScale_ = -1;
-        GLint uSkyOffset_ = -1;
-        GLint uSkyUseTex_ = -1;
+        ShaderPermutation skyShader_;
+        enum SkyUniform
+        {
+            SKY_HEIGHT,
+            SKY_COLOR,
+            SKY_SCALE,
+            SKY_OFFSET
+        };
 
         GLuint vaoSky_ = 0;
         GLuint vboSky_ = 0;
@@ -727,22 +2026,13 @@ namespace ds_internal
         const glm::mat4 shadowProject_ = makeShadowProjectMatrix(lightDir_);
 
         // 影用シェーダ
-        GLuint programShadow_ = 0;
-        GLint uShadowMVP_ = -1;
-        GLint uShadowColor_ = -1;
-        GLint uShadowIntensity_ = -1;
-        GLint uShadowModel_ = -1;
-        GLint uShadowUseTex_ = -1;
-
-        GLuint programShadowInstanced_ = 0;
-        GLint uShadowMVPInst_ = -1;
-        GLint uShadowModelInst_ = -1;
-        GLint uGroundScaleInst_ = -1;
-        GLint uGroundOffsetInst_ = -1;
-        GLint uGroundTexInst_ = -1;
-        GLint uShadowIntensityInst_ = -1;
-        GLint uShadowUseTexInst_ = -1;
-        GLint uGroundColorInst_ = -1;
+        ShaderPermutation shadowShader_;
+        enum ShadowUniform
+        {
+            SHADOW_MODEL
+        };
+
+        ShaderPermutation shadowInstancedShader_;
 
         // 影用の初期化ヘルパ
         void initShadowProjection();
@@ -753,8 +2043,6 @@ namespace ds_internal
         // 影描画ヘルパ（後で中身を実装）
         // void drawShadowPrimitive(PrimitiveType type, const glm::mat4 &model);
 
-        void initLineMesh();
-
         void initPyramidMesh();
 
         // 必要ならカメラパラメータも保存
@@ -772,8 +2060,9 @@ namespace ds_internal
         std::array<float, 3> view_hpr;
 
         glm::vec4 current_color;
+        std::uint8_t current_color_rgba8_[4] = {255, 255, 255, 255}; // インスタンス用に詰めた current_color
         int texture_id;
-        int currentBoundTextureId_ = -1;
+        GLStateCache glState_; // 描画経路の GL 状態はここを通して変える
 
         dsFunctions callbacks_storage_;       // 渡された dsFunctions を保持（実体）
         const dsFunctions *callbacks_ = nullptr;
@@ -799,11 +2088,11 @@ namespace ds_internal
         void applyViewpointToGL();
         void initSphereMeshForQuality(int quality, Mesh &dstMesh);
         void initCylinderMeshForQuality(int quality, Mesh &dstMesh);
-        void initTriangleMesh();
-        void initTrianglesBatchMesh();
+        void initStreamMesh();
         void createPrimitiveMeshes();
         void applyMaterials();
-        void drawSky(const float view_xyz[3]);
+        void packColor();
+        void drawSky();
         void drawGround();
         void drawPyramidGrid();
 
@@ -818,6 +2107,7 @@ namespace ds_internal
         void drawShadowMesh(
             const Mesh &mesh,
             const glm::mat4 &model);
+        void useShadowProgram(const glm::mat4 &model);
 
         void bindTextureUnit0(const int texId);
 
@@ -862,77 +2152,262 @@ namespace ds_internal
             return model;
         }
 
+        // インスタンスの記録先を選ぶ。並列記録中ならそのスレッドのバッファ，
+        // そうでなければマップ済みアリーナ（半透明なら TransparentQueue）。
+        // color には記録に使う現在色が返る。
+        InstanceCompact *allocateInstances(const int bucket, const std::size_t n,
+                                           const std::uint8_t *&color)
+        {
+            color = currentColorRgba8();
+            return allocateTo(bucket, n, color[3] < 255);
+        }
+        const std::uint8_t *currentColorRgba8() const
+        {
+            if (ParallelRecorder *rec = tlsRecorder_)
+                return rec->color_rgba8;
+            return current_color_rgba8_;
+        }
+        InstanceCompact *allocateTo(const int bucket, const std::size_t n, const bool translucent)
+        {
+            if (ParallelRecorder *rec = tlsRecorder_)
+                return rec->allocate(bucket, n, translucent);
+            return translucent ? transparentQueue_.allocate(bucket, n) : instanceArena_.allocate(bucket, n);
+        }
+
+        void requireDrawingState(const char *name) const
+        {
+            if (current_state != SIM_STATE_DRAWING)
+                fatalError("%s: drawing function called outside simulation loop (current_state=%d)",
+                           name, static_cast<int>(current_state));
+        }
+
+        // バッチ API 用：バイト単位ストライドの配列アクセス（stride 0 は詰めて並んでいる）
+        template <typename U>
+        struct BatchStride
+        {
+            const unsigned char *base;
+            std::size_t stride;
+
+            BatchStride(const U *p, const std::size_t s, const std::size_t n)
+                : base(reinterpret_cast<const unsigned char *>(p)),
+                  stride(s != 0 ? s : n * sizeof(U)) {}
+            const U *operator[](const int i) const
+            {
+                return reinterpret_cast<const U *>(base + static_cast<std::size_t>(i) * stride);
+            }
+        };
+
+        // バッチ API 用：i 番目の色（配列がなければ現在色）
+        static const std::uint8_t *batchColor(const BatchStride<float> &c, const int i,
+                                              const std::uint8_t *curColor,
+                                              std::uint8_t rgba[4])
+        {
+            if (!c.base)
+                return curColor;
+            const float *cf = c[i];
+            rgba[0] = packUnorm8(cf[0]);
+            rgba[1] = packUnorm8(cf[1]);
+            rgba[2] = packUnorm8(cf[2]);
+            rgba[3] = packUnorm8(cf[3]);
+            return rgba;
+        }
+
+        // バッチの四元数変換はこの個数ずつスタック上で行う
+        static constexpr int kBatchChunk = 256;
+
+        // rot[base..base+m) の四元数を q へ（R 配列がなければ単位四元数）
         template <typename T>
-        void drawTriangleWithAutoNormal(const T *v0, const T *v1,
-                                        const T *v2,
-                                        const glm::mat4 &model,
-                                        const bool solid = true)
+        static void convertBatchRotations(const BatchStride<T> &rot, const int base, const int m,
+                                          std::int16_t (*q)[4])
         {
-            static_assert(
-                std::is_same<T, float>::value || std::is_same<T, double>::value,
-                "T must be float or double");
+            if (!rot.base)
+            {
+                for (int j = 0; j < m; ++j)
+                {
+                    q[j][0] = q[j][1] = q[j][2] = 0;
+                    q[j][3] = 32767;
+                }
+                return;
+            }
+            convertRotationsToQuat(rot[base], rot.stride, static_cast<std::size_t>(m), q);
+        }
 
-            // 1. T配列 → glm::vec3 に変換
-            glm::vec3 p[3] = {
-                glm::vec3(static_cast<float>(v0[0]),
-                          static_cast<float>(v0[1]),
-                          static_cast<float>(v0[2])),
-                glm::vec3(static_cast<float>(v1[0]),
-                          static_cast<float>(v1[1]),
-                          static_cast<float>(v1[2])),
-                glm::vec3(static_cast<float>(v2[0]),
-                          static_cast<float>(v2[1]),
-                          static_cast<float>(v2[2]))};
+        // 1 バケットに count 個を書き込むバッチの共通部分
+        template <typename T, typename ScaleFn>
+        void recordBatch(const char *name, const int bucket, const int count,
+                         const T *pos, const std::size_t posStride,
+                         const T *R, const std::size_t RStride,
+                         const float *color, const std::size_t colorStride,
+                         ScaleFn scaleOf)
+        {
+            requireDrawingState(name);
+            if (count <= 0)
+                return;
+
+            const BatchStride<T> p(pos, posStride, 3);
+            const BatchStride<T> rot(R, RStride, 12);
+            const BatchStride<float> c(color, colorStride, 4);
+
+            // 半透明の要素は TransparentQueue 側へ。先に数えて不透明・半透明の 2 か所を確保する
+            const std::uint8_t *curColor = currentColorRgba8();
+            std::size_t translucentCount = 0;
+            if (c.base)
+            {
+                for (int i = 0; i < count; ++i)
+                    translucentCount += (packUnorm8(c[i][3]) < 255) ? 1 : 0;
+            }
+            else if (curColor[3] < 255)
+            {
+                translucentCount = static_cast<std::size_t>(count);
+            }
+            const std::size_t opaqueCount = static_cast<std::size_t>(count) - translucentCount;
+            InstanceCompact *opaque = opaqueCount ? allocateTo(bucket, opaqueCount, false) : nullptr;
+            InstanceCompact *translucent = translucentCount ? allocateTo(bucket, translucentCount, true) : nullptr;
 
-            // 2. 法線計算は glm だけで完結
-            glm::vec3 U = p[1] - p[0];
-            glm::vec3 V = p[2] - p[0];
-            glm::vec3 N = glm::normalize(glm::cross(U, V));
+            // 四元数はチャンク単位で SIMD カーネルに任せ，残りの詰め込みはスカラーで
+            std::int16_t q[kBatchChunk][4];
+            for (int base = 0; base < count; base += kBatchChunk)
+            {
+                const int m = std::min(kBatchChunk, count - base);
+                convertBatchRotations(rot, base, m, q);
+                for (int j = 0; j < m; ++j)
+                {
+                    const int i = base + j;
+                    std::uint8_t rgba[4];
+                    const std::uint8_t *ci = batchColor(c, i, curColor, rgba);
+                    float sc[3];
+                    scaleOf(i, sc);
+                    InstanceCompact *dst = (ci[3] < 255) ? translucent++ : opaque++;
+                    writeInstanceQuat(dst, ci, p[i], q[j], sc[0], sc[1], sc[2]);
+                }
+            }
+        }
 
-            // 3. 実際の描画は非テンプレートのプライベート関数に丸投げ
-            drawTriangleCore(p, N, model, solid);
+        void requireRetained(const char *name, const std::uint32_t id) const
+        {
+            if (!instancePool_.isValid(id))
+                fatalError("%s: invalid or destroyed instance handle (%u)", name, id);
         }
 
+        // 保持インスタンスの姿勢を書き換える（色はそのまま）
         template <typename T>
-        void drawLineCore(const T pos1[3], const T pos2[3])
+        void writeRetainedPose(const std::uint32_t id, const T pos[3], const T R[12])
         {
-            static_assert(
-                std::is_same_v<T, float> || std::is_same_v<T, double>,
-                "T must be float or double");
+            std::int16_t q[4];
+            packRotationQuat(R, q);
+            const float *sz = instancePool_.size(id);
+            switch (instancePool_.shape(id))
+            {
+            case RETAINED_SPHERE:
+                writeRetained(id, pos, q, sz[0], sz[0], sz[0]);
+                break;
+            case RETAINED_BOX:
+                writeRetained(id, pos, q, sz[0], sz[1], sz[2]);
+                break;
+            case RETAINED_CYLINDER:
+                // size = (length, radius)，スケールは drawCylinder / drawCapsule と同じ
+                writeRetained(id, pos, q, sz[1], sz[1], sz[0]);
+                break;
+            case RETAINED_CAPSULE:
+                writeRetained(id, pos, q, sz[1], sz[1], 0.5f * sz[0]);
+                break;
+            }
+        }
 
-            initLineMesh(); // VAO/VBO 初期化。meshLine_.primitive = GL_LINES 前提。
+        template <typename T>
+        void writeRetained(const std::uint32_t id, const T pos[3], const std::int16_t q[4],
+                           const float sx, const float sy, const float sz)
+        {
+            // 保持側は CPU メモリなので色を読み戻してよい
+            InstanceCompact *dst = instancePool_.edit(id);
+            std::uint8_t color[4];
+            std::memcpy(color, dst->color, 4);
+            writeInstanceQuat(dst, color, pos, q, sx, sy, sz);
+        }
 
-            VertexPN verts[2];
+        // 即時に GL を呼ぶ描画関数はワーカースレッドからは呼べない
+        void checkNotParallel(const char *name) const
+        {
+            if (tlsRecorder_)
+                fatalError("%s: cannot be called between dsBeginParallelDraw() and dsEndParallelDraw()", name);
+        }
 
-            // 位置（ワールド座標）
-            verts[0].pos = glm::vec3(
-                static_cast<float>(pos1[0]),
-                static_cast<float>(pos1[1]),
-                static_cast<float>(pos1[2]));
-            verts[1].pos = glm::vec3(
-                static_cast<float>(pos2[0]),
-                static_cast<float>(pos2[1]),
-                static_cast<float>(pos2[2]));
+        // ODE の pos/R とスケールから InstanceCompact を書く。
+        // dst は書き込み専用のマップ済みメモリなので，読み戻さずに順に埋める。
+        template <typename T>
+        void writeInstance(InstanceCompact *dst, const std::uint8_t color[4],
+                           const T pos[3], const T R[12],
+                           const float sx, const float sy, const float sz)
+        {
+            std::int16_t q[4];
+            packRotationQuat(R, q);
+            writeInstanceQuat(dst, color, pos, q, sx, sy, sz);
+        }
 
-            // 法線：適当に線方向を入れておく（A項でそれなりに見える）
-            glm::vec3 dir = verts[1].pos - verts[0].pos;
-            glm::vec3 N = glm::length(dir) > 0.0f
-                              ? glm::normalize(dir)
-                              : glm::vec3(0.0f, 1.0f, 0.0f);
-
-            verts[0].normal = N;
-            verts[1].normal = N;
-
-            // VBO に書き込み
-            glBindBuffer(GL_ARRAY_BUFFER, meshLine_.vbo);
-            glBufferSubData(GL_ARRAY_BUFFER,
-                            0,
-                            sizeof(verts),
-                            verts);
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-            // 念のため：2 頂点
-            meshLine_.indexCount = 2;
+        // 四元数（snorm16）計算済み版
+        template <typename T>
+        void writeInstanceQuat(InstanceCompact *dst, const std::uint8_t color[4],
+                               const T pos[3], const std::int16_t q[4],
+                               const float sx, const float sy, const float sz)
+        {
+            dst->pos[0] = (float)pos[0];
+            dst->pos[1] = (float)pos[1];
+            dst->pos[2] = (float)pos[2];
+            std::memcpy(dst->rot, q, sizeof(dst->rot));
+            dst->scale[0] = sx;
+            dst->scale[1] = sy;
+            dst->scale[2] = sz;
+            std::memcpy(dst->color, color, 4);
+        }
+
+        // 即時描画の三角形・線の置き場（不透明 / 半透明で分ける）
+        std::vector<VertexFlat> stream_[STREAM_BATCH_COUNT][2];
+        std::vector<VertexStream> streamLines_[2];
+        std::vector<VertexFlat> &streamBatch(const int kind)
+        {
+            return stream_[kind][current_color[3] < 1.0f ? 1 : 0];
+        }
+        // フレームの終わりに影 → 不透明 → 半透明の順で種類ごとに 1 回ずつ描く
+        void drawStreamBatches();
+        ShaderPermutation streamShader_;
+        void initStreamProgram();
+
+        // モデル座標の点と法線をワールド座標へ変換して積む
+        void appendStreamVertex(std::vector<VertexStream> &dst, const glm::mat4 &model,
+                                const glm::vec3 &p, const glm::vec3 &N)
+        {
+            VertexStream vtx;
+            vtx.pos = glm::vec3(model * glm::vec4(p, 1.0f));
+            // basic.vs と同じく mat3(model) で回すだけ（長さは FS で正規化）
+            vtx.normal = glm::mat3(model) * N;
+            vtx.localPos = p;
+            vtx.localNormal = N;
+            std::memcpy(vtx.color, current_color_rgba8_, 4);
+            dst.push_back(vtx);
+        }
+
+        // モデル座標の点をワールド座標へ変換して積む（法線は FS が求める）
+        void appendFlatVertex(std::vector<VertexFlat> &dst, const glm::mat4 &model, const glm::vec3 &p)
+        {
+            VertexFlat vtx;
+            vtx.pos = glm::vec3(model * glm::vec4(p, 1.0f));
+            vtx.localPos = p;
+            std::memcpy(vtx.color, current_color_rgba8_, 4);
+            dst.push_back(vtx);
+        }
+
+        // 法線は FS で 3 点の並び（表裏）から求めるので，ここでは位置だけ
+        template <typename T>
+        void appendStreamTriangle(std::vector<VertexFlat> &dst, const glm::mat4 &model,
+                                  const T *v0, const T *v1, const T *v2)
+        {
+            static_assert(
+                std::is_same<T, float>::value || std::is_same<T, double>::value,
+                "T must be float or double");
+
+            for (const T *v : {v0, v1, v2})
+                appendFlatVertex(dst, model,
+                                 glm::vec3(static_cast<float>(v[0]), static_cast<float>(v[1]), static_cast<float>(v[2])));
         }
     };
 } // namespace ds_internal
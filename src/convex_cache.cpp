@@ -0,0 +1,182 @@
+// convex_cache.cpp - cached and instanced convex shapes for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+#include "mesh_utils.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // これだけのフレーム描かれなかった形は捨てる
+        constexpr std::uint64_t kMaxIdleFrames = 120;
+        // キャッシュする形の数の上限
+        constexpr std::size_t kMaxEntries = 1024;
+        // インスタンスバッファの最小容量（インスタンス数）
+        constexpr std::size_t kMinCapacity = 256;
+    } // anonymous namespace
+
+    // 8 バイトずつ混ぜる簡単なハッシュ（暗号用途ではない）
+    std::uint64_t ConvexCache::hashBytes(const void *data, std::size_t size, std::uint64_t h)
+    {
+        constexpr std::uint64_t kMul = 0x9e3779b97f4a7c15ull;
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for (; size >= 8; size -= 8, p += 8)
+        {
+            std::uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * kMul;
+            h ^= h >> 29;
+        }
+        if (size > 0)
+        {
+            std::uint64_t w = 0;
+            std::memcpy(&w, p, size);
+            h = (h ^ w ^ (std::uint64_t(size) << 56)) * kMul;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
+    // splitmix64 の仕上げ
+    std::uint64_t ConvexCache::finalize(std::uint64_t h)
+    {
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        h ^= h >> 31;
+        return h;
+    }
+
+    std::vector<InstanceCompact> *ConvexCache::find(const std::uint64_t key)
+    {
+        const auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+        Entry &e = entries_[it->second];
+        e.lastUsed = frame_;
+        return &e.instances;
+    }
+
+    std::vector<InstanceCompact> *ConvexCache::add(const std::uint64_t key, MeshPN &mesh)
+    {
+        if (entries_.size() >= kMaxEntries)
+        {
+            // 最後に使ったのが一番古い形を追い出す（このフレームで使った形は残す）
+            std::size_t victim = 0;
+            for (std::size_t i = 1; i < entries_.size(); ++i)
+            {
+                if (entries_[i].lastUsed < entries_[victim].lastUsed)
+                    victim = i;
+            }
+            if (entries_[victim].lastUsed == frame_)
+                return nullptr;
+            evict(victim);
+        }
+
+        Entry e;
+        e.key = key;
+        e.lastUsed = frame_;
+        geometry_.upload(e.mesh, mesh.vertices, mesh.indices);
+
+        index_[key] = entries_.size();
+        entries_.push_back(std::move(e));
+        return &entries_.back().instances;
+    }
+
+    // 末尾の形を i へ移して詰める
+    void ConvexCache::evict(const std::size_t i)
+    {
+        Entry &e = entries_[i];
+        geometry_.release(e.mesh);
+        index_.erase(e.key);
+
+        if (i + 1 != entries_.size())
+        {
+            e = std::move(entries_.back());
+            index_[e.key] = i;
+        }
+        entries_.pop_back();
+    }
+
+    void ConvexCache::beginFrame()
+    {
+        ++frame_;
+        for (std::size_t i = entries_.size(); i-- > 0;)
+        {
+            if (frame_ - entries_[i].lastUsed > kMaxIdleFrames)
+                evict(i);
+            else
+                entries_[i].instances.clear();
+        }
+    }
+
+    void ConvexCache::upload()
+    {
+        std::size_t total = 0;
+        for (Entry &e : entries_)
+        {
+            e.offset = total;
+            total += e.instances.size();
+        }
+        if (total == 0)
+            return;
+
+        const std::size_t stride = sizeof(InstanceCompact);
+        if (buffer_ == 0)
+            glGenBuffers(1, &buffer_);
+        if (total > capacity_)
+            capacity_ = std::max(kMinCapacity, total + total / 2);
+
+        // 前のフレームの描画を待たないよう，毎フレーム確保し直して（orphan）から詰める
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(capacity_ * stride),
+                     nullptr, GL_STREAM_DRAW);
+        for (const Entry &e : entries_)
+        {
+            if (e.instances.empty())
+                continue;
+            glBufferSubData(GL_COPY_WRITE_BUFFER,
+                            static_cast<GLintptr>(e.offset * stride),
+                            static_cast<GLsizeiptr>(e.instances.size() * stride),
+                            e.instances.data());
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    bool ConvexCache::range(const std::size_t i, InstanceRange &r) const
+    {
+        const Entry &e = entries_[i];
+        if (e.instances.empty() || buffer_ == 0)
+            return false;
+        r.buffer = buffer_;
+        r.offset = static_cast<GLintptr>(e.offset * sizeof(InstanceCompact));
+        r.count = static_cast<GLsizei>(e.instances.size());
+        return true;
+    }
+
+    void ConvexCache::refreshGeometry()
+    {
+        for (Entry &e : entries_)
+            geometry_.refresh(e.mesh);
+    }
+
+    void ConvexCache::releaseGL()
+    {
+        while (!entries_.empty())
+            evict(entries_.size() - 1);
+        if (buffer_ != 0)
+            glDeleteBuffers(1, &buffer_);
+        buffer_ = 0;
+        capacity_ = 0;
+    }
+} // namespace ds_internal
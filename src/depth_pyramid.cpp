@@ -0,0 +1,140 @@
+// depth_pyramid.cpp - hierarchical-Z (max depth) pyramid for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// 描画し終えたフレームの深度をテクスチャへコピーし，2x2 の最大値で縮小していく。
+// 縮小中は読む level を GL_TEXTURE_BASE_LEVEL/MAX_LEVEL で 1 つに絞り，
+// 書き込み先の level と重ならないようにする（フィードバックループ回避）。
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    void DepthPyramid::init(const GLuint program)
+    {
+        program_ = program;
+        uSrc_ = glGetUniformLocation(program, "uSrc");
+        uSrcSize_ = glGetUniformLocation(program, "uSrcSize");
+
+        glGenVertexArrays(1, &vao_);
+        glGenFramebuffers(1, &fbo_);
+        glGenTextures(1, &depth_);
+        glGenTextures(1, &pyramid_);
+    }
+
+    void DepthPyramid::destroy()
+    {
+        if (fbo_ != 0)
+            glDeleteFramebuffers(1, &fbo_);
+        if (vao_ != 0)
+            glDeleteVertexArrays(1, &vao_);
+        if (depth_ != 0)
+            glDeleteTextures(1, &depth_);
+        if (pyramid_ != 0)
+            glDeleteTextures(1, &pyramid_);
+        fbo_ = vao_ = depth_ = pyramid_ = 0;
+        width_ = height_ = levels_ = 0;
+        valid_ = false;
+        program_ = 0; // プログラム自体は DrawstuffApp の持ち物
+    }
+
+    void DepthPyramid::resize(const int width, const int height)
+    {
+        width_ = width;
+        height_ = height;
+
+        glBindTexture(GL_TEXTURE_2D, depth_);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0,
+                     GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+        // level 0 は画面の 1/2，1x1 まで
+        int w = std::max(1, width / 2), h = std::max(1, height / 2);
+        glBindTexture(GL_TEXTURE_2D, pyramid_);
+        levels_ = 0;
+        for (;;)
+        {
+            glTexImage2D(GL_TEXTURE_2D, levels_, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, nullptr);
+            ++levels_;
+            if (w == 1 && h == 1)
+                break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    void DepthPyramid::build(const int width, const int height, const glm::mat4 &viewProj)
+    {
+        if (width < 2 || height < 2)
+        {
+            valid_ = false;
+            return;
+        }
+        if (width != width_ || height != height_)
+            resize(width, height);
+
+        // ---- 画面の深度をコピー（読み込み先はデフォルトフレームバッファ）----
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, depth_);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        glDisable(GL_CULL_FACE);
+        glUseProgram(program_);
+        glUniform1i(uSrc_, 0);
+        glBindVertexArray(vao_);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+
+        // ---- 1 段ずつ最大値で縮小 ----
+        int sw = width, sh = height;
+        for (int level = 0; level < levels_; ++level)
+        {
+            if (level == 0)
+            {
+                glBindTexture(GL_TEXTURE_2D, depth_);
+            }
+            else
+            {
+                glBindTexture(GL_TEXTURE_2D, pyramid_);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+            }
+            const int dw = std::max(1, sw / 2), dh = std::max(1, sh / 2);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pyramid_, level);
+            glViewport(0, 0, dw, dh);
+            glUniform2i(uSrcSize_, sw, sh);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            sw = dw;
+            sh = dh;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, pyramid_);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels_ - 1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindVertexArray(0);
+        glViewport(0, 0, width, height);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+
+        viewProj_ = viewProj;
+        valid_ = true;
+    }
+} // namespace ds_internal
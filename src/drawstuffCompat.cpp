@@ -163,6 +163,25 @@ extern "C" void dsSetColorAlpha(const float red, const float green, const float
     app.storeColor(red, green, blue, alpha);
 }
 
+// ---------- Parallel recording ----------
+extern "C" void dsBeginParallelDraw(const int slot)
+{
+    with_app(
+        [slot](ds_internal::DrawstuffApp &app)
+        {
+            app.beginParallelDraw(slot);
+        });
+}
+
+extern "C" void dsEndParallelDraw()
+{
+    with_app(
+        [](ds_internal::DrawstuffApp &app)
+        {
+            app.endParallelDraw();
+        });
+}
+
 // ---------- Box ----------
 extern "C" void dsDrawBox(const float pos[3], const float R[12],
                           const float sides[3])
@@ -313,6 +332,127 @@ extern "C" void dsDrawCapsuleD(const double pos[3], const double R[12],
         });
 }
 
+// ---------- SoA batches ----------
+extern "C" void dsDrawSpheresBatch(const int count,
+                                   const float *pos, const int pos_stride,
+                                   const float *R, const int R_stride,
+                                   const float *radius, const int radius_stride,
+                                   const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawSpheresBatch<float>(count, pos, pos_stride, R, R_stride,
+                                        radius, radius_stride, color, color_stride);
+        });
+}
+
+extern "C" void dsDrawSpheresBatchD(const int count,
+                                    const double *pos, const int pos_stride,
+                                    const double *R, const int R_stride,
+                                    const double *radius, const int radius_stride,
+                                    const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawSpheresBatch<double>(count, pos, pos_stride, R, R_stride,
+                                         radius, radius_stride, color, color_stride);
+        });
+}
+
+extern "C" void dsDrawBoxesBatch(const int count,
+                                 const float *pos, const int pos_stride,
+                                 const float *R, const int R_stride,
+                                 const float *sides, const int sides_stride,
+                                 const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawBoxesBatch<float>(count, pos, pos_stride, R, R_stride,
+                                      sides, sides_stride, color, color_stride);
+        });
+}
+
+extern "C" void dsDrawBoxesBatchD(const int count,
+                                  const double *pos, const int pos_stride,
+                                  const double *R, const int R_stride,
+                                  const double *sides, const int sides_stride,
+                                  const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawBoxesBatch<double>(count, pos, pos_stride, R, R_stride,
+                                       sides, sides_stride, color, color_stride);
+        });
+}
+
+extern "C" void dsDrawCylindersBatch(const int count,
+                                     const float *pos, const int pos_stride,
+                                     const float *R, const int R_stride,
+                                     const float *length, const int length_stride,
+                                     const float *radius, const int radius_stride,
+                                     const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawCylindersBatch<float>(count, pos, pos_stride, R, R_stride,
+                                          length, length_stride, radius, radius_stride,
+                                          color, color_stride);
+        });
+}
+
+extern "C" void dsDrawCylindersBatchD(const int count,
+                                      const double *pos, const int pos_stride,
+                                      const double *R, const int R_stride,
+                                      const double *length, const int length_stride,
+                                      const double *radius, const int radius_stride,
+                                      const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawCylindersBatch<double>(count, pos, pos_stride, R, R_stride,
+                                           length, length_stride, radius, radius_stride,
+                                           color, color_stride);
+        });
+}
+
+extern "C" void dsDrawCapsulesBatch(const int count,
+                                    const float *pos, const int pos_stride,
+                                    const float *R, const int R_stride,
+                                    const float *length, const int length_stride,
+                                    const float *radius, const int radius_stride,
+                                    const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawCapsulesBatch<float>(count, pos, pos_stride, R, R_stride,
+                                         length, length_stride, radius, radius_stride,
+                                         color, color_stride);
+        });
+}
+
+extern "C" void dsDrawCapsulesBatchD(const int count,
+                                     const double *pos, const int pos_stride,
+                                     const double *R, const int R_stride,
+                                     const double *length, const int length_stride,
+                                     const double *radius, const int radius_stride,
+                                     const float *color, const int color_stride)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.drawCapsulesBatch<double>(count, pos, pos_stride, R, R_stride,
+                                          length, length_stride, radius, radius_stride,
+                                          color, color_stride);
+        });
+}
+
 // ---------- Line ----------
 extern "C" void dsDrawLine(const float pos1[3], const float pos2[3])
 {
@@ -332,6 +472,122 @@ extern "C" void dsDrawLineD(const double _pos1[3], const double _pos2[3])
         });
 }
 
+void dsSetCulling(const int mode)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setCulling(mode);
+}
+
+void dsSetCullScreenSize(const float pixels)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setCullScreenSize(pixels);
+}
+
+void dsSetOcclusionCulling(const int enable)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setOcclusionCulling(enable != 0);
+}
+
+void dsSetLevelOfDetail(const int enable)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setLevelOfDetail(enable != 0);
+}
+
+void dsSetLevelOfDetailThresholds(const float fine, const float coarse)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setLevelOfDetailThresholds(fine, coarse);
+}
+
+void dsSetImpostor(const int shape, const int enable)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setImpostor(shape, enable != 0);
+}
+
+void dsSetConvexCache(const int mode)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setConvexCache(mode);
+}
+
+void dsSetTransparency(const int mode)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setTransparency(mode);
+}
+
+void dsGetCullStats(dsCullStats *stats)
+{
+    if (!stats)
+        return;
+    const auto &s = ds_internal::DrawstuffApp::instance().cullStats();
+    stats->instances = static_cast<int>(s.instances);
+    stats->visible = static_cast<int>(s.visible);
+    stats->culled = static_cast<int>(s.instances - s.visible - s.occluded);
+    stats->occluded = static_cast<int>(s.occluded);
+    stats->shadow_visible = static_cast<int>(s.shadowVisible);
+    stats->shadow_culled = s.shadows ? static_cast<int>(s.instances - s.shadowVisible - s.shadowOccluded) : 0;
+    stats->shadow_occluded = static_cast<int>(s.shadowOccluded);
+}
+
+void dsSetDepthSort(const int enable)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setDepthSort(enable != 0);
+}
+
+void dsGetOpaquePassStats(dsOpaquePassStats *stats)
+{
+    if (!stats)
+        return;
+    const auto &s = ds_internal::DrawstuffApp::instance().opaquePassStats();
+    stats->gpu_ms = s.gpuMilliseconds;
+    stats->overdraw = s.overdraw;
+    stats->sorted = static_cast<int>(s.sorted);
+    stats->reused = static_cast<int>(s.reused);
+}
+
+void dsSetMultiDrawIndirect(const int enable)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.setMultiDrawIndirect(enable != 0);
+}
+
+void dsGetMultiDrawStats(dsMultiDrawStats *stats)
+{
+    if (!stats)
+        return;
+    const auto s = ds_internal::DrawstuffApp::instance().multiDrawStats();
+    stats->active = s.active ? 1 : 0;
+    stats->commands = static_cast<int>(s.commands);
+    stats->draws = static_cast<int>(s.draws);
+}
+
+void dsGetGeometryStats(dsGeometryStats *stats)
+{
+    if (!stats)
+        return;
+    const auto s = ds_internal::DrawstuffApp::instance().geometryStats();
+    stats->vertices = static_cast<int>(s.vertices);
+    stats->indices = static_cast<int>(s.indices);
+    stats->used_mb = static_cast<double>(s.usedBytes) / (1024.0 * 1024.0);
+    stats->reserved_mb = static_cast<double>(s.reservedBytes) / (1024.0 * 1024.0);
+    stats->max_normal_error = s.maxNormalError;
+}
+
+void dsGetGLStateStats(dsGLStateStats *stats)
+{
+    if (!stats)
+        return;
+    const auto &s = ds_internal::DrawstuffApp::instance().glStateStats();
+    stats->issued = static_cast<int>(s.issued);
+    stats->elided = static_cast<int>(s.elided);
+}
+
 void dsSetSphereQuality(const int n)
 {
     auto &app = ds_internal::DrawstuffApp::instance();
@@ -436,4 +692,91 @@ extern "C" void dsDrawRegisteredMesh(
         });
 }
 
+// 登録と同じく，シミュレーションループの外でも呼べる
+extern "C" void dsUnregisterMesh(const dsMeshHandle handle)
+{
+    auto &app = ds_internal::DrawstuffApp::instance();
+    app.unregisterMesh(handle.id);
+}
+
+extern "C" void dsGetRegisteredMeshStats(const dsMeshHandle handle, dsRegisteredMeshStats *stats)
+{
+    if (!stats)
+        return;
+    const auto s = ds_internal::DrawstuffApp::instance().registeredMeshStats(handle.id);
+    stats->vertices = static_cast<int>(s.vertices);
+    stats->triangles = static_cast<int>(s.triangles);
+    stats->index_bytes = static_cast<int>(s.indexBytes);
+    stats->acmr_before = s.acmrBefore;
+    stats->acmr_after = s.acmrAfter;
+    stats->atvr_before = s.atvrBefore;
+    stats->atvr_after = s.atvrAfter;
+}
+
+// ========================================================================
+// 保持型インスタンス
+// ========================================================================
+extern "C" dsInstanceHandle dsCreateInstance(const int shape, const float pos[3], const float R[12],
+                                             const float size[3])
+{
+    dsInstanceHandle h;
+    h.id = with_app_or_default(
+        [shape, pos, R, size](ds_internal::DrawstuffApp &app)
+        {
+            return app.createInstance(shape, pos, R, size);
+        },
+        0u);
+    return h;
+}
+
+extern "C" dsInstanceHandle dsCreateInstanceD(const int shape, const double pos[3], const double R[12],
+                                              const double size[3])
+{
+    dsInstanceHandle h;
+    h.id = with_app_or_default(
+        [shape, pos, R, size](ds_internal::DrawstuffApp &app)
+        {
+            return app.createInstance(shape, pos, R, size);
+        },
+        0u);
+    return h;
+}
+
+extern "C" void dsUpdateInstancePose(const dsInstanceHandle h, const float pos[3], const float R[12])
+{
+    with_app(
+        [h, pos, R](ds_internal::DrawstuffApp &app)
+        {
+            app.updateInstancePose(h.id, pos, R);
+        });
+}
+
+extern "C" void dsUpdateInstancePoseD(const dsInstanceHandle h, const double pos[3], const double R[12])
+{
+    with_app(
+        [h, pos, R](ds_internal::DrawstuffApp &app)
+        {
+            app.updateInstancePose(h.id, pos, R);
+        });
+}
+
+extern "C" void dsSetInstanceColor(const dsInstanceHandle h,
+                                   const float red, const float green, const float blue, const float alpha)
+{
+    with_app(
+        [=](ds_internal::DrawstuffApp &app)
+        {
+            app.setInstanceColor(h.id, red, green, blue, alpha);
+        });
+}
+
+extern "C" void dsDestroyInstance(const dsInstanceHandle h)
+{
+    with_app(
+        [h](ds_internal::DrawstuffApp &app)
+        {
+            app.destroyInstance(h.id);
+        });
+}
+
 // ========================================================================
@@ -14,6 +14,7 @@
 #include <windows.h>
 #endif
 
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <fstream>
@@ -30,6 +31,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 // 必要に応じて <GL/gl.h> など既存の include も
 
 const char *DEFAULT_PATH_TO_TEXTURES = "../textures/";
@@ -40,6 +42,7 @@ const char *DEFAULT_PATH_TO_TEXTURES = "../textures/";
 #include <glm/gtx/string_cast.hpp>
 
 #include "drawstuff_core.hpp"
+#include "gl_extensions.hpp"
 #include "mesh_utils.hpp"
 
 // ==============================================================
@@ -258,75 +261,41 @@ namespace ds_internal
         {
             glBindTexture(GL_TEXTURE_2D, name);
         }
+
+        GLuint id() const { return name; }
     };
 
     constexpr int DS_NUMTEXTURES = 4; // number of standard textures
     std::array<std::unique_ptr<Texture>, DS_NUMTEXTURES + 1> texture;
 
-    // ============================================================================
-    // TriMesh 用高速描画 API 実装
-    // ============================================================================
-    // GPU 側に MeshPN データを転送して Mesh を構築
-    void buildTrianglesMeshFromMeshPN(
-        Mesh &outMesh,
-        MeshPN &meshPN)
+    // TriMesh 用高速描画 API：登録メッシュ
+    struct MeshResource
     {
-        const std::vector<VertexPN> &verts = meshPN.vertices;
-        const std::vector<uint32_t> &indices = meshPN.indices;
-
-        // 既存リソースの破棄
-        if (outMesh.vao)
-        {
-            glDeleteVertexArrays(1, &outMesh.vao);
-            outMesh.vao = 0;
-        }
-        if (outMesh.vbo)
-        {
-            glDeleteBuffers(1, &outMesh.vbo);
-            outMesh.vbo = 0;
-        }
-        if (outMesh.ebo)
-        {
-            glDeleteBuffers(1, &outMesh.ebo);
-            outMesh.ebo = 0;
-        }
-
-        // VAO/VBO/EBO 設定
-        glGenVertexArrays(1, &outMesh.vao);
-        glBindVertexArray(outMesh.vao);
-
-        glGenBuffers(1, &outMesh.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, outMesh.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     verts.size() * sizeof(VertexPN),
-                     verts.data(),
-                     GL_STATIC_DRAW);
-
-        glGenBuffers(1, &outMesh.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, outMesh.ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(uint32_t),
-                     indices.data(),
-                     GL_STATIC_DRAW);
-
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, normal)));
-
-        outMesh.indexCount = static_cast<GLsizei>(indices.size());
-        outMesh.primitive = GL_TRIANGLES;
+        MeshPN meshPN;
+        Mesh meshGL;
+        bool dirty = true; // GPU 側の再構築が必要かどうか
+        bool live = false; // 登録中（dsUnregisterMesh で false）
+        // 登録時に並べ替える前と後の頂点キャッシュの効き具合
+        VertexCacheStats cacheBefore, cacheAfter;
+        // このフレームに描くインスタンス（[0] 塗り潰し，[1] ワイヤーフレーム）
+        std::vector<InstanceCompact> instances[2];
+        // upload 後：インスタンスバッファ内の位置（[0] の先頭。[1] はその直後）と個数
+        std::size_t offset = 0;
+        GLsizei count[2] = {0, 0};
+    };
+    std::vector<MeshResource> meshRegistry_;
+    std::vector<MeshHandle> meshRegistryFree_; // 取り消されたハンドル（使い回す）
 
-        glBindVertexArray(0);
+    static MeshResource &registeredMesh(const char *name, const MeshHandle h)
+    {
+        if (h == 0 || h > meshRegistry_.size() || !meshRegistry_[h - 1].live)
+            fatalError("%s: invalid or unregistered mesh handle (%zu)", name, h);
+        return meshRegistry_[h - 1];
     }
 
+    // ============================================================================
+    // TriMesh 用高速描画 API 実装
+    // ============================================================================
     // CPU 側：頂点配列データから MeshPN を構築
     MeshPN buildTrianglesMeshPNFromVerticesAndIndices(
         const std::vector<float> &vertices,   // x,y,z,...
@@ -346,22 +315,6 @@ namespace ds_internal
     // Mesh generation utility members and functions
     // ============================================================================
 
-    // =================================================
-    // インスタンス描画用バッファ
-    std::vector<InstanceBasic> sphereInstances_;
-    std::vector<InstanceBasic> boxInstances_;
-    std::vector<InstanceBasic> cylinderInstances_;
-    std::vector<InstanceBasic> capsuleCapTopInstances_;
-    std::vector<InstanceBasic> capsuleCapBottomInstances_;
-    std::vector<InstanceBasic> capsuleCylinderInstances_;
-
-    GLuint g_sphereInstanceVBO = 0;
-    GLuint g_boxInstanceVBO = 0;
-    GLuint g_cylinderInstanceVBO = 0;
-    GLuint g_capsuleCapTopInstanceVBO = 0;
-    GLuint g_capsuleCapBottomInstanceVBO = 0;
-    GLuint g_capsuleCylinderInstanceVBO = 0;
-
     // ================ DrawstuffApp implementation =================
     DrawstuffApp &DrawstuffApp::instance()
     {
@@ -443,10 +396,19 @@ namespace ds_internal
 
     void DrawstuffApp::storeColor(const float r, const float g, const float b, const float alpha)
     {
+        // 並列記録中はそのスレッドの記録バッファ側の色を変える
+        if (ParallelRecorder *rec = tlsRecorder_)
+        {
+            rec->color = glm::vec4(r, g, b, alpha);
+            for (int i = 0; i < 4; ++i)
+                rec->color_rgba8[i] = packUnorm8(rec->color[i]);
+            return;
+        }
         current_color[0] = r;
         current_color[1] = g;
         current_color[2] = b;
         current_color[3] = alpha;
+        packColor();
     }
 
     // メンバ: 現在の色（もともと float[4] ならそこに合わせてください）
@@ -461,10 +423,21 @@ namespace ds_internal
         current_color[1] = g;
         current_color[2] = b;
         current_color[3] = alpha;
+        packColor();
+    }
+
+    // インスタンス用に current_color を RGBA8 へ詰めておく（記録時に毎回変換しないため）
+    void DrawstuffApp::packColor()
+    {
+        for (int i = 0; i < 4; ++i)
+            current_color_rgba8_[i] = packUnorm8(current_color[i]);
     }
 
     void DrawstuffApp::setTexture(int texnum)
     {
+        // インスタンス描画はテクスチャ番号を見ないので，並列記録中は無視する
+        if (tlsRecorder_)
+            return;
         texture_id = texnum;
     }
 
@@ -476,15 +449,8 @@ namespace ds_internal
             return;
         }
 
-        if (texId == currentBoundTextureId_)
-        {
-            // すでに同じテクスチャが GL_TEXTURE0 にバインドされている
-            return;
-        }
-
-        glActiveTexture(GL_TEXTURE0);
-        texture[texId]->bind(0); // 内部で glBindTexture(GL_TEXTURE_2D, ...) している前提
-        currentBoundTextureId_ = texId;
+        // すでに同じテクスチャが GL_TEXTURE0 にバインドされていれば glState_ が省く
+        glState_.bindTexture2D(0, texture[texId]->id());
     }
 
     void DrawstuffApp::applyMaterials()
@@ -493,54 +459,62 @@ namespace ds_internal
 
         if (current_color[3] < 1)
         {
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glState_.enable(GL_BLEND);
+            glState_.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         }
         else
         {
-            glDisable(GL_BLEND);
+            glState_.disable(GL_BLEND);
         }
     }
 
     // ==============================================================
     // drawing functions
     // ==============================================================
+    // カメラ・光源・地面のパラメータをまとめて 1 回で送り，全シェーダ共通の結合点につなぐ
+    void DrawstuffApp::uploadFrameUniforms(const float eye[3])
+    {
+        FrameUniforms u;
+        u.proj = proj_;
+        u.view = view_;
+        u.viewProj = proj_ * view_;
+        u.shadowProject = shadowProject_;
+        u.eye = glm::vec4(eye[0], eye[1], eye[2], 1.0f);
+        u.lightDir = glm::vec4(lightDir_, 0.0f);
+        u.ground = glm::vec4(ground_scale, ground_ofsx, ground_ofsy, SHADOW_INTENSITY);
+        u.groundColor = glm::vec4(GROUND_R, GROUND_G, GROUND_B, 1.0f);
+
+        if (frameUniformBuffer_ == 0)
+            glGenBuffers(1, &frameUniformBuffer_);
+        // 前のフレームの描画を待たないよう，毎フレーム確保し直す（orphan）
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer_);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), &u, GL_STREAM_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, kFrameUniformBinding, frameUniformBuffer_);
+    }
+
     void DrawstuffApp::drawMeshBasic(
         const Mesh &mesh,
         const glm::mat4 &model,
         const glm::vec4 &color)
     {
-        glm::mat4 shadowMvp = proj_ * view_ * model;
-
-        glUseProgram(programBasic_);
-        glUniform3f(uLightDir_, lightDir_.x, lightDir_.y, lightDir_.z);
-        glUniformMatrix4fv(uMVP_, 1, GL_FALSE, glm::value_ptr(shadowMvp));
-        glUniform4fv(uColor_, 1, glm::value_ptr(color));
-        glUniformMatrix4fv(uModel_, 1, GL_FALSE, glm::value_ptr(model));
-
-        // テクスチャスケール（模様の大きさ）適当に調整
-        glUniform1f(uTexScale_, 0.5f); // 0.1〜2.0 くらいを試して好みで
-
-        // ★ テクスチャの ON/OFF
-        if (use_textures && texture[DS_WOOD]) // 例として木目テクスチャを使う場合
-        {
-            glUniform1i(uUseTex_, GL_TRUE);
-
-            glActiveTexture(GL_TEXTURE0);
+        // 投影・ビュー・光源は FrameUniforms から読む
+        // テクスチャの ON/OFF は変種で切り替える（例として木目テクスチャを使う）
+        const unsigned features = textureFeatures(texture[DS_WOOD] != nullptr);
+        useShader(basicShader_, features);
+        glState_.uniform4fv(basicShader_.location(features, BASIC_COLOR), glm::value_ptr(color));
+        glState_.uniformMatrix4fv(basicShader_.location(features, BASIC_MODEL), glm::value_ptr(model));
+        if (features & SHADER_TEXTURE)
             bindTextureUnit0(DS_WOOD);
-            glUniform1i(uTex_, 0);     // sampler2D uTex はテクスチャユニット0を参照
-        }
-        else
-        {
-            glUniform1i(uUseTex_, GL_FALSE);
-        }
-        glBindVertexArray(mesh.vao);
-        if (mesh.ebo != 0)
+
+        glState_.bindVertexArray(mesh.vao);
+        if (mesh.ebo != 0 || mesh.geometry != 0)
         {
-            glDrawElements(mesh.primitive,
-                           mesh.indexCount,
-                           GL_UNSIGNED_INT,
-                           nullptr);
+            glDrawElementsBaseVertex(mesh.primitive,
+                                     mesh.indexCount,
+                                     mesh.indexType,
+                                     mesh.indexOffset(),
+                                     mesh.baseVertex);
         }
         else
         {
@@ -549,9 +523,7 @@ namespace ds_internal
                          0,
                          mesh.indexCount);
         }
-        glBindVertexArray(0);
-
-        glUseProgram(0);
+        // VAO / program は次の描画がそのまま使えるよう戻さない（フレームの最後に戻す）
     }
 
     void DrawstuffApp::drawShadowMesh(
@@ -561,62 +533,45 @@ namespace ds_internal
         if (!use_shadows)
             return;
 
-        glm::mat4 shadowModel = shadowProject_ * model;
-        glm::mat4 mvp = proj_ * view_ * shadowModel;
+        useShadowProgram(model);
 
-        glUseProgram(programShadow_);
-
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LEQUAL);
+        glState_.bindVertexArray(mesh.vao);
+        if (mesh.ebo != 0 || mesh.geometry != 0) {
+            glDrawElementsBaseVertex(mesh.primitive, mesh.indexCount,
+                                     mesh.indexType, mesh.indexOffset(), mesh.baseVertex);
+        }
+        else {
+            glDrawArrays(mesh.primitive, 0, mesh.indexCount);
+        }
 
-        glEnable(GL_POLYGON_OFFSET_FILL);
-        glPolygonOffset(-1.0f, -1.0f);
+        glState_.disable(GL_POLYGON_OFFSET_FILL);
+    }
 
-        glDisable(GL_BLEND); // ここは「上書き型の影」でいく前提
+    // shadowShader_ と影用の状態（深度・ポリゴンオフセット・ブレンドなし）を設定する
+    void DrawstuffApp::useShadowProgram(const glm::mat4 &model)
+    {
+        // テクスチャあり：旧 setShadowDrawingMode の「if (use_textures)」相当
+        const unsigned features = textureFeatures(texture[DS_GROUND] != nullptr);
+        useShader(shadowShader_, features);
 
-        // 行列・共通パラメータ
-        glUniformMatrix4fv(uShadowMVP_, 1, GL_FALSE, glm::value_ptr(mvp));
-        glUniformMatrix4fv(uShadowModel_, 1, GL_FALSE, glm::value_ptr(shadowModel));
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LEQUAL);
 
-        glUniform2f(uGroundScale_, ground_scale, ground_scale);
-        glUniform2f(uGroundOffset_, ground_ofsx, ground_ofsy);
-        glUniform1f(uShadowIntensity_, SHADOW_INTENSITY);
+        glState_.enable(GL_POLYGON_OFFSET_FILL);
+        glState_.polygonOffset(-1.0f, -1.0f);
 
-        if (use_textures)
-        {
-            // ★ テクスチャあり：旧 setShadowDrawingMode の「if (use_textures)」相当
-            glUniform1i(uShadowUseTex_, GL_TRUE);
+        glState_.disable(GL_BLEND); // ここは「上書き型の影」でいく前提
 
-            glActiveTexture(GL_TEXTURE0);
+        // 影への投影・地面テクスチャの座標・影の濃さ・地面色は FrameUniforms にある
+        glState_.uniformMatrix4fv(shadowShader_.location(features, SHADOW_MODEL), glm::value_ptr(model));
+        if (features & SHADER_TEXTURE)
             bindTextureUnit0(DS_GROUND);
-            glUniform1i(uGroundTex_, 0);
-        }
-        else
-        {
-            // ★ テクスチャなし：旧コードの else 分岐相当
-            glUniform1i(uShadowUseTex_, GL_FALSE);
-            // GROUND_R/G/B は既存の地面色定数を流用
-            glUniform3f(uGroundColor_, GROUND_R, GROUND_G, GROUND_B);
-        }
-
-        glBindVertexArray(mesh.vao);
-        if (mesh.ebo != 0) {
-            glDrawElements(mesh.primitive, mesh.indexCount,
-                           GL_UNSIGNED_INT, nullptr);
-        }
-        else {
-            glDrawArrays(mesh.primitive, 0, mesh.indexCount);
-        }
-        glBindVertexArray(0);
-
-        glDisable(GL_POLYGON_OFFSET_FILL);
-        glUseProgram(0);
     }
 
-    void DrawstuffApp::drawSky(const float view_xyz[3])
+    void DrawstuffApp::drawSky()
     {
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LEQUAL);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LEQUAL);
 
         initSkyProgram();
         initSkyMesh();
@@ -627,113 +582,73 @@ namespace ds_internal
         if (offset > 1.0f)
             offset -= 1.0f;
 
-        // モデル行列：
-        //   カメラ位置に合わせて xy をシフト、
-        //   z は view_xyz[2] + sky_height の高さに。
-        glm::mat4 model(1.0f);
-        model = glm::translate(
-            model,
-            glm::vec3(view_xyz[0],
-                      view_xyz[1],
-                      view_xyz[2] + sky_height));
-
-        glm::mat4 mvp = proj_ * view_ * model;
-
         // 「最奥にだけ書く」ための depth range
-        glDepthRange(1, 1);
+        glState_.depthRange(1, 1);
 
-        glUseProgram(programSky_);
-        glBindVertexArray(vaoSky_);
+        const unsigned features = textureFeatures(texture[DS_SKY] != nullptr);
+        useShader(skyShader_, features);
+        glState_.bindVertexArray(vaoSky_);
 
-        glUniformMatrix4fv(uSkyMVP_, 1, GL_FALSE, glm::value_ptr(mvp));
+        // カメラ位置に合わせて xy をシフト、z は視点 + sky_height の高さに（視点は FrameUniforms）
+        glState_.uniform1f(skyShader_.location(features, SKY_HEIGHT), sky_height);
 
-        // 空色（テクスチャなしのとき用・あるいはテクスチャの色乗算）
+        // 空色（テクスチャなしのとき用）
         glm::vec4 skyColor(0.0f, 0.5f, 1.0f, 1.0f);
-        glUniform4fv(uSkyColor_, 1, glm::value_ptr(skyColor));
+        glState_.uniform4fv(skyShader_.location(features, SKY_COLOR), glm::value_ptr(skyColor));
 
-        glUniform1f(uSkyScale_, sky_scale);
-        glUniform1f(uSkyOffset_, offset);
+        glState_.uniform1f(skyShader_.location(features, SKY_SCALE), sky_scale);
+        glState_.uniform1f(skyShader_.location(features, SKY_OFFSET), offset);
 
-        if (use_textures)
-        {
-            glUniform1i(uSkyUseTex_, 1);    // テクスチャを使う
+        if (features & SHADER_TEXTURE)
             bindTextureUnit0(DS_SKY);
-            glUniform1i(uSkyTex_, 0); // sampler2D uTex にユニット 0 を対応付け
-        }
-        else
-        {
-            glUniform1i(uSkyUseTex_, 0); // テクスチャは使わない
-            glUniform1i(uSkyTex_, 0);    // sampler2D uTex にユニット 0 を対応付け
-        }
 
         glDrawArrays(GL_TRIANGLES, 0, 6);
 
-        glBindVertexArray(0);
-        glUseProgram(0);
-
         // depth 状態を元に戻す
-        glDepthFunc(GL_LESS);
-        glDepthRange(0, 1);
+        glState_.depthFunc(GL_LESS);
+        glState_.depthRange(0, 1);
     }
 
     void DrawstuffApp::drawGround()
     {
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LESS);
 
         initGroundMesh();
 
-        glm::mat4 model(1.0f);
-        glm::mat4 mvp = proj_ * view_ * model;
-
-        glUseProgram(programGround_);
-        glBindVertexArray(vaoGround_);
-
-        glUniformMatrix4fv(uGroundModel_, 1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(uGroundMVP_, 1, GL_FALSE, glm::value_ptr(mvp));
+        // 行列と地面テクスチャの座標は FrameUniforms から読む
+        const unsigned features = textureFeatures(texture[DS_GROUND] != nullptr);
+        useShader(groundShader_, features);
+        glState_.bindVertexArray(vaoGround_);
 
         glm::vec4 groundColor;
-        if (use_textures) {
+        if (features & SHADER_TEXTURE) {
             groundColor = glm::vec4(1.0f);
-            glUniform1i(uGroundUseTex_, 1); // テクスチャ有効
 
             // テクスチャをユニット0に bind
             bindTextureUnit0(DS_GROUND);
-            glUniform1i(uGroundTex_, 0);
         }
         else
         {
             groundColor = glm::vec4(GROUND_R, GROUND_G, GROUND_B, 1.0f);
-            glUniform1i(uGroundUseTex_, 0); // テクスチャ無効
         }
-        glUniform4fv(uGroundColor_, 1, glm::value_ptr(groundColor));
-
-        // 元のパラメータを uniform で渡す
-        glUniform1f(uGroundScale_, ground_scale);
-        glUniform2f(uGroundOffset_, ground_ofsx, ground_ofsy);
+        glState_.uniform4fv(groundShader_.location(features, GROUND_COLOR), glm::value_ptr(groundColor));
 
         glDrawArrays(GL_TRIANGLES, 0, 6);
-
-        glBindVertexArray(0);
-        glUseProgram(0);
     }
 
     void DrawstuffApp::drawPyramidGrid()
     {
         // 深度テストは有効にしておく
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LESS);
 
-        // 共通描画状態（programBasic_, uLightDir, など）
+        // 共通描画状態（ブレンドなど）
         applyMaterials();
 
         // ピラミッド Mesh を必要に応じて初期化
         initPyramidMesh();
 
-        // 補助オブジェクトなのでテクスチャは明示的に OFF にしておく
-        // （drawMeshBasic の実装によっては不要だが、元挙動に合わせて上書き）
-        glUniform1i(uUseTex_, 0);
-
         const float kScale = 0.03f; // 元コードの k に相当
 
         for (int i = -1; i <= 1; ++i)
@@ -763,347 +678,833 @@ namespace ds_internal
                 // if (use_shadows) { drawShadowMesh(meshPyramid_, model); }
             }
         }
-
-        // drawMeshBasic 側で VAO / program を片付ける設計なら、ここでの後処理は不要。
-        // 念のため状態を戻したいなら以下を入れてもよい。
-        // glBindVertexArray(0);
-        // glUseProgram(0);
     }
 
-    void DrawstuffApp::drawTriangleCore(const glm::vec3 p[3],
-                                        const glm::vec3 &N,
-                                        const glm::mat4 &model,
-                                        const bool solid)
+    // ==============================================================
+    // instanced drawing functions
+    // ==============================================================
+    // インスタンス属性（location 2..5）の有効化と divisor 設定。
+    // 参照先のバッファとオフセットは描画範囲ごとに bindInstanceRange() で差し替える。
+    void DrawstuffApp::setupInstanceAttributes(const GLuint vao)
     {
-        VertexPN tri[3];
-        tri[0].pos = p[0];
-        tri[1].pos = p[1];
-        tri[2].pos = p[2];
-        tri[0].normal = N;
-        tri[1].normal = N;
-        tri[2].normal = N;
-
-        // 三角形メッシュの VBO を更新
-        glBindBuffer(GL_ARRAY_BUFFER, meshTriangle_.vbo);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(tri), tri);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(vao);
 
-        // あとは他のプリミティブと同じ「基本パイプライン」に投げる
-        if (!solid) {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        }
-        drawMeshBasic(meshTriangle_, model, current_color);
-        if (!solid) {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        // layout(location = 2) vec3 iPos, 3) vec4 iRot, 4) vec3 iScale, 5) vec4 iColor
+        for (GLuint loc = 2; loc <= 5; ++loc)
+        {
+            glEnableVertexAttribArray(loc);
+            glVertexAttribDivisor(loc, 1); // ★ インスタンスごとに 1 つ進める
         }
 
-        // 影（Core パス）
-        if (use_shadows && solid) {
-            drawShadowMesh(meshTriangle_, model);
-        }
+        glBindVertexArray(0);
     }
 
-    void DrawstuffApp::drawTrianglesBatch(
-        const std::vector<VertexPN> &verts,
-        const glm::mat4 &model,
-        const bool solid)
+    // 現在の VAO のインスタンス属性を range の位置に向ける
+    void DrawstuffApp::bindInstanceRange(const InstanceRange &range)
     {
-        if (verts.empty())
-            return;
+        const GLsizei stride = static_cast<GLsizei>(sizeof(InstanceCompact));
+        const std::size_t base = static_cast<std::size_t>(range.offset);
+
+        glBindBuffer(GL_ARRAY_BUFFER, range.buffer);
+
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, pos)));
+        // 四元数は snorm16 → [-1,1] に正規化して受け取る
+        glVertexAttribPointer(3, 4, GL_SHORT, GL_TRUE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, rot)));
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, scale)));
+        glVertexAttribPointer(5, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, color)));
+    }
 
-        const std::size_t needed = verts.size();
+    // bucket に溜まったインスタンスを meshes[quality] でまとめて描く（1 範囲 = 1 draw，LOD の段数ごとに範囲が分かれる）
+    void DrawstuffApp::drawInstancedBucket(const Mesh *meshes, const int quality, const int bucket,
+                                           const bool shadow)
+    {
+        // インポスタで描く bucket は drawImpostorBuckets() が四角形で描く
+        if (impostor_[bucket] && meshes != &meshImpostorQuad_)
+            return;
+        const Mesh &mesh = meshes[quality];
+        // GPU カリング時は選別済みの出力バッファから描く（保持型も含む）
+        if (gpuCulled_)
+        {
+            InstanceRange culled;
+            if (!gpuCuller_.output(bucket, shadow, culled))
+                return;
+            glState_.bindVertexArray(mesh.vao);
+            bindInstanceRange(culled);
+            gpuCuller_.drawElements(mesh, bucket, shadow);
+            return;
+        }
 
-        glBindBuffer(GL_ARRAY_BUFFER, meshTrianglesBatch_.vbo);
+        const std::vector<InstanceRange> &ranges =
+            shadow ? instanceArena_.shadowRanges(bucket) : instanceArena_.ranges(bucket);
+        InstanceRange retained;
+        const bool hasRetained = instancePool_.range(bucket, retained);
+        if (ranges.empty() && !hasRetained)
+            return;
 
-        // 必要ならバッファサイズを拡張
-        if (needed > trianglesBatchCapacity_)
+        // 保持型インスタンス（GPU に常駐）→ このフレームの即時描画分の順
+        if (hasRetained)
+            drawMeshInstances(mesh, retained);
+        for (const InstanceRange &r : ranges)
         {
-            trianglesBatchCapacity_ = needed;
-            glBufferData(GL_ARRAY_BUFFER,
-                         trianglesBatchCapacity_ * sizeof(VertexPN),
-                         nullptr,
-                         GL_DYNAMIC_DRAW);
+            // LOD で粗くした範囲は対応する quality のメッシュ（同じ VAO の別の場所）
+            // （quality 0 は 1 種類しかないメッシュ：箱やインポスタ）
+            const Mesh &m = (r.lod == 0 || quality == 0) ? mesh : meshes[std::max(1, quality - r.lod)];
+            drawMeshInstances(m, r);
         }
+    }
 
-        // 実データを先頭から詰める
-        glBufferSubData(GL_ARRAY_BUFFER,
-                        0,
-                        needed * sizeof(VertexPN),
-                        verts.data());
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    void DrawstuffApp::drawMeshInstances(const Mesh &mesh, const InstanceRange &r)
+    {
+        if (multiDrawActive_ && mesh.geometry != 0)
+        {
+            multiDraw_.add(mesh, r);
+            return;
+        }
+        glState_.bindVertexArray(mesh.vao);
+        bindInstanceRange(r);
+        glDrawElementsInstancedBaseVertex(mesh.primitive, mesh.indexCount, mesh.indexType, mesh.indexOffset(),
+                                          r.count, mesh.baseVertex);
+    }
 
-        meshTrianglesBatch_.indexCount =
-            static_cast<GLsizei>(needed); // 頂点数として使う
+    // ==============================================================
+    // multi-draw-indirect（GL 4.3）
+    // ==============================================================
+    void DrawstuffApp::beginMultiDraw()
+    {
+        multiDrawActive_ = multiDrawEnabled_ && multiDraw_.ready();
+    }
 
-        // 本体
-        if (!solid)
+    // 積んだコマンドを送り，インスタンスバッファごとに属性を向け直して 1 回ずつ描く
+    void DrawstuffApp::endMultiDraw()
+    {
+        if (!multiDrawActive_)
+            return;
+        multiDrawActive_ = false;
+        if (multiDraw_.empty())
+            return;
+        multiDraw_.upload();
+        glState_.bindVertexArray(geometryArena_.vao());
+        for (std::size_t i = 0; i < multiDraw_.groupCount(); ++i)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            bindInstanceRange(multiDraw_.groupRange(i));
+            multiDraw_.drawGroup(i);
         }
-        drawMeshBasic(meshTrianglesBatch_, model, current_color);
-        if (!solid)
+    }
+
+    DrawstuffApp::MultiDrawStats DrawstuffApp::multiDrawStats() const
+    {
+        MultiDrawStats s;
+        s.active = multiDrawEnabled_ && multiDraw_.ready();
+        s.commands = multiDraw_.lastCommands();
+        s.draws = multiDraw_.lastDraws();
+        return s;
+    }
+
+    DrawstuffApp::GeometryStats DrawstuffApp::geometryStats() const
+    {
+        GeometryStats s;
+        s.vertices = geometryArena_.usedVertices();
+        s.indices = geometryArena_.usedIndices();
+        s.usedBytes = geometryArena_.usedVertices() * sizeof(VertexPacked) + geometryArena_.usedIndexBytes();
+        s.reservedBytes = geometryArena_.capacityVertices() * sizeof(VertexPacked) +
+                          geometryArena_.capacityIndexBytes();
+        s.maxNormalError = geometryArena_.maxNormalError();
+        return s;
+    }
+
+    // インポスタとして描く形（bucket ごとの単位メッシュに合わせる）
+    //   shape      : 0 = 球，1 = 両端を塞いだ円柱，2 = カプセル
+    //   halfLength : 円柱・平行部の半分の長さ（scale.z の何倍か）
+    struct ImpostorShape
+    {
+        int shape;
+        float halfLength;
+    };
+    static ImpostorShape impostorShape(const int bucket)
+    {
+        switch (bucket)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        case BUCKET_CYLINDER:
+            return {1, 0.5f}; // z ∈ [-0.5, 0.5]
+        case BUCKET_CAPSULE:
+            return {2, 1.0f}; // 平行部 z ∈ [-1, 1]
+        default:
+            return {0, 0.0f};
         }
+    }
+
+    // インポスタ指定の bucket を四角形で描く。テクスチャは呼び出し側で unit 0 に bind 済み
+    void DrawstuffApp::drawImpostorBuckets(const bool shadow)
+    {
+        if (std::none_of(std::begin(impostor_), std::end(impostor_), [](bool b) { return b; }))
+            return;
+
+        ShaderPermutation &shader = shadow ? shadowImpostorShader_ : impostorShader_;
+        const unsigned features = textureFeatures(texture[shadow ? DS_GROUND : DS_WOOD] != nullptr);
+        useShader(shader, features);
+        const GLint uShape = shader.location(features, IMPOSTOR_SHAPE);
+        const GLint uHalfLength = shader.location(features, IMPOSTOR_HALF_LENGTH);
 
-        // 影
-        if (use_shadows && solid)
+        for (int b = 0; b < BUCKET_COUNT; ++b)
         {
-            drawShadowMesh(meshTrianglesBatch_, model);
+            if (!impostor_[b])
+                continue;
+            const ImpostorShape s = impostorShape(b);
+            glState_.uniform1i(uShape, s.shape);
+            glState_.uniform1f(uHalfLength, s.halfLength);
+            drawInstancedBucket(&meshImpostorQuad_, 0, b, shadow);
         }
     }
-    
+
     // ==============================================================
-    // instanced drawing functions
+    // 半透明インスタンス
     // ==============================================================
-    void uploadInstanceBuffer(GLuint &vbo, const std::vector<InstanceBasic> &instances)
+    void DrawstuffApp::setTransparency(const int mode)
     {
-        if (vbo == 0)
+        if (mode != TRANSPARENCY_SORTED && mode != TRANSPARENCY_WEIGHTED)
+            fatalError("dsSetTransparency: unknown mode %d", mode);
+        transparencyMode_ = mode;
+    }
+
+    void DrawstuffApp::drawTransparentRange(const int bucket, const InstanceRange &r, const bool shadow,
+                                            const unsigned features)
+    {
+        const Mesh *mesh;
+        if (impostor_[bucket])
         {
-            // 念のため。初期化し忘れていた場合に備えるならこう。
-            glGenBuffers(1, &vbo);
+            ShaderPermutation &shader = shadow ? shadowImpostorShader_ : impostorShader_;
+            useShader(shader, features);
+            const ImpostorShape s = impostorShape(bucket);
+            glState_.uniform1i(shader.location(features, IMPOSTOR_SHAPE), s.shape);
+            glState_.uniform1f(shader.location(features, IMPOSTOR_HALF_LENGTH), s.halfLength);
+            mesh = &meshImpostorQuad_;
         }
-
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-
-        const GLsizeiptr bytes =
-            static_cast<GLsizeiptr>(instances.size() * sizeof(InstanceBasic));
-
-        // インスタンスが0個のときでも、一応バッファサイズ0で呼んでおくか、
-        // 早期returnするかは好み。ここではそのまま流す。
-        glBufferData(
-            GL_ARRAY_BUFFER,
-            bytes,
-            instances.empty() ? nullptr : instances.data(),
-            GL_STREAM_DRAW); // 毎フレーム書き換えるので STREAM_DRAW / DYNAMIC_DRAW が無難
+        else
+        {
+            useShader(shadow ? shadowInstancedShader_ : basicInstancedShader_, features);
+            // 列は LOD を選ばないので，設定どおり（影は影用）の品質で描く
+            switch (bucket)
+            {
+            case BUCKET_SPHERE:
+                mesh = &meshSphere_[shadow ? shadow_sphere_quality : sphere_quality];
+                break;
+            case BUCKET_CYLINDER:
+                mesh = &meshCylinder_[shadow ? shadow_cylinder_quality : cylinder_quality];
+                break;
+            case BUCKET_CAPSULE:
+                mesh = &meshCapsule_[shadow ? shadow_cylinder_quality : capsule_quality];
+                break;
+            default:
+                mesh = &meshBox_;
+                break;
+            }
+        }
+        drawMeshInstances(*mesh, r);
     }
 
-
-    // DrawstuffApp のメンバ関数として
-    void DrawstuffApp::setupSphereInstanceAttributes()
+    // 影は重ねる順によらないので bucket ごとに 1 回。状態は影パスのものをそのまま使う
+    void DrawstuffApp::drawTransparentShadows()
     {
-        // インスタンス用 VBO がまだなければ作る
-        if (g_sphereInstanceVBO == 0)
+        const unsigned features = textureFeatures(texture[DS_GROUND] != nullptr);
+        for (int b = 0; b < BUCKET_COUNT; ++b)
         {
-            glGenBuffers(1, &g_sphereInstanceVBO);
+            InstanceRange r;
+            if (transparentQueue_.range(b, r))
+                drawTransparentRange(b, r, true, features);
         }
+    }
 
-        const GLsizei stride = static_cast<GLsizei>(sizeof(InstanceBasic));
+    // 深度は読むだけ（書かない）。並べ替えた場合は遠い順の run ごとに，
+    // 重み付き OIT なら bucket ごとに 1 回ずつ溜めてから画面へ合成する
+    void DrawstuffApp::drawTransparentInstances(const int width, const int height)
+    {
+        if (transparentQueue_.empty())
+            return;
 
-        // 品質ごとに VAO へ同じインスタンス属性を設定
-        for (int sphere_quality_ = 1; sphere_quality_ <= 3; ++sphere_quality_)
+        const bool weighted = (transparencyMode_ == TRANSPARENCY_WEIGHTED && weightedOit_.ready());
+        if (weighted)
         {
-            Mesh &mesh = meshSphere_[sphere_quality_];
+            // FBO とテクスチャを直接触るので，覚えている状態は捨てる
+            weightedOit_.begin(width, height);
+            glState_.invalidate();
+        }
+
+        unsigned features = textureFeatures(texture[DS_WOOD] != nullptr);
+        if (features & SHADER_TEXTURE)
+            bindTextureUnit0(DS_WOOD);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LESS);
+        glState_.depthMask(false);
+        glState_.enable(GL_BLEND);
 
-            if (mesh.vao == 0)
+        if (weighted)
+        {
+            features |= SHADER_WEIGHTED_OIT;
+            glState_.blendFunc(GL_ONE, GL_ONE);
+            for (int b = 0; b < BUCKET_COUNT; ++b)
             {
-                // まだメッシュが初期化されていない場合はスキップ
-                continue;
+                InstanceRange r;
+                if (transparentQueue_.range(b, r))
+                    drawTransparentRange(b, r, false, features);
             }
+            glState_.depthMask(true);
+            weightedOit_.composite();
+            glState_.invalidate();
+        }
+        else
+        {
+            glState_.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            for (const TransparentQueue::Run &run : transparentQueue_.sortedRuns())
+                drawTransparentRange(run.bucket, run.range, false, features);
+            glState_.depthMask(true);
+        }
+    }
 
-            glBindVertexArray(mesh.vao);
-
-            // この VAO に対して「インスタンス用 VBO を使う」設定を記録する
-            glBindBuffer(GL_ARRAY_BUFFER, g_sphereInstanceVBO);
+    // ==============================================================
+    // 並列記録
+    // ==============================================================
+    void DrawstuffApp::beginParallelDraw(const int slot)
+    {
+        if (current_state != SIM_STATE_DRAWING)
+            fatalError("dsBeginParallelDraw: must be called from within the step() callback");
+        if (slot < 0 || slot >= kMaxParallelDrawSlots)
+            fatalError("dsBeginParallelDraw: slot %d out of range [0, %d)", slot, kMaxParallelDrawSlots);
+        if (tlsRecorder_)
+            fatalError("dsBeginParallelDraw: already recording on this thread");
+
+        // 同じスロットを同時に複数スレッドで使わない限り，配列要素ごとの生成は競合しない
+        std::unique_ptr<ParallelRecorder> &rec = parallelRecorders_[slot];
+        if (!rec)
+            rec = std::make_unique<ParallelRecorder>();
+
+        // 色は毎回白から始める（メインスレッドの現在色は読まない）
+        rec->color = glm::vec4(1.0f);
+        std::memset(rec->color_rgba8, 255, 4);
+        tlsRecorder_ = rec.get();
+    }
 
-            std::size_t offset = 0;
+    void DrawstuffApp::endParallelDraw()
+    {
+        if (!tlsRecorder_)
+            fatalError("dsEndParallelDraw: called without dsBeginParallelDraw on this thread");
+        tlsRecorder_ = nullptr;
+    }
 
-            // layout(location = 2..5) mat4 iModel
-            for (int i = 0; i < 4; ++i)
+    // step() の後（ワーカーがすべて dsEndParallelDraw 済み）にメインスレッドで呼ぶ。
+    // メインスレッドが直接書いた分の後ろに，スロット番号順で連結する。
+    void DrawstuffApp::mergeParallelRecorders()
+    {
+        for (std::unique_ptr<ParallelRecorder> &rec : parallelRecorders_)
+        {
+            if (!rec)
+                continue;
+            for (int b = 0; b < BUCKET_COUNT; ++b)
             {
-                const GLuint loc = 2 + i;
-                glEnableVertexAttribArray(loc);
-                glVertexAttribPointer(
-                    loc,
-                    4,
-                    GL_FLOAT,
-                    GL_FALSE,
-                    stride,
-                    reinterpret_cast<const void *>(offset));
-
-                // ★ インスタンスごとに 1 つ進める
-                glVertexAttribDivisor(loc, 1);
-
-                offset += sizeof(glm::vec4);
+                std::vector<InstanceCompact> &v = rec->instances[b];
+                if (!v.empty())
+                {
+                    std::memcpy(instanceArena_.allocate(b, v.size()), v.data(),
+                                v.size() * sizeof(InstanceCompact));
+                    v.clear(); // 容量は次フレームのために残す
+                }
+                std::vector<InstanceCompact> &t = rec->transparent[b];
+                if (!t.empty())
+                {
+                    std::memcpy(transparentQueue_.allocate(b, t.size()), t.data(),
+                                t.size() * sizeof(InstanceCompact));
+                    t.clear();
+                }
             }
-
-            // layout(location = 6) vec4 iColor
-            glEnableVertexAttribArray(6);
-            glVertexAttribPointer(
-                6,
-                4,
-                GL_FLOAT,
-                GL_FALSE,
-                stride,
-                reinterpret_cast<const void *>(offsetof(InstanceBasic, color)));
-            glVertexAttribDivisor(6, 1);
         }
-
-        // 後始末（どの VAO も bind されていない状態に戻す）
-        glBindVertexArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
-    void DrawstuffApp::setupBoxInstanceAttributes()
+    // ==============================================================
+    // 保持型インスタンス
+    // ==============================================================
+    void DrawstuffApp::setInstanceColor(const std::uint32_t id,
+                                        const float r, const float g, const float b, const float alpha)
     {
-        glBindVertexArray(meshBox_.vao);
+        checkNotParallel("dsSetInstanceColor");
+        requireRetained("dsSetInstanceColor", id);
 
-        // インスタンス用 VBO をバインド
-        glBindBuffer(GL_ARRAY_BUFFER, g_boxInstanceVBO);
+        const std::uint8_t rgba[4] = {packUnorm8(r), packUnorm8(g), packUnorm8(b), packUnorm8(alpha)};
+        std::memcpy(instancePool_.edit(id)->color, rgba, 4);
+        instancePool_.setTranslucent(id, rgba[3] < 255);
+    }
 
-        GLsizei stride = sizeof(InstanceBasic);
-        std::size_t offset = 0;
+    void DrawstuffApp::destroyInstance(const std::uint32_t id)
+    {
+        checkNotParallel("dsDestroyInstance");
+        requireRetained("dsDestroyInstance", id);
+        instancePool_.destroy(id);
+    }
 
-        // layout(location = 2..5) mat4 iModel
-        for (int i = 0; i < 4; ++i)
-        {
-            GLuint loc = 2 + i;
-            glEnableVertexAttribArray(loc);
-            glVertexAttribPointer(
-                loc,
-                4,
-                GL_FLOAT,
-                GL_FALSE,
-                stride,
-                reinterpret_cast<const void *>(offset));
-            glVertexAttribDivisor(loc, 1); // ★ インスタンスごとに1回進める
-            offset += sizeof(glm::vec4);
-        }
-
-        // layout(location = 6) vec4 iColor
-        glEnableVertexAttribArray(6);
-        glVertexAttribPointer(
-            6,
-            4,
-            GL_FLOAT,
-            GL_FALSE,
-            stride,
-            reinterpret_cast<const void *>(offsetof(InstanceBasic, color)));
-        glVertexAttribDivisor(6, 1);
+    // ==============================================================
+    // Convex のキャッシュ
+    // ==============================================================
+    void DrawstuffApp::setConvexCache(const int mode)
+    {
+        if (mode < CONVEX_CACHE_OFF || mode > CONVEX_CACHE_POINTER)
+            fatalError("dsSetConvexCache: unknown mode %d", mode);
+        // キーの作り方が変わるので，前の形は使われなくなって追い出される
+        convexCacheMode_ = mode;
+    }
 
-        glBindVertexArray(0);
+    // convexVerts_ / convexIndices_ の分割結果を key の形として登録する
+    std::vector<InstanceCompact> *DrawstuffApp::addConvexMesh(const std::uint64_t key)
+    {
+        MeshPN mesh;
+        mesh.vertices.swap(convexVerts_);
+        mesh.indices.swap(convexIndices_);
+        std::vector<InstanceCompact> *list = convexCache_.add(key, mesh);
+        // 作業領域は呼び出し側（キャッシュできなかったときの従来経路）でまだ使う
+        mesh.vertices.swap(convexVerts_);
+        mesh.indices.swap(convexIndices_);
+        return list;
     }
-    // どこかにある前提
-    // extern GLuint g_cylinderInstanceVBO;
-    // extern Mesh   meshCylinder_[/* quality index */];
 
-    void DrawstuffApp::setupCylinderInstanceAttributes()
+    // 本描画と影で同じメッシュ・同じ範囲を使う（影はプログラム側で地面へ潰す）
+    void DrawstuffApp::drawConvexInstances()
     {
-        // インスタンス用 VBO がまだなければ作る
-        if (g_cylinderInstanceVBO == 0)
+        for (std::size_t i = 0; i < convexCache_.size(); ++i)
         {
-            glGenBuffers(1, &g_cylinderInstanceVBO);
+            InstanceRange r;
+            if (!convexCache_.range(i, r))
+                continue;
+            drawMeshInstances(convexCache_.mesh(i), r);
         }
+    }
 
-        const GLsizei stride = static_cast<GLsizei>(sizeof(InstanceBasic));
-
-        // 品質ごとに VAO へ同じインスタンス属性を設定
-        // ※ 範囲 1..3 はあなたの環境に合わせて変更可
-        for (int cylinder_quality_ = 1; cylinder_quality_ <= 3; ++cylinder_quality_)
+    // ==============================================================
+    // 即時描画の三角形・線
+    // ==============================================================
+    // 即時描画の頂点バッファの最小容量（バイト数）
+    constexpr std::size_t kMinStreamCapacity = 4096 * sizeof(VertexStream);
+
+    // step() 中に積んだ三角形・線を 1 本のバッファへ詰めて，
+    // 影（塗り潰しの三角形と線）→ 不透明 → 半透明 の順に種類ごとに 1 回ずつ描く。
+    // 三角形（VertexFlat）を先頭に，線（VertexStream）はその後ろの sizeof(VertexStream) の倍数の位置から詰める
+    // （線の VAO はバッファの先頭を指したままで，first だけずらして描ける）
+    void DrawstuffApp::drawStreamBatches()
+    {
+        std::size_t first[STREAM_BATCH_COUNT][2];
+        std::size_t triangles = 0;
+        for (int kind = 0; kind < STREAM_BATCH_COUNT; ++kind)
         {
-            Mesh &mesh = meshCylinder_[cylinder_quality_];
+            for (int alpha = 0; alpha < 2; ++alpha)
+            {
+                first[kind][alpha] = triangles;
+                triangles += stream_[kind][alpha].size();
+            }
+        }
+        const std::size_t lineStride = sizeof(VertexStream);
+        const std::size_t lineBase = (triangles * sizeof(VertexFlat) + lineStride - 1) / lineStride;
+        const std::size_t firstLine[2] = {lineBase, lineBase + streamLines_[0].size()};
+        const std::size_t lines = streamLines_[0].size() + streamLines_[1].size();
+        if (triangles == 0 && lines == 0)
+            return;
 
-            if (mesh.vao == 0)
+        // ---- アップロード：毎フレーム確保し直して（orphan）前のフレームの描画を待たない ----
+        const std::size_t bytes = (lineBase + lines) * lineStride;
+        if (bytes > streamCapacity_)
+            streamCapacity_ = std::max(kMinStreamCapacity, bytes + bytes / 2);
+        glBindBuffer(GL_ARRAY_BUFFER, meshStream_.vbo);
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(streamCapacity_), nullptr, GL_STREAM_DRAW);
+        for (int kind = 0; kind < STREAM_BATCH_COUNT; ++kind)
+        {
+            for (int alpha = 0; alpha < 2; ++alpha)
             {
-                // まだメッシュが初期化されていない場合はスキップ
-                continue;
+                const std::vector<VertexFlat> &v = stream_[kind][alpha];
+                if (v.empty())
+                    continue;
+                glBufferSubData(GL_ARRAY_BUFFER,
+                                static_cast<GLintptr>(first[kind][alpha] * sizeof(VertexFlat)),
+                                static_cast<GLsizeiptr>(v.size() * sizeof(VertexFlat)),
+                                v.data());
             }
+        }
+        for (int alpha = 0; alpha < 2; ++alpha)
+        {
+            const std::vector<VertexStream> &v = streamLines_[alpha];
+            if (v.empty())
+                continue;
+            glBufferSubData(GL_ARRAY_BUFFER,
+                            static_cast<GLintptr>(firstLine[alpha] * lineStride),
+                            static_cast<GLsizeiptr>(v.size() * lineStride),
+                            v.data());
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-            glBindVertexArray(mesh.vao);
+        // 線幅（対応状況は GPU 依存だが、指定するだけしておく）
+        glState_.lineWidth(2.0f);
 
-            // この VAO に対して「インスタンス用 VBO を使う」設定を記録する
-            glBindBuffer(GL_ARRAY_BUFFER, g_cylinderInstanceVBO);
+        // ---- 影：頂点はワールド座標なのでモデル行列は単位行列 ----
+        // 不透明と半透明は隣り合っているので，種類ごとに 1 回で描ける
+        if (use_shadows)
+        {
+            useShadowProgram(glm::mat4(1.0f));
+            const std::size_t solid = stream_[STREAM_SOLID][0].size() + stream_[STREAM_SOLID][1].size();
+            if (solid > 0)
+            {
+                glState_.bindVertexArray(meshStream_.vao);
+                glDrawArrays(GL_TRIANGLES, static_cast<GLint>(first[STREAM_SOLID][0]), static_cast<GLsizei>(solid));
+            }
+            if (lines > 0)
+            {
+                glState_.bindVertexArray(meshStreamLines_.vao);
+                glDrawArrays(GL_LINES, static_cast<GLint>(firstLine[0]), static_cast<GLsizei>(lines));
+            }
+            glState_.disable(GL_POLYGON_OFFSET_FILL);
+            glState_.depthFunc(GL_LESS);
+        }
 
-            std::size_t offset = 0;
+        // ---- 本体：三角形は FLAT_NORMAL の変種，線は法線付きの変種 ----
+        const unsigned features = textureFeatures(texture[DS_WOOD] != nullptr);
+        if (features & SHADER_TEXTURE)
+            bindTextureUnit0(DS_WOOD);
 
-            // layout(location = 2..5) mat4 iModel
-            for (int i = 0; i < 4; ++i)
+        for (int alpha = 0; alpha < 2; ++alpha)
+        {
+            if (alpha == 0)
+            {
+                glState_.disable(GL_BLEND);
+            }
+            else
+            {
+                glState_.enable(GL_BLEND);
+                glState_.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            }
+            if (!stream_[STREAM_SOLID][alpha].empty() || !stream_[STREAM_WIRE][alpha].empty())
+            {
+                useShader(streamShader_, features | SHADER_FLAT_NORMAL);
+                glState_.bindVertexArray(meshStream_.vao);
+                for (int kind = 0; kind < STREAM_BATCH_COUNT; ++kind)
+                {
+                    const std::size_t n = stream_[kind][alpha].size();
+                    if (n == 0)
+                        continue;
+                    if (kind == STREAM_WIRE)
+                        glState_.polygonMode(GL_LINE);
+                    glDrawArrays(GL_TRIANGLES, static_cast<GLint>(first[kind][alpha]), static_cast<GLsizei>(n));
+                    if (kind == STREAM_WIRE)
+                        glState_.polygonMode(GL_FILL);
+                }
+            }
+            if (!streamLines_[alpha].empty())
             {
-                const GLuint loc = 2 + i;
-                glEnableVertexAttribArray(loc);
-                glVertexAttribPointer(
-                    loc,
-                    4,
-                    GL_FLOAT,
-                    GL_FALSE,
-                    stride,
-                    reinterpret_cast<const void *>(offset));
-
-                // インスタンスごとに 1 つ進める
-                glVertexAttribDivisor(loc, 1);
-
-                offset += sizeof(glm::vec4);
+                useShader(streamShader_, features);
+                glState_.bindVertexArray(meshStreamLines_.vao);
+                glDrawArrays(GL_LINES, static_cast<GLint>(firstLine[alpha]),
+                             static_cast<GLsizei>(streamLines_[alpha].size()));
             }
+        }
+        glState_.disable(GL_BLEND);
 
-            // layout(location = 6) vec4 iColor
-            glEnableVertexAttribArray(6);
-            glVertexAttribPointer(
-                6,
-                4,
-                GL_FLOAT,
-                GL_FALSE,
-                stride,
-                reinterpret_cast<const void *>(offsetof(InstanceBasic, color)));
-            glVertexAttribDivisor(6, 1);
+        // 容量は残したまま空にする
+        for (auto &lists : stream_)
+        {
+            for (std::vector<VertexFlat> &v : lists)
+                v.clear();
         }
+        for (std::vector<VertexStream> &v : streamLines_)
+            v.clear();
+    }
 
-        // 後始末（どの VAO も bind されていない状態に戻す）
-        glBindVertexArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // ==============================================================
+    // 視錐台カリング
+    // ==============================================================
+    void DrawstuffApp::setCulling(const int mode)
+    {
+        // 0 / 2 以外は従来どおり「有効」= CPU 扱い
+        cullMode_ = (mode == CULL_OFF || mode == CULL_GPU) ? mode : CULL_CPU;
+        instanceArena_.setDeferred(cullMode_ == CULL_CPU);
+    }
+
+    void DrawstuffApp::setImpostor(const int shape, const bool enable)
+    {
+        if (shape < 0 || shape >= RETAINED_SHAPE_COUNT)
+            fatalError("dsSetImpostor: unknown shape %d", shape);
+        // 箱は平面だけなのでメッシュのほうが軽い
+        if (shape == RETAINED_BOX)
+            return;
+        impostor_[InstancePool::shapeBucket(shape)] = enable;
+    }
+
+    CullParams DrawstuffApp::makeCullParams() const
+    {
+        CullParams params;
+        extractFrustumPlanes(proj_ * view_, params.planes);
+        params.shadows = use_shadows;
+        // 影は (x - kx z, y - ky z, 0) への投影（shadowProject_ の第 2 列が (-kx, -ky, 0)）
+        params.shadowKx = -shadowProject_[2][0];
+        params.shadowKy = -shadowProject_[2][1];
+        params.shadowScale = std::sqrt(1.0f + params.shadowKx * params.shadowKx +
+                                       params.shadowKy * params.shadowKy);
+        return params;
     }
 
-    void DrawstuffApp::setupCapsuleInstanceAttributes()
+    // step 中に staging へ記録されたインスタンスを，本描画用と影用に選別して
+    // マップ済みスロットへ詰める。判定も書き込みもチャンク単位でワーカーに分ける。
+    // 球・円柱・カプセルは画面上の大きさで LOD の段数も選び，段数ごとに別の範囲へ詰める。
+    void DrawstuffApp::cullInstances(const int height)
     {
-        if (g_capsuleCapTopInstanceVBO == 0)    glGenBuffers(1, &g_capsuleCapTopInstanceVBO);
-        if (g_capsuleCapBottomInstanceVBO == 0) glGenBuffers(1, &g_capsuleCapBottomInstanceVBO);
-        if (g_capsuleCylinderInstanceVBO == 0)  glGenBuffers(1, &g_capsuleCylinderInstanceVBO);
+        constexpr std::size_t kCullChunk = 8192;
 
-        const GLsizei stride = static_cast<GLsizei>(sizeof(InstanceBasic));
+        const CullParams params = makeCullParams();
+        const glm::mat4 viewProj = proj_ * view_;
+        LodParams lod;
+        for (int c = 0; c < 4; ++c)
+            lod.wRow[c] = viewProj[c][3];
+        lod.pixelScale = 0.5f * static_cast<float>(height) * proj_[1][1];
+        for (int k = 0; k < kLodLevels - 1; ++k)
+        {
+            lod.mainPixels[k] = lodPixels_[k];
+            lod.shadowPixels[k] = 2.0f * lodPixels_[k]; // 影はぼやけて見えるので早めに粗くする
+        }
 
-        auto setupForMesh = [&](Mesh& mesh, GLuint instanceVbo)
+        // 描く順（詰めて書く順）を近い順にする。可視判定と LOD は記録順のまま
+        opaquePassStats_.sorted = opaquePassStats_.reused = 0;
+        if (depthSort_)
         {
-            glBindVertexArray(mesh.vao);
-            glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+            // glm::frustum の投影行列から遠クリップ面の距離を戻す
+            const float zFar = proj_[3][2] / (proj_[2][2] + 1.0f);
+            sortStagedByDepth(lod.wRow, zFar);
+        }
 
-            // もし InstanceBasic の先頭が model でない可能性があるなら offsetof を使う
-            std::size_t offset = 0; // = offsetof(InstanceBasic, model); とできるならそれがより安全
+        // ---- 1) チャンク分けと可視判定 ----
+        cullChunks_.clear();
+        std::size_t total = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            const std::size_t n = instanceArena_.count(b);
+            if (lodBucket(b))
+                lodState_[b].resize(n, 0);
+            for (std::size_t begin = 0; begin < n; begin += kCullChunk)
+            {
+                CullChunk c{};
+                c.bucket = b;
+                c.begin = begin;
+                c.end = std::min(n, begin + kCullChunk);
+                c.maskOffset = total + begin;
+                cullChunks_.push_back(c);
+            }
+            total += n;
+        }
+        cullStats_ = CullStats();
+        cullStats_.instances = total;
+        cullStats_.shadows = use_shadows;
+        if (total == 0)
+            return;
+        if (cullMask_.size() < total)
+            cullMask_.resize(total);
 
-            for (int i = 0; i < 4; ++i)
+        jobPool_.parallelFor(cullChunks_.size(), 1, [this, &params, &lod](std::size_t first, std::size_t last)
+                             {
+            for (std::size_t ci = first; ci < last; ++ci)
+            {
+                CullChunk &c = cullChunks_[ci];
+                const InstanceCompact *in = instanceArena_.staged(c.bucket) + c.begin;
+                std::uint8_t *mask = cullMask_.data() + c.maskOffset;
+                cullInstanceVisibility(in, c.end - c.begin, c.bucket, params, mask,
+                                       c.mainCount[0], c.shadowCount[0]);
+                if (lodBucket(c.bucket))
+                    selectInstanceLod(in, c.end - c.begin, c.bucket, params, lod, mask,
+                                      lodState_[c.bucket].data() + c.begin, c.mainCount, c.shadowCount);
+            } });
+
+        // 並べ替えた場合，チャンクは並べ替えた順の [begin, end) を書くので，その中身で数え直す
+        if (depthSort_)
+        {
+            jobPool_.parallelFor(cullChunks_.size(), 1, [this](std::size_t first, std::size_t last)
+                                 {
+                for (std::size_t ci = first; ci < last; ++ci)
+                {
+                    CullChunk &c = cullChunks_[ci];
+                    const std::uint8_t *mask = cullMask_.data() + c.maskOffset - c.begin;
+                    const std::uint32_t *order = depthOrder_[c.bucket].data();
+                    for (int l = 0; l < kLodLevels; ++l)
+                        c.mainCount[l] = c.shadowCount[l] = 0;
+                    for (std::size_t i = c.begin; i < c.end; ++i)
+                    {
+                        const std::uint8_t m = mask[order[i]];
+                        if (m & kCullMain)
+                            ++c.mainCount[(m >> kLodMainShift) & 3];
+                        if (m & kCullShadow)
+                            ++c.shadowCount[(m >> kLodShadowShift) & 3];
+                    }
+                } });
+        }
+
+        // ---- 2) 出力位置：bucket ごとに [本描画 LOD 0..2][影 LOD 0..2] の順に並べる ----
+        std::size_t mainFirst[BUCKET_COUNT][kLodLevels], mainCount[BUCKET_COUNT][kLodLevels];
+        std::size_t shadowFirst[BUCKET_COUNT][kLodLevels], shadowCount[BUCKET_COUNT][kLodLevels];
+        std::size_t out = 0;
+        std::size_t k = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            const std::size_t kBegin = k;
+            while (k < cullChunks_.size() && cullChunks_[k].bucket == b)
+                ++k;
+            // LOD を選ばない bucket は全部 0 段目（1 段目以降の個数は 0 にしておく）
+            const int levels = lodBucket(b) ? kLodLevels : 1;
+            for (std::size_t j = kBegin; j < k; ++j)
+            {
+                for (int l = levels; l < kLodLevels; ++l)
+                    cullChunks_[j].mainCount[l] = cullChunks_[j].shadowCount[l] = 0;
+            }
+            for (int l = 0; l < kLodLevels; ++l)
+            {
+                mainFirst[b][l] = out;
+                for (std::size_t j = kBegin; j < k; ++j)
+                {
+                    cullChunks_[j].mainOut[l] = out;
+                    out += cullChunks_[j].mainCount[l];
+                }
+                mainCount[b][l] = out - mainFirst[b][l];
+                cullStats_.visible += mainCount[b][l];
+            }
+            for (int l = 0; l < kLodLevels; ++l)
             {
-                const GLuint loc = 2 + i;
-                glEnableVertexAttribArray(loc);
-                glVertexAttribPointer(
-                    loc, 4, GL_FLOAT, GL_FALSE, stride,
-                    reinterpret_cast<const void*>(offset));
-                glVertexAttribDivisor(loc, 1);
-                offset += sizeof(glm::vec4);
+                shadowFirst[b][l] = out;
+                for (std::size_t j = kBegin; j < k; ++j)
+                {
+                    cullChunks_[j].shadowOut[l] = out;
+                    out += cullChunks_[j].shadowCount[l];
+                }
+                shadowCount[b][l] = out - shadowFirst[b][l];
+                cullStats_.shadowVisible += shadowCount[b][l];
             }
+        }
+        if (out == 0)
+            return;
 
-            glEnableVertexAttribArray(6);
-            glVertexAttribPointer(
-                6, 4, GL_FLOAT, GL_FALSE, stride,
-                reinterpret_cast<const void*>(offsetof(InstanceBasic, color)));
-            glVertexAttribDivisor(6, 1);
+        // ---- 3) 詰めて書き込む（書き込み専用メモリなので前から順に）----
+        InstanceCompact *dst = instanceArena_.mapOutput(out);
+        jobPool_.parallelFor(cullChunks_.size(), 1, [this, dst](std::size_t first, std::size_t last)
+                             {
+            for (std::size_t ci = first; ci < last; ++ci)
+            {
+                const CullChunk &c = cullChunks_[ci];
+                const InstanceCompact *src = instanceArena_.staged(c.bucket);
+                const std::uint8_t *mask = cullMask_.data() + c.maskOffset - c.begin;
+                const std::uint32_t *order = depthSort_ ? depthOrder_[c.bucket].data() : nullptr;
+                InstanceCompact *mainDst[kLodLevels], *shadowDst[kLodLevels];
+                for (int l = 0; l < kLodLevels; ++l)
+                {
+                    mainDst[l] = dst + c.mainOut[l];
+                    shadowDst[l] = dst + c.shadowOut[l];
+                }
+                for (std::size_t i = c.begin; i < c.end; ++i)
+                {
+                    const std::size_t j = order ? order[i] : i;
+                    const std::uint8_t m = mask[j];
+                    if (m & kCullMain)
+                        *mainDst[(m >> kLodMainShift) & 3]++ = src[j];
+                    if (m & kCullShadow)
+                        *shadowDst[(m >> kLodShadowShift) & 3]++ = src[j];
+                }
+            } });
+
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            for (int l = 0; l < kLodLevels; ++l)
+                instanceArena_.addRange(b, mainFirst[b][l], mainCount[b][l], false, l);
+            for (int l = 0; l < kLodLevels; ++l)
+                instanceArena_.addRange(b, shadowFirst[b][l], shadowCount[b][l], true, l);
+        }
+        instanceArena_.unmapOutput();
+    }
 
-            glBindVertexArray(0);
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-        };
+    // 不透明インスタンスの前から順の並べ替え。キーは clip w（視点からの奥行き）を 16bit に丸めたもの。
+    // early-Z を効かせるには大まかな順で足りるので，前フレームの順で逆転が少なければそのまま使う
+    void DrawstuffApp::sortStagedByDepth(const float wRow[4], const float zFar)
+    {
+        constexpr std::size_t kKeyChunk = 16384;
+        constexpr int kKeyBits = 16;
+        constexpr std::size_t kReuseSlack = 256; // 逆転がこの 1 個に 1 つ以下なら並べ替えない
+        const float scale = static_cast<float>((1u << kKeyBits) - 1) / zFar;
 
-        for (int capsule_quality_ = 1; capsule_quality_ <= 3; ++capsule_quality_)
+        for (int b = 0; b < BUCKET_COUNT; ++b)
         {
-            Mesh& meshTop      = meshCapsuleCapTop_[capsule_quality_];
-            Mesh& meshBottom   = meshCapsuleCapBottom_[capsule_quality_];
-            Mesh& meshCylinder = meshCapsuleCylinder_[capsule_quality_];
-
-            if (meshTop.vao == 0 || meshBottom.vao == 0 || meshCylinder.vao == 0)
+            const std::size_t n = instanceArena_.count(b);
+            std::vector<std::uint32_t> &order = depthOrder_[b];
+            if (order.size() != n)
+            {
+                // 記録の中身が変わったので記録順から
+                order.resize(n);
+                for (std::size_t i = 0; i < n; ++i)
+                    order[i] = static_cast<std::uint32_t>(i);
+            }
+            if (n == 0)
                 continue;
 
-            setupForMesh(meshTop,      g_capsuleCapTopInstanceVBO);
-            setupForMesh(meshBottom,   g_capsuleCapBottomInstanceVBO);
-            setupForMesh(meshCylinder, g_capsuleCylinderInstanceVBO); // ←ここが重要
+            // ---- 前フレームの順でキーを作り，逆転を数える ----
+            depthKeys_.resize(n);
+            const InstanceCompact *in = instanceArena_.staged(b);
+            std::atomic<std::size_t> inversions{0};
+            const std::size_t chunks = (n + kKeyChunk - 1) / kKeyChunk;
+            jobPool_.parallelFor(chunks, 1, [&](std::size_t first, std::size_t last)
+                                 {
+                for (std::size_t c = first; c < last; ++c)
+                {
+                    const std::size_t end = std::min(n, (c + 1) * kKeyChunk);
+                    std::size_t inv = 0;
+                    for (std::size_t i = c * kKeyChunk; i < end; ++i)
+                    {
+                        const float *p = in[order[i]].pos;
+                        const float w = wRow[0] * p[0] + wRow[1] * p[1] + wRow[2] * p[2] + wRow[3];
+                        const float q = std::min(std::max(w * scale, 0.0f), static_cast<float>((1u << kKeyBits) - 1));
+                        depthKeys_[i] = static_cast<std::uint32_t>(q);
+                        if (i > c * kKeyChunk && depthKeys_[i] < depthKeys_[i - 1])
+                            ++inv;
+                    }
+                    inversions.fetch_add(inv, std::memory_order_relaxed);
+                } });
+
+            opaquePassStats_.sorted += n;
+            if (inversions.load() * kReuseSlack <= n)
+            {
+                opaquePassStats_.reused += n;
+                continue;
+            }
+            radixSort(depthKeys_, order, kKeyBits, depthSortScratch_, jobPool_);
         }
     }
 
+    // GPU 版：保持型とこのフレームの即時描画分をまとめて transform feedback で選別する。
+    // 集計はクエリ結果を待たないよう 1 フレーム前のもの
+    void DrawstuffApp::cullInstancesGpu(const int height)
+    {
+        const glm::mat4 viewProj = proj_ * view_;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            std::vector<InstanceRange> &in = gpuCullInputs_[b];
+            in.clear();
+            InstanceRange retained;
+            if (instancePool_.range(b, retained))
+                in.push_back(retained);
+            const std::vector<InstanceRange> &ranges = instanceArena_.ranges(b);
+            in.insert(in.end(), ranges.begin(), ranges.end());
+        }
+
+        // clip w = viewProj の第 4 行・p。画面上の半径は r * (h/2) * proj[1][1] / w
+        const glm::vec4 wRow(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+        gpuCuller_.run(gpuCullInputs_, makeCullParams(), wRow, 0.5f * static_cast<float>(height) * proj_[1][1],
+                       cullMinPixels_, occlusionCulling_ ? &depthPyramid_ : nullptr);
+
+        cullStats_ = CullStats();
+        cullStats_.instances = gpuCuller_.lastInstances();
+        cullStats_.visible = gpuCuller_.lastVisible();
+        cullStats_.shadowVisible = gpuCuller_.lastShadowVisible();
+        cullStats_.occluded = gpuCuller_.lastOccluded();
+        cullStats_.shadowOccluded = gpuCuller_.lastShadowOccluded();
+        cullStats_.shadows = gpuCuller_.lastShadows();
+    }
+
     // ==============================================================
     // main simulation loop and related functions
     // ==============================================================
@@ -1184,13 +1585,22 @@ namespace ds_internal
             exit(EXIT_FAILURE);
         }
 
+        // 3.3 より新しい機能（永続マップ等）の有無を調べておく
+        loadGLExtensions();
+
         // シェーダープログラム初期化
         initBasicProgram();
         initBasicInstancedProgram();
 
         initShadowProgram();
         initShadowInstancedProgram();
+        initCullProgram();
+        initHiZProgram();
+        initOitProgram();
+        initImpostorPrograms();
+        initStreamProgram();
 
+        geometryArena_.init();
         createPrimitiveMeshes();
 
         // ground メッシュがまだなら初期化
@@ -1210,53 +1620,60 @@ namespace ds_internal
         texture[DS_CHECKERED] = std::make_unique<Texture>(checkeredpath.c_str());
 
         // 基本形状描画用バッファ初期化
-        constexpr std::size_t initialInstanceBufferSize = 1024*128;
-        sphereInstances_.clear();
-        sphereInstances_.reserve(initialInstanceBufferSize);
-        boxInstances_.clear();
-        boxInstances_.reserve(initialInstanceBufferSize);
-        cylinderInstances_.clear();
-        cylinderInstances_.reserve(initialInstanceBufferSize);
-        capsuleCapTopInstances_.clear();
-        capsuleCapTopInstances_.reserve(initialInstanceBufferSize);
-        capsuleCapBottomInstances_.clear();
-        capsuleCapBottomInstances_.reserve(initialInstanceBufferSize);
-        capsuleCylinderInstances_.clear();
-        capsuleCylinderInstances_.reserve(initialInstanceBufferSize);
-
-
-        if (g_sphereInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_sphereInstanceVBO);
-        }
-        if (g_boxInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_boxInstanceVBO);
-        }
-        if (g_cylinderInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_cylinderInstanceVBO);
-        }
-        if (g_capsuleCapTopInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_capsuleCapTopInstanceVBO);
-        }
-        if (g_capsuleCapBottomInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_capsuleCapBottomInstanceVBO);
-        }
-        if (g_capsuleCylinderInstanceVBO == 0)
-        {
-            glGenBuffers(1, &g_capsuleCylinderInstanceVBO);
-        }
-        setupSphereInstanceAttributes();
-        setupBoxInstanceAttributes();
-        setupCylinderInstanceAttributes();
-        setupCapsuleInstanceAttributes();
+        instanceArena_.init();
+        instanceArena_.setDeferred(cullMode_ == CULL_CPU);
+        jobPool_.start();
+        opaquePassQuery_.init();
+        if (glExt.multiDrawIndirect)
+            multiDraw_.init();
+
+        // 形状メッシュは全部 GeometryArena の 1 つの VAO
+        setupInstanceAttributes(geometryArena_.vao());
+
+        // プログラム・テクスチャを作り直したので，覚えている状態と uniform の値は全部捨てる
+        glState_.reset();
     }
 
     void DrawstuffApp::stopGraphics()
     {
+        jobPool_.stop();
+        instanceArena_.destroy();
+        instancePool_.releaseGL();
+        transparentQueue_.releaseGL();
+        convexCache_.releaseGL();
+        // 登録メッシュは次の startGraphics 後に描かれたとき載せ直す
+        for (MeshResource &meshRes : meshRegistry_)
+        {
+            meshRes.meshGL = Mesh();
+            meshRes.dirty = true;
+        }
+        geometryArena_.destroy();
+        if (registeredInstanceBuffer_ != 0)
+            glDeleteBuffers(1, &registeredInstanceBuffer_);
+        registeredInstanceBuffer_ = 0;
+        registeredInstanceCapacity_ = 0;
+        gpuCuller_.destroy();
+        depthPyramid_.destroy();
+        weightedOit_.destroy();
+        opaquePassQuery_.destroy();
+        multiDraw_.destroy();
+        if (programCull_ != 0)
+            glDeleteProgram(programCull_);
+        if (programHiZ_ != 0)
+            glDeleteProgram(programHiZ_);
+        if (programOit_ != 0)
+            glDeleteProgram(programOit_);
+        programCull_ = 0;
+        programHiZ_ = 0;
+        programOit_ = 0;
+        // 描画用シェーダの変種（ソースは残るので次の startGraphics 後に使うとき作り直す）
+        for (ShaderPermutation *shader : {&basicShader_, &basicInstancedShader_, &streamShader_, &groundShader_,
+                                          &skyShader_, &shadowShader_, &shadowInstancedShader_, &impostorShader_,
+                                          &shadowImpostorShader_})
+            shader->release();
+        if (frameUniformBuffer_ != 0)
+            glDeleteBuffers(1, &frameUniformBuffer_);
+        frameUniformBuffer_ = 0;
         for (int i = 0; i < DS_NUMTEXTURES; i++)
         {
             texture[i].reset();
@@ -1280,11 +1697,19 @@ namespace ds_internal
         }
         current_state = SIM_STATE_DRAWING;
 
+        // 前のフレームの後（HUD や Hi-Z）に GL が直接触られているので，覚えている状態は捨てる
+        glState_.invalidate();
+
+        // 取り消した登録メッシュや追い出した Convex の跡で共有バッファの穴が増えていたら詰める
+        if (geometryArena_.fragmented())
+            compactGeometry();
+        multiDraw_.beginFrame();
+
         // ---- 基本 GL 状態（core で有効なものだけ）----
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LESS);
 
-        glEnable(GL_CULL_FACE);
+        glState_.enable(GL_CULL_FACE);
         glCullFace(GL_BACK);
         glFrontFace(GL_CCW);
 
@@ -1323,8 +1748,8 @@ namespace ds_internal
         proj_ = glm::frustum(left, right, bottom, top, vnear, vfar);
 
         // ★ 3.3 core なので glMatrixMode/glLoadMatrixf は一切呼ばない。
-        //   proj_ は drawMeshBasic / drawSky / drawGround / drawPyramidGrid の中で
-        //   uMVP に使われる前提。
+        //   proj_ は uploadFrameUniforms() で FrameUniforms（uViewProj など）に入り，
+        //   各シェーダはそこから読む。
 
         // ---- 画面クリア ----
         glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
@@ -1344,16 +1769,19 @@ namespace ds_internal
         // ---- ライト方向の更新（固定機能 glLight* は使わない）----
         // --> 投影行列を定数化したので，不要．
 
+        // ---- このフレームの共通 uniform（UBO）----
+        uploadFrameUniforms(view2_xyz.data());
+
         // ---- 背景（空・地面など）----
-        drawSky(view2_xyz.data()); // 既存シグネチャに合わせて必要なら .data()
+        drawSky();
         drawGround();
 
         // ---- 地面のマーカー ----
         drawPyramidGrid();
 
         // ---- ユーザ描画前の状態整備 ----
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
+        glState_.enable(GL_DEPTH_TEST);
+        glState_.depthFunc(GL_LESS);
 
         // setColor は 3.3 core 版（current_color を更新するだけ）の実装になっている前提
         setColor(1.0f, 1.0f, 1.0f, 1.0f);
@@ -1365,241 +1793,148 @@ namespace ds_internal
 
         texture_id = 0; // 「テクスチャ未使用」の初期値として継続利用
 
+        // ---- インスタンス書き込み先（マップ済みリングのスロット）を用意 ----
+        instanceArena_.beginFrame();
+        convexCache_.beginFrame();
+        transparentQueue_.clear();
+        translucentInstances_ = false;
+
         // ---- ユーザ描画コールバック ----
         if (fn && fn->step)
         {
             fn->step(pause);
         }
+        // step() の中でユーザが GL を触ったり，メッシュを作ったりしているかもしれない
+        glState_.invalidate();
 
         // ---- 球，直方体，円柱のバッチ描画パス ----
-        if (!sphereInstances_.empty())
-        {
-            // インスタンスバッファを GPU にアップロード
-            uploadInstanceBuffer(g_sphereInstanceVBO, sphereInstances_); // VBO or SSBO
-        }
-        if (!boxInstances_.empty())
-        {
-            // インスタンスバッファを GPU にアップロード
-            uploadInstanceBuffer(g_boxInstanceVBO, boxInstances_); // VBO or SSBO
-        }
-        if (!cylinderInstances_.empty())
+        // ワーカースレッドが記録した分を決まった順で合流させてから，
+        // step 中に書き込まれたインスタンスを確定（フォールバック時はアンマップ）
+        mergeParallelRecorders();
+        instanceArena_.endFrame();
+        if (instanceArena_.isDeferred())
         {
-            // インスタンスバッファを GPU にアップロード
-            uploadInstanceBuffer(g_cylinderInstanceVBO, cylinderInstances_); // VBO or SSBO
+            cullInstances(height);
         }
-        if (!capsuleCapTopInstances_.empty())
+        else if (cullMode_ != CULL_GPU)
         {
-            uploadInstanceBuffer(g_capsuleCapTopInstanceVBO, capsuleCapTopInstances_);
+            cullStats_ = CullStats();
+            for (int b = 0; b < BUCKET_COUNT; ++b)
+                cullStats_.instances += instanceArena_.count(b);
+            cullStats_.visible = cullStats_.instances;
+            cullStats_.shadowVisible = use_shadows ? cullStats_.instances : 0;
+            cullStats_.shadows = use_shadows;
         }
-        if (!capsuleCapBottomInstances_.empty())
+        // 保持型インスタンスは変更されたスロットだけ送る
+        instancePool_.upload();
+        convexCache_.upload();
+        uploadRegisteredMeshInstances();
+        // GPU カリングは保持型も含めて，アップロードが済んだ後で選別する
+        gpuCulled_ = (cullMode_ == CULL_GPU && gpuCuller_.ready());
+        if (gpuCulled_)
         {
-            uploadInstanceBuffer(g_capsuleCapBottomInstanceVBO, capsuleCapBottomInstances_);
+            cullInstancesGpu(height);
+            glState_.invalidate();
         }
-        if (!capsuleCylinderInstances_.empty())
-        {
-            uploadInstanceBuffer(g_capsuleCylinderInstanceVBO, capsuleCylinderInstances_);
-        }
-
-        glUseProgram(programBasicInstanced_);
 
-        glUniformMatrix4fv(uProjInst_, 1, GL_FALSE, glm::value_ptr(proj_));
-        glUniformMatrix4fv(uViewInst_, 1, GL_FALSE, glm::value_ptr(view_));
-        glUniform3f(uLightDirInst_, lightDir_.x, lightDir_.y, lightDir_.z);
-        glUniform1f(uTexScaleInst_, 0.5f);
+        // 半透明のインスタンス：保持型の分も足して遠い順に並べ（重み付き OIT なら並べ替えない）送る
+        instancePool_.appendTranslucent(transparentQueue_);
+        if (transparencyMode_ == TRANSPARENCY_SORTED)
+            transparentQueue_.sortBackToFront(view2_xyz.data(), jobPool_);
+        transparentQueue_.upload();
 
-        if (use_textures && texture[DS_WOOD])
+        // 記録時には GL を触らないので，ブレンドはここでまとめて決める
+        // （球・箱・円柱・カプセルの半透明は列のほうで描くので，残るのは convex と登録メッシュ）
+        if (translucentInstances_)
         {
-            glUniform1i(uUseTexInst_, GL_TRUE);
-            glActiveTexture(GL_TEXTURE0);
-            bindTextureUnit0(DS_WOOD);
-            glUniform1i(uTexInst_, 0);
+            glState_.enable(GL_BLEND);
+            glState_.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         }
         else
         {
-            glUniform1i(uUseTexInst_, GL_FALSE);
-        }
-
-        if (!sphereInstances_.empty())
-        {
-            // 球をまとめて描画
-            glBindVertexArray(meshSphere_[sphere_quality].vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshSphere_[sphere_quality].indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(sphereInstances_.size()));
-        }
-        if (!boxInstances_.empty())
-        {
-            // 直方体をまとめて描画
-            glBindVertexArray(meshBox_.vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshBox_.indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(boxInstances_.size()));
-        }
-        if (!cylinderInstances_.empty())
-        {
-            // 円柱をまとめて描画
-            glBindVertexArray(meshCylinder_[cylinder_quality].vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshCylinder_[cylinder_quality].indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(cylinderInstances_.size()));
-        }
-        if (!capsuleCapTopInstances_.empty())
-        {
-            // カプセル上部半球をまとめて描画
-            glBindVertexArray(meshCapsuleCapTop_[capsule_quality].vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshCapsuleCapTop_[capsule_quality].indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(capsuleCapTopInstances_.size()));
-        }
-        if (!capsuleCapBottomInstances_.empty())
-        {
-            // カプセル下部半球をまとめて描画
-            glBindVertexArray(meshCapsuleCapBottom_[capsule_quality].vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshCapsuleCapBottom_[capsule_quality].indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(capsuleCapBottomInstances_.size()));
-        }
-        if (!capsuleCylinderInstances_.empty())
-        {
-            // カプセル円柱部をまとめて描画
-            glBindVertexArray(meshCapsuleCylinder_[capsule_quality].vao);
-            glDrawElementsInstanced(
-                GL_TRIANGLES,
-                meshCapsuleCylinder_[capsule_quality].indexCount,
-                GL_UNSIGNED_INT,
-                nullptr,
-                static_cast<GLsizei>(capsuleCylinderInstances_.size()));
+            glState_.disable(GL_BLEND);
+        }
+
+        const unsigned features = textureFeatures(texture[DS_WOOD] != nullptr);
+        useShader(basicInstancedShader_, features);
+        if (features & SHADER_TEXTURE)
+            bindTextureUnit0(DS_WOOD);
+
+        // 不透明のインスタンス描画パスを測る（結果は数フレーム後に読める）
+        if (opaquePassQuery_.ready())
+            opaquePassQuery_.begin();
+        beginMultiDraw();
+        drawInstancedBucket(meshSphere_, sphere_quality, BUCKET_SPHERE);
+        drawInstancedBucket(&meshBox_, 0, BUCKET_BOX);
+        drawInstancedBucket(meshCylinder_, cylinder_quality, BUCKET_CYLINDER);
+        drawInstancedBucket(meshCapsule_, capsule_quality, BUCKET_CAPSULE);
+        drawConvexInstances();
+        drawRegisteredMeshInstances(false);
+        endMultiDraw();
+        drawImpostorBuckets(false);
+        if (opaquePassQuery_.ready())
+        {
+            opaquePassQuery_.end();
+            opaquePassStats_.gpuMilliseconds = opaquePassQuery_.lastMilliseconds();
+            opaquePassStats_.overdraw = (width > 0 && height > 0)
+                                            ? static_cast<double>(opaquePassQuery_.lastSamples()) /
+                                                  (static_cast<double>(width) * height)
+                                            : 0.0;
         }
 
         if (use_shadows)
         {
-            glUseProgram(programShadowInstanced_);
+            const unsigned shadowFeatures = textureFeatures(texture[DS_GROUND] != nullptr);
+            useShader(shadowInstancedShader_, shadowFeatures);
 
             // Z-fighting 対策（★必須）
-            glEnable(GL_DEPTH_TEST);
-            glDepthFunc(GL_LEQUAL);
+            glState_.enable(GL_DEPTH_TEST);
+            glState_.depthFunc(GL_LEQUAL);
 
-            glEnable(GL_POLYGON_OFFSET_FILL);
-            glPolygonOffset(-1.0f, -1.0f);
+            glState_.enable(GL_POLYGON_OFFSET_FILL);
+            glState_.polygonOffset(-1.0f, -1.0f);
 
             // 影は上書き型なら blend off
-            glDisable(GL_BLEND);
-
-            // 共通行列
-            glUniformMatrix4fv(uShadowModelInst_, 1, GL_FALSE, glm::value_ptr(shadowProject_)); // world→shadow
-            glm::mat4 shadowMVP = proj_ * view_ * shadowProject_;
-            glUniformMatrix4fv(uShadowMVPInst_, 1, GL_FALSE, glm::value_ptr(shadowMVP));
+            glState_.disable(GL_BLEND);
 
-            glUniform2f(uGroundScaleInst_, ground_scale, ground_scale);
-            glUniform2f(uGroundOffsetInst_, ground_ofsx, ground_ofsy);
-            glUniform1f(uShadowIntensityInst_, SHADOW_INTENSITY);
-
-            if (use_textures)
-            {
-                glUniform1i(uShadowUseTexInst_, GL_TRUE);
-                glActiveTexture(GL_TEXTURE0);
+            // 共通行列・地面のパラメータは FrameUniforms にある
+            if (shadowFeatures & SHADER_TEXTURE)
                 bindTextureUnit0(DS_GROUND);
-                glUniform1i(uGroundTexInst_, 0);
-            }
-            else
-            {
-                glUniform1i(uShadowUseTexInst_, GL_FALSE);
-                glUniform3f(uGroundColor_, GROUND_R, GROUND_G, GROUND_B);
-            }
 
-            // 球の影
-            if (!sphereInstances_.empty())
-            {
-                glBindVertexArray(meshSphere_[shadow_sphere_quality].vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshSphere_[shadow_sphere_quality].indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(sphereInstances_.size()));
-            }
-            if (!boxInstances_.empty())
-            {
-                // 直方体の影
-                glBindVertexArray(meshBox_.vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshBox_.indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(boxInstances_.size()));
-            }
-            if (!cylinderInstances_.empty())
-            {
-                // 円柱の影
-                glBindVertexArray(meshCylinder_[shadow_cylinder_quality].vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshCylinder_[shadow_cylinder_quality].indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(cylinderInstances_.size()));
-            }
-            if (!capsuleCapTopInstances_.empty())
-            {
-                // カプセル上部半球の影
-                glBindVertexArray(meshCapsuleCapTop_[shadow_cylinder_quality].vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshCapsuleCapTop_[shadow_cylinder_quality].indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(capsuleCapTopInstances_.size()));
-            }
-            if (!capsuleCapBottomInstances_.empty())
-            {
-                // カプセル下部半球の影
-                glBindVertexArray(meshCapsuleCapBottom_[shadow_cylinder_quality].vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshCapsuleCapBottom_[shadow_cylinder_quality].indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(capsuleCapBottomInstances_.size()));
-            }
-            if (!capsuleCylinderInstances_.empty())
-            {
-                // カプセル円柱部の影
-                glBindVertexArray(meshCapsuleCylinder_[shadow_cylinder_quality].vao);
-                glDrawElementsInstanced(
-                    GL_TRIANGLES,
-                    meshCapsuleCylinder_[shadow_cylinder_quality].indexCount,
-                    GL_UNSIGNED_INT,
-                    nullptr,
-                    static_cast<GLsizei>(capsuleCylinderInstances_.size()));
-            }
+            beginMultiDraw();
+            drawInstancedBucket(meshSphere_, shadow_sphere_quality, BUCKET_SPHERE, true);
+            drawInstancedBucket(&meshBox_, 0, BUCKET_BOX, true);
+            drawInstancedBucket(meshCylinder_, shadow_cylinder_quality, BUCKET_CYLINDER, true);
+            drawInstancedBucket(meshCapsule_, shadow_cylinder_quality, BUCKET_CAPSULE, true);
+            drawConvexInstances();
+            drawRegisteredMeshInstances(true);
+            endMultiDraw();
+            drawImpostorBuckets(true);
+            drawTransparentShadows();
         }
-        glDisable(GL_POLYGON_OFFSET_FILL);
-        glBindVertexArray(0);
-        glUseProgram(0);
+        glState_.disable(GL_POLYGON_OFFSET_FILL);
+
+        // 即時描画の三角形・線（dsDrawTriangle(s) / dsDrawLine）をまとめて描く
+        drawStreamBatches();
+
+        // 半透明のインスタンスは不透明のものを全部描いた後
+        drawTransparentInstances(width, height);
 
-        // インスタンスバッファをクリア
-        sphereInstances_.clear();
-        boxInstances_.clear();
-        cylinderInstances_.clear();
-        capsuleCapTopInstances_.clear();
-        capsuleCapBottomInstances_.clear();
-        capsuleCylinderInstances_.clear();
+        // postStep（HUD など）には何も bind していない状態で渡す
+        glState_.bindVertexArray(0);
+        glState_.useProgram(0);
+        glState_.endFrame();
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // 遮蔽カリング用に，このフレームの深度から Hi-Z を作っておく（次のフレームで使う）
+        if (gpuCulled_ && occlusionCulling_)
+            depthPyramid_.build(width, height, proj_ * view_);
+        else
+            depthPyramid_.invalidate();
+
+        // このスロットを GPU が読み終わったら再利用できるようにフェンスを置く
+        instanceArena_.fenceFrame();
 
         current_state = SIM_STATE_RUNNING;
     }
@@ -1632,16 +1967,7 @@ namespace ds_internal
 
     // ==============================================================
     // TriMesh高速描画API
-    // メッシュ登録
-    struct MeshResource
-    {
-        MeshPN meshPN;
-        Mesh meshGL;
-        bool dirty = true; // GPU 側の再構築が必要かどうか
-    };
-    // TriMesh 用高速描画 API 実装
-    std::vector<MeshResource> meshRegistry_;
-
+    // ハンドルは meshRegistry_ の位置 + 1（0 は無効）
     MeshHandle DrawstuffApp::registerIndexedMesh(
         const std::vector<float> &vertices,
         const std::vector<unsigned int> &indices)
@@ -1649,42 +1975,169 @@ namespace ds_internal
         MeshResource meshRes;
         meshRes.meshPN = buildTrianglesMeshPNFromVerticesAndIndices(
             vertices, indices);
+        // 頂点キャッシュ・重ね塗り・頂点の読み出しの順に並べ替える（見た目は変わらない）
+        meshRes.cacheBefore = analyzeVertexCache(meshRes.meshPN.indices, meshRes.meshPN.vertices.size());
+        optimizeMeshPN(meshRes.meshPN);
+        meshRes.cacheAfter = analyzeVertexCache(meshRes.meshPN.indices, meshRes.meshPN.vertices.size());
         meshRes.dirty = true;
+        meshRes.live = true;
+
+        // 取り消された位置があれば使い回す
+        if (!meshRegistryFree_.empty())
+        {
+            const MeshHandle h = meshRegistryFree_.back();
+            meshRegistryFree_.pop_back();
+            meshRegistry_[h - 1] = std::move(meshRes);
+            return h;
+        }
         meshRegistry_.push_back(std::move(meshRes));
-        MeshHandle h = static_cast<unsigned int>(meshRegistry_.size() - 1);
+        return meshRegistry_.size();
+    }
+
+    void DrawstuffApp::unregisterMesh(const MeshHandle h)
+    {
+        checkNotParallel("dsUnregisterMesh");
+        MeshResource &meshRes = registeredMesh("dsUnregisterMesh", h);
+
+        // このフレームに積んだ分は描かずに捨てる
+        geometryArena_.release(meshRes.meshGL);
+        meshRes = MeshResource();
+        meshRegistryFree_.push_back(h);
+    }
+
+    DrawstuffApp::RegisteredMeshStats DrawstuffApp::registeredMeshStats(const MeshHandle h) const
+    {
+        const MeshResource &meshRes = registeredMesh("dsGetRegisteredMeshStats", h);
+        RegisteredMeshStats s;
+        s.vertices = meshRes.meshPN.vertices.size();
+        s.triangles = meshRes.meshPN.indices.size() / 3;
+        s.indexBytes = GeometryArena::shortIndices(s.vertices) ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+        s.acmrBefore = meshRes.cacheBefore.acmr;
+        s.acmrAfter = meshRes.cacheAfter.acmr;
+        s.atvrBefore = meshRes.cacheBefore.atvr;
+        s.atvrAfter = meshRes.cacheAfter.atvr;
+        return s;
+    }
 
-        return h;
+    // GeometryArena に載っている全メッシュの場所を詰め直した後の位置に合わせる
+    void DrawstuffApp::compactGeometry()
+    {
+        geometryArena_.compact();
+        geometryArena_.refresh(meshBox_);
+        for (int quality = 1; quality <= 3; ++quality)
+        {
+            geometryArena_.refresh(meshSphere_[quality]);
+            geometryArena_.refresh(meshCylinder_[quality]);
+            geometryArena_.refresh(meshCapsule_[quality]);
+        }
+        geometryArena_.refresh(meshImpostorQuad_);
+        convexCache_.refreshGeometry();
+        for (MeshResource &meshRes : meshRegistry_)
+            geometryArena_.refresh(meshRes.meshGL);
     }
 
+    // その場では描かず，メッシュごとのインスタンス列に積む（renderFrame でまとめて描く）
     void DrawstuffApp::drawRegisteredMesh(
         MeshHandle h,
         const float pos[3], const float R[12], const bool solid)
     {
-        MeshResource &meshRes = meshRegistry_[h];
+        checkNotParallel("drawRegisteredMesh");
+
+        MeshResource &meshRes = registeredMesh("dsDrawRegisteredMesh", h);
 
         if (meshRes.dirty)
         {
-            // メッシュ VBO/VAO を初期化・更新
-            buildTrianglesMeshFromMeshPN(meshRes.meshGL, meshRes.meshPN);
+            // 初めて描くときに GeometryArena へ載せる（VAO は共有なのでインスタンス属性は設定済み）
+            geometryArena_.upload(meshRes.meshGL, meshRes.meshPN.vertices, meshRes.meshPN.indices);
             meshRes.dirty = false;
         }
 
-        glm::mat4 model = buildModelMatrix(pos, R);
+        std::vector<InstanceCompact> &list = meshRes.instances[solid ? 0 : 1];
+        list.emplace_back();
+        writeInstance(&list.back(), current_color_rgba8_, pos, R, 1.0f, 1.0f, 1.0f);
+        if (current_color_rgba8_[3] < 255)
+            translucentInstances_ = true;
+    }
 
-        applyMaterials(); // 色・ブレンドなど
-        if (!solid)
+    // 全メッシュのインスタンスを 1 本のバッファへ詰めて送る（CPU 側の列はここで空にする）
+    void DrawstuffApp::uploadRegisteredMeshInstances()
+    {
+        std::size_t total = 0;
+        for (MeshResource &meshRes : meshRegistry_)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            meshRes.offset = total;
+            for (int k = 0; k < 2; ++k)
+            {
+                meshRes.count[k] = static_cast<GLsizei>(meshRes.instances[k].size());
+                total += meshRes.instances[k].size();
+            }
         }
-        drawMeshBasic(meshRes.meshGL, model, current_color);
-        if (!solid)
+        if (total == 0)
+            return;
+
+        const std::size_t stride = sizeof(InstanceCompact);
+        if (registeredInstanceBuffer_ == 0)
+            glGenBuffers(1, &registeredInstanceBuffer_);
+        if (total > registeredInstanceCapacity_)
+            registeredInstanceCapacity_ = std::max<std::size_t>(256, total + total / 2);
+
+        // 前のフレームの描画を待たないよう，毎フレーム確保し直して（orphan）から詰める
+        glBindBuffer(GL_COPY_WRITE_BUFFER, registeredInstanceBuffer_);
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(registeredInstanceCapacity_ * stride),
+                     nullptr, GL_STREAM_DRAW);
+        for (MeshResource &meshRes : meshRegistry_)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            std::size_t at = meshRes.offset;
+            for (std::vector<InstanceCompact> &list : meshRes.instances)
+            {
+                if (list.empty())
+                    continue;
+                glBufferSubData(GL_COPY_WRITE_BUFFER,
+                                static_cast<GLintptr>(at * stride),
+                                static_cast<GLsizeiptr>(list.size() * stride),
+                                list.data());
+                at += list.size();
+                list.clear();
+            }
         }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
 
-        if (use_shadows)
+    // メッシュごとに塗り潰し・ワイヤーフレームを 1 回ずつ描く（影は両方まとめて 1 回）
+    // プログラムと共通の uniform は呼び出し側で設定済み
+    void DrawstuffApp::drawRegisteredMeshInstances(const bool shadow)
+    {
+        for (const MeshResource &meshRes : meshRegistry_)
         {
-            drawShadowMesh(meshRes.meshGL, model);
+            if (meshRes.count[0] + meshRes.count[1] == 0)
+                continue;
+            const Mesh &mesh = meshRes.meshGL;
+
+            InstanceRange r;
+            r.buffer = registeredInstanceBuffer_;
+            r.offset = static_cast<GLintptr>(meshRes.offset * sizeof(InstanceCompact));
+            if (shadow)
+            {
+                r.count = meshRes.count[0] + meshRes.count[1];
+                drawMeshInstances(mesh, r);
+                continue;
+            }
+            if (meshRes.count[0] > 0)
+            {
+                r.count = meshRes.count[0];
+                drawMeshInstances(mesh, r);
+            }
+            if (meshRes.count[1] > 0)
+            {
+                // ワイヤーフレームはポリゴンモードが違うので multi-draw には積まず，その場で描く
+                r.offset += static_cast<GLintptr>(meshRes.count[0] * sizeof(InstanceCompact));
+                glState_.bindVertexArray(mesh.vao);
+                bindInstanceRange(r);
+                glState_.polygonMode(GL_LINE);
+                glDrawElementsInstancedBaseVertex(mesh.primitive, mesh.indexCount, mesh.indexType, mesh.indexOffset(),
+                                                  meshRes.count[1], mesh.baseVertex);
+                glState_.polygonMode(GL_FILL);
+            }
         }
     }
 
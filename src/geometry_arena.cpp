@@ -0,0 +1,411 @@
+// geometry_arena.cpp - shared vertex / index buffers for static meshes in drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// インデックスはメッシュ内の頂点番号のまま入れておき，描画時に baseVertex を足してもらう。
+// なので詰め直し（compact）やバッファの作り直しでは中身を書き換えずにコピーするだけで済む。
+// バッファを作り直しても VAO は同じものを使い続ける（属性と EBO だけ付け直す）。
+// 頂点は VertexPacked に詰め替えてから載せる（位置は float のまま，法線と cap は 4 バイト）。
+// インデックスの空きは 32bit 単位で管理し，16bit のメッシュは 2 つずつ詰める。
+// 場所は 4 バイト境界から始まるので，16bit の firstIndex は offset * 2 になる。
+
+#include <algorithm>
+#include <cmath>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // 最初に確保する容量（要素数）。基本形状を最高品質まで全部載せても収まる大きさ
+        constexpr std::size_t kMinVertices = std::size_t(1) << 16;
+        constexpr std::size_t kMinIndices = std::size_t(1) << 18;
+        // これより小さい穴は詰めない（要素数）
+        constexpr std::size_t kMinHoles = 16384;
+        // 法線の 10bit 整数の目盛り（±511）
+        constexpr float kNormalScale = 511.0f;
+
+        inline std::uint32_t packField(const int v, const int bits, const int shift)
+        {
+            return (static_cast<std::uint32_t>(v) & ((1u << bits) - 1u)) << shift;
+        }
+
+        inline int normalComponent(const float n)
+        {
+            return static_cast<int>(std::lround(std::max(-1.0f, std::min(1.0f, n)) * kNormalScale));
+        }
+
+        // VertexPacked::normalCap を作り，法線の角度誤差（度）を err へ（長さ 0 の法線は 0）
+        inline std::uint32_t packNormalCap(const glm::vec3 &normal, const float cap, double &err)
+        {
+            err = 0.0;
+            const float len = glm::length(normal);
+            const glm::vec3 n = (len > 0.0f) ? normal / len : glm::vec3(0.0f, 0.0f, 0.0f);
+            const int x = normalComponent(n.x);
+            const int y = normalComponent(n.y);
+            const int z = normalComponent(n.z);
+            const int w = (cap > 0.5f) ? 1 : (cap < -0.5f ? -1 : 0);
+            if (len > 0.0f)
+            {
+                const glm::vec3 decoded(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z));
+                const float c = glm::dot(n, decoded) / glm::length(decoded);
+                err = std::acos(std::max(-1.0f, std::min(1.0f, c))) * (180.0 / 3.14159265358979323846);
+            }
+            return packField(x, 10, 0) | packField(y, 10, 10) | packField(z, 10, 20) | packField(w, 2, 30);
+        }
+    } // anonymous namespace
+
+    // ---- FreeList ----
+    bool GeometryArena::FreeList::allocate(const std::size_t n, std::size_t &offset)
+    {
+        for (std::size_t i = 0; i < free.size(); ++i)
+        {
+            Span &span = free[i];
+            if (span.size < n)
+                continue;
+            offset = span.offset;
+            span.offset += n;
+            span.size -= n;
+            if (span.size == 0)
+                free.erase(free.begin() + static_cast<std::ptrdiff_t>(i));
+            used += n;
+            return true;
+        }
+        return false;
+    }
+
+    void GeometryArena::FreeList::release(const std::size_t offset, const std::size_t n)
+    {
+        if (n == 0)
+            return;
+        used -= n;
+        auto next = std::lower_bound(free.begin(), free.end(), offset,
+                                     [](const Span &s, const std::size_t o) { return s.offset < o; });
+        // 前の空きの直後なら伸ばし，後ろの空きともつながればまとめる
+        if (next != free.begin())
+        {
+            Span &prev = *(next - 1);
+            if (prev.offset + prev.size == offset)
+            {
+                prev.size += n;
+                if (next != free.end() && prev.offset + prev.size == next->offset)
+                {
+                    prev.size += next->size;
+                    free.erase(next);
+                }
+                return;
+            }
+        }
+        if (next != free.end() && offset + n == next->offset)
+        {
+            next->offset = offset;
+            next->size += n;
+            return;
+        }
+        Span span;
+        span.offset = offset;
+        span.size = n;
+        free.insert(next, span);
+    }
+
+    void GeometryArena::FreeList::grow(const std::size_t newCapacity)
+    {
+        if (!free.empty() && free.back().offset + free.back().size == capacity)
+        {
+            free.back().size += newCapacity - capacity;
+        }
+        else
+        {
+            Span span;
+            span.offset = capacity;
+            span.size = newCapacity - capacity;
+            free.push_back(span);
+        }
+        capacity = newCapacity;
+    }
+
+    std::size_t GeometryArena::FreeList::holes() const
+    {
+        std::size_t total = 0;
+        for (const Span &span : free)
+            total += span.size;
+        if (!free.empty() && free.back().offset + free.back().size == capacity)
+            total -= free.back().size; // 末尾の空きは穴ではない
+        return total;
+    }
+
+    // ---- GeometryArena ----
+    void GeometryArena::init()
+    {
+        glGenVertexArrays(1, &vao_);
+        resize(vbo_, sizeof(VertexPacked), 0, kMinVertices);
+        vertices_.grow(kMinVertices);
+        resize(ebo_, sizeof(std::uint32_t), 0, kMinIndices);
+        indices_.grow(kMinIndices);
+        bindLayout();
+    }
+
+    void GeometryArena::destroy()
+    {
+        if (vao_ != 0)
+            glDeleteVertexArrays(1, &vao_);
+        if (vbo_ != 0)
+            glDeleteBuffers(1, &vbo_);
+        if (ebo_ != 0)
+            glDeleteBuffers(1, &ebo_);
+        vao_ = vbo_ = ebo_ = 0;
+        vertices_ = FreeList();
+        indices_ = FreeList();
+        slots_.clear();
+        freeSlots_.clear();
+        packed_.clear();
+        packed_.shrink_to_fit();
+        shortIndices_.clear();
+        shortIndices_.shrink_to_fit();
+        liveIndices_ = 0;
+        maxNormalError_ = 0.0;
+    }
+
+    // 中身を残したまま容量を変える（oldCapacity ぶんをコピー）
+    void GeometryArena::resize(GLuint &buffer, const std::size_t stride, const std::size_t oldCapacity,
+                               const std::size_t newCapacity)
+    {
+        GLuint grown = 0;
+        glGenBuffers(1, &grown);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(newCapacity * stride), nullptr, GL_STATIC_DRAW);
+        if (buffer != 0)
+        {
+            if (oldCapacity > 0)
+            {
+                glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                                    static_cast<GLsizeiptr>(oldCapacity * stride));
+                glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        buffer = grown;
+    }
+
+    // VAO の頂点属性と EBO を今のバッファに向け直す。
+    // インスタンス属性（location 2..5）は描画ごとに bindInstanceRange() が向けるので触らない。
+    // 描画の途中で呼ばれても GLStateCache の覚えている VAO がずれないよう，元の VAO に戻す
+    void GeometryArena::bindLayout()
+    {
+        GLint previous = 0;
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous);
+
+        glBindVertexArray(vao_);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+        const GLsizei stride = static_cast<GLsizei>(sizeof(VertexPacked));
+        // layout(location = 0) aPos, 1) aNormal（xyz 法線 × 511，w カプセルの蓋。整数のまま float で読む）
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexPacked, pos)));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexPacked, normalCap)));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+
+        glBindVertexArray(static_cast<GLuint>(previous));
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    std::size_t GeometryArena::allocate(FreeList &list, GLuint &buffer, const std::size_t stride, const std::size_t n)
+    {
+        std::size_t offset = 0;
+        if (list.allocate(n, offset))
+            return offset;
+
+        // 1.5 倍（足りなければ必要なだけ）に広げる。末尾の空きとつながるので必ず取れる
+        const std::size_t newCapacity = std::max(list.capacity + list.capacity / 2, list.capacity + n);
+        resize(buffer, stride, list.capacity, newCapacity);
+        list.grow(newCapacity);
+        bindLayout();
+        list.allocate(n, offset);
+        return offset;
+    }
+
+    void GeometryArena::upload(Mesh &mesh, const VertexPNC *vertices, const std::size_t vertexCount,
+                               const std::uint32_t *indices, const std::size_t indexCount)
+    {
+        packed_.resize(vertexCount);
+        for (std::size_t i = 0; i < vertexCount; ++i)
+        {
+            double err;
+            packed_[i].pos = vertices[i].pos;
+            packed_[i].normalCap = packNormalCap(vertices[i].normal, vertices[i].cap, err);
+            maxNormalError_ = std::max(maxNormalError_, err);
+        }
+        uploadPacked(mesh, indices, indexCount);
+    }
+
+    void GeometryArena::upload(Mesh &mesh, const std::vector<VertexPN> &vertices,
+                               const std::vector<std::uint32_t> &indices)
+    {
+        packed_.resize(vertices.size());
+        for (std::size_t i = 0; i < vertices.size(); ++i)
+        {
+            double err;
+            packed_[i].pos = vertices[i].pos;
+            packed_[i].normalCap = packNormalCap(vertices[i].normal, 0.0f, err);
+            maxNormalError_ = std::max(maxNormalError_, err);
+        }
+        uploadPacked(mesh, indices.data(), indices.size());
+    }
+
+    // packed_ の頂点を載せる
+    void GeometryArena::uploadPacked(Mesh &mesh, const std::uint32_t *indices, const std::size_t indexCount)
+    {
+        const std::size_t vertexCount = packed_.size();
+        std::uint32_t id;
+        if (!freeSlots_.empty())
+        {
+            id = freeSlots_.back();
+            freeSlots_.pop_back();
+        }
+        else
+        {
+            slots_.emplace_back();
+            id = static_cast<std::uint32_t>(slots_.size());
+        }
+
+        Slot &slot = slots_[id - 1];
+        slot.vertices.offset = allocate(vertices_, vbo_, sizeof(VertexPacked), vertexCount);
+        slot.vertices.size = vertexCount;
+        slot.shortIndices = shortIndices(vertexCount);
+        const std::size_t words = slot.shortIndices ? (indexCount + 1) / 2 : indexCount;
+        slot.indices.offset = allocate(indices_, ebo_, sizeof(std::uint32_t), words);
+        slot.indices.size = words;
+        slot.indexCount = indexCount;
+        slot.live = true;
+        liveIndices_ += indexCount;
+
+        // 16bit に詰め直す（奇数個なら最後の 1 つぶんは埋め草）
+        const void *indexData = indices;
+        if (slot.shortIndices)
+        {
+            shortIndices_.assign(words * 2, 0);
+            for (std::size_t i = 0; i < indexCount; ++i)
+                shortIndices_[i] = static_cast<std::uint16_t>(indices[i]);
+            indexData = shortIndices_.data();
+        }
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo_);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(slot.vertices.offset * sizeof(VertexPacked)),
+                        static_cast<GLsizeiptr>(vertexCount * sizeof(VertexPacked)), packed_.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ebo_);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(slot.indices.offset * sizeof(std::uint32_t)),
+                        static_cast<GLsizeiptr>(words * sizeof(std::uint32_t)), indexData);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        mesh.vao = vao_;
+        mesh.vbo = 0;
+        mesh.ebo = 0;
+        mesh.indexCount = static_cast<GLsizei>(indexCount);
+        mesh.primitive = GL_TRIANGLES;
+        mesh.geometry = id;
+        refresh(mesh);
+    }
+
+    void GeometryArena::release(Mesh &mesh)
+    {
+        if (mesh.geometry == 0 || mesh.geometry > slots_.size())
+            return;
+        Slot &slot = slots_[mesh.geometry - 1];
+        if (slot.live)
+        {
+            vertices_.release(slot.vertices.offset, slot.vertices.size);
+            indices_.release(slot.indices.offset, slot.indices.size);
+            liveIndices_ -= slot.indexCount;
+            slot.live = false;
+            freeSlots_.push_back(mesh.geometry);
+        }
+        mesh = Mesh();
+    }
+
+    void GeometryArena::refresh(Mesh &mesh) const
+    {
+        if (mesh.geometry == 0)
+            return;
+        const Slot &slot = slots_[mesh.geometry - 1];
+        mesh.baseVertex = static_cast<GLint>(slot.vertices.offset);
+        mesh.indexType = slot.shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        mesh.firstIndex = static_cast<GLuint>(slot.shortIndices ? slot.indices.offset * 2 : slot.indices.offset);
+    }
+
+    bool GeometryArena::fragmented() const
+    {
+        // 穴が使っている量の 1/4 を超えたら
+        for (const FreeList *list : {&vertices_, &indices_})
+        {
+            const std::size_t holes = list->holes();
+            if (holes >= kMinHoles && holes * 4 > list->used)
+                return true;
+        }
+        return false;
+    }
+
+    // 使っている場所を先頭から位置順に詰めた新しいバッファへ移す（容量はそのまま）
+    void GeometryArena::compact()
+    {
+        std::vector<Slot *> live;
+        for (Slot &slot : slots_)
+        {
+            if (slot.live)
+                live.push_back(&slot);
+        }
+
+        auto pack = [&live](FreeList &list, GLuint &buffer, const std::size_t stride, Span Slot::*member)
+        {
+            std::sort(live.begin(), live.end(),
+                      [member](const Slot *a, const Slot *b) { return (a->*member).offset < (b->*member).offset; });
+
+            GLuint packed = 0;
+            glGenBuffers(1, &packed);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, packed);
+            glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(list.capacity * stride), nullptr,
+                         GL_STATIC_DRAW);
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            std::size_t at = 0;
+            for (Slot *slot : live)
+            {
+                Span &span = slot->*member;
+                if (span.size > 0)
+                {
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                        static_cast<GLintptr>(span.offset * stride),
+                                        static_cast<GLintptr>(at * stride),
+                                        static_cast<GLsizeiptr>(span.size * stride));
+                }
+                span.offset = at;
+                at += span.size;
+            }
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+            buffer = packed;
+
+            list.free.clear();
+            list.used = at;
+            if (at < list.capacity)
+            {
+                Span rest;
+                rest.offset = at;
+                rest.size = list.capacity - at;
+                list.free.push_back(rest);
+            }
+        };
+        pack(vertices_, vbo_, sizeof(VertexPacked), &Slot::vertices);
+        pack(indices_, ebo_, sizeof(std::uint32_t), &Slot::indices);
+        bindLayout();
+    }
+} // namespace ds_internal
@@ -0,0 +1,63 @@
+// gl_extensions.cpp - optional OpenGL 4.x entry points for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include <cstring>
+
+#include "gl_extensions.hpp"
+
+namespace ds_internal
+{
+    GLExtensions glExt;
+
+    bool hasGLExtension(const char *name)
+    {
+        GLint n = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+        for (GLint i = 0; i < n; ++i)
+        {
+            const char *ext = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+            if (ext && std::strcmp(ext, name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void loadGLExtensions()
+    {
+        glExt = GLExtensions();
+        glGetIntegerv(GL_MAJOR_VERSION, &glExt.major);
+        glGetIntegerv(GL_MINOR_VERSION, &glExt.minor);
+
+        // ---- buffer storage（永続マップ用）----
+        if (glExt.versionAtLeast(4, 4) || hasGLExtension("GL_ARB_buffer_storage"))
+        {
+            glExt.BufferStorage = reinterpret_cast<PFN_dsglBufferStorage>(getGLProcAddress("glBufferStorage"));
+            glExt.bufferStorage = (glExt.BufferStorage != nullptr);
+        }
+
+        // ---- 間接描画とクエリ結果のバッファ書き込み（GPU カリングの描画数用）----
+        if (glExt.versionAtLeast(4, 0) || hasGLExtension("GL_ARB_draw_indirect"))
+        {
+            glExt.DrawElementsIndirect =
+                reinterpret_cast<PFN_dsglDrawElementsIndirect>(getGLProcAddress("glDrawElementsIndirect"));
+            glExt.drawIndirect = (glExt.DrawElementsIndirect != nullptr);
+        }
+
+        // ---- まとめて間接描画（1 パスの instanced draw を 1 回に）----
+        const bool baseInstance = glExt.versionAtLeast(4, 2) || hasGLExtension("GL_ARB_base_instance");
+        if (glExt.drawIndirect && baseInstance &&
+            (glExt.versionAtLeast(4, 3) || hasGLExtension("GL_ARB_multi_draw_indirect")))
+        {
+            glExt.MultiDrawElementsIndirect = reinterpret_cast<PFN_dsglMultiDrawElementsIndirect>(
+                getGLProcAddress("glMultiDrawElementsIndirect"));
+            glExt.multiDrawIndirect = (glExt.MultiDrawElementsIndirect != nullptr);
+        }
+        glExt.queryBufferObject = glExt.versionAtLeast(4, 4) || hasGLExtension("GL_ARB_query_buffer_object");
+    }
+} // namespace ds_internal
@@ -0,0 +1,80 @@
+// gl_extensions.hpp - optional OpenGL 4.x entry points for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#pragma once
+
+#include <glad/glad.h>
+
+// 同梱の glad は GL 3.3 core だけを生成しているので，
+// 4.x / ARB 拡張で使いたい関数・定数はここで自前に読み込む。
+// 使えない環境では各フラグが false のままになり，3.3 の経路にフォールバックする。
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_DYNAMIC_STORAGE_BIT
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+#endif
+#ifndef GL_CLIENT_STORAGE_BIT
+#define GL_CLIENT_STORAGE_BIT 0x0200
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_QUERY_BUFFER
+#define GL_QUERY_BUFFER 0x9192
+#endif
+
+namespace ds_internal
+{
+    typedef void(APIENTRYP PFN_dsglBufferStorage)(GLenum target, GLsizeiptr size,
+                                                  const void *data, GLbitfield flags);
+    typedef void(APIENTRYP PFN_dsglDrawElementsIndirect)(GLenum mode, GLenum type, const void *indirect);
+    typedef void(APIENTRYP PFN_dsglMultiDrawElementsIndirect)(GLenum mode, GLenum type, const void *indirect,
+                                                             GLsizei drawcount, GLsizei stride);
+
+    struct GLExtensions
+    {
+        int major = 0;
+        int minor = 0;
+
+        // GL 4.4 / GL_ARB_buffer_storage
+        bool bufferStorage = false;
+        PFN_dsglBufferStorage BufferStorage = nullptr;
+
+        // GL 4.0 / GL_ARB_draw_indirect
+        bool drawIndirect = false;
+        PFN_dsglDrawElementsIndirect DrawElementsIndirect = nullptr;
+
+        // GL 4.3 / GL_ARB_multi_draw_indirect。コマンドの baseInstance を効かせるため
+        // GL 4.2 / GL_ARB_base_instance もあるときだけ true
+        bool multiDrawIndirect = false;
+        PFN_dsglMultiDrawElementsIndirect MultiDrawElementsIndirect = nullptr;
+
+        // GL 4.4 / GL_ARB_query_buffer_object（関数は増えない：GL_QUERY_BUFFER に結果を書ける）
+        bool queryBufferObject = false;
+
+        bool versionAtLeast(const int maj, const int min) const
+        {
+            return major > maj || (major == maj && minor >= min);
+        }
+    };
+
+    extern GLExtensions glExt;
+
+    // コンテキスト作成・gladLoadGL() の後に 1 回だけ呼ぶ
+    void loadGLExtensions();
+    bool hasGLExtension(const char *name);
+
+    // プラットフォーム層（platform_x11_glx.cpp）が提供する
+    void *getGLProcAddress(const char *name);
+} // namespace ds_internal
@@ -0,0 +1,239 @@
+// gl_state.cpp - shadowed GL state for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    void GLStateCache::invalidate()
+    {
+        program_ = kUnknown;
+        vao_ = kUnknown;
+        for (int &c : capability_)
+            c = -1;
+        depthFunc_ = kUnknown;
+        depthRange_[0] = depthRange_[1] = -1.0f; // glDepthRange は [0,1] に丸めるので来ない値
+        depthMask_ = -1;
+        blendFunc_[0] = blendFunc_[1] = kUnknown;
+        polygonOffsetKnown_ = false;
+        polygonMode_ = kUnknown;
+        lineWidth_ = -1.0f;
+        activeUnit_ = -1;
+        for (GLuint &t : textures_)
+            t = kUnknown;
+        programUniforms_ = nullptr;
+    }
+
+    void GLStateCache::reset()
+    {
+        invalidate();
+        uniforms_.clear();
+    }
+
+    void GLStateCache::useProgram(const GLuint program)
+    {
+        if (elide(program == program_))
+            return;
+        glUseProgram(program);
+        program_ = program;
+        programUniforms_ = (program != 0) ? &uniforms_[program] : nullptr;
+    }
+
+    void GLStateCache::bindVertexArray(const GLuint vao)
+    {
+        if (elide(vao == vao_))
+            return;
+        glBindVertexArray(vao);
+        vao_ = vao;
+    }
+
+    void GLStateCache::setCapability(const GLenum cap, const bool enable)
+    {
+        int i;
+        switch (cap)
+        {
+        case GL_DEPTH_TEST:
+            i = CAP_DEPTH_TEST;
+            break;
+        case GL_BLEND:
+            i = CAP_BLEND;
+            break;
+        case GL_CULL_FACE:
+            i = CAP_CULL_FACE;
+            break;
+        case GL_POLYGON_OFFSET_FILL:
+            i = CAP_POLYGON_OFFSET_FILL;
+            break;
+        default:
+            // 覚えていない capability はそのまま呼ぶ
+            elide(false);
+            if (enable)
+                glEnable(cap);
+            else
+                glDisable(cap);
+            return;
+        }
+        if (elide(capability_[i] == int(enable)))
+            return;
+        if (enable)
+            glEnable(cap);
+        else
+            glDisable(cap);
+        capability_[i] = int(enable);
+    }
+
+    void GLStateCache::depthFunc(const GLenum func)
+    {
+        if (elide(func == depthFunc_))
+            return;
+        glDepthFunc(func);
+        depthFunc_ = func;
+    }
+
+    void GLStateCache::depthMask(const bool write)
+    {
+        if (elide(depthMask_ == int(write)))
+            return;
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+        depthMask_ = int(write);
+    }
+
+    void GLStateCache::depthRange(const float zNear, const float zFar)
+    {
+        if (elide(zNear == depthRange_[0] && zFar == depthRange_[1]))
+            return;
+        glDepthRange(zNear, zFar);
+        depthRange_[0] = zNear;
+        depthRange_[1] = zFar;
+    }
+
+    void GLStateCache::blendFunc(const GLenum src, const GLenum dst)
+    {
+        if (elide(src == blendFunc_[0] && dst == blendFunc_[1]))
+            return;
+        glBlendFunc(src, dst);
+        blendFunc_[0] = src;
+        blendFunc_[1] = dst;
+    }
+
+    void GLStateCache::polygonOffset(const float factor, const float units)
+    {
+        if (elide(polygonOffsetKnown_ && factor == polygonOffset_[0] && units == polygonOffset_[1]))
+            return;
+        glPolygonOffset(factor, units);
+        polygonOffset_[0] = factor;
+        polygonOffset_[1] = units;
+        polygonOffsetKnown_ = true;
+    }
+
+    void GLStateCache::polygonMode(const GLenum mode)
+    {
+        if (elide(mode == polygonMode_))
+            return;
+        glPolygonMode(GL_FRONT_AND_BACK, mode);
+        polygonMode_ = mode;
+    }
+
+    void GLStateCache::lineWidth(const float width)
+    {
+        if (elide(width == lineWidth_))
+            return;
+        glLineWidth(width);
+        lineWidth_ = width;
+    }
+
+    void GLStateCache::bindTexture2D(const int unit, const GLuint texture)
+    {
+        if (unit < 0 || unit >= kTextureUnits)
+        {
+            internalError("GLStateCache::bindTexture2D: texture unit %d out of range", unit);
+            return;
+        }
+        if (elide(textures_[unit] == texture))
+            return;
+        if (!elide(activeUnit_ == unit))
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            activeUnit_ = unit;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        textures_[unit] = texture;
+    }
+
+    bool GLStateCache::sameUniform(const GLint loc, const void *v, const int n)
+    {
+        // location -1（最適化で消えた uniform）への代入は GL でも何もしない
+        if (loc < 0)
+            return true;
+        if (!programUniforms_)
+            return false;
+        std::vector<UniformSlot> &slots = *programUniforms_;
+        if (static_cast<std::size_t>(loc) >= slots.size())
+            slots.resize(static_cast<std::size_t>(loc) + 1);
+        UniformSlot &s = slots[static_cast<std::size_t>(loc)];
+        // ビット列で比べる（int もそのまま，-0.0 と 0.0 は別の値として送り直す）
+        const std::size_t bytes = static_cast<std::size_t>(n) * sizeof(float);
+        if (s.size == n && std::memcmp(s.v, v, bytes) == 0)
+            return true;
+        std::memcpy(s.v, v, bytes);
+        s.size = n;
+        return false;
+    }
+
+    void GLStateCache::uniform1i(const GLint loc, const GLint v)
+    {
+        static_assert(sizeof(GLint) == sizeof(float), "GLint and float must have the same size");
+        if (elide(sameUniform(loc, &v, 1)))
+            return;
+        glUniform1i(loc, v);
+    }
+
+    void GLStateCache::uniform1f(const GLint loc, const float v)
+    {
+        if (elide(sameUniform(loc, &v, 1)))
+            return;
+        glUniform1f(loc, v);
+    }
+
+    void GLStateCache::uniform2f(const GLint loc, const float x, const float y)
+    {
+        const float v[2] = {x, y};
+        if (elide(sameUniform(loc, v, 2)))
+            return;
+        glUniform2f(loc, x, y);
+    }
+
+    void GLStateCache::uniform3f(const GLint loc, const float x, const float y, const float z)
+    {
+        const float v[3] = {x, y, z};
+        if (elide(sameUniform(loc, v, 3)))
+            return;
+        glUniform3f(loc, x, y, z);
+    }
+
+    void GLStateCache::uniform4fv(const GLint loc, const float *v)
+    {
+        if (elide(sameUniform(loc, v, 4)))
+            return;
+        glUniform4fv(loc, 1, v);
+    }
+
+    void GLStateCache::uniformMatrix4fv(const GLint loc, const float *m)
+    {
+        if (elide(sameUniform(loc, m, 16)))
+            return;
+        glUniformMatrix4fv(loc, 1, GL_FALSE, m);
+    }
+
+    void GLStateCache::endFrame()
+    {
+        last_ = frame_;
+        frame_ = Stats();
+    }
+} // namespace ds_internal
@@ -0,0 +1,358 @@
+// instance_arena.cpp - ring-buffered instance storage for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+#include "gl_extensions.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // バケットごとの最小容量（インスタンス数）
+        constexpr std::size_t kMinBucketCapacity = 1024;
+        // 前フレームより少し多めに取っておく（増加中のシーンで溢れにくくする）
+        inline std::size_t estimateCapacity(const std::size_t lastCount)
+        {
+            const std::size_t c = lastCount + lastCount / 4;
+            return std::max(kMinBucketCapacity, (c + 255) & ~std::size_t(255));
+        }
+    } // anonymous namespace
+
+    void InstanceArena::init()
+    {
+        persistent_ = glExt.bufferStorage;
+        if (spillBuffer_ == 0)
+            glGenBuffers(1, &spillBuffer_);
+
+        std::size_t bytes = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+            bytes += estimateCapacity(0) * sizeof(InstanceCompact);
+        createBuffer(bytes);
+    }
+
+    void InstanceArena::destroy()
+    {
+        for (int i = 0; i < kFrameCount; ++i)
+            waitFence(i);
+        if (buffer_ != 0)
+        {
+            if (mapped_ || persistentPtr_)
+            {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &buffer_);
+            buffer_ = 0;
+        }
+        if (spillBuffer_ != 0)
+        {
+            glDeleteBuffers(1, &spillBuffer_);
+            spillBuffer_ = 0;
+        }
+        persistentPtr_ = nullptr;
+        mappedSlot_ = nullptr;
+        mapped_ = false;
+    }
+
+    // リング全体（slotBytes × kFrameCount）を作り直す
+    void InstanceArena::createBuffer(const std::size_t slotBytes)
+    {
+        // 古いバッファは GPU が使い終わるまでドライバが保持してくれるが，
+        // フェンスはバッファと一緒に捨てる
+        for (int i = 0; i < kFrameCount; ++i)
+            waitFence(i);
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        if (buffer_ != 0)
+        {
+            if (persistentPtr_)
+            {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+                persistentPtr_ = nullptr;
+            }
+            glDeleteBuffers(1, &buffer_);
+        }
+
+        slotBytes_ = slotBytes;
+        const GLsizeiptr total = static_cast<GLsizeiptr>(slotBytes_ * kFrameCount);
+
+        glGenBuffers(1, &buffer_);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+        if (persistent_)
+        {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glExt.BufferStorage(GL_COPY_WRITE_BUFFER, total, nullptr, flags);
+            persistentPtr_ = static_cast<unsigned char *>(
+                glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total, flags));
+            if (!persistentPtr_)
+                fatalError("InstanceArena: persistent mapping of instance buffer failed");
+        }
+        else
+        {
+            glBufferData(GL_COPY_WRITE_BUFFER, total, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    void InstanceArena::waitFence(const int slot)
+    {
+        GLsync &fence = fences_[slot];
+        if (!fence)
+            return;
+
+        // 普通は 2 フレーム前のコマンドなのでもう終わっている
+        GLbitfield flags = 0;
+        for (;;)
+        {
+            const GLenum r = glClientWaitSync(fence, flags, 1000000000ull); // 1 秒
+            if (r == GL_ALREADY_SIGNALED || r == GL_CONDITION_SATISFIED || r == GL_WAIT_FAILED)
+                break;
+            flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    void InstanceArena::beginFrame()
+    {
+        slot_ = (slot_ + 1) % kFrameCount;
+        deferred_ = wantDeferred_;
+
+        // ---- バケットの配置を前フレームの個数から決める ----
+        std::size_t need = 0;
+        std::size_t caps[BUCKET_COUNT];
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            caps[b] = estimateCapacity(segments_[b].lastCount);
+            need += caps[b] * sizeof(InstanceCompact);
+        }
+
+        if (deferred_)
+        {
+            // 遅延モード：GPU 側はまだ触らない（フェンス待ちも mapOutput まで遅らせる）
+            for (int b = 0; b < BUCKET_COUNT; ++b)
+            {
+                Segment &seg = segments_[b];
+                if (seg.staging.size() < caps[b])
+                    seg.staging.resize(caps[b]);
+                seg.offset = 0;
+                seg.base = seg.staging.data();
+                seg.capacity = seg.staging.size();
+                seg.count = 0;
+                seg.overflow.clear();
+                seg.ranges.clear();
+                seg.shadowRanges.clear();
+            }
+            return;
+        }
+
+        if (need > slotBytes_)
+        {
+            // 足りなければリングごと拡張（1.5 倍単位で伸ばして頻繁な再確保を避ける）
+            createBuffer(std::max(need, slotBytes_ + slotBytes_ / 2));
+        }
+        else
+        {
+            waitFence(slot_);
+        }
+
+        const std::size_t slotOffset = slotBytes_ * static_cast<std::size_t>(slot_);
+        if (persistent_)
+        {
+            mappedSlot_ = persistentPtr_ + slotOffset;
+        }
+        else
+        {
+            // フェンスで GPU の読み終わりを確認済みなので同期なしでマップしてよい
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+            mappedSlot_ = static_cast<unsigned char *>(glMapBufferRange(
+                GL_COPY_WRITE_BUFFER,
+                static_cast<GLintptr>(slotOffset),
+                static_cast<GLsizeiptr>(slotBytes_),
+                GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            if (!mappedSlot_)
+                fatalError("InstanceArena: glMapBufferRange failed");
+            mapped_ = true;
+        }
+
+        std::size_t offset = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            Segment &seg = segments_[b];
+            seg.offset = offset;
+            seg.base = reinterpret_cast<InstanceCompact *>(mappedSlot_ + offset);
+            seg.capacity = caps[b];
+            seg.count = 0;
+            seg.overflow.clear();
+            seg.ranges.clear();
+            offset += caps[b] * sizeof(InstanceCompact);
+        }
+    }
+
+    InstanceCompact *InstanceArena::allocateSlow(const int bucket, const std::size_t n)
+    {
+        // マップ領域が尽きた分は CPU 側に退避して，endFrame で別バッファへ送る。
+        // 次フレームからは lastCount を元に容量が広がるので，ここに来るのは増加直後だけ。
+        Segment &seg = segments_[bucket];
+        if (deferred_)
+        {
+            // staging は CPU メモリなので伸ばしてしまえばよい
+            // （呼び出し側は書き込み後にポインタを持ち続けない）
+            seg.staging.resize(std::max(seg.count + n, seg.staging.size() * 2));
+            seg.base = seg.staging.data();
+            seg.capacity = seg.staging.size();
+            InstanceCompact *p = seg.base + seg.count;
+            seg.count += n;
+            return p;
+        }
+        const std::size_t old = seg.overflow.size();
+        seg.overflow.resize(old + n);
+        return seg.overflow.data() + old;
+    }
+
+    void InstanceArena::endFrame()
+    {
+        if (deferred_)
+        {
+            for (Segment &seg : segments_)
+                seg.lastCount = seg.count;
+            return;
+        }
+
+        if (!persistent_ && mapped_)
+        {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+            if (glUnmapBuffer(GL_COPY_WRITE_BUFFER) == GL_FALSE)
+            {
+                // 内容が失われた（モード切り替え等）。このフレームのインスタンスは諦める
+                for (Segment &seg : segments_)
+                    seg.count = 0;
+            }
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            mapped_ = false;
+        }
+
+        const std::size_t slotOffset = slotBytes_ * static_cast<std::size_t>(slot_);
+        std::size_t spillTotal = 0;
+        for (Segment &seg : segments_)
+        {
+            if (seg.count > 0)
+            {
+                InstanceRange r;
+                r.buffer = buffer_;
+                r.offset = static_cast<GLintptr>(slotOffset + seg.offset);
+                r.count = static_cast<GLsizei>(seg.count);
+                seg.ranges.push_back(r);
+            }
+            spillTotal += seg.overflow.size();
+            seg.lastCount = seg.count + seg.overflow.size();
+        }
+
+        if (spillTotal == 0)
+            return;
+
+        // ---- 溢れ分：まとめて 1 本のバッファに詰めて追加の描画範囲にする ----
+        glBindBuffer(GL_COPY_WRITE_BUFFER, spillBuffer_);
+        glBufferData(GL_COPY_WRITE_BUFFER,
+                     static_cast<GLsizeiptr>(spillTotal * sizeof(InstanceCompact)),
+                     nullptr, GL_STREAM_DRAW);
+        std::size_t spillOffset = 0;
+        for (Segment &seg : segments_)
+        {
+            if (seg.overflow.empty())
+                continue;
+            const std::size_t bytes = seg.overflow.size() * sizeof(InstanceCompact);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(spillOffset),
+                            static_cast<GLsizeiptr>(bytes), seg.overflow.data());
+
+            InstanceRange r;
+            r.buffer = spillBuffer_;
+            r.offset = static_cast<GLintptr>(spillOffset);
+            r.count = static_cast<GLsizei>(seg.overflow.size());
+            seg.ranges.push_back(r);
+            spillOffset += bytes;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    InstanceCompact *InstanceArena::mapOutput(const std::size_t total)
+    {
+        const std::size_t need = std::max<std::size_t>(total, 1) * sizeof(InstanceCompact);
+        if (need > slotBytes_)
+            createBuffer(std::max(need, slotBytes_ + slotBytes_ / 2));
+        else
+            waitFence(slot_);
+
+        const std::size_t slotOffset = slotBytes_ * static_cast<std::size_t>(slot_);
+        if (persistent_)
+        {
+            mappedSlot_ = persistentPtr_ + slotOffset;
+        }
+        else
+        {
+            // 使う分だけマップする
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+            mappedSlot_ = static_cast<unsigned char *>(glMapBufferRange(
+                GL_COPY_WRITE_BUFFER,
+                static_cast<GLintptr>(slotOffset),
+                static_cast<GLsizeiptr>(need),
+                GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            if (!mappedSlot_)
+                fatalError("InstanceArena: glMapBufferRange failed");
+            mapped_ = true;
+        }
+        return reinterpret_cast<InstanceCompact *>(mappedSlot_);
+    }
+
+    void InstanceArena::addRange(const int bucket, const std::size_t first, const std::size_t count,
+                                 const bool shadow, const int lod)
+    {
+        if (count == 0)
+            return;
+        InstanceRange r;
+        r.buffer = buffer_;
+        r.offset = static_cast<GLintptr>(slotBytes_ * static_cast<std::size_t>(slot_) +
+                                         first * sizeof(InstanceCompact));
+        r.count = static_cast<GLsizei>(count);
+        r.lod = lod;
+        Segment &seg = segments_[bucket];
+        (shadow ? seg.shadowRanges : seg.ranges).push_back(r);
+    }
+
+    void InstanceArena::unmapOutput()
+    {
+        if (persistent_ || !mapped_)
+            return;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+        if (glUnmapBuffer(GL_COPY_WRITE_BUFFER) == GL_FALSE)
+        {
+            // 内容が失われた。このフレームは描かない
+            for (Segment &seg : segments_)
+            {
+                seg.ranges.clear();
+                seg.shadowRanges.clear();
+            }
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        mapped_ = false;
+    }
+
+    void InstanceArena::fenceFrame()
+    {
+        if (fences_[slot_])
+            glDeleteSync(fences_[slot_]);
+        fences_[slot_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+} // namespace ds_internal
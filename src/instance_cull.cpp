@@ -0,0 +1,261 @@
+// instance_cull.cpp - frustum culling of recorded instances for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// 境界球による視錐台カリング。本描画用と，地面に落ちる影用の 2 つを同時に判定する。
+// x86-64 では SSE2 で 4 インスタンスずつ処理する（InstanceCompact は 36 バイトの
+// AoS なので，位置とスケールを 4 個分まとめて読んで転置する）。
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "drawstuff_core.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DS_CULL_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+namespace ds_internal
+{
+    namespace
+    {
+        // 境界球の半径^2 = a (sx^2 + sy^2) + b max(sx^2, sy^2) + c sz^2
+        // （bucket ごとの単位メッシュの形から決まる係数）
+        struct BoundCoef
+        {
+            float a, b, c;
+        };
+
+        BoundCoef boundCoef(const int bucket)
+        {
+            switch (bucket)
+            {
+            case BUCKET_BOX:
+                return {0.25f, 0.0f, 0.25f}; // 単位立方体 [-0.5, 0.5]^3
+            case BUCKET_CYLINDER:
+                return {0.0f, 1.0f, 0.25f}; // 半径 1, z ∈ [-0.5, 0.5]
+            case BUCKET_CAPSULE:
+                return {0.0f, 2.0f, 2.0f}; // 半径 r, 平行部 z ∈ [-h, h]：(r + h)^2 <= 2 (r^2 + h^2)
+            default:
+                return {0.0f, 1.0f, 0.0f}; // 単位球
+            }
+        }
+
+        // 前の段数 prev の範囲を hysteresis だけ広げて，まだ入っていれば prev のまま
+        int pickLod(const float px, const float (&th)[kLodLevels - 1], const int prev, const float hysteresis)
+        {
+            int lod = kLodLevels - 1;
+            for (int k = 0; k < kLodLevels - 1; ++k)
+            {
+                if (px >= th[k])
+                {
+                    lod = k;
+                    break;
+                }
+            }
+            if (prev < 0 || prev == lod)
+                return lod;
+            const float lo = (prev == kLodLevels - 1) ? 0.0f : th[prev] * (1.0f - hysteresis);
+            const bool belowHi = (prev == 0) || px < th[prev - 1] * (1.0f + hysteresis);
+            return (px >= lo && belowHi) ? prev : lod;
+        }
+
+        inline float projectedRadius(const LodParams &lod, const float x, const float y, const float z,
+                                     const float r)
+        {
+            const float w = lod.wRow[0] * x + lod.wRow[1] * y + lod.wRow[2] * z + lod.wRow[3];
+            // 視点が球の中にあるときは最も細かく
+            return (w <= r) ? 1e30f : r * lod.pixelScale / w;
+        }
+
+        inline bool sphereInside(const float planes[6][4], const float x, const float y, const float z,
+                                 const float r)
+        {
+            for (int k = 0; k < 6; ++k)
+            {
+                if (planes[k][0] * x + planes[k][1] * y + planes[k][2] * z + planes[k][3] < -r)
+                    return false;
+            }
+            return true;
+        }
+
+        std::uint8_t cullOne(const InstanceCompact &inst, const BoundCoef &bc, const CullParams &p)
+        {
+            const float sx2 = inst.scale[0] * inst.scale[0];
+            const float sy2 = inst.scale[1] * inst.scale[1];
+            const float sz2 = inst.scale[2] * inst.scale[2];
+            const float r = std::sqrt(bc.a * (sx2 + sy2) + bc.b * std::max(sx2, sy2) + bc.c * sz2);
+            const float x = inst.pos[0], y = inst.pos[1], z = inst.pos[2];
+
+            std::uint8_t m = sphereInside(p.planes, x, y, z, r) ? kCullMain : 0;
+            if (p.shadows &&
+                sphereInside(p.planes, x - p.shadowKx * z, y - p.shadowKy * z, 0.0f, r * p.shadowScale))
+                m |= kCullShadow;
+            return m;
+        }
+
+#ifdef DS_CULL_KERNEL_X86
+        // 4 枚ずつの平面判定：全平面で n・c + d >= -r なら内側
+        inline __m128 insideSSE(const __m128 (&pl)[6][4], const __m128 x, const __m128 y, const __m128 z,
+                                const __m128 negR)
+        {
+            __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int k = 0; k < 6; ++k)
+            {
+                const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pl[k][0], x), _mm_mul_ps(pl[k][1], y)),
+                                            _mm_add_ps(_mm_mul_ps(pl[k][2], z), pl[k][3]));
+                in = _mm_and_ps(in, _mm_cmpge_ps(d, negR));
+            }
+            return in;
+        }
+#endif
+    } // anonymous namespace
+
+    void selectInstanceLod(const InstanceCompact *in, const std::size_t n, const int bucket,
+                           const CullParams &params, const LodParams &lod, std::uint8_t *mask,
+                           std::uint8_t *state, std::size_t mainCount[kLodLevels],
+                           std::size_t shadowCount[kLodLevels])
+    {
+        // state：bit0-1 本描画の段数，bit2-3 影の段数，bit6 本描画が有効，bit7 影が有効
+        constexpr std::uint8_t kMainValid = 0x40, kShadowValid = 0x80;
+        const BoundCoef bc = boundCoef(bucket);
+        for (int k = 0; k < kLodLevels; ++k)
+            mainCount[k] = shadowCount[k] = 0;
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            std::uint8_t m = mask[i];
+            std::uint8_t st = state[i];
+            if ((m & (kCullMain | kCullShadow)) == 0)
+            {
+                state[i] = 0; // 見えない間は覚えておかない
+                continue;
+            }
+            const InstanceCompact &inst = in[i];
+            const float sx2 = inst.scale[0] * inst.scale[0];
+            const float sy2 = inst.scale[1] * inst.scale[1];
+            const float sz2 = inst.scale[2] * inst.scale[2];
+            const float r = std::sqrt(bc.a * (sx2 + sy2) + bc.b * std::max(sx2, sy2) + bc.c * sz2);
+            const float x = inst.pos[0], y = inst.pos[1], z = inst.pos[2];
+
+            std::uint8_t next = 0;
+            if (m & kCullMain)
+            {
+                const int prev = (st & kMainValid) ? (st & 3) : -1;
+                const int k = pickLod(projectedRadius(lod, x, y, z, r), lod.mainPixels, prev, lod.hysteresis);
+                m |= static_cast<std::uint8_t>(k << kLodMainShift);
+                next |= static_cast<std::uint8_t>(k | kMainValid);
+                ++mainCount[k];
+            }
+            if (m & kCullShadow)
+            {
+                const int prev = (st & kShadowValid) ? ((st >> 2) & 3) : -1;
+                const float px = projectedRadius(lod, x - params.shadowKx * z, y - params.shadowKy * z, 0.0f,
+                                                 r * params.shadowScale);
+                const int k = pickLod(px, lod.shadowPixels, prev, lod.hysteresis);
+                m |= static_cast<std::uint8_t>(k << kLodShadowShift);
+                next |= static_cast<std::uint8_t>((k << 2) | kShadowValid);
+                ++shadowCount[k];
+            }
+            mask[i] = m;
+            state[i] = next;
+        }
+    }
+
+    void cullBoundCoef(const int bucket, float coef[3])
+    {
+        const BoundCoef bc = boundCoef(bucket);
+        coef[0] = bc.a;
+        coef[1] = bc.b;
+        coef[2] = bc.c;
+    }
+
+    void extractFrustumPlanes(const glm::mat4 &m, float planes[6][4])
+    {
+        // Gribb-Hartmann：clip = M p の各行から left/right/bottom/top/near/far を作る
+        // glm は列優先なので行 i は (m[0][i], m[1][i], m[2][i], m[3][i])
+        for (int k = 0; k < 6; ++k)
+        {
+            const int row = k / 2;
+            const float sign = (k % 2 == 0) ? 1.0f : -1.0f;
+            float n[4];
+            for (int c = 0; c < 4; ++c)
+                n[c] = m[c][3] + sign * m[c][row];
+            const float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            const float inv = len > 0.0f ? 1.0f / len : 0.0f;
+            for (int c = 0; c < 4; ++c)
+                planes[k][c] = n[c] * inv;
+        }
+    }
+
+    void cullInstanceVisibility(const InstanceCompact *in, const std::size_t n, const int bucket,
+                                const CullParams &params, std::uint8_t *mask,
+                                std::size_t &mainCount, std::size_t &shadowCount)
+    {
+        const BoundCoef bc = boundCoef(bucket);
+        std::size_t nMain = 0, nShadow = 0;
+        std::size_t i = 0;
+
+#ifdef DS_CULL_KERNEL_X86
+        __m128 pl[6][4];
+        for (int k = 0; k < 6; ++k)
+            for (int c = 0; c < 4; ++c)
+                pl[k][c] = _mm_set1_ps(params.planes[k][c]);
+        const __m128 ca = _mm_set1_ps(bc.a), cb = _mm_set1_ps(bc.b), cc = _mm_set1_ps(bc.c);
+        const __m128 kx = _mm_set1_ps(params.shadowKx), ky = _mm_set1_ps(params.shadowKy);
+        const __m128 ks = _mm_set1_ps(params.shadowScale);
+        const __m128 zero = _mm_setzero_ps();
+
+        // scale から 16 バイト読むと color までで，ちょうどレコードの末尾に収まる
+        for (; i + 4 <= n; i += 4)
+        {
+            const InstanceCompact *p = in + i;
+            // pos (x y z + rot の一部)，scale (sx sy sz + color) を 4 個分読んで転置
+            __m128 x = _mm_loadu_ps(p[0].pos), y = _mm_loadu_ps(p[1].pos);
+            __m128 z = _mm_loadu_ps(p[2].pos), w0 = _mm_loadu_ps(p[3].pos);
+            _MM_TRANSPOSE4_PS(x, y, z, w0);
+            __m128 sx = _mm_loadu_ps(p[0].scale), sy = _mm_loadu_ps(p[1].scale);
+            __m128 sz = _mm_loadu_ps(p[2].scale), w1 = _mm_loadu_ps(p[3].scale);
+            _MM_TRANSPOSE4_PS(sx, sy, sz, w1);
+
+            const __m128 sx2 = _mm_mul_ps(sx, sx), sy2 = _mm_mul_ps(sy, sy), sz2 = _mm_mul_ps(sz, sz);
+            const __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ca, _mm_add_ps(sx2, sy2)),
+                                                    _mm_mul_ps(cb, _mm_max_ps(sx2, sy2))),
+                                         _mm_mul_ps(cc, sz2));
+            const __m128 r = _mm_sqrt_ps(r2);
+
+            const int vis = _mm_movemask_ps(insideSSE(pl, x, y, z, _mm_sub_ps(zero, r)));
+            int shadow = 0;
+            if (params.shadows)
+            {
+                const __m128 shx = _mm_sub_ps(x, _mm_mul_ps(kx, z));
+                const __m128 shy = _mm_sub_ps(y, _mm_mul_ps(ky, z));
+                shadow = _mm_movemask_ps(insideSSE(pl, shx, shy, zero, _mm_sub_ps(zero, _mm_mul_ps(r, ks))));
+            }
+            for (int j = 0; j < 4; ++j)
+            {
+                const std::uint8_t m = static_cast<std::uint8_t>(((vis >> j) & 1) | (((shadow >> j) & 1) << 1));
+                mask[i + j] = m;
+                nMain += (m & kCullMain);
+                nShadow += (m >> 1);
+            }
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            const std::uint8_t m = cullOne(in[i], bc, params);
+            mask[i] = m;
+            nMain += (m & kCullMain);
+            nShadow += (m >> 1);
+        }
+        mainCount = nMain;
+        shadowCount = nShadow;
+    }
+} // namespace ds_internal
@@ -0,0 +1,273 @@
+// instance_cull_gpu.cpp - GPU frustum culling via transform feedback for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// 選別は GL 3.3 の範囲（VS + GS + transform feedback）で行う。
+// VS だけだと出力を詰められないので，GS で見えるものだけ点を出す。
+// glDrawTransformFeedbackInstanced は捕まえた数を「頂点数」に使うので，
+// インスタンス数には GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN クエリを使う。
+
+#include <algorithm>
+#include <cstddef>
+
+#include "drawstuff_core.hpp"
+#include "gl_extensions.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // 出力バッファの最小容量（インスタンス数）
+        constexpr std::size_t kMinCullCapacity = 1024;
+    } // anonymous namespace
+
+    void GpuCuller::init(const GLuint program)
+    {
+        program_ = program;
+        uPlanes_ = glGetUniformLocation(program, "uPlanes");
+        uBound_ = glGetUniformLocation(program, "uBound");
+        uShadow_ = glGetUniformLocation(program, "uShadow");
+        uShadowPass_ = glGetUniformLocation(program, "uShadowPass");
+        uWRow_ = glGetUniformLocation(program, "uWRow");
+        uPixelScale_ = glGetUniformLocation(program, "uPixelScale");
+        uMinPixels_ = glGetUniformLocation(program, "uMinPixels");
+        uOcclusion_ = glGetUniformLocation(program, "uOcclusion");
+        uHiZ_ = glGetUniformLocation(program, "uHiZ");
+        uHiZViewProj_ = glGetUniformLocation(program, "uHiZViewProj");
+        uHiZScreen_ = glGetUniformLocation(program, "uHiZScreen");
+        uHiZMaxLevel_ = glGetUniformLocation(program, "uHiZMaxLevel");
+
+        glGenVertexArrays(1, &vao_);
+        glBindVertexArray(vao_);
+        for (GLuint loc = 0; loc <= 3; ++loc)
+            glEnableVertexAttribArray(loc); // divisor 0：インスタンス 1 個 = 点 1 個
+        glBindVertexArray(0);
+
+        for (auto &pass : out_)
+        {
+            for (Output &o : pass)
+            {
+                glGenBuffers(1, &o.buffer);
+                glGenQueries(1, &o.query);
+                glGenQueries(1, &o.frustumQuery);
+            }
+        }
+
+        if (glExt.drawIndirect && glExt.queryBufferObject)
+        {
+            glGenBuffers(1, &indirect_);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * 2 * BUCKET_COUNT,
+                         nullptr, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+    }
+
+    void GpuCuller::destroy()
+    {
+        for (auto &pass : out_)
+        {
+            for (Output &o : pass)
+            {
+                if (o.buffer != 0)
+                    glDeleteBuffers(1, &o.buffer);
+                if (o.query != 0)
+                    glDeleteQueries(1, &o.query);
+                if (o.frustumQuery != 0)
+                    glDeleteQueries(1, &o.frustumQuery);
+                o = Output();
+            }
+        }
+        if (indirect_ != 0)
+            glDeleteBuffers(1, &indirect_);
+        if (vao_ != 0)
+            glDeleteVertexArrays(1, &vao_);
+        indirect_ = 0;
+        vao_ = 0;
+        program_ = 0; // プログラム自体は DrawstuffApp の持ち物
+    }
+
+    // 入力は InstanceCompact の並び。回転と色は整数のまま受けてそのまま書き戻す
+    void GpuCuller::bindInput(const InstanceRange &r)
+    {
+        const GLsizei stride = static_cast<GLsizei>(sizeof(InstanceCompact));
+        const std::size_t base = static_cast<std::size_t>(r.offset);
+
+        glBindBuffer(GL_ARRAY_BUFFER, r.buffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, pos)));
+        glVertexAttribIPointer(1, 2, GL_UNSIGNED_INT, stride,
+                               reinterpret_cast<const void *>(base + offsetof(InstanceCompact, rot)));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<const void *>(base + offsetof(InstanceCompact, scale)));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, stride,
+                               reinterpret_cast<const void *>(base + offsetof(InstanceCompact, color)));
+    }
+
+    // 前のフレームのクエリ結果を読む（描画はもう発行済みなので通常は待たない）
+    void GpuCuller::collectStats()
+    {
+        lastInstances_ = instances_;
+        lastShadows_ = shadows_;
+        lastVisible_ = 0;
+        lastShadowVisible_ = 0;
+        lastOccluded_ = 0;
+        lastShadowOccluded_ = 0;
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (const Output &o : out_[pass])
+            {
+                if (!o.active)
+                    continue;
+                GLuint n = 0;
+                glGetQueryObjectuiv(o.query, GL_QUERY_RESULT, &n);
+                (pass == 0 ? lastVisible_ : lastShadowVisible_) += n;
+                if (o.counted)
+                {
+                    GLuint inFrustum = 0;
+                    glGetQueryObjectuiv(o.frustumQuery, GL_QUERY_RESULT, &inFrustum);
+                    (pass == 0 ? lastOccluded_ : lastShadowOccluded_) += (inFrustum > n) ? inFrustum - n : 0;
+                }
+            }
+        }
+    }
+
+    void GpuCuller::run(const std::vector<InstanceRange> (&inputs)[BUCKET_COUNT], const CullParams &params,
+                        const glm::vec4 &wRow, const float pixelScale, const float minPixels,
+                        const DepthPyramid *occluder)
+    {
+        collectStats();
+        const bool occlusion = occluder && occluder->valid();
+
+        glUseProgram(program_);
+        glUniform4fv(uPlanes_, 6, &params.planes[0][0]);
+        glUniform3f(uShadow_, params.shadowKx, params.shadowKy, params.shadowScale);
+        glUniform4f(uWRow_, wRow.x, wRow.y, wRow.z, wRow.w);
+        glUniform1f(uPixelScale_, pixelScale);
+        glUniform1f(uMinPixels_, minPixels);
+        glUniform1i(uOcclusion_, occlusion ? 1 : 0);
+        if (occlusion)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, occluder->texture());
+            glUniform1i(uHiZ_, 0);
+            glUniformMatrix4fv(uHiZViewProj_, 1, GL_FALSE, glm::value_ptr(occluder->viewProj()));
+            glUniform2i(uHiZScreen_, occluder->width(), occluder->height());
+            glUniform1i(uHiZMaxLevel_, occluder->levels() - 1);
+        }
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBindVertexArray(vao_);
+
+        instances_ = 0;
+        shadows_ = params.shadows;
+        const std::size_t stride = sizeof(InstanceCompact);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            glUniform1i(uShadowPass_, pass);
+            for (int b = 0; b < BUCKET_COUNT; ++b)
+            {
+                Output &o = out_[pass][b];
+                std::size_t total = 0;
+                for (const InstanceRange &r : inputs[b])
+                    total += static_cast<std::size_t>(r.count);
+                if (pass == 0)
+                    instances_ += total;
+                o.active = (total > 0) && (pass == 0 || params.shadows);
+                if (!o.active)
+                    continue;
+
+                // 全部残っても入るだけの容量を確保（中身は毎フレーム書き直すので捨ててよい）
+                if (total > o.capacity)
+                {
+                    o.capacity = std::max(kMinCullCapacity, total + total / 2);
+                    glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, o.buffer);
+                    glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, static_cast<GLsizeiptr>(o.capacity * stride),
+                                 nullptr, GL_DYNAMIC_COPY);
+                }
+
+                float coef[3];
+                cullBoundCoef(b, coef);
+                glUniform3fv(uBound_, 1, coef);
+
+                glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, o.buffer);
+                glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, o.query);
+                glBeginTransformFeedback(GL_POINTS);
+                for (const InstanceRange &r : inputs[b])
+                {
+                    bindInput(r);
+                    glDrawArrays(GL_POINTS, 0, r.count);
+                }
+                glEndTransformFeedback();
+                glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+
+                // 遮蔽で減った数を出すため，遮蔽判定なしでもう一度数える（出力はしない）
+                o.counted = occlusion;
+                if (occlusion)
+                {
+                    glUniform1i(uOcclusion_, 0);
+                    glBeginQuery(GL_PRIMITIVES_GENERATED, o.frustumQuery);
+                    for (const InstanceRange &r : inputs[b])
+                    {
+                        bindInput(r);
+                        glDrawArrays(GL_POINTS, 0, r.count);
+                    }
+                    glEndQuery(GL_PRIMITIVES_GENERATED);
+                    glUniform1i(uOcclusion_, 1);
+                }
+            }
+        }
+
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        if (occlusion)
+            glBindTexture(GL_TEXTURE_2D, 0);
+        glBindVertexArray(0);
+        glDisable(GL_RASTERIZER_DISCARD);
+    }
+
+    bool GpuCuller::output(const int bucket, const bool shadow, InstanceRange &r) const
+    {
+        const Output &o = out_[shadow ? 1 : 0][bucket];
+        if (!o.active)
+            return false;
+        r.buffer = o.buffer;
+        r.offset = 0;
+        r.count = static_cast<GLsizei>(o.capacity);
+        return true;
+    }
+
+    void GpuCuller::drawElements(const Mesh &mesh, const int bucket, const bool shadow)
+    {
+        const int slot = (shadow ? BUCKET_COUNT : 0) + bucket;
+        const Output &o = out_[shadow ? 1 : 0][bucket];
+
+        if (indirect_ != 0)
+        {
+            // インスタンス数はクエリ結果を GPU 上でコマンドへ直接書き込む（CPU は待たない）
+            const std::size_t offset = slot * sizeof(DrawElementsIndirectCommand);
+            const DrawElementsIndirectCommand cmd = {static_cast<GLuint>(mesh.indexCount), 0, mesh.firstIndex,
+                                                     mesh.baseVertex, 0};
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_);
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, static_cast<GLintptr>(offset), sizeof(cmd), &cmd);
+            glBindBuffer(GL_QUERY_BUFFER, indirect_);
+            glGetQueryObjectuiv(o.query, GL_QUERY_RESULT,
+                                reinterpret_cast<GLuint *>(offset + offsetof(DrawElementsIndirectCommand, instanceCount)));
+            glBindBuffer(GL_QUERY_BUFFER, 0);
+            glExt.DrawElementsIndirect(mesh.primitive, mesh.indexType, reinterpret_cast<const void *>(offset));
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            return;
+        }
+
+        // GL 3.3：結果を CPU で待つ（選別が終わるまでの間だけ止まる）
+        GLuint n = 0;
+        glGetQueryObjectuiv(o.query, GL_QUERY_RESULT, &n);
+        if (n > 0)
+            glDrawElementsInstancedBaseVertex(mesh.primitive, mesh.indexCount, mesh.indexType, mesh.indexOffset(),
+                                              static_cast<GLsizei>(n), mesh.baseVertex);
+    }
+} // namespace ds_internal
@@ -0,0 +1,270 @@
+// instance_pool.cpp - retained-mode instances for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        constexpr std::uint32_t kIndexBits = 24;
+        constexpr std::uint32_t kIndexMask = (1u << kIndexBits) - 1;
+        constexpr std::uint32_t kMaxEntries = kIndexMask - 1;
+
+        // GPU バッファの最小容量（インスタンス数）
+        constexpr std::size_t kMinPoolCapacity = 256;
+        // dirty な範囲の間がこれ以下なら 1 回の glBufferSubData にまとめる
+        constexpr std::size_t kMergeGap = 32;
+
+        inline bool testBit(const std::vector<std::uint64_t> &bits, const std::size_t i)
+        {
+            return (bits[i >> 6] >> (i & 63)) & 1u;
+        }
+    } // anonymous namespace
+
+    int InstancePool::shapeBucket(const int shape)
+    {
+        switch (shape)
+        {
+        case RETAINED_SPHERE:
+            return BUCKET_SPHERE;
+        case RETAINED_BOX:
+            return BUCKET_BOX;
+        case RETAINED_CYLINDER:
+            return BUCKET_CYLINDER;
+        default:
+            return BUCKET_CAPSULE;
+        }
+    }
+
+    const InstancePool::Entry *InstancePool::lookup(const std::uint32_t id) const
+    {
+        const std::uint32_t index = (id & kIndexMask);
+        if (index == 0 || index > entries_.size())
+            return nullptr;
+        const Entry &e = entries_[index - 1];
+        if (e.shape < 0 || (e.generation & 0xffu) != (id >> kIndexBits))
+            return nullptr;
+        return &e;
+    }
+
+    void InstancePool::markDirty(const int shape, const std::uint32_t slot)
+    {
+        std::vector<std::uint64_t> &dirty = shapes_[shape].dirty;
+        const std::size_t word = slot >> 6;
+        if (word >= dirty.size())
+            dirty.resize(word + 1, 0);
+        dirty[word] |= (std::uint64_t(1) << (slot & 63));
+    }
+
+    std::uint32_t InstancePool::create(const int shape, const float size[3])
+    {
+        std::uint32_t index;
+        if (!freeEntries_.empty())
+        {
+            index = freeEntries_.back();
+            freeEntries_.pop_back();
+        }
+        else
+        {
+            if (entries_.size() >= kMaxEntries)
+                return 0;
+            index = static_cast<std::uint32_t>(entries_.size());
+            entries_.emplace_back();
+        }
+
+        Entry &e = entries_[index];
+        ShapeSlots &slots = shapes_[shape];
+        e.shape = shape;
+        e.slot = static_cast<std::uint32_t>(slots.owner.size());
+        e.size[0] = size[0];
+        e.size[1] = size[1];
+        e.size[2] = size[2];
+        e.translucent = false;
+
+        slots.owner.push_back(index);
+        buckets_[shapeBucket(shape)].data.emplace_back();
+        markDirty(shape, e.slot);
+
+        return ((e.generation & 0xffu) << kIndexBits) | (index + 1);
+    }
+
+    void InstancePool::destroy(const std::uint32_t id)
+    {
+        if (!lookup(id))
+            return;
+        const std::uint32_t index = (id & kIndexMask) - 1;
+        Entry &e = entries_[index];
+        ShapeSlots &slots = shapes_[e.shape];
+
+        // 末尾のスロットを空いた位置へ移して詰める
+        const std::uint32_t last = static_cast<std::uint32_t>(slots.owner.size() - 1);
+        if (e.slot != last)
+        {
+            const std::uint32_t moved = slots.owner[last];
+            slots.owner[e.slot] = moved;
+            entries_[moved].slot = e.slot;
+            std::vector<InstanceCompact> &data = buckets_[shapeBucket(e.shape)].data;
+            data[e.slot] = data[last];
+            markDirty(e.shape, e.slot);
+        }
+        slots.owner.pop_back();
+        buckets_[shapeBucket(e.shape)].data.pop_back();
+        // 範囲外になったスロットの dirty は upload で無視される
+        if (e.translucent)
+            --translucentCount_;
+
+        e.shape = -1;
+        ++e.generation;
+        freeEntries_.push_back(index);
+    }
+
+    InstanceCompact *InstancePool::edit(const std::uint32_t id)
+    {
+        const Entry *e = lookup(id);
+        markDirty(e->shape, e->slot);
+        return &buckets_[shapeBucket(e->shape)].data[e->slot];
+    }
+
+    void InstancePool::setTranslucent(const std::uint32_t id, const bool translucent)
+    {
+        Entry &e = entries_[(id & kIndexMask) - 1];
+        if (e.translucent == translucent)
+            return;
+        e.translucent = translucent;
+        if (translucent)
+            ++translucentCount_;
+        else
+            --translucentCount_;
+        // GPU 側のスケールを 0 にする／戻す
+        markDirty(e.shape, e.slot);
+    }
+
+    void InstancePool::appendTranslucent(TransparentQueue &queue) const
+    {
+        if (translucentCount_ == 0)
+            return;
+        // 半透明は少数の想定なので，毎フレーム全スロットを見て拾う
+        for (int shape = 0; shape < RETAINED_SHAPE_COUNT; ++shape)
+        {
+            const std::vector<std::uint32_t> &owner = shapes_[shape].owner;
+            const int bucket = shapeBucket(shape);
+            const std::vector<InstanceCompact> &data = buckets_[bucket].data;
+            for (std::size_t slot = 0; slot < owner.size(); ++slot)
+            {
+                if (entries_[owner[slot]].translucent)
+                    *queue.allocate(bucket) = data[slot];
+            }
+        }
+    }
+
+    void InstancePool::uploadSlots(const int shape, const std::size_t first, const std::size_t n)
+    {
+        const std::size_t stride = sizeof(InstanceCompact);
+        const InstanceCompact *src = buckets_[shapeBucket(shape)].data.data() + first;
+        if (translucentCount_ > 0)
+        {
+            const std::vector<std::uint32_t> &owner = shapes_[shape].owner;
+            scratch_.assign(src, src + n);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                if (entries_[owner[first + i]].translucent)
+                    scratch_[i].scale[0] = scratch_[i].scale[1] = scratch_[i].scale[2] = 0.0f;
+            }
+            src = scratch_.data();
+        }
+        glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(first * stride),
+                        static_cast<GLsizeiptr>(n * stride), src);
+    }
+
+    void InstancePool::upload()
+    {
+        const std::size_t stride = sizeof(InstanceCompact);
+        for (int shape = 0; shape < RETAINED_SHAPE_COUNT; ++shape)
+        {
+            ShapeSlots &slots = shapes_[shape];
+            const std::size_t n = slots.owner.size();
+            BucketStore &b = buckets_[shapeBucket(shape)];
+
+            // ---- 容量が足りなければ作り直して全体を送る ----
+            if (n > 0 && (b.buffer == 0 || n > b.capacity))
+            {
+                if (b.buffer == 0)
+                    glGenBuffers(1, &b.buffer);
+                b.capacity = std::max(kMinPoolCapacity, n + n / 2);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, b.buffer);
+                glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(b.capacity * stride),
+                             nullptr, GL_DYNAMIC_DRAW);
+                uploadSlots(shape, 0, n);
+                std::fill(slots.dirty.begin(), slots.dirty.end(), 0);
+                continue;
+            }
+
+            // ---- dirty な連続範囲をまとめて送る ----
+            std::vector<std::uint64_t> &dirty = slots.dirty;
+            const std::size_t words = std::min(dirty.size(), (n + 63) / 64);
+            std::size_t runBegin = 0, runEnd = 0; // [runBegin, runEnd)
+            bool inRun = false;
+            auto flush = [&]()
+            {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, b.buffer);
+                uploadSlots(shape, runBegin, runEnd - runBegin);
+            };
+            for (std::size_t w = 0; w < words; ++w)
+            {
+                if (dirty[w] == 0)
+                    continue;
+                const std::size_t end = std::min(n, (w + 1) * 64);
+                for (std::size_t i = w * 64; i < end; ++i)
+                {
+                    if (!testBit(dirty, i))
+                        continue;
+                    if (inRun && i <= runEnd + kMergeGap)
+                    {
+                        runEnd = i + 1;
+                        continue;
+                    }
+                    if (inRun)
+                        flush();
+                    runBegin = i;
+                    runEnd = i + 1;
+                    inRun = true;
+                }
+            }
+            if (inRun)
+                flush();
+            std::fill(dirty.begin(), dirty.end(), 0);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    bool InstancePool::range(const int bucket, InstanceRange &r) const
+    {
+        const BucketStore &b = buckets_[bucket];
+        if (b.data.empty() || b.buffer == 0)
+            return false;
+        r.buffer = b.buffer;
+        r.offset = 0;
+        r.count = static_cast<GLsizei>(b.data.size());
+        return true;
+    }
+
+    void InstancePool::releaseGL()
+    {
+        for (BucketStore &b : buckets_)
+        {
+            if (b.buffer != 0)
+                glDeleteBuffers(1, &b.buffer);
+            b.buffer = 0;
+            b.capacity = 0;
+        }
+    }
+} // namespace ds_internal
@@ -0,0 +1,113 @@
+// job_pool.cpp - minimal worker thread pool for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    void JobPool::start(int workers)
+    {
+        stop();
+        if (workers < 0)
+        {
+            // 描画スレッド自身も働くので 1 つ減らす。多すぎても効かないので上限を設ける
+            const int hw = static_cast<int>(std::thread::hardware_concurrency());
+            workers = std::min(std::max(hw - 1, 0), kMaxWorkers);
+        }
+        quit_ = false;
+        for (int i = 0; i < workers; ++i)
+            threads_.emplace_back([this]
+                                  { workerLoop(); });
+    }
+
+    void JobPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            quit_ = true;
+        }
+        wakeCv_.notify_all();
+        for (std::thread &t : threads_)
+            t.join();
+        threads_.clear();
+    }
+
+    void JobPool::parallelFor(const std::size_t count, const std::size_t chunk, const JobFn &fn)
+    {
+        if (count == 0)
+            return;
+        const std::size_t step = std::max<std::size_t>(chunk, 1);
+        if (threads_.empty() || count <= step)
+        {
+            fn(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            job_ = &fn;
+            count_ = count;
+            chunk_ = step;
+            next_.store(0, std::memory_order_relaxed);
+            ++generation_;
+        }
+        wakeCv_.notify_all();
+
+        runChunks(fn, count, step);
+
+        // 途中のチャンクを処理中のワーカーがいなくなるまで待つ
+        std::unique_lock<std::mutex> lk(mutex_);
+        doneCv_.wait(lk, [this]
+                     { return busy_ == 0; });
+        job_ = nullptr;
+    }
+
+    void JobPool::runChunks(const JobFn &fn, const std::size_t count, const std::size_t chunk)
+    {
+        for (;;)
+        {
+            const std::size_t begin = next_.fetch_add(chunk, std::memory_order_relaxed);
+            if (begin >= count)
+                return;
+            fn(begin, std::min(count, begin + chunk));
+        }
+    }
+
+    void JobPool::workerLoop()
+    {
+        std::uint64_t seen = 0;
+        for (;;)
+        {
+            const JobFn *fn;
+            std::size_t count, chunk;
+            {
+                std::unique_lock<std::mutex> lk(mutex_);
+                wakeCv_.wait(lk, [&]
+                             { return quit_ || (generation_ != seen && job_ != nullptr); });
+                if (quit_)
+                    return;
+                seen = generation_;
+                fn = job_;
+                count = count_;
+                chunk = chunk_;
+                ++busy_;
+            }
+
+            runChunks(*fn, count, chunk);
+
+            {
+                std::lock_guard<std::mutex> lk(mutex_);
+                --busy_;
+            }
+            doneCv_.notify_all();
+        }
+    }
+} // namespace ds_internal
@@ -0,0 +1,271 @@
+// mesh_optimize.cpp - triangle and vertex reordering of registered meshes for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// 登録メッシュを GPU へ載せる前に並べ替える。
+//   1. 三角形の順：Tipsify（Sander, Nehab, Barczak 2007）で頂点キャッシュに残っている頂点を使い回す
+//   2. クラスタの順：Tipsify が行き詰まった位置で区切り，外を向いたクラスタから描く（重ね塗りを減らす）
+//   3. 頂点の順：インデックスで初めて使う順に並べ直す（頂点の読み出しを前から順に）
+// どれも三角形の集合と向きは変えないので，見た目は同じ。
+
+#include <algorithm>
+#include <numeric>
+
+#include "mesh_utils.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // Tipsify が想定する頂点キャッシュの大きさ
+        constexpr int kTipsifyCacheSize = 16;
+        // クラスタの最小の三角形数（区切るたびに頂点キャッシュを入れ直すので，細かくしすぎない）
+        constexpr std::size_t kMinClusterTriangles = 128;
+        // ACMR / ATVR を測るときの FIFO キャッシュの大きさ
+        constexpr std::size_t kAnalyzeCacheSize = 16;
+
+        // 頂点 → それを使う三角形（CSR 形式）
+        struct VertexTriangles
+        {
+            std::vector<std::uint32_t> first; // 頂点ごとの先頭（vertexCount + 1 個）
+            std::vector<std::uint32_t> tris;
+
+            VertexTriangles(const std::vector<std::uint32_t> &indices, const std::size_t vertexCount)
+                : first(vertexCount + 1, 0), tris(indices.size())
+            {
+                for (const std::uint32_t v : indices)
+                    ++first[v + 1];
+                for (std::size_t v = 0; v < vertexCount; ++v)
+                    first[v + 1] += first[v];
+                std::vector<std::uint32_t> at(first.begin(), first.end() - 1);
+                for (std::size_t i = 0; i < indices.size(); ++i)
+                    tris[at[indices[i]]++] = static_cast<std::uint32_t>(i / 3);
+            }
+        };
+
+        // Tipsify。indices を並べ替え，行き詰まって飛んだ位置（三角形番号）を clusters に積む
+        // （直前の区切りから kMinClusterTriangles 未満なら区切らない）
+        void tipsify(std::vector<std::uint32_t> &indices, const std::size_t vertexCount,
+                     std::vector<std::uint32_t> &clusters)
+        {
+            const std::size_t triCount = indices.size() / 3;
+            const VertexTriangles adj(indices, vertexCount);
+
+            std::vector<int> live(vertexCount);  // まだ出していない三角形の数
+            for (std::size_t v = 0; v < vertexCount; ++v)
+                live[v] = static_cast<int>(adj.first[v + 1] - adj.first[v]);
+            std::vector<int> stamp(vertexCount, 0); // キャッシュに入った時刻
+            std::vector<char> emitted(triCount, 0);
+            std::vector<std::uint32_t> deadEnd;     // 最近使った頂点（行き詰まったときの戻り先）
+            std::vector<std::uint32_t> candidates;
+            std::vector<std::uint32_t> out;
+            out.reserve(indices.size());
+
+            int time = kTipsifyCacheSize + 1;
+            std::size_t cursor = 0; // 次に調べる頂点番号（全部行き詰まったとき用）
+
+            auto skipDeadEnd = [&]() -> long
+            {
+                while (!deadEnd.empty())
+                {
+                    const std::uint32_t d = deadEnd.back();
+                    deadEnd.pop_back();
+                    if (live[d] > 0)
+                        return d;
+                }
+                while (cursor < vertexCount)
+                {
+                    if (live[cursor] > 0)
+                        return static_cast<long>(cursor);
+                    ++cursor;
+                }
+                return -1;
+            };
+
+            clusters.clear();
+            clusters.push_back(0);
+            long fan = skipDeadEnd();
+            while (fan >= 0)
+            {
+                candidates.clear();
+                for (std::uint32_t k = adj.first[fan]; k < adj.first[fan + 1]; ++k)
+                {
+                    const std::uint32_t t = adj.tris[k];
+                    if (emitted[t])
+                        continue;
+                    emitted[t] = 1;
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        const std::uint32_t v = indices[3 * t + c];
+                        out.push_back(v);
+                        deadEnd.push_back(v);
+                        candidates.push_back(v);
+                        --live[v];
+                        if (time - stamp[v] > kTipsifyCacheSize)
+                            stamp[v] = time++;
+                    }
+                }
+
+                // 次の扇の中心：キャッシュに残っていて，使い切るまでに追い出されない頂点のうち最も古いもの
+                long next = -1;
+                int best = -1;
+                for (const std::uint32_t v : candidates)
+                {
+                    if (live[v] <= 0)
+                        continue;
+                    int priority = 0;
+                    if (time - stamp[v] + 2 * live[v] <= kTipsifyCacheSize)
+                        priority = time - stamp[v];
+                    if (priority > best)
+                    {
+                        best = priority;
+                        next = v;
+                    }
+                }
+                if (next < 0)
+                {
+                    next = skipDeadEnd();
+                    const std::size_t at = out.size() / 3;
+                    if (next >= 0 && at < triCount && at - clusters.back() >= kMinClusterTriangles)
+                        clusters.push_back(static_cast<std::uint32_t>(at));
+                }
+                fan = next;
+            }
+            indices.swap(out);
+        }
+
+        // クラスタを外向きのものから並べる。キーは（クラスタの重心 − メッシュの重心）・（クラスタの法線）
+        void sortClustersOutward(std::vector<std::uint32_t> &indices, const std::vector<VertexPN> &vertices,
+                                 const std::vector<std::uint32_t> &clusters)
+        {
+            const std::size_t triCount = indices.size() / 3;
+            const std::size_t clusterCount = clusters.size();
+            if (clusterCount < 2)
+                return;
+
+            // 面積で重み付けした重心と法線
+            glm::vec3 meshCentroid(0.0f, 0.0f, 0.0f);
+            float meshArea = 0.0f;
+            std::vector<glm::vec3> centroid(clusterCount, glm::vec3(0.0f, 0.0f, 0.0f));
+            std::vector<glm::vec3> normal(clusterCount, glm::vec3(0.0f, 0.0f, 0.0f));
+            std::vector<float> area(clusterCount, 0.0f);
+            for (std::size_t c = 0; c < clusterCount; ++c)
+            {
+                const std::size_t end = (c + 1 < clusterCount) ? clusters[c + 1] : triCount;
+                for (std::size_t t = clusters[c]; t < end; ++t)
+                {
+                    const glm::vec3 &p0 = vertices[indices[3 * t + 0]].pos;
+                    const glm::vec3 &p1 = vertices[indices[3 * t + 1]].pos;
+                    const glm::vec3 &p2 = vertices[indices[3 * t + 2]].pos;
+                    const glm::vec3 n = glm::cross(p1 - p0, p2 - p0); // 長さは面積の 2 倍
+                    const float a = glm::length(n);
+                    const glm::vec3 mid = (p0 + p1 + p2) * (1.0f / 3.0f);
+                    centroid[c] += mid * a;
+                    normal[c] += n;
+                    area[c] += a;
+                }
+                meshCentroid += centroid[c];
+                meshArea += area[c];
+            }
+            if (meshArea > 0.0f)
+                meshCentroid /= meshArea;
+
+            std::vector<float> key(clusterCount, 0.0f);
+            for (std::size_t c = 0; c < clusterCount; ++c)
+            {
+                const float len = glm::length(normal[c]);
+                if (area[c] > 0.0f && len > 0.0f)
+                    key[c] = glm::dot(centroid[c] / area[c] - meshCentroid, normal[c] / len);
+            }
+            std::vector<std::uint32_t> order(clusterCount);
+            std::iota(order.begin(), order.end(), 0u);
+            std::stable_sort(order.begin(), order.end(),
+                             [&key](const std::uint32_t a, const std::uint32_t b) { return key[a] > key[b]; });
+
+            std::vector<std::uint32_t> out;
+            out.reserve(indices.size());
+            for (const std::uint32_t c : order)
+            {
+                const std::size_t end = (c + 1 < clusterCount) ? clusters[c + 1] : triCount;
+                out.insert(out.end(), indices.begin() + 3 * clusters[c], indices.begin() + 3 * end);
+            }
+            indices.swap(out);
+        }
+
+        // 頂点をインデックスで初めて使う順に並べ直す（使われない頂点は落とす）
+        void reorderVertexFetch(MeshPN &mesh)
+        {
+            constexpr std::uint32_t kUnused = ~0u;
+            std::vector<std::uint32_t> remap(mesh.vertices.size(), kUnused);
+            std::vector<VertexPN> vertices;
+            vertices.reserve(mesh.vertices.size());
+            for (std::uint32_t &i : mesh.indices)
+            {
+                if (remap[i] == kUnused)
+                {
+                    remap[i] = static_cast<std::uint32_t>(vertices.size());
+                    vertices.push_back(mesh.vertices[i]);
+                }
+                i = remap[i];
+            }
+            mesh.vertices.swap(vertices);
+        }
+    } // anonymous namespace
+
+    VertexCacheStats analyzeVertexCache(const std::vector<std::uint32_t> &indices, const std::size_t vertexCount)
+    {
+        VertexCacheStats stats;
+        const std::size_t triCount = indices.size() / 3;
+        if (triCount == 0 || vertexCount == 0)
+            return stats;
+
+        // FIFO：入った時刻が今より kAnalyzeCacheSize 以上前なら追い出されている
+        std::vector<std::size_t> stamp(vertexCount, 0);
+        std::vector<char> used(vertexCount, 0);
+        std::size_t time = kAnalyzeCacheSize + 1;
+        std::size_t misses = 0;
+        std::size_t unique = 0;
+        for (const std::uint32_t v : indices)
+        {
+            if (v >= vertexCount)
+                continue;
+            if (!used[v])
+            {
+                used[v] = 1;
+                ++unique;
+            }
+            if (time - stamp[v] > kAnalyzeCacheSize)
+            {
+                stamp[v] = time++;
+                ++misses;
+            }
+        }
+        stats.acmr = static_cast<double>(misses) / static_cast<double>(triCount);
+        stats.atvr = static_cast<double>(misses) / static_cast<double>(unique);
+        return stats;
+    }
+
+    void optimizeMeshPN(MeshPN &mesh)
+    {
+        const std::size_t vertexCount = mesh.vertices.size();
+        if (mesh.indices.size() < 3 || vertexCount == 0)
+            return;
+        // 範囲外のインデックスがあるメッシュはそのまま（並べ替えの前提が崩れる）
+        for (const std::uint32_t i : mesh.indices)
+        {
+            if (i >= vertexCount)
+                return;
+        }
+        mesh.indices.resize(mesh.indices.size() / 3 * 3);
+
+        std::vector<std::uint32_t> clusters;
+        tipsify(mesh.indices, vertexCount, clusters);
+        sortClustersOutward(mesh.indices, mesh.vertices, clusters);
+        reorderVertexFetch(mesh);
+    }
+} // namespace ds_internal
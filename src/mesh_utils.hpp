@@ -52,4 +52,14 @@ namespace ds_internal {
         const std::vector<float>& vertices,         // x,y,z,...
         const std::vector<uint32_t>& indices,       // 0-based index
         float creaseAngleDegrees);
+
+    // 頂点キャッシュの効き具合（FIFO 16 個で数えたキャッシュミス）
+    struct VertexCacheStats {
+        double acmr = 0.0; // 三角形あたりのミス（最良 0.5 前後，並べ替えなしで 1〜3）
+        double atvr = 0.0; // 使われている頂点あたりのミス（最良 1.0）
+    };
+    VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, std::size_t vertexCount);
+
+    // 三角形（頂点キャッシュ → 重ね塗り）と頂点（読み出し順）を並べ替える（mesh_optimize.cpp）
+    void optimizeMeshPN(MeshPN& mesh);
 } // namespace ds_internal
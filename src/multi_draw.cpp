@@ -0,0 +1,128 @@
+// multi_draw.cpp - multi-draw-indirect batching of instanced draws for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// baseInstance は divisor 付きの属性の読み出し位置を「インスタンス数」単位でずらす。
+// インスタンス属性は (offset % stride) の位置に向けておき，コマンドごとに offset / stride を渡す。
+// stride の端数が違う範囲（リングのスロット境界など）は別のまとまりにする。
+// インデックスの型（16bit / 32bit）は呼び出しごとに 1 つなので，これも別のまとまりにする。
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+#include "gl_extensions.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // コマンドバッファの最小容量（コマンド数）
+        constexpr std::size_t kMinCommands = 64;
+    } // anonymous namespace
+
+    void MultiDrawBatch::init()
+    {
+        glGenBuffers(1, &buffer_);
+        capacity_ = 0;
+        commands_.clear();
+        groups_.clear();
+    }
+
+    void MultiDrawBatch::destroy()
+    {
+        if (buffer_ != 0)
+            glDeleteBuffers(1, &buffer_);
+        buffer_ = 0;
+        capacity_ = 0;
+        commands_.clear();
+        groups_.clear();
+    }
+
+    void MultiDrawBatch::beginFrame()
+    {
+        lastCommands_ = commandsThisFrame_;
+        lastDraws_ = drawsThisFrame_;
+        commandsThisFrame_ = 0;
+        drawsThisFrame_ = 0;
+    }
+
+    void MultiDrawBatch::add(const Mesh &mesh, const InstanceRange &range)
+    {
+        if (range.count <= 0)
+            return;
+        constexpr GLintptr stride = static_cast<GLintptr>(sizeof(InstanceCompact));
+        Pending p;
+        p.buffer = range.buffer;
+        p.residue = range.offset % stride;
+        p.indexType = mesh.indexType;
+        p.cmd.count = static_cast<GLuint>(mesh.indexCount);
+        p.cmd.instanceCount = static_cast<GLuint>(range.count);
+        p.cmd.firstIndex = mesh.firstIndex;
+        p.cmd.baseVertex = mesh.baseVertex;
+        p.cmd.baseInstance = static_cast<GLuint>(range.offset / stride);
+        commands_.push_back(p);
+    }
+
+    void MultiDrawBatch::upload()
+    {
+        groups_.clear();
+        if (commands_.empty())
+            return;
+
+        // 同じインスタンスバッファ・端数・インデックスの型のコマンドを隣り合わせる（まとまりの中は積んだ順）
+        std::stable_sort(commands_.begin(), commands_.end(), [](const Pending &a, const Pending &b)
+                         {
+                             if (a.buffer != b.buffer)
+                                 return a.buffer < b.buffer;
+                             return a.residue != b.residue ? a.residue < b.residue : a.indexType < b.indexType;
+                         });
+        packed_.resize(commands_.size());
+        for (std::size_t i = 0; i < commands_.size(); ++i)
+        {
+            const Pending &p = commands_[i];
+            packed_[i] = p.cmd;
+            if (groups_.empty() || groups_.back().range.buffer != p.buffer ||
+                groups_.back().range.offset != p.residue || groups_.back().indexType != p.indexType)
+            {
+                Group g;
+                g.range.buffer = p.buffer;
+                g.range.offset = p.residue;
+                g.indexType = p.indexType;
+                g.first = i;
+                groups_.push_back(g);
+            }
+            ++groups_.back().count;
+        }
+
+        // 本描画と影で同じバッファを使うので，毎回確保し直して（orphan）から詰める
+        const std::size_t n = packed_.size();
+        if (n > capacity_)
+            capacity_ = std::max(kMinCommands, n + n / 2);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer_);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER,
+                     static_cast<GLsizeiptr>(capacity_ * sizeof(DrawElementsIndirectCommand)), nullptr,
+                     GL_STREAM_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, static_cast<GLsizeiptr>(n * sizeof(DrawElementsIndirectCommand)),
+                        packed_.data());
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+        commandsThisFrame_ += n;
+        drawsThisFrame_ += groups_.size();
+        commands_.clear();
+    }
+
+    void MultiDrawBatch::drawGroup(const std::size_t i) const
+    {
+        const Group &g = groups_[i];
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer_);
+        glExt.MultiDrawElementsIndirect(GL_TRIANGLES, g.indexType,
+                                        reinterpret_cast<const void *>(g.first * sizeof(DrawElementsIndirectCommand)),
+                                        g.count, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+} // namespace ds_internal
@@ -0,0 +1,75 @@
+// pass_query.cpp - GPU time and sample counts of one render pass for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// GL_TIME_ELAPSED（GL 3.3 / ARB_timer_query）と GL_SAMPLES_PASSED はどちらも 3.3 core にある。
+// 同じスロットを使い回す前に結果が出ていなければ，そのフレームの分は捨てる。
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    void PassQuery::init()
+    {
+        glGenQueries(kFrameCount, time_);
+        glGenQueries(kFrameCount, samples_);
+        for (bool &p : pending_)
+            p = false;
+        slot_ = 0;
+    }
+
+    void PassQuery::destroy()
+    {
+        if (time_[0] != 0)
+        {
+            glDeleteQueries(kFrameCount, time_);
+            glDeleteQueries(kFrameCount, samples_);
+        }
+        for (int i = 0; i < kFrameCount; ++i)
+        {
+            time_[i] = samples_[i] = 0;
+            pending_[i] = false;
+        }
+        lastMilliseconds_ = 0.0;
+        lastSamples_ = 0;
+    }
+
+    void PassQuery::begin()
+    {
+        slot_ = (slot_ + 1) % kFrameCount;
+        if (pending_[slot_])
+        {
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(samples_[slot_], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                // samples の後に time が出来ていることは保証されないので，time も確かめる
+                glGetQueryObjectuiv(time_[slot_], GL_QUERY_RESULT_AVAILABLE, &available);
+            }
+            if (available)
+            {
+                GLuint64 ns = 0;
+                GLuint64 samples = 0;
+                glGetQueryObjectui64v(time_[slot_], GL_QUERY_RESULT, &ns);
+                glGetQueryObjectui64v(samples_[slot_], GL_QUERY_RESULT, &samples);
+                lastMilliseconds_ = static_cast<double>(ns) * 1e-6;
+                lastSamples_ = samples;
+            }
+            pending_[slot_] = false;
+        }
+        glBeginQuery(GL_TIME_ELAPSED, time_[slot_]);
+        glBeginQuery(GL_SAMPLES_PASSED, samples_[slot_]);
+    }
+
+    void PassQuery::end()
+    {
+        glEndQuery(GL_SAMPLES_PASSED);
+        glEndQuery(GL_TIME_ELAPSED);
+        pending_[slot_] = true;
+    }
+} // namespace ds_internal
@@ -23,6 +23,7 @@
 #include <sys/time.h> // gettimeofday
 #include <X11/Xatom.h> // XA_STRING, XA_WM_NAME など
 #include "drawstuff_core.hpp"
+#include "gl_extensions.hpp"
 #include <GL/glx.h> // GLXContext など
 
 namespace ds_internal {
@@ -342,6 +343,13 @@ namespace ds_internal {
         std::this_thread::sleep_for(std::chrono::microseconds(usecs));
     }
 
+    // GL 3.3 より新しい関数のアドレス取得（gl_extensions.cpp から使う）
+    void *getGLProcAddress(const char *name)
+    {
+        return reinterpret_cast<void *>(
+            glXGetProcAddressARB(reinterpret_cast<const GLubyte *>(name)));
+    }
+
     void DrawstuffApp::processRenderFrame(int *frame, const dsFunctions *fn)
     {
         renderFrame(width, height, fn, pausemode && !singlestep);
@@ -217,35 +217,8 @@ namespace ds_internal {
             vertices[i].normal = pos[i]; // unit sphere → smooth shading
         }
 
-        // --- 4) VAO / VBO / EBO 作成（あなたのコードと同じ） ---
-        glGenVertexArrays(1, &dstMesh.vao);
-        glBindVertexArray(dstMesh.vao);
-
-        glGenBuffers(1, &dstMesh.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, dstMesh.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     vertices.size() * sizeof(VertexPN),
-                     vertices.data(),
-                     GL_STATIC_DRAW);
-
-        glGenBuffers(1, &dstMesh.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dstMesh.ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(uint32_t),
-                     indices.data(),
-                     GL_STATIC_DRAW);
-
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN),
-                              reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN),
-                              reinterpret_cast<void *>(offsetof(VertexPN, normal)));
-
-        dstMesh.indexCount = static_cast<GLsizei>(indices.size());
-
-        glBindVertexArray(0);
+        // --- 4) 共有バッファ（GeometryArena）へ載せる ---
+        geometryArena_.upload(dstMesh, vertices, indices);
     }
 
     void DrawstuffApp::initCylinderMeshForQuality(int quality, Mesh &dstMesh)
@@ -390,147 +363,63 @@ namespace ds_internal {
             indices.push_back(i2);
         }
 
-        // --- 3. VAO / VBO / EBO へアップロード（sphere と同様） ---
-        glGenVertexArrays(1, &dstMesh.vao);
-        glBindVertexArray(dstMesh.vao);
-
-        glGenBuffers(1, &dstMesh.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, dstMesh.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     vertices.size() * sizeof(VertexPN),
-                     vertices.data(),
-                     GL_STATIC_DRAW);
-
-        glGenBuffers(1, &dstMesh.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dstMesh.ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(uint32_t),
-                     indices.data(),
-                     GL_STATIC_DRAW);
-
-        // layout(location = 0) vec3 aPos;
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
-        // layout(location = 1) vec3 aNormal;
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, normal)));
-
-        dstMesh.indexCount = static_cast<GLsizei>(indices.size());
-
-        glBindVertexArray(0);
-    }
-
-    void DrawstuffApp::initTriangleMesh()
-    {
-        glGenVertexArrays(1, &meshTriangle_.vao);
-        glBindVertexArray(meshTriangle_.vao);
-
-        // VBO
-        glGenBuffers(1, &meshTriangle_.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, meshTriangle_.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     3 * sizeof(VertexPN),
-                     nullptr,
-                     GL_DYNAMIC_DRAW);
-
-        // ★ VAO を bind した「状態」で EBO を bind することが重要
-        glGenBuffers(1, &meshTriangle_.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshTriangle_.ebo);
-        uint32_t indices[3] = {0, 1, 2};
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     sizeof(indices),
-                     indices,
-                     GL_STATIC_DRAW);
-
-        // 属性
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            (void *)offsetof(VertexPN, pos));
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            (void *)offsetof(VertexPN, normal));
-
-        glBindVertexArray(0);
-
-        meshTriangle_.indexCount = 3;
+        // --- 3. 共有バッファへ載せる（sphere と同様） ---
+        geometryArena_.upload(dstMesh, vertices, indices);
     }
 
-    void DrawstuffApp::initTrianglesBatchMesh()
+    // 即時描画の三角形用（VertexFlat）と線用（VertexStream）。インデックスなし。
+    // 2 つの VAO は同じ VBO を読み，容量は drawStreamBatches() が必要に応じて確保する
+    void DrawstuffApp::initStreamMesh()
     {
-        glGenVertexArrays(1, &meshTrianglesBatch_.vao);
-        glBindVertexArray(meshTrianglesBatch_.vao);
-
-        glGenBuffers(1, &meshTrianglesBatch_.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, meshTrianglesBatch_.vbo);
-
-        trianglesBatchCapacity_ = 0;
-        // ここではまだ glBufferData はしない（最初の呼び出し時にサイズ決定）
-
-        // インデックスは使わない
-        meshTrianglesBatch_.ebo = 0;
-        meshTrianglesBatch_.indexCount = 0;
-
+        glGenBuffers(1, &meshStream_.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, meshStream_.vbo);
+        streamCapacity_ = 0;
+
+        meshStream_.ebo = 0;
+        meshStream_.indexCount = 0;
+        meshStreamLines_.vbo = meshStream_.vbo;
+        meshStreamLines_.ebo = 0;
+        meshStreamLines_.indexCount = 0;
+        meshStreamLines_.primitive = GL_LINES;
+
+        // 三角形：layout(location=0) pos（影シェーダも同じ位置を読む）, 2) localPos, 4) color
+        glGenVertexArrays(1, &meshStream_.vao);
+        glBindVertexArray(meshStream_.vao);
+        const GLsizei flatStride = static_cast<GLsizei>(sizeof(VertexFlat));
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, normal)));
-
-        glBindVertexArray(0);
-    }
-    void DrawstuffApp::initLineMesh()
-    {
-        glGenVertexArrays(1, &meshLine_.vao);
-        glBindVertexArray(meshLine_.vao);
-
-        glGenBuffers(1, &meshLine_.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, meshLine_.vbo);
-
-        // ラインなので頂点は常に2つ分だけあればよい
-        glBufferData(GL_ARRAY_BUFFER,
-                     2 * sizeof(VertexPN),
-                     nullptr,
-                     GL_DYNAMIC_DRAW);
-
-        // ライン用メッシュ構築（インデックスは使わない）
-        meshLine_.ebo = 0;
-        meshLine_.indexCount = 2;
-        meshLine_.primitive = GL_LINES;
-
-        // layout(location=0) pos, location=1 normal
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, flatStride,
+                              reinterpret_cast<void *>(offsetof(VertexFlat, pos)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, flatStride,
+                              reinterpret_cast<void *>(offsetof(VertexFlat, localPos)));
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, flatStride,
+                              reinterpret_cast<void *>(offsetof(VertexFlat, color)));
+
+        // 線：layout(location=0) pos, 1) normal, 2) localPos, 3) localNormal, 4) color
+        glGenVertexArrays(1, &meshStreamLines_.vao);
+        glBindVertexArray(meshStreamLines_.vao);
+        const GLsizei stride = static_cast<GLsizei>(sizeof(VertexStream));
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexStream, pos)));
         glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, normal)));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexStream, normal)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexStream, localPos)));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexStream, localNormal)));
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                              reinterpret_cast<void *>(offsetof(VertexStream, color)));
 
         glBindVertexArray(0);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
+
     void DrawstuffApp::initPyramidMesh()
     {
         if (meshPyramid_.vao != 0)
@@ -604,62 +493,6 @@ namespace ds_internal {
         glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
-    static void initMeshFromVectors(
-        Mesh &dst,
-        const std::vector<VertexPN> &vertices,
-        const std::vector<uint32_t> &indices)
-    {
-        // 既存リソースの破棄
-        if (dst.vao)
-        {
-            glDeleteVertexArrays(1, &dst.vao);
-            dst.vao = 0;
-        }
-        if (dst.vbo)
-        {
-            glDeleteBuffers(1, &dst.vbo);
-            dst.vbo = 0;
-        }
-        if (dst.ebo)
-        {
-            glDeleteBuffers(1, &dst.ebo);
-            dst.ebo = 0;
-        }
-
-        glGenVertexArrays(1, &dst.vao);
-        glBindVertexArray(dst.vao);
-
-        glGenBuffers(1, &dst.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, dst.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     vertices.size() * sizeof(VertexPN),
-                     vertices.data(),
-                     GL_STATIC_DRAW);
-
-        glGenBuffers(1, &dst.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dst.ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(uint32_t),
-                     indices.data(),
-                     GL_STATIC_DRAW);
-
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
-            0, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, pos)));
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(
-            1, 3, GL_FLOAT, GL_FALSE,
-            sizeof(VertexPN),
-            reinterpret_cast<void *>(offsetof(VertexPN, normal)));
-
-        dst.indexCount = static_cast<GLsizei>(indices.size());
-
-        glBindVertexArray(0);
-    }
-
     // =================================================
     // Capsule メッシュ初期化補助関数群
     // ---- ユーティリティ：量子化キーで頂点溶接（重複排除） ----
@@ -1012,11 +845,8 @@ namespace ds_internal {
     }
 
     // ---- メイン関数：Capsule メッシュ生成 ----
-    static void initUnitCapsulePartsForQuality(
-        int quality,
-        Mesh &bodyMesh,
-        Mesh &capTopMesh,
-        Mesh &capBottomMesh)
+    // 胴と両端の半球を 1 つのメッシュにまとめる（1 カプセル = 1 インスタンス）
+    static void initUnitCapsuleMeshForQuality(GeometryArena &geometry, int quality, Mesh &mesh)
     {
         // ========= パラメータ =========
         const int capsule_quality = quality;  // 1〜3
@@ -1115,11 +945,36 @@ namespace ds_internal {
         );
 
         // =================================================
-        // 4. Mesh へ転送
+        // 4. 1 つにまとめて Mesh へ転送
         // =================================================
-        initMeshFromVectors(bodyMesh, cylVerts, cylIndices);
-        initMeshFromVectors(capTopMesh, capTopVerts, capTopIndices);
-        initMeshFromVectors(capBottomMesh, capBottomVerts, capBottomIndices);
+        std::vector<VertexPNC> verts;
+        std::vector<uint32_t> indices;
+        auto append = [&](const std::vector<VertexPN> &pv, const std::vector<uint32_t> &pi, const float cap)
+        {
+            const uint32_t base = static_cast<uint32_t>(verts.size());
+            for (const VertexPN &v : pv)
+                verts.push_back({v.pos, v.normal, cap});
+            for (uint32_t i : pi)
+                indices.push_back(base + i);
+        };
+        append(cylVerts, cylIndices, 0.0f);
+        append(capTopVerts, capTopIndices, +1.0f);
+        append(capBottomVerts, capBottomIndices, -1.0f);
+
+        // 蓋の印（cap）は aNormal の w に入る（VertexPacked）。他の形は cap = 0
+        geometry.upload(mesh, verts.data(), verts.size(), indices.data(), indices.size());
+    }
+
+    // インポスタ用の四角形：角 (±1, ±1, 0)。VS が視点に向けて広げるので法線は使わない
+    void DrawstuffApp::initImpostorQuadMesh()
+    {
+        const std::vector<VertexPN> verts = {
+            {glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+            {glm::vec3(+1.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+            {glm::vec3(+1.0f, +1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+            {glm::vec3(-1.0f, +1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)}};
+        const std::vector<uint32_t> indices = {0, 1, 2, 0, 2, 3};
+        geometryArena_.upload(meshImpostorQuad_, verts, indices);
     }
 
     void DrawstuffApp::createPrimitiveMeshes()
@@ -1190,38 +1045,14 @@ namespace ds_internal {
             // -Z
             20, 21, 22, 20, 22, 23};
 
-        glGenVertexArrays(1, &meshBox_.vao);
-        glBindVertexArray(meshBox_.vao);
-
-        glGenBuffers(1, &meshBox_.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, meshBox_.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     vertices.size() * sizeof(Vertex),
-                     vertices.data(),
-                     GL_STATIC_DRAW);
-
-        glGenBuffers(1, &meshBox_.ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBox_.ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(uint32_t),
-                     indices.data(),
-                     GL_STATIC_DRAW);
-
-        // layout(location = 0) vec3 aPos;
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                              sizeof(Vertex),
-                              reinterpret_cast<void *>(offsetof(Vertex, pos)));
-
-        // layout(location = 1) vec3 aNormal;
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                              sizeof(Vertex),
-                              reinterpret_cast<void *>(offsetof(Vertex, normal)));
-
-        meshBox_.indexCount = static_cast<GLsizei>(indices.size());
-
-        glBindVertexArray(0);
+        // 共有バッファ（GeometryArena）へ載せる
+        std::vector<VertexPN> boxVertices(vertices.size());
+        for (std::size_t i = 0; i < vertices.size(); ++i)
+        {
+            boxVertices[i].pos = glm::vec3(vertices[i].pos[0], vertices[i].pos[1], vertices[i].pos[2]);
+            boxVertices[i].normal = glm::vec3(vertices[i].normal[0], vertices[i].normal[1], vertices[i].normal[2]);
+        }
+        geometryArena_.upload(meshBox_, boxVertices, indices);
 
         // --- ここから sphere 用メッシュ生成 ---
 
@@ -1235,20 +1066,12 @@ namespace ds_internal {
         initCylinderMeshForQuality(3, meshCylinder_[3]);
 
         // --- ここから capsule 用メッシュ生成 ---
-        initUnitCapsulePartsForQuality(1, meshCapsuleCylinder_[1],
-                                        meshCapsuleCapTop_[1],
-                                        meshCapsuleCapBottom_[1]);
-        initUnitCapsulePartsForQuality(2, meshCapsuleCylinder_[2],
-                                        meshCapsuleCapTop_[2],
-                                        meshCapsuleCapBottom_[2]);
-        initUnitCapsulePartsForQuality(3, meshCapsuleCylinder_[3],
-                                        meshCapsuleCapTop_[3],
-                                        meshCapsuleCapBottom_[3]);
-
-        initTriangleMesh();
-        initTrianglesBatchMesh();
-
-        initLineMesh();
+        initUnitCapsuleMeshForQuality(geometryArena_, 1, meshCapsule_[1]);
+        initUnitCapsuleMeshForQuality(geometryArena_, 2, meshCapsule_[2]);
+        initUnitCapsuleMeshForQuality(geometryArena_, 3, meshCapsule_[3]);
+
+        initStreamMesh();
         initPyramidMesh();
+        initImpostorQuadMesh();
     }
 }
\ No newline at end of file
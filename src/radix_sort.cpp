@@ -0,0 +1,100 @@
+// radix_sort.cpp - parallel LSD radix sort for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// LSD で 8bit ずつ。各パスはチャンクごとのヒストグラムを並列に数え，
+// (digit, チャンク) の順に累積してから各チャンクが自分の出力位置へ並列に書く（安定）。
+
+#include <algorithm>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        constexpr int kRadixBits = 8;
+        constexpr std::size_t kRadixSize = std::size_t(1) << kRadixBits;
+        // 1 チャンクの要素数（これ以下ならワーカーに分けない）
+        constexpr std::size_t kSortChunk = 16384;
+    } // anonymous namespace
+
+    void radixSort(std::vector<std::uint32_t> &keys, std::vector<std::uint32_t> &order, const int keyBits,
+                   RadixSortScratch &scratch, JobPool &jobs)
+    {
+        const std::size_t n = keys.size();
+        if (n < 2)
+            return;
+        scratch.keys.resize(n);
+        scratch.order.resize(n);
+        const std::size_t chunks = (n + kSortChunk - 1) / kSortChunk;
+        scratch.histograms.resize(chunks * kRadixSize);
+        std::uint32_t *hist = scratch.histograms.data();
+
+        for (int shift = 0; shift < keyBits; shift += kRadixBits)
+        {
+            const std::uint32_t *key = keys.data();
+            jobs.parallelFor(chunks, 1, [key, hist, n, shift](std::size_t firstChunk, std::size_t lastChunk)
+            {
+                for (std::size_t c = firstChunk; c < lastChunk; ++c)
+                {
+                    std::uint32_t *h = hist + c * kRadixSize;
+                    std::fill(h, h + kRadixSize, 0u);
+                    const std::size_t end = std::min(n, (c + 1) * kSortChunk);
+                    for (std::size_t i = c * kSortChunk; i < end; ++i)
+                        ++h[(key[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // 全部が同じ digit ならこのパスは並びを変えない
+            bool trivial = false;
+            for (std::size_t d = 0; d < kRadixSize && !trivial; ++d)
+            {
+                std::size_t count = 0;
+                for (std::size_t c = 0; c < chunks; ++c)
+                    count += hist[c * kRadixSize + d];
+                trivial = (count == n);
+            }
+            if (trivial)
+                continue;
+
+            // (digit, チャンク) の順に累積して，各チャンクの書き込み開始位置にする
+            std::size_t total = 0;
+            for (std::size_t d = 0; d < kRadixSize; ++d)
+            {
+                for (std::size_t c = 0; c < chunks; ++c)
+                {
+                    std::uint32_t &h = hist[c * kRadixSize + d];
+                    const std::uint32_t count = h;
+                    h = static_cast<std::uint32_t>(total);
+                    total += count;
+                }
+            }
+
+            const std::uint32_t *ord = order.data();
+            std::uint32_t *keyOut = scratch.keys.data();
+            std::uint32_t *ordOut = scratch.order.data();
+            jobs.parallelFor(chunks, 1, [=](std::size_t firstChunk, std::size_t lastChunk)
+            {
+                for (std::size_t c = firstChunk; c < lastChunk; ++c)
+                {
+                    std::uint32_t *offset = hist + c * kRadixSize;
+                    const std::size_t end = std::min(n, (c + 1) * kSortChunk);
+                    for (std::size_t i = c * kSortChunk; i < end; ++i)
+                    {
+                        const std::uint32_t at = offset[(key[i] >> shift) & (kRadixSize - 1)]++;
+                        keyOut[at] = key[i];
+                        ordOut[at] = ord[i];
+                    }
+                }
+            });
+            keys.swap(scratch.keys);
+            order.swap(scratch.order);
+        }
+    }
+} // namespace ds_internal
@@ -60,17 +60,166 @@ namespace
         return prog;
     }
 
+    // transform feedback 用：フラグメントシェーダなし，リンク前に捕まえる出力を指定する
+    GLuint linkTransformFeedbackProgram(GLuint vs, GLuint gs, const char *const *varyings, GLsizei count)
+    {
+        GLuint prog = glCreateProgram();
+        glAttachShader(prog, vs);
+        glAttachShader(prog, gs);
+        glTransformFeedbackVaryings(prog, count, varyings, GL_INTERLEAVED_ATTRIBS);
+        glLinkProgram(prog);
+
+        GLint ok = GL_FALSE;
+        glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+        if (!ok)
+        {
+            GLint logLen = 0;
+            glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &logLen);
+            std::string log(logLen, '\0');
+            glGetProgramInfoLog(prog, logLen, nullptr, log.data());
+            fprintf(stderr, "Program link error:\n%s\n", log.c_str());
+            glDeleteProgram(prog);
+            return 0;
+        }
+        return prog;
+    }
+
+    // フレーム共通の uniform ブロック（std140）。ds_internal::FrameUniforms と同じ並び
+    const char *kFrameUniformsSrc = R"GLSL(
+layout(std140) uniform FrameUniforms
+{
+    mat4 uProj;
+    mat4 uView;
+    mat4 uViewProj;      // uProj * uView
+    mat4 uShadowProject; // ワールド → 地面 z=0 に潰した影（ワールド）
+    vec4 uEye;           // 視点（ワールド）。w は未使用
+    vec4 uLightDir;      // 光源方向（光源→頂点）。w は未使用
+    vec4 uGround;        // 地面テクスチャの (scale, offset x, offset y)，w は影の濃さ
+    vec4 uGroundColor;   // テクスチャ無し時の地面色。w は未使用
+};
+)GLSL";
+
+    // 機能ビットごとの #define（ds_internal::ShaderFeature と同じ並び）
+    const char *const kFeatureDefines[] = {
+        "#define USE_TEXTURE\n",
+        "#define WEIGHTED_OIT\n",
+        "#define FLAT_NORMAL\n",
+    };
+
+    // WEIGHTED_OIT の FS に足す出力と書き込み（ds_internal::WeightedOit の 2 枚のアタッチメント）。
+    // 重みは McGuire & Bavoil (2013) の式 (9) を深度バッファの値で使う
+    const char *kWeightedOitSrc = R"GLSL(
+layout(location = 0) out vec4 oAccum;
+layout(location = 1) out float oReveal;
+
+void writeOit(vec4 c)
+{
+    float a = clamp(c.a, 0.0, 0.999);
+    float z = gl_FragCoord.z;
+    float w = clamp(pow(min(1.0, a * 10.0) + 0.01, 3.0) * 1e8 * pow(1.0 - z * 0.9, 3.0), 1e-2, 3e3);
+    oAccum = vec4(c.rgb * a, a) * w;
+    oReveal = -log(1.0 - a); // 和の exp(-x) が (1 - a) の積になる
+}
+)GLSL";
+
+    // #version の行の直後に機能の #define と FrameUniforms の宣言（WEIGHTED_OIT の FS なら writeOit() も）を
+    // 差し込んでからコンパイルする
+    GLuint compileFrameShader(GLenum type, const std::string &src, const unsigned features = 0)
+    {
+        std::string full(src);
+        const std::size_t version = full.find("#version");
+        const std::size_t eol = (version == std::string::npos) ? std::string::npos : full.find('\n', version);
+        if (eol == std::string::npos)
+        {
+            fprintf(stderr, "Shader compile error:\nmissing #version line\n");
+            return 0;
+        }
+        std::string prelude;
+        for (std::size_t i = 0; i < sizeof(kFeatureDefines) / sizeof(kFeatureDefines[0]); ++i)
+            if (features & (1u << i))
+                prelude += kFeatureDefines[i];
+        prelude += kFrameUniformsSrc;
+        if (type == GL_FRAGMENT_SHADER && (features & ds_internal::SHADER_WEIGHTED_OIT))
+            prelude += kWeightedOitSrc;
+        full.insert(eol + 1, prelude);
+        return compileShader(type, full.c_str());
+    }
+
+    // FrameUniforms を共通の結合点につなぐ（GLSL 3.30 では layout(binding) が書けない）
+    void bindFrameUniforms(GLuint prog)
+    {
+        const GLuint index = glGetUniformBlockIndex(prog, "FrameUniforms");
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(prog, index, ds_internal::kFrameUniformBinding);
+    }
+
 } // namespace
 
 namespace ds_internal {
+    // =================================================
+    // シェーダの変種
+    // =================================================
+    void ShaderPermutation::setSource(const char *label, std::string vs, std::string fs,
+                                      std::initializer_list<const char *> uniforms)
+    {
+        release();
+        label_ = label;
+        vs_ = std::move(vs);
+        fs_ = std::move(fs);
+        uniforms_.assign(uniforms.begin(), uniforms.end());
+    }
+
+    GLuint ShaderPermutation::program(const unsigned features)
+    {
+        if (features >= SHADER_VARIANT_COUNT)
+        {
+            internalError("ShaderPermutation(%s): invalid feature bits %u", label_, features);
+            return 0;
+        }
+        Variant &v = variants_[features];
+        if (v.program != 0)
+            return v.program;
+
+        GLuint vs = compileFrameShader(GL_VERTEX_SHADER, vs_, features);
+        GLuint fs = compileFrameShader(GL_FRAGMENT_SHADER, fs_, features);
+        if (!vs || !fs)
+        {
+            internalError("Failed to compile %s shaders (features 0x%x)", label_, features);
+        }
+
+        v.program = linkProgram(vs, fs);
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        if (!v.program)
+        {
+            internalError("Failed to link %s shader program (features 0x%x)", label_, features);
+        }
+        bindFrameUniforms(v.program);
+
+        v.locations.clear();
+        for (const char *name : uniforms_)
+            v.locations.push_back(glGetUniformLocation(v.program, name));
+        return v.program;
+    }
+
+    void ShaderPermutation::release()
+    {
+        for (Variant &v : variants_)
+        {
+            if (v.program != 0)
+                glDeleteProgram(v.program);
+            v = Variant();
+        }
+    }
+
     // =================================================
     // シェーダプログラム群
     // =================================================
     // 基本シェーダプログラム
     void DrawstuffApp::initBasicProgram()
     {
-        // すでに作ってあれば何もしない
-        if (programBasic_ != 0)
+        // すでに設定してあれば何もしない
+        if (basicShader_.hasSource())
             return;
 
         // ライティング付きシェーダ
@@ -81,7 +230,6 @@ namespace ds_internal {
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 
-uniform mat4 uMVP;
 uniform mat4 uModel;
 
 out vec3 vLocalPos;
@@ -100,7 +248,7 @@ void main()
     // 今回は簡易版として mat3(uModel) を使用
     vWorldNormal = mat3(uModel) * aNormal;
 
-    gl_Position = uMVP * vec4(aPos, 1.0);
+    gl_Position = uViewProj * worldPos4;
 }
     )GLSL";
 
@@ -114,30 +262,28 @@ in vec3 vWorldNormal;
 in vec3 vWorldPos;
 
 uniform vec4      uColor;
+#ifdef USE_TEXTURE
 uniform sampler2D uTex;
-uniform bool      uUseTex;
-uniform float     uTexScale;   // 例: 0.5f など
-
-uniform vec3 uLightDir; // 光源方向をシェーダ内で指定
+const float kTexScale = 0.5;   // 模様の大きさ。0.1〜2.0 くらいを試して好みで
+#endif
 
 out vec4 FragColor;
 
 void main()
 {
-    vec3 N_tex = normalize(vLocalNormal);
-
     vec3 base = uColor.rgb;
 
-    if (uUseTex) {
+#ifdef USE_TEXTURE
+    {
         // トライプラナー重み
-        vec3 an  = abs(N_tex);
+        vec3 an  = abs(normalize(vLocalNormal));
         float sum = an.x + an.y + an.z + 1e-5;
         vec3 w   = an / sum;
 
         // 各軸方向からの投影座標
-        vec2 uvX = vLocalPos.yz * uTexScale; // X向きの面 → YZ平面
-        vec2 uvY = vLocalPos.xz * uTexScale; // Y向きの面 → XZ平面
-        vec2 uvZ = vLocalPos.xy * uTexScale; // Z向きの面 → XY平面
+        vec2 uvX = vLocalPos.yz * kTexScale; // X向きの面 → YZ平面
+        vec2 uvY = vLocalPos.xz * kTexScale; // Y向きの面 → XZ平面
+        vec2 uvZ = vLocalPos.xy * kTexScale; // Z向きの面 → XY平面
 
         vec3 texX = texture(uTex, uvX).rgb;
         vec3 texY = texture(uTex, uvY).rgb;
@@ -147,9 +293,10 @@ void main()
 
         base *= texColor;
     }
+#endif
 
     // 簡単なディフューズライティング
-    vec3 L = normalize(uLightDir); // 光線方向（光源→頂点）
+    vec3 L = normalize(uLightDir.xyz); // 光線方向（光源→頂点）
     vec3 N_lit = normalize(vWorldNormal);
 
     // vec3 rgb = base * (0.3 + 0.7 * diff);
@@ -167,35 +314,13 @@ void main()
 }
     )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsSrc);
-        if (!vs || !fs)
-        {
-            internalError("Failed to compile basic shaders");
-        }
-
-        programBasic_ = linkProgram(vs, fs);
-        glDeleteShader(vs);
-        glDeleteShader(fs);
-        if (!programBasic_)
-        {
-            internalError("Failed to link basic shader program");
-        }
-
-        
-
-        // uniform ロケーションを取得
-        uMVP_ = glGetUniformLocation(programBasic_, "uMVP");
-        uModel_ = glGetUniformLocation(programBasic_, "uModel");
-        uColor_ = glGetUniformLocation(programBasic_, "uColor");
-        uUseTex_ = glGetUniformLocation(programBasic_, "uUseTex");
-        uTex_ = glGetUniformLocation(programBasic_, "uTex");
-        uTexScale_ = glGetUniformLocation(programBasic_, "uTexScale");
+        // uniform の並びは BasicUniform と同じ
+        basicShader_.setSource("basic", vsSrc, fsSrc, {"uModel", "uColor"});
     }
     void DrawstuffApp::initBasicInstancedProgram()
     {
-        // すでに作ってあれば何もしない
-        if (programBasicInstanced_ != 0)
+        // すでに設定してあれば何もしない
+        if (basicInstancedShader_.hasSource())
             return;
 
         // ライティング付き・インスタンシング対応シェーダ
@@ -204,14 +329,21 @@ void main()
 #version 330 core
 
 layout(location = 0) in vec3 aPos;
-layout(location = 1) in vec3 aNormal;
+// GeometryArena の VertexPacked：xyz は法線 × 511（整数のまま），w はカプセルの蓋の頂点だけ ±1（他は 0）
+layout(location = 1) in vec4 aNormal;
 
-// インスタンスごとのモデル行列＆色
-layout(location = 2) in mat4 iModel; // 2,3,4,5 を占有
-layout(location = 6) in vec4 iColor;
+// インスタンスごとの位置・姿勢（四元数）・スケール＆色（InstanceCompact）
+layout(location = 2) in vec3 iPos;
+layout(location = 3) in vec4 iRot;   // snorm16 を正規化して受け取る
+layout(location = 4) in vec3 iScale;
+layout(location = 5) in vec4 iColor; // RGBA8 を正規化して受け取る
 
-uniform mat4 uProj;
-uniform mat4 uView;
+// 四元数 q でベクトル v を回転
+vec3 quatRotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
 
 out vec3 vLocalPos;
 out vec3 vLocalNormal;
@@ -221,19 +353,28 @@ out vec4 vColor;
 
 void main()
 {
+    vec3 normal = aNormal.xyz * (1.0 / 511.0);
+    float aCap  = aNormal.w;
+
     vLocalPos    = aPos;
-    vLocalNormal = aNormal;
+    vLocalNormal = normal;
 
-    vec4 worldPos4 = iModel * vec4(aPos, 1.0);
+    // 量子化誤差で長さが 1 からずれるので正規化しておく
+    vec4 q = normalize(iRot);
+
+    // カプセルの蓋は半径 scale.x の球のまま，平行部の端 (z = ±scale.z) へずらす
+    vec3 s = mix(iScale, iScale.xxx, abs(aCap));
+    vec3 local = (aPos - vec3(0.0, 0.0, aCap)) * s + vec3(0.0, 0.0, aCap * iScale.z);
+
+    vec4 worldPos4 = vec4(quatRotate(q, local) + iPos, 1.0);
     vWorldPos      = worldPos4.xyz;
 
-    // 非一様スケールがきつい場合は本当は逆転置行列が必要だが、
-    // 今回は簡易版として mat3(iModel) を使用
-    vWorldNormal = mat3(iModel) * aNormal;
+    // 法線は逆スケール → 回転（＝逆転置行列と同じ向き。長さは FS で正規化）
+    vWorldNormal = quatRotate(q, normal / s);
 
     vColor = iColor;
 
-    gl_Position = uProj * uView * worldPos4;
+    gl_Position = uViewProj * worldPos4;
 }
     )GLSL";
 
@@ -247,31 +388,31 @@ in vec3 vWorldNormal;
 in vec3 vWorldPos;
 in vec4 vColor;
 
+#ifdef USE_TEXTURE
 uniform sampler2D uTex;
-uniform bool      uUseTex;
-uniform float     uTexScale;   // 例: 0.5f など
-
-uniform vec3 uLightDir; // 光源方向（光源→頂点）
+const float kTexScale = 0.5;   // basic.fs と同じ
+#endif
 
+#ifndef WEIGHTED_OIT
 out vec4 FragColor;
+#endif
 
 void main()
 {
-    vec3 N_tex = normalize(vLocalNormal);
-
     // ベース色はインスタンスごとの色
     vec3 base = vColor.rgb;
 
-    if (uUseTex) {
+#ifdef USE_TEXTURE
+    {
         // トライプラナー重み
-        vec3 an  = abs(N_tex);
+        vec3 an  = abs(normalize(vLocalNormal));
         float sum = an.x + an.y + an.z + 1e-5;
         vec3 w   = an / sum;
 
         // 各軸方向からの投影座標
-        vec2 uvX = vLocalPos.yz * uTexScale; // X向きの面 → YZ平面
-        vec2 uvY = vLocalPos.xz * uTexScale; // Y向きの面 → XZ平面
-        vec2 uvZ = vLocalPos.xy * uTexScale; // Z向きの面 → XY平面
+        vec2 uvX = vLocalPos.yz * kTexScale; // X向きの面 → YZ平面
+        vec2 uvY = vLocalPos.xz * kTexScale; // Y向きの面 → XZ平面
+        vec2 uvZ = vLocalPos.xy * kTexScale; // Z向きの面 → XY平面
 
         vec3 texX = texture(uTex, uvX).rgb;
         vec3 texY = texture(uTex, uvY).rgb;
@@ -281,9 +422,10 @@ void main()
 
         base *= texColor;
     }
+#endif
 
     // 簡単なディフューズライティング
-    vec3 L = normalize(uLightDir); // 光線方向（光源→頂点）
+    vec3 L = normalize(uLightDir.xyz); // 光線方向（光源→頂点）
     vec3 N_lit = normalize(vWorldNormal);
 
     const float A = 1.0/3.0;  // 陰側
@@ -294,37 +436,123 @@ void main()
 
     vec3 rgb = base * lightFactor;
 
+#ifdef WEIGHTED_OIT
+    writeOit(vec4(rgb, vColor.a));
+#else
     FragColor = vec4(rgb, vColor.a);
+#endif
 }
     )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsSrc);
-        if (!vs || !fs)
-        {
-            internalError("Failed to compile basic instanced shaders");
-        }
+        basicInstancedShader_.setSource("basic instanced", vsSrc, fsSrc, {});
+    }
 
-        programBasicInstanced_ = linkProgram(vs, fs);
-        glDeleteShader(vs);
-        glDeleteShader(fs);
-        if (!programBasicInstanced_)
-        {
-            internalError("Failed to link basic instanced shader program");
-        }
+    // 即時描画の三角形（VertexFlat）・線（VertexStream）用。座標・法線はワールド座標に変換済みで，色は頂点ごと。
+    // 三角形は FLAT_NORMAL の変種で描き，法線は位置の画面上の微分から求める
+    void DrawstuffApp::initStreamProgram()
+    {
+        if (streamShader_.hasSource())
+            return;
+
+        static const char *vsSrc = R"GLSL(
+// stream.vs
+#version 330 core
+
+layout(location = 0) in vec3 aPos;         // ワールド座標
+layout(location = 2) in vec3 aLocalPos;    // テクスチャ用（モデル座標）
+layout(location = 4) in vec4 aColor;       // RGBA8 を正規化して受け取る
+#ifndef FLAT_NORMAL
+layout(location = 1) in vec3 aNormal;      // ワールド座標
+layout(location = 3) in vec3 aLocalNormal;
+#endif
+
+out vec3 vLocalPos;
+out vec3 vWorldPos;
+out vec4 vColor;
+#ifndef FLAT_NORMAL
+out vec3 vLocalNormal;
+out vec3 vWorldNormal;
+#endif
+
+void main()
+{
+    vLocalPos    = aLocalPos;
+    vWorldPos    = aPos;
+    vColor       = aColor;
+#ifndef FLAT_NORMAL
+    vLocalNormal = aLocalNormal;
+    vWorldNormal = aNormal;
+#endif
+
+    gl_Position = uViewProj * vec4(aPos, 1.0);
+}
+    )GLSL";
+
+        static const char *fsSrc = R"GLSL(
+// stream.fs
+#version 330 core
+
+in vec3 vLocalPos;
+in vec3 vWorldPos;
+in vec4 vColor;
+#ifndef FLAT_NORMAL
+in vec3 vLocalNormal;
+in vec3 vWorldNormal;
+#endif
+
+#ifdef USE_TEXTURE
+uniform sampler2D uTex;
+const float kTexScale = 0.5;
+#endif
+
+out vec4 FragColor;
+
+void main()
+{
+    vec3 base = vColor.rgb;
+
+#ifdef FLAT_NORMAL
+    // 三角形の中では位置が平面上を動くので，画面の x / y 方向の変化の外積が面の法線になる。
+    // 外積は常に視点側を向くので，裏面なら反転して頂点の並びで決まる向きに揃える
+    vec3 worldNormal = cross(dFdx(vWorldPos), dFdy(vWorldPos));
+    if (!gl_FrontFacing)
+        worldNormal = -worldNormal;
+    vec3 localNormal = cross(dFdx(vLocalPos), dFdy(vLocalPos)); // トライプラナーの重みは向きによらない
+#else
+    vec3 worldNormal = vWorldNormal;
+    vec3 localNormal = vLocalNormal;
+#endif
+
+#ifdef USE_TEXTURE
+    {
+        // トライプラナー（basic.fs と同じ）
+        vec3 an  = abs(normalize(localNormal));
+        float sum = an.x + an.y + an.z + 1e-5;
+        vec3 w   = an / sum;
+
+        vec3 texX = texture(uTex, vLocalPos.yz * kTexScale).rgb;
+        vec3 texY = texture(uTex, vLocalPos.xz * kTexScale).rgb;
+        vec3 texZ = texture(uTex, vLocalPos.xy * kTexScale).rgb;
+
+        base *= w.x * texX + w.y * texY + w.z * texZ;
+    }
+#endif
+
+    const float A = 1.0/3.0;  // 陰側
+    const float B = 2.0/3.0;  // 光源側とのコントラスト
+
+    float diff = max(dot(normalize(worldNormal), normalize(uLightDir.xyz)), 0.0);
+
+    FragColor = vec4(base * (A + B * diff), vColor.a);
+}
+    )GLSL";
 
-        // uniform ロケーションを取得
-        uProjInst_ = glGetUniformLocation(programBasicInstanced_, "uProj");
-        uViewInst_ = glGetUniformLocation(programBasicInstanced_, "uView");
-        uLightDirInst_ = glGetUniformLocation(programBasicInstanced_, "uLightDir");
-        uUseTexInst_ = glGetUniformLocation(programBasicInstanced_, "uUseTex");
-        uTexInst_ = glGetUniformLocation(programBasicInstanced_, "uTex");
-        uTexScaleInst_ = glGetUniformLocation(programBasicInstanced_, "uTexScale");
+        streamShader_.setSource("stream", vsSrc, fsSrc, {});
     }
 
     void DrawstuffApp::initGroundProgram()
     {
-        if (programGround_ != 0)
+        if (groundShader_.hasSource())
             return;
         static const char *ground_vs_src = R"GLSL(
 // ground_vs.glsl
@@ -332,25 +560,19 @@ void main()
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 
-uniform mat4 uMVP;
-uniform mat4 uModel;
-
-// ground_scale, ground_ofsx, ground_ofsy を uniform で渡す想定
-uniform float uGroundScale;
-uniform vec2  uGroundOffset;
-
 out vec3 vNormal;
 out vec2 vTex;
 
 void main()
 {
-    gl_Position = uMVP * vec4(aPos, 1.0);
-    vNormal = mat3(uModel) * aNormal;
+    // 地面はワールド座標そのまま
+    gl_Position = uViewProj * vec4(aPos, 1.0);
+    vNormal = aNormal;
 
     // 元の fixed-function の対応：
     // u = x * ground_scale + ground_ofsx
     // v = y * ground_scale + ground_ofsy
-    vTex = aPos.xy * uGroundScale + uGroundOffset;
+    vTex = aPos.xy * uGround.x + uGround.yz;
 }
 )GLSL";
 
@@ -359,62 +581,39 @@ void main()
         in vec3 vNormal;
         in vec2 vTex;
 
-        uniform sampler2D uTex;
         uniform vec4 uColor;
-        uniform int  uUseTex; // 1 = テクスチャ使用, 0 = 単色
+        #ifdef USE_TEXTURE
+        uniform sampler2D uTex;
+        #endif
 
         out vec4 FragColor;
 
         void main()
         {
-            vec3 rgb;
-
-            if (uUseTex == 1)
-            {
-                vec4 texColor = texture(uTex, vTex);
-                rgb = uColor.rgb * texColor.rgb;
-            }
-            else
-            {
-                // テクスチャなし
-                rgb = uColor.rgb;
-            }
+        #ifdef USE_TEXTURE
+            vec4 texColor = texture(uTex, vTex);
+            vec3 rgb = uColor.rgb * texColor.rgb;
+        #else
+            // テクスチャなし
+            vec3 rgb = uColor.rgb;
+        #endif
             FragColor = vec4(rgb, uColor.a);
         }
     )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, ground_vs_src); // 上記 GLSL
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, ground_fs_src);
-        if (!vs || !fs)
-            internalError("Failed to compile ground shaders");
-
-        programGround_ = linkProgram(vs, fs);
-        glDeleteShader(vs);
-        glDeleteShader(fs);
-        if (!programGround_)
-            internalError("Failed to link ground shader program");
-
-        uGroundMVP_ = glGetUniformLocation(programGround_, "uMVP");
-        uGroundModel_ = glGetUniformLocation(programGround_, "uModel");
-        uGroundColor_ = glGetUniformLocation(programGround_, "uColor");
-        uGroundTex_ = glGetUniformLocation(programGround_, "uTex");
-        uGroundScale_ = glGetUniformLocation(programGround_, "uGroundScale");
-        uGroundOffset_ = glGetUniformLocation(programGround_, "uGroundOffset");
-        uGroundUseTex_ = glGetUniformLocation(programGround_, "uUseTex");
-        uShadowIntensity_ = glGetUniformLocation(programShadow_, "uShadowIntensity");
-        uLightDir_ = glGetUniformLocation(programBasic_, "uLightDir");
+        groundShader_.setSource("ground", ground_vs_src, ground_fs_src, {"uColor"});
     }
 
     void DrawstuffApp::initSkyProgram()
     {
-        if (programSky_ != 0)
+        if (skyShader_.hasSource())
             return;
         static const char *sky_vs_src = R"GLSL(
 #version 330 core
 
 layout(location = 0) in vec3 aPos;
 
-uniform mat4 uMVP;
+uniform float uSkyHeight;  // sky_height（視点からの高さ）
 uniform float uSkyScale;   // sky_scale
 uniform float uSkyOffset;  // offset
 
@@ -422,7 +621,8 @@ out vec2 vTex;
 
 void main()
 {
-    gl_Position = uMVP * vec4(aPos, 1.0);
+    // 空の板は視点の真上に付いてくる
+    gl_Position = uViewProj * vec4(aPos + uEye.xyz + vec3(0.0, 0.0, uSkyHeight), 1.0);
 
     // aPos.xy は [-ssize, ssize] の範囲
     //   vTex = aPos.xy * sky_scale + offset
@@ -435,49 +635,30 @@ void main()
 
 in vec2 vTex;
 
-uniform sampler2D uTex;
 uniform vec4      uColor;   // テクスチャを使わないときの空色
-uniform int       uUseTex;  // 1 = テクスチャ, 0 = 単色
+#ifdef USE_TEXTURE
+uniform sampler2D uTex;
+#endif
 
 out vec4 FragColor;
 
 void main()
 {
-    vec4 color = uColor;
-
-    if (uUseTex != 0)
-    {
-        FragColor = texture(uTex, vTex);  // テクスチャそのまま
-    }
-    else
-    {
-        FragColor = uColor;
-    }
+#ifdef USE_TEXTURE
+    FragColor = texture(uTex, vTex);  // テクスチャそのまま
+#else
+    FragColor = uColor;
+#endif
 }
 )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, sky_vs_src);
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, sky_fs_src);
-        if (!vs || !fs)
-            internalError("Failed to compile sky shaders");
-
-        programSky_ = linkProgram(vs, fs);
-        glDeleteShader(vs);
-        glDeleteShader(fs);
-        if (!programSky_)
-            internalError("Failed to link sky shader program");
-
-        uSkyMVP_ = glGetUniformLocation(programSky_, "uMVP");
-        uSkyColor_ = glGetUniformLocation(programSky_, "uColor");
-        uSkyTex_ = glGetUniformLocation(programSky_, "uTex");
-        uSkyScale_ = glGetUniformLocation(programSky_, "uSkyScale");
-        uSkyOffset_ = glGetUniformLocation(programSky_, "uSkyOffset");
-        uSkyUseTex_ = glGetUniformLocation(programSky_, "uUseTex");
+        // uniform の並びは SkyUniform と同じ
+        skyShader_.setSource("sky", sky_vs_src, sky_fs_src, {"uSkyHeight", "uColor", "uSkyScale", "uSkyOffset"});
     }
 
     void DrawstuffApp::initShadowProgram()
     {
-        if (programShadow_ != 0)
+        if (shadowShader_.hasSource())
             return;
 
         static const char *shadow_vs_src = R"GLSL(
@@ -487,23 +668,20 @@ void main()
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 
-uniform mat4 uShadowMVP;    // proj * view * shadowModel
-uniform mat4 uShadowModel;  // ★ 影としてのモデル行列（= shadowModel）
-uniform vec2 uGroundScale;
-uniform vec2 uGroundOffset;
+uniform mat4 uModel;
 
 out vec2 vTex;
 
 void main()
 {
     // 影として地面上に投影されたワールド座標
-    vec4 shadowWorld = uShadowModel * vec4(aPos, 1.0);
+    vec4 shadowWorld = uShadowProject * (uModel * vec4(aPos, 1.0));
 
     // ground と同じ定義: (x,y) にスケール＋オフセット
-    vTex = shadowWorld.xy * uGroundScale + uGroundOffset;
+    vTex = shadowWorld.xy * uGround.x + uGround.yz;
 
-    // 位置も同じ shadowWorld を使う（事前に uShadowMVP = proj*view*uShadowModel にしてある前提）
-    gl_Position = uShadowMVP * vec4(aPos, 1.0);
+    // 位置も同じ shadowWorld を使う
+    gl_Position = uViewProj * shadowWorld;
 }
 )GLSL";
 
@@ -514,60 +692,32 @@ void main()
 in vec2 vTex;
 out vec4 FragColor;
 
+#ifdef USE_TEXTURE
 uniform sampler2D uGroundTex;
-uniform float uShadowIntensity;  // 例: 0.5f
-uniform bool  uUseTex;      // ★ 追加：テクスチャを使うか
-uniform vec3  uGroundColor;      // ★ 追加：テクスチャ無し時の地面色 (GROUND_R,G,B)
+#endif
 
 void main()
 {
-    vec3 base;
-
-    if (uUseTex) {
-        // テクスチャあり：地面テクスチャをそのままベースに
-        base = texture(uGroundTex, vTex).rgb;
-    } else {
-        // テクスチャなし：地面のフラットカラー
-        base = uGroundColor;
-    }
+#ifdef USE_TEXTURE
+    // テクスチャあり：地面テクスチャをそのままベースに
+    vec3 base = texture(uGroundTex, vTex).rgb;
+#else
+    // テクスチャなし：地面のフラットカラー
+    vec3 base = uGroundColor.rgb;
+#endif
 
     // SHADOW_INTENSITY 倍だけ暗くする
-    vec3 shaded = base * uShadowIntensity;
+    vec3 shaded = base * uGround.w;
 
     FragColor = vec4(shaded, 1.0);
 }
 )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, shadow_vs_src);
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, shadow_fs_src);
-        if (!vs || !fs)
-        {
-            internalError("Failed to compile shadow shaders");
-        }
-
-        programShadow_ = linkProgram(vs, fs);
-        glDeleteShader(vs);
-        glDeleteShader(fs);
-        if (!programShadow_)
-        {
-            internalError("Failed to link shadow shader program");
-        }
-
-        // すでにあるもの
-        uShadowMVP_ = glGetUniformLocation(programShadow_, "uShadowMVP");
-        uShadowModel_ = glGetUniformLocation(programShadow_, "uShadowModel");
-        uGroundScale_ = glGetUniformLocation(programShadow_, "uGroundScale");
-        uGroundOffset_ = glGetUniformLocation(programShadow_, "uGroundOffset");
-        uGroundTex_ = glGetUniformLocation(programShadow_, "uGroundTex");
-        uShadowIntensity_ = glGetUniformLocation(programShadow_, "uShadowIntensity");
-
-        // ★ 新しく追加
-        uShadowUseTex_ = glGetUniformLocation(programShadow_, "uUseTex");
-        uGroundColor_ = glGetUniformLocation(programShadow_, "uGroundColor");
+        shadowShader_.setSource("shadow", shadow_vs_src, shadow_fs_src, {"uModel"});
     }
     void DrawstuffApp::initShadowInstancedProgram()
     {
-        if (programShadowInstanced_ != 0)
+        if (shadowInstancedShader_.hasSource())
             return;
 
         // インスタンス版 shadow.vs
@@ -576,33 +726,36 @@ void main()
 #version 330 core
 
 layout(location = 0) in vec3 aPos;
-layout(location = 2) in mat4 iModel; // インスタンスごとのモデル行列
-
-// world → shadow 平面への変換（旧 uShadowModel 相当だが、modelは含まない）
-uniform mat4 uShadowModel;   
-
-// 画面への変換用: proj * view * uShadowModel
-uniform mat4 uShadowMVP;     
-
-uniform vec2 uGroundScale;
-uniform vec2 uGroundOffset;
+// インスタンスごとの位置・姿勢（四元数）・スケール（InstanceCompact）
+layout(location = 2) in vec3 iPos;
+layout(location = 3) in vec4 iRot;
+layout(location = 4) in vec3 iScale;
+layout(location = 1) in vec4 aNormal; // w だけ使う：カプセルの蓋（basic_instanced.vs と同じ）
 
 out vec2 vTex;
 
+vec3 quatRotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
 void main()
 {
     // まず通常どおりワールド座標を作る
-    vec4 worldPos = iModel * vec4(aPos, 1.0);
+    float aCap = aNormal.w;
+    vec3 s = mix(iScale, iScale.xxx, abs(aCap));
+    vec3 local = (aPos - vec3(0.0, 0.0, aCap)) * s + vec3(0.0, 0.0, aCap * iScale.z);
+    vec4 worldPos = vec4(quatRotate(normalize(iRot), local) + iPos, 1.0);
 
     // 影として地面上に投影された座標（world → shadow平面）
-    vec4 shadowWorld = uShadowModel * worldPos;
+    vec4 shadowWorld = uShadowProject * worldPos;
 
     // ground と同じ定義: (x,y) にスケール＋オフセット
-    vTex = shadowWorld.xy * uGroundScale + uGroundOffset;
+    vTex = shadowWorld.xy * uGround.x + uGround.yz;
 
-    // 位置も同じ shadowWorld 由来の uShadowMVP を使う
-    // （CPU側で uShadowMVP = proj * view * uShadowModel としておく前提）
-    gl_Position = uShadowMVP * worldPos;
+    // 位置も同じ shadowWorld を使う
+    gl_Position = uViewProj * shadowWorld;
 }
 )GLSL";
 
@@ -614,53 +767,581 @@ void main()
 in vec2 vTex;
 out vec4 FragColor;
 
+#ifdef USE_TEXTURE
 uniform sampler2D uGroundTex;
-uniform float uShadowIntensity;  // 例: 0.5f
-uniform bool  uUseTex;           // テクスチャを使うか
-uniform vec3  uGroundColor;      // テクスチャ無し時の地面色 (GROUND_R,G,B)
+#endif
 
 void main()
 {
-    vec3 base;
-
-    if (uUseTex) {
-        // テクスチャあり：地面テクスチャをそのままベースに
-        base = texture(uGroundTex, vTex).rgb;
-    } else {
-        // テクスチャなし：地面のフラットカラー
-        base = uGroundColor;
-    }
+#ifdef USE_TEXTURE
+    // テクスチャあり：地面テクスチャをそのままベースに
+    vec3 base = texture(uGroundTex, vTex).rgb;
+#else
+    // テクスチャなし：地面のフラットカラー
+    vec3 base = uGroundColor.rgb;
+#endif
 
     // SHADOW_INTENSITY 倍だけ暗くする
-    vec3 shaded = base * uShadowIntensity;
+    vec3 shaded = base * uGround.w;
 
     FragColor = vec4(shaded, 1.0);
 }
 )GLSL";
 
-        GLuint vs = compileShader(GL_VERTEX_SHADER, shadow_vs_instanced_src);
-        GLuint fs = compileShader(GL_FRAGMENT_SHADER, shadow_fs_src);
+        shadowInstancedShader_.setSource("shadow instanced", shadow_vs_instanced_src, shadow_fs_src, {});
+    }
+
+    // GPU カリング用（transform feedback）
+    // インスタンス 1 個を点 1 個として流し，見えるものだけ GS から出力する。
+    // 出力の並びは InstanceCompact と同じ 36 バイト（回転と色はビット列のまま運ぶ）
+    void DrawstuffApp::initCullProgram()
+    {
+        if (programCull_ != 0)
+            return;
+
+        static const char *vsSrc = R"GLSL(
+// cull.vs
+#version 330 core
+layout(location = 0) in vec3  iPos;
+layout(location = 1) in uvec2 iRot;    // snorm16 x4 のまま
+layout(location = 2) in vec3  iScale;
+layout(location = 3) in uint  iColor;  // RGBA8 のまま
+
+uniform vec4  uPlanes[6];   // n・p + d >= 0 が内側
+uniform vec3  uBound;       // 境界球の半径^2 = a (sx^2 + sy^2) + b max(sx^2, sy^2) + c sz^2
+uniform vec3  uShadow;      // (kx, ky, 半径の倍率)：影は (x - kx z, y - ky z, 0)
+uniform bool  uShadowPass;
+uniform vec4  uWRow;        // 投影×ビュー行列の第 4 行（clip w）
+uniform float uPixelScale;  // 半径 / w → ピクセル
+uniform float uMinPixels;   // 0 なら画面上の大きさでは捨てない
+
+uniform bool      uOcclusion;    // 前フレームの深度ピラミッドで遮蔽判定するか
+uniform sampler2D uHiZ;          // level 0 が画面の 1/2 の最大深度
+uniform mat4      uHiZViewProj;  // ピラミッドを作ったフレームの投影×ビュー
+uniform ivec2     uHiZScreen;    // そのフレームの画面サイズ
+uniform int       uHiZMaxLevel;
+
+out vec3 vPos;
+flat out uvec2 vRot;
+out vec3 vScale;
+flat out uint vColor;
+flat out int vKeep;
+
+// 境界球を囲む箱が，前フレームの深度ピラミッドより確実に奥にあれば true
+bool occluded(vec3 c, float r)
+{
+    vec2 lo = vec2(1.0), hi = vec2(-1.0);
+    float zNear = 1.0;
+    for (int i = 0; i < 8; ++i) {
+        vec3 corner = c + r * vec3((i & 1) != 0 ? 1.0 : -1.0,
+                                   (i & 2) != 0 ? 1.0 : -1.0,
+                                   (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 p = uHiZViewProj * vec4(corner, 1.0);
+        if (p.w <= 0.0)
+            return false; // 視点の後ろにかかるものは判定しない
+        vec3 ndc = p.xyz / p.w;
+        lo = min(lo, ndc.xy);
+        hi = max(hi, ndc.xy);
+        zNear = min(zNear, ndc.z);
+    }
+
+    // 画面のピクセル範囲 → 2x2 texel に収まる level（level L の texel = ピクセル >> (L + 1)）
+    ivec2 p0 = clamp(ivec2((lo * 0.5 + 0.5) * vec2(uHiZScreen)), ivec2(0), uHiZScreen - 1);
+    ivec2 p1 = clamp(ivec2((hi * 0.5 + 0.5) * vec2(uHiZScreen)), ivec2(0), uHiZScreen - 1);
+    int extent = max(p1.x - p0.x, p1.y - p0.y) + 1;
+    int shift = 1;
+    while ((1 << shift) < extent)
+        ++shift;
+    int lod = min(shift - 1, uHiZMaxLevel);
+    ivec2 size = textureSize(uHiZ, lod);
+    ivec2 t0 = min(p0 >> (lod + 1), size - 1);
+    ivec2 t1 = min(p1 >> (lod + 1), size - 1);
+    float d = max(max(texelFetch(uHiZ, t0, lod).r, texelFetch(uHiZ, ivec2(t1.x, t0.y), lod).r),
+                  max(texelFetch(uHiZ, ivec2(t0.x, t1.y), lod).r, texelFetch(uHiZ, t1, lod).r));
+    return zNear * 0.5 + 0.5 > d;
+}
+
+void main()
+{
+    vec3 s2 = iScale * iScale;
+    float r = sqrt(uBound.x * (s2.x + s2.y) + uBound.y * max(s2.x, s2.y) + uBound.z * s2.z);
+    vec3 c = iPos;
+    if (uShadowPass) {
+        c = vec3(iPos.x - uShadow.x * iPos.z, iPos.y - uShadow.y * iPos.z, 0.0);
+        r *= uShadow.z;
+    }
+
+    bool keep = true;
+    for (int k = 0; k < 6; ++k)
+        keep = keep && (dot(uPlanes[k].xyz, c) + uPlanes[k].w >= -r);
+
+    if (keep && uMinPixels > 0.0) {
+        // 視点が球の中にあるとき（w <= r）は大きさで捨てない
+        float w = dot(uWRow, vec4(c, 1.0));
+        keep = (w <= r) || (r * uPixelScale >= uMinPixels * w);
+    }
+
+    if (keep && uOcclusion)
+        keep = !occluded(c, r);
+
+    vPos = iPos;
+    vRot = iRot;
+    vScale = iScale;
+    vColor = iColor;
+    vKeep = keep ? 1 : 0;
+}
+)GLSL";
+
+        static const char *gsSrc = R"GLSL(
+// cull.gs
+#version 330 core
+layout(points) in;
+layout(points, max_vertices = 1) out;
+
+in vec3 vPos[];
+flat in uvec2 vRot[];
+in vec3 vScale[];
+flat in uint vColor[];
+flat in int vKeep[];
+
+out vec3 oPos;
+flat out uvec2 oRot;
+out vec3 oScale;
+flat out uint oColor;
+
+void main()
+{
+    if (vKeep[0] == 0)
+        return;
+    oPos = vPos[0];
+    oRot = vRot[0];
+    oScale = vScale[0];
+    oColor = vColor[0];
+    EmitVertex();
+    EndPrimitive();
+}
+)GLSL";
+
+        static const char *const varyings[] = {"oPos", "oRot", "oScale", "oColor"};
+
+        GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
+        GLuint gs = compileShader(GL_GEOMETRY_SHADER, gsSrc);
+        if (!vs || !gs)
+        {
+            internalError("Failed to compile cull shaders");
+        }
+
+        programCull_ = linkTransformFeedbackProgram(vs, gs, varyings, 4);
+        glDeleteShader(vs);
+        glDeleteShader(gs);
+        if (!programCull_)
+        {
+            internalError("Failed to link cull shader program");
+        }
+
+        gpuCuller_.init(programCull_);
+    }
+
+    // 深度ピラミッド（Hi-Z）の縮小用：下の level の 2x2 の最大値を書く
+    void DrawstuffApp::initHiZProgram()
+    {
+        if (programHiZ_ != 0)
+            return;
+
+        static const char *vsSrc = R"GLSL(
+// hiz.vs (全画面三角形)
+#version 330 core
+void main()
+{
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
+)GLSL";
+
+        static const char *fsSrc = R"GLSL(
+// hiz.fs
+#version 330 core
+uniform sampler2D uSrc;   // 読む level だけが見えるようにしてある
+uniform ivec2 uSrcSize;
+out float oDepth;
+
+float fetch(ivec2 p)
+{
+    return texelFetch(uSrc, min(p, uSrcSize - 1), 0).r;
+}
+
+void main()
+{
+    ivec2 s = 2 * ivec2(gl_FragCoord.xy);
+    float d = max(max(fetch(s), fetch(s + ivec2(1, 0))),
+                  max(fetch(s + ivec2(0, 1)), fetch(s + ivec2(1, 1))));
+
+    // 奇数サイズのときは最後の列・行が余るので，端の texel に含める
+    bool ex = (uSrcSize.x & 1) == 1 && s.x + 3 == uSrcSize.x;
+    bool ey = (uSrcSize.y & 1) == 1 && s.y + 3 == uSrcSize.y;
+    if (ex)
+        d = max(d, max(fetch(s + ivec2(2, 0)), fetch(s + ivec2(2, 1))));
+    if (ey)
+        d = max(d, max(fetch(s + ivec2(0, 2)), fetch(s + ivec2(1, 2))));
+    if (ex && ey)
+        d = max(d, fetch(s + ivec2(2, 2)));
+    oDepth = d;
+}
+)GLSL";
+
+        GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
+        GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsSrc);
+        if (!vs || !fs)
+        {
+            internalError("Failed to compile hi-z shaders");
+        }
+
+        programHiZ_ = linkProgram(vs, fs);
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        if (!programHiZ_)
+        {
+            internalError("Failed to link hi-z shader program");
+        }
+
+        depthPyramid_.init(programHiZ_);
+    }
+
+    // 重み付き OIT の合成：溜めた平均色と透過率を画面へ重ねる（ブレンドは WeightedOit::composite）
+    void DrawstuffApp::initOitProgram()
+    {
+        if (programOit_ != 0)
+            return;
+
+        static const char *vsSrc = R"GLSL(
+// oit_composite.vs (全画面三角形)
+#version 330 core
+void main()
+{
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
+)GLSL";
+
+        static const char *fsSrc = R"GLSL(
+// oit_composite.fs
+#version 330 core
+uniform sampler2D uAccum;
+uniform sampler2D uReveal;
+out vec4 FragColor;
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float reveal = texelFetch(uReveal, p, 0).r;
+    if (reveal <= 0.0)
+        discard; // 何も描かれていない
+    vec4 accum = texelFetch(uAccum, p, 0);
+    FragColor = vec4(accum.rgb / max(accum.a, 1e-5), exp(-reveal));
+}
+)GLSL";
+
+        GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
+        GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsSrc);
         if (!vs || !fs)
         {
-            internalError("Failed to compile shadow instanced shaders");
+            internalError("Failed to compile OIT composite shaders");
         }
 
-        programShadowInstanced_ = linkProgram(vs, fs);
+        programOit_ = linkProgram(vs, fs);
         glDeleteShader(vs);
         glDeleteShader(fs);
-        if (!programShadowInstanced_)
+        if (!programOit_)
         {
-            internalError("Failed to link shadow instanced shader program");
+            internalError("Failed to link OIT composite shader program");
         }
 
-        // uniform ロケーション（Inst 用）
-        uShadowMVPInst_ = glGetUniformLocation(programShadowInstanced_, "uShadowMVP");
-        uShadowModelInst_ = glGetUniformLocation(programShadowInstanced_, "uShadowModel");
-        uGroundScaleInst_ = glGetUniformLocation(programShadowInstanced_, "uGroundScale");
-        uGroundOffsetInst_ = glGetUniformLocation(programShadowInstanced_, "uGroundOffset");
-        uGroundTexInst_ = glGetUniformLocation(programShadowInstanced_, "uGroundTex");
-        uShadowIntensityInst_ = glGetUniformLocation(programShadowInstanced_, "uShadowIntensity");
-        uShadowUseTexInst_ = glGetUniformLocation(programShadowInstanced_, "uUseTex");
-        uGroundColorInst_ = glGetUniformLocation(programShadowInstanced_, "uGroundColor");
+        weightedOit_.init(programOit_);
+    }
+
+    // インポスタ（球・円柱・カプセル）。インスタンス 1 個を四角形 1 枚に広げ，
+    // FS で形と光線の交点を求めて深度と法線を書く。本描画用と影用で交差計算を共有する
+    void DrawstuffApp::initImpostorPrograms()
+    {
+        if (impostorShader_.hasSource())
+            return;
+
+        // 両方のプログラムの VS / FS の先頭に付ける共通部分
+        static const char *commonSrc = R"GLSL(
+#version 330 core
+
+// 形：0 = 球，1 = 両端を塞いだ円柱，2 = カプセル（どちらも局所 z 軸方向）
+uniform int   uShape;
+uniform float uHalfLength; // 円柱・平行部の半分の長さ（scale.z の何倍か）
+
+vec3 quatRotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+// 逆回転（共役で回す）
+vec3 quatRotateInv(vec4 q, vec3 v)
+{
+    return quatRotate(vec4(-q.xyz, q.w), v);
+}
+
+// 影は (x - kx z, y - ky z, 0)：uShadowProject の z 列から読む
+vec2 shadowK()
+{
+    return -uShadowProject[2].xy;
+}
+
+// 外接球の半径と (半径, 半分の長さ)。形の中心はインスタンスの位置
+void impostorBound(vec3 scale, out float radius, out vec2 shape)
+{
+    float r = scale.x;
+    float h = uHalfLength * scale.z;
+    shape  = vec2(r, h);
+    radius = (uShape == 0) ? r : (uShape == 1) ? sqrt(r * r + h * h) : r + h;
+}
+
+// 形の局所座標（中心が原点）での光線との最初の交点。外れたら負を返す（rd は単位ベクトル）
+float hitSphere(vec3 ro, vec3 rd, float r)
+{
+    float b = dot(ro, rd);
+    float c = dot(ro, ro) - r * r;
+    float disc = b * b - c;
+    if (disc < 0.0)
+        return -1.0;
+    return -b - sqrt(disc);
+}
+
+float hitCylinder(vec3 ro, vec3 rd, float r, float h, out vec3 n)
+{
+    // 側面
+    float a = dot(rd.xy, rd.xy);
+    if (a > 1e-8) {
+        float b = dot(ro.xy, rd.xy);
+        float c = dot(ro.xy, ro.xy) - r * r;
+        float disc = b * b - a * c;
+        if (disc < 0.0)
+            return -1.0;
+        float t = (-b - sqrt(disc)) / a;
+        if (t > 0.0 && abs(ro.z + t * rd.z) <= h) {
+            n = vec3((ro.xy + t * rd.xy) / r, 0.0);
+            return t;
+        }
+    }
+    // 側面の手前で当たらなければ，手前側の蓋
+    if (abs(rd.z) > 1e-8) {
+        float zc = (rd.z > 0.0) ? -h : h;
+        float t = (zc - ro.z) / rd.z;
+        vec2 p = ro.xy + t * rd.xy;
+        if (t > 0.0 && dot(p, p) <= r * r) {
+            n = vec3(0.0, 0.0, -sign(rd.z));
+            return t;
+        }
+    }
+    return -1.0;
+}
+
+// 胴（閉じた円柱）と両端の球の和集合：いちばん手前の交点
+float hitCapsule(vec3 ro, vec3 rd, float r, float h, out vec3 n)
+{
+    float t = hitCylinder(ro, rd, r, h, n);
+    for (int k = 0; k < 2; ++k) {
+        vec3 c = vec3(0.0, 0.0, (k == 0) ? h : -h);
+        float ts = hitSphere(ro - c, rd, r);
+        if (ts > 0.0 && (t <= 0.0 || ts < t)) {
+            t = ts;
+            n = (ro + ts * rd - c) / r;
+        }
+    }
+    return t;
+}
+
+float hitShape(vec3 ro, vec3 rd, vec2 shape, out vec3 n)
+{
+    if (uShape == 0) {
+        float t = hitSphere(ro, rd, shape.x);
+        n = (ro + t * rd) / shape.x;
+        return t;
+    }
+    if (uShape == 1)
+        return hitCylinder(ro, rd, shape.x, shape.y, n);
+    return hitCapsule(ro, rd, shape.x, shape.y, n);
+}
+)GLSL";
+
+        static const char *vsSrc = R"GLSL(
+// impostor.vs
+layout(location = 0) in vec3 aPos; // 四角形の角 (±1, ±1, 0)
+layout(location = 2) in vec3 iPos;
+layout(location = 3) in vec4 iRot;
+layout(location = 4) in vec3 iScale;
+layout(location = 5) in vec4 iColor;
+
+out vec3 vWorldPos;
+flat out vec3 vCenter;
+flat out vec4 vQuat;
+flat out vec3 vScale;
+flat out vec2 vShape;
+flat out vec4 vColor;
+
+void main()
+{
+    vec3 c = iPos;
+    float rb;
+    vec2 shape;
+    impostorBound(iScale, rb, shape);
+
+    // 外接球の中心を通り視線に垂直な面に，視点から見たシルエットを覆う正方形を置く
+    vec3 toC = c - uEye.xyz;
+    float d = max(length(toC), 1e-6);
+    vec3 dir = toC / d;
+    vec3 side = normalize(cross(dir, abs(dir.z) < 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 up = cross(side, dir);
+    float ext = rb * d / sqrt(max(d * d - rb * rb, 0.01 * rb * rb));
+    vec3 p = c + (aPos.x * side + aPos.y * up) * ext;
+
+    vWorldPos = p;
+    vCenter = c;
+    vQuat = normalize(iRot);
+    vScale = iScale;
+    vShape = shape;
+    vColor = iColor;
+    gl_Position = uViewProj * vec4(p, 1.0);
+}
+)GLSL";
+
+        static const char *fsSrc = R"GLSL(
+// impostor.fs（ライティングは basic_instanced.fs と同じ）
+in vec3 vWorldPos;
+flat in vec3 vCenter;
+flat in vec4 vQuat;
+flat in vec3 vScale;
+flat in vec2 vShape;
+flat in vec4 vColor;
+
+#ifdef USE_TEXTURE
+uniform sampler2D uTex;
+const float kTexScale = 0.5;
+#endif
+
+#ifndef WEIGHTED_OIT
+out vec4 FragColor;
+#endif
+
+void main()
+{
+    vec3 eye = uEye.xyz;
+    vec3 rd = normalize(vWorldPos - eye);
+    vec3 n;
+    float t = hitShape(quatRotateInv(vQuat, eye - vCenter), quatRotateInv(vQuat, rd), vShape, n);
+    if (t <= 0.0)
+        discard;
+
+    vec3 hit = eye + t * rd;
+    vec4 clip = uViewProj * vec4(hit, 1.0);
+    gl_FragDepth = (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far) * 0.5;
+
+    vec3 base = vColor.rgb;
+#ifdef USE_TEXTURE
+    {
+        // メッシュ版と同じ単位メッシュ上の座標でテクスチャを貼る（カプセルの蓋は中心 (0,0,±1) の単位球）
+        vec3 lp = quatRotateInv(vQuat, hit - vCenter);
+        vec3 localPos = lp / vScale;
+        if (uShape == 2 && abs(lp.z) > vShape.y)
+            localPos = vec3(lp.xy / vShape.x, sign(lp.z) * (1.0 + (abs(lp.z) - vShape.y) / vShape.x));
+        vec3 an  = abs(n);
+        vec3 w   = an / (an.x + an.y + an.z + 1e-5);
+        vec3 texX = texture(uTex, localPos.yz * kTexScale).rgb;
+        vec3 texY = texture(uTex, localPos.xz * kTexScale).rgb;
+        vec3 texZ = texture(uTex, localPos.xy * kTexScale).rgb;
+        base *= w.x * texX + w.y * texY + w.z * texZ;
+    }
+#endif
+
+    vec3 L = normalize(uLightDir.xyz);
+    vec3 N_lit = quatRotate(vQuat, n);
+
+    const float A = 1.0/3.0;
+    const float B = 2.0/3.0;
+    float lightFactor = A + B * max(dot(N_lit, L), 0.0);
+
+#ifdef WEIGHTED_OIT
+    writeOit(vec4(base * lightFactor, vColor.a));
+#else
+    FragColor = vec4(base * lightFactor, vColor.a);
+#endif
+}
+)GLSL";
+
+        static const char *shadowVsSrc = R"GLSL(
+// shadow_impostor.vs
+layout(location = 0) in vec3 aPos;
+layout(location = 2) in vec3 iPos;
+layout(location = 3) in vec4 iRot;
+layout(location = 4) in vec3 iScale;
+
+out vec3 vGround;
+out vec2 vTex;
+flat out vec3 vCenter;
+flat out vec4 vQuat;
+flat out vec2 vShape;
+
+void main()
+{
+    vec3 c = iPos;
+    float rb;
+    vec2 shape;
+    impostorBound(iScale, rb, shape);
+
+    // 外接球の影（楕円）を覆う，地面上の正方形
+    vec2 k = shadowK();
+    vec2 cs = c.xy - k * c.z;
+    float ext = rb * sqrt(1.0 + dot(k, k));
+    vGround = vec3(cs + aPos.xy * ext, 0.0);
+    vTex = vGround.xy * uGround.x + uGround.yz;
+
+    vCenter = c;
+    vQuat = normalize(iRot);
+    vShape = shape;
+    gl_Position = uViewProj * vec4(vGround, 1.0);
+}
+)GLSL";
+
+        static const char *shadowFsSrc = R"GLSL(
+// shadow_impostor.fs（色は shadow.fs と同じ）
+in vec3 vGround;
+in vec2 vTex;
+flat in vec3 vCenter;
+flat in vec4 vQuat;
+flat in vec2 vShape;
+
+#ifdef USE_TEXTURE
+uniform sampler2D uGroundTex;
+#endif
+
+out vec4 FragColor;
+
+void main()
+{
+    // 地面の点から光源へ向かう光線が形に当たれば影
+    vec3 rd = normalize(vec3(shadowK(), 1.0));
+    vec3 n;
+    if (hitShape(quatRotateInv(vQuat, vGround - vCenter), quatRotateInv(vQuat, rd), vShape, n) <= 0.0)
+        discard;
+
+#ifdef USE_TEXTURE
+    vec3 base = texture(uGroundTex, vTex).rgb;
+#else
+    vec3 base = uGroundColor.rgb;
+#endif
+    FragColor = vec4(base * uGround.w, 1.0);
+}
+)GLSL";
+
+        // uniform の並びは ImpostorUniform と同じ
+        const std::string common(commonSrc);
+        impostorShader_.setSource("impostor", common + vsSrc, common + fsSrc, {"uShape", "uHalfLength"});
+        shadowImpostorShader_.setSource("shadow impostor", common + shadowVsSrc, common + shadowFsSrc,
+                                        {"uShape", "uHalfLength"});
     }
-} // namespace ds_internal
\ No newline at end of file
+} // namespace ds_internal
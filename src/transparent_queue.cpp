@@ -0,0 +1,185 @@
+// transparent_queue.cpp - sorted queue of translucent instances for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// キーは視点からの距離の 2 乗（float）のビット列を反転したもの。
+// 非負の float はビット列のまま大小が比べられるので，反転すると昇順 = 遠い順になる。
+
+#include <algorithm>
+#include <cstring>
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    namespace
+    {
+        // キー作りと並べ替えた後の集め直しを分ける単位
+        constexpr std::size_t kSortChunk = 16384;
+        // GPU バッファの最小容量（インスタンス数）
+        constexpr std::size_t kMinQueueCapacity = 256;
+
+        inline std::uint32_t depthKey(const InstanceCompact &inst, const float eye[3])
+        {
+            const float dx = inst.pos[0] - eye[0];
+            const float dy = inst.pos[1] - eye[1];
+            const float dz = inst.pos[2] - eye[2];
+            const float d2 = dx * dx + dy * dy + dz * dz;
+            std::uint32_t bits;
+            std::memcpy(&bits, &d2, sizeof(bits));
+            return ~bits;
+        }
+    } // anonymous namespace
+
+    std::size_t TransparentQueue::size() const
+    {
+        std::size_t n = 0;
+        for (const std::vector<InstanceCompact> &v : items_)
+            n += v.size();
+        return n;
+    }
+
+    void TransparentQueue::clear()
+    {
+        for (std::vector<InstanceCompact> &v : items_)
+            v.clear();
+        runs_.clear();
+        sortedValid_ = false;
+    }
+
+    const InstanceCompact &TransparentQueue::flat(const std::size_t i, int &bucket) const
+    {
+        bucket = 0;
+        while (i >= first_[bucket + 1])
+            ++bucket;
+        return items_[bucket][i - first_[bucket]];
+    }
+
+    void TransparentQueue::sortBackToFront(const float eye[3], JobPool &jobs)
+    {
+        first_[0] = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+            first_[b + 1] = first_[b] + items_[b].size();
+        const std::size_t n = first_[BUCKET_COUNT];
+        runs_.clear();
+        sortedValid_ = false;
+        if (n == 0)
+            return;
+
+        keys_.resize(n);
+        order_.resize(n);
+        const std::size_t chunks = (n + kSortChunk - 1) / kSortChunk;
+
+        // ---- キーを作る ----
+        jobs.parallelFor(chunks, 1, [this, eye, n](std::size_t firstChunk, std::size_t lastChunk)
+        {
+            for (std::size_t c = firstChunk; c < lastChunk; ++c)
+            {
+                const std::size_t end = std::min(n, (c + 1) * kSortChunk);
+                for (int b = 0; b < BUCKET_COUNT; ++b)
+                {
+                    const std::size_t lo = std::max(c * kSortChunk, first_[b]);
+                    const std::size_t hi = std::min(end, first_[b + 1]);
+                    for (std::size_t i = lo; i < hi; ++i)
+                    {
+                        keys_[i] = depthKey(items_[b][i - first_[b]], eye);
+                        order_[i] = static_cast<std::uint32_t>(i);
+                    }
+                }
+            }
+        });
+        radixSort(keys_, order_, 32, scratch_, jobs);
+
+        // ---- 並べ替えた順に集める ----
+        sorted_.resize(n);
+        sortedBucket_.resize(n);
+        jobs.parallelFor(chunks, 1, [this, n](std::size_t firstChunk, std::size_t lastChunk)
+        {
+            for (std::size_t c = firstChunk; c < lastChunk; ++c)
+            {
+                const std::size_t end = std::min(n, (c + 1) * kSortChunk);
+                for (std::size_t k = c * kSortChunk; k < end; ++k)
+                {
+                    int bucket;
+                    sorted_[k] = flat(order_[k], bucket);
+                    sortedBucket_[k] = static_cast<std::uint8_t>(bucket);
+                }
+            }
+        });
+        sortedValid_ = true;
+    }
+
+    void TransparentQueue::upload()
+    {
+        first_[0] = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+            first_[b + 1] = first_[b] + items_[b].size();
+        const std::size_t n = first_[BUCKET_COUNT];
+        if (n == 0)
+            return;
+
+        // bucket 順の n 個の後ろに，並べ替えた順の n 個
+        const std::size_t total = sortedValid_ ? 2 * n : n;
+        const std::size_t stride = sizeof(InstanceCompact);
+        if (buffer_ == 0)
+            glGenBuffers(1, &buffer_);
+        if (total > capacity_)
+            capacity_ = std::max(kMinQueueCapacity, total + total / 2);
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(capacity_ * stride),
+                     nullptr, GL_STREAM_DRAW);
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            if (items_[b].empty())
+                continue;
+            glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(first_[b] * stride),
+                            static_cast<GLsizeiptr>(items_[b].size() * stride), items_[b].data());
+        }
+        if (sortedValid_)
+        {
+            glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(n * stride),
+                            static_cast<GLsizeiptr>(n * stride), sorted_.data());
+
+            // 同じ bucket が続く区間ごとに 1 run
+            runs_.clear();
+            for (std::size_t k = 0; k < n;)
+            {
+                std::size_t e = k + 1;
+                while (e < n && sortedBucket_[e] == sortedBucket_[k])
+                    ++e;
+                Run run;
+                run.bucket = sortedBucket_[k];
+                run.range.buffer = buffer_;
+                run.range.offset = static_cast<GLintptr>((n + k) * stride);
+                run.range.count = static_cast<GLsizei>(e - k);
+                runs_.push_back(run);
+                k = e;
+            }
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    bool TransparentQueue::range(const int bucket, InstanceRange &r) const
+    {
+        if (items_[bucket].empty() || buffer_ == 0)
+            return false;
+        r.buffer = buffer_;
+        r.offset = static_cast<GLintptr>(first_[bucket] * sizeof(InstanceCompact));
+        r.count = static_cast<GLsizei>(items_[bucket].size());
+        return true;
+    }
+
+    void TransparentQueue::releaseGL()
+    {
+        if (buffer_ != 0)
+            glDeleteBuffers(1, &buffer_);
+        buffer_ = 0;
+        capacity_ = 0;
+    }
+} // namespace ds_internal
@@ -0,0 +1,115 @@
+// weighted_oit.cpp - weighted blended order-independent transparency for drawstuff-modern
+//
+// This file is part of drawstuff-modern, a modern reimplementation inspired by
+// the drawstuff library distributed with the Open Dynamics Engine (ODE).
+//
+// Copyright (c) 2025 Akihisa Konno
+// Released under the BSD 3-Clause License.
+// See the LICENSE file for details.
+
+// 溜め込み用の FBO は画面と同じ大きさ。深度は不透明パスを描き終えた画面からコピーして，
+// 半透明のものが不透明のものの後ろに回ったときは深度テストで捨てる（書き込みはしない）。
+
+#include "drawstuff_core.hpp"
+
+namespace ds_internal
+{
+    void WeightedOit::init(const GLuint program)
+    {
+        program_ = program;
+        uAccum_ = glGetUniformLocation(program, "uAccum");
+        uReveal_ = glGetUniformLocation(program, "uReveal");
+
+        glGenVertexArrays(1, &vao_);
+        glGenFramebuffers(1, &fbo_);
+        glGenTextures(1, &depth_);
+        glGenTextures(1, &accum_);
+        glGenTextures(1, &reveal_);
+    }
+
+    void WeightedOit::destroy()
+    {
+        if (fbo_ != 0)
+            glDeleteFramebuffers(1, &fbo_);
+        if (vao_ != 0)
+            glDeleteVertexArrays(1, &vao_);
+        for (GLuint *tex : {&depth_, &accum_, &reveal_})
+        {
+            if (*tex != 0)
+                glDeleteTextures(1, tex);
+            *tex = 0;
+        }
+        fbo_ = vao_ = 0;
+        width_ = height_ = 0;
+        program_ = 0; // プログラム自体は DrawstuffApp の持ち物
+    }
+
+    void WeightedOit::resize(const int width, const int height)
+    {
+        width_ = width;
+        height_ = height;
+
+        auto allocate = [width, height](const GLuint tex, const GLint internalFormat, const GLenum format,
+                                        const GLenum type)
+        {
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        };
+        allocate(depth_, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+        allocate(accum_, GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        allocate(reveal_, GL_R16F, GL_RED, GL_FLOAT);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accum_, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, reveal_, 0);
+        const GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            internalError("WeightedOit: incomplete framebuffer");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void WeightedOit::begin(const int width, const int height)
+    {
+        if (width != width_ || height != height_)
+            resize(width, height);
+
+        // ---- 不透明パスまでの深度をコピー（読み込み先はデフォルトフレームバッファ）----
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, depth_);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+        const float zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        glClearBufferfv(GL_COLOR, 0, zero);
+        glClearBufferfv(GL_COLOR, 1, zero);
+    }
+
+    void WeightedOit::composite()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // 平均色を 1 - 透過率 の割合で重ねる：dst = color * (1 - T) + dst * T
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+        glUseProgram(program_);
+        glUniform1i(uAccum_, 0);
+        glUniform1i(uReveal_, 1);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, reveal_);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, accum_);
+        glBindVertexArray(vao_);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        glBindVertexArray(0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glEnable(GL_DEPTH_TEST);
+    }
+} // namespace ds_internal